@@ -0,0 +1,219 @@
+/*
+ * adschip.h
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * One traits type per supported chip: channel count, where its registers
+ * are and how its reference is powered up. Code on the sample path is
+ * templated on the traits, so every chip gets its own copy with constant
+ * sizes and no branches, and adcDispatch() picks the copy once from the ID
+ * register. Frames keep room for ADS_MAX_CHANNELS; a chip with fewer
+ * channels reads only its own and leaves the rest zero.
+ */
+
+#ifndef _ADS_CHIP_H
+#define _ADS_CHIP_H
+
+#include <string.h>
+#include <hal/gpio_ll.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "adscommand.h"
+#include "osemboard.h"
+#include "spidma.h"
+
+#define ADS_MAX_CHANNELS 8
+#define ADS_STATUS_SIZE 3
+#define ADS_SAMPLE_SIZE 3 // bytes per channel
+#define ADS_MAX_DATA_SIZE (ADS_MAX_CHANNELS * ADS_SAMPLE_SIZE)
+
+// Status and channels in one SPI transfer into the frame block; 0 reads them
+// in two transfers into a separate status buffer, with CS by digitalWrite()
+#ifndef ADS_READ_IN_ONE_TRANSACTION
+#define ADS_READ_IN_ONE_TRANSACTION 1
+#endif
+
+static_assert(ADS_STATUS_SIZE + ADS_MAX_DATA_SIZE <= SPI_READ_MAX, "a conversion must fit one spiRead()");
+
+// CS through the GPIO set and clear registers, without digitalWrite() looking the pin up
+static inline void IRAM_ATTR adcSelect(bool selected)
+{
+    gpio_ll_set_level(&GPIO, (gpio_num_t)PIN_CS, selected ? 0 : 1);
+}
+
+struct ADS1292RChip
+{
+    static const int CHANNELS = 2;
+    static const AdcFamily FAMILY = ADC_FAMILY_ADS1292;
+    static const uint8_t CH1SET = ADS129x::ADS1292R_CH1SET;
+    static const uint8_t GPIO = ADS129x::ADS1292R_GPIO;
+    static const uint8_t REFERENCE = ADS129x::ADS1292R_CONFIG2;
+    static const uint8_t REFERENCE_ON = ADS129x::ADS1292R_CONFIG2_const | ADS129x::ADS1292R_PDB_REFBUF;
+    static const char *name() { return "ADS1292R"; }
+};
+
+// ADS1294, ADS1296 and ADS1298
+template <int Channels>
+struct ADS129xChip
+{
+    static const int CHANNELS = Channels;
+    static const AdcFamily FAMILY = ADC_FAMILY_ADS129X;
+    static const uint8_t CH1SET = ADS129x::CH1SET;
+    static const uint8_t GPIO = ADS129x::GPIO;
+    static const uint8_t REFERENCE = ADS129x::CONFIG3;
+    static const uint8_t REFERENCE_ON = ADS129x::PD_REFBUF | ADS129x::CONFIG3_const;
+    static const char *name() { return Channels == 4 ? "ADS1294" : Channels == 6 ? "ADS1296" : "ADS1298"; }
+};
+
+// ADS1299, ADS1299-4 and ADS1299-6
+template <int Channels>
+struct ADS1299Chip
+{
+    static const int CHANNELS = Channels;
+    static const AdcFamily FAMILY = ADC_FAMILY_ADS1299;
+    static const uint8_t CH1SET = ADS129x::CH1SET;
+    static const uint8_t GPIO = ADS129x::GPIO;
+    static const uint8_t REFERENCE = ADS129x::CONFIG3;
+    static const uint8_t REFERENCE_ON = ADS129x::PD_REFBUF | ADS129x::CONFIG3_const;
+    static const char *name() { return Channels == 4 ? "ADS1299-4" : Channels == 6 ? "ADS1299-6" : "ADS1299"; }
+};
+
+template <class Chip>
+struct AdsReadout
+{
+    static const size_t DATA_SIZE = Chip::CHANNELS * ADS_SAMPLE_SIZE;
+    static const size_t READ_SIZE = ADS_STATUS_SIZE + DATA_SIZE;
+
+    /**
+     * One conversion in RDATAC mode into READ_SIZE bytes at record, the
+     * status word first, then the channels, taken at now_us. Returns false
+     * if the status word lacks its 1100 prefix, i.e. the read was not
+     * aligned with the conversion. The caller has claimed the bus with
+     * adcBusClaim(); it is released here.
+     */
+    static inline bool IRAM_ATTR readRecord(uint8_t *record, uint32_t now_us)
+    {
+#if ADS_READ_IN_ONE_TRANSACTION
+        adcSelect(true);
+        spiRead(record, READ_SIZE);
+        adcSelect(false);
+#else
+        digitalWrite(PIN_CS, LOW);
+        spiRead(record, ADS_STATUS_SIZE);
+        spiRead(record + ADS_STATUS_SIZE, DATA_SIZE);
+        digitalWrite(PIN_CS, HIGH);
+#endif
+        adcBusRelease();
+        adc_read_interval_us = now_us - adc_last_read_us;
+        adc_last_read_us = now_us;
+        adc_reads = adc_reads + 1;
+        return (record[0] & 0xF0) == 0xC0;
+    }
+
+    /**
+     * One conversion into the channel section of a frame block, see
+     * readRecord(). The status word lands in the ADS_STATUS_SIZE bytes in
+     * front of data, so the caller fills those afterwards, and the channels
+     * a smaller chip lacks are zeroed.
+     */
+    static inline bool IRAM_ATTR read(uint8_t *data, uint32_t now_us)
+    {
+        bool aligned = readRecord(data - ADS_STATUS_SIZE, now_us);
+        if (DATA_SIZE < ADS_MAX_DATA_SIZE)
+            memset(data + DATA_SIZE, 0, ADS_MAX_DATA_SIZE - DATA_SIZE);
+        return aligned;
+    }
+
+    // 24 bit big endian two's complement codes to counts
+    static void counts(const uint8_t *data, int32_t *out)
+    {
+#pragma GCC unroll 8
+        for (int ch = 0; ch < Chip::CHANNELS; ch++)
+        {
+            const uint8_t *code = data + ADS_SAMPLE_SIZE * ch;
+            out[ch] = (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+        }
+    }
+};
+
+// What the rest of the firmware needs to know about the chip at runtime
+struct AdcChip
+{
+    const char *name;
+    int channels;
+    AdcFamily family;
+    uint8_t ch1set; // CHnSET of channel 1, the others follow
+    size_t read_size;
+    void (*counts)(const uint8_t *data, int32_t *out);
+};
+
+template <class Chip>
+const AdcChip *adcChip()
+{
+    static const AdcChip chip = {Chip::name(), Chip::CHANNELS, Chip::FAMILY, Chip::CH1SET,
+                                 AdsReadout<Chip>::READ_SIZE, AdsReadout<Chip>::counts};
+    return &chip;
+}
+
+// GPIOs driven low (floating CMOS inputs can flicker on and off, creating noise) and the reference buffer on
+template <class Chip>
+void adcPowerUp()
+{
+    adcWreg(Chip::GPIO, 0);
+    adcWreg(Chip::REFERENCE, Chip::REFERENCE_ON);
+}
+
+/**
+ * Calls target.template use<Chip>() with the traits of the chip whose ID
+ * register reads id. Returns false for an unknown chip.
+ */
+template <class Target>
+bool adcDispatch(int id, Target &target)
+{
+    if (id == 0x73)
+    {
+        target.template use<ADS1292RChip>();
+        return true;
+    }
+    switch (id & 0x1F)
+    {
+    case 0x10:
+        target.template use<ADS129xChip<4> >();
+        return true;
+    case 0x11:
+        target.template use<ADS129xChip<6> >();
+        return true;
+    case 0x12:
+        target.template use<ADS129xChip<8> >();
+        return true;
+    case 0x1C:
+        target.template use<ADS1299Chip<4> >();
+        return true;
+    case 0x1D:
+        target.template use<ADS1299Chip<6> >();
+        return true;
+    case 0x1E:
+        target.template use<ADS1299Chip<8> >();
+        return true;
+    default:
+        return false;
+    }
+}
+
+#endif // _ADS_CHIP_H
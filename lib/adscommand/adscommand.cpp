@@ -24,12 +24,56 @@
 #include "adscommand.h"
 #include "ads129x.h"
 #include "spidma.h"
+#include "trace.h"
+
+volatile bool adc_bus_claimed = false;
+volatile uint32_t adc_reads = 0;
+volatile uint32_t adc_last_read_us = 0;
+volatile uint32_t adc_read_interval_us = 0;
+
+/*
+ * Command transactions and the DRDY readout share the bus. A transaction
+ * claims it, so the readout never cuts into it, and while conversions are
+ * being read it first waits for the next read: in RDATAC mode every SCLK
+ * shifts conversion data out, so it has to run after the readout has
+ * taken the conversion and end long before the next DRDY. At low rates
+ * the wait sleeps, the period leaves room for a tick of lateness.
+ */
+static void busBegin() {
+    uint32_t now = micros();
+    // Reads stop with SDATAC or a full ring, so wait two periods at most
+    uint32_t interval = adc_read_interval_us;
+    uint32_t wait = 2 * interval;
+    if (wait > ADC_BUS_WAIT_US)
+        wait = ADC_BUS_WAIT_US;
+    if (now - adc_last_read_us < wait) {
+        traceEvent(TRACE_BUS_WAIT_BEGIN, 0);
+        uint32_t reads = adc_reads;
+        while (adc_reads == reads && micros() - now < wait) {
+            if (interval >= ADC_BUS_YIELD_US)
+                vTaskDelay(1);
+            else
+                delayMicroseconds(1);
+        }
+        traceEvent(TRACE_BUS_WAIT_END, micros() - now);
+    }
+    while (!adcBusClaim())
+        delayMicroseconds(1);
+    traceEvent(TRACE_BUS_BEGIN, 0);
+}
+
+static void busEnd() {
+    traceEvent(TRACE_BUS_END, 0);
+    adcBusRelease();
+}
 
 void adcSendCommand(int cmd) {
+    busBegin();
     digitalWrite(PIN_CS, LOW);
     spiSend(cmd);
     delayMicroseconds(1);
     digitalWrite(PIN_CS, HIGH);
+    busEnd();
 }
 
 void adcSendCommandLeaveCsActive(int cmd) {
@@ -39,6 +83,7 @@ void adcSendCommandLeaveCsActive(int cmd) {
 
 void adcWreg(int reg, int val) {
     //see pages 40,43 of datasheet -
+    busBegin();
     digitalWrite(PIN_CS, LOW);
     spiSend(ADS129x::WREG | reg);
     delayMicroseconds(2);
@@ -47,10 +92,12 @@ void adcWreg(int reg, int val) {
     spiSend(val);
     delayMicroseconds(1);
     digitalWrite(PIN_CS, HIGH);
+    busEnd();
 }
 
 int adcRreg(int reg) {
     uint8_t out = 0;
+    busBegin();
     digitalWrite(PIN_CS, LOW);
     spiSend(ADS129x::RREG | reg);
     delayMicroseconds(2);
@@ -59,5 +106,162 @@ int adcRreg(int reg) {
     out = spiRec();
     delayMicroseconds(1);
     digitalWrite(PIN_CS, HIGH);
+    busEnd();
     return ((int) out);
-}
\ No newline at end of file
+}
+
+AdcFamily adcFamily(int id) {
+    if (id == 0x73)
+        return ADC_FAMILY_ADS1292;
+    switch (id & 0x1F) {
+    case 0x10:
+    case 0x11:
+    case 0x12:
+        return ADC_FAMILY_ADS129X;
+    case 0x1C:
+    case 0x1D:
+    case 0x1E:
+        return ADC_FAMILY_ADS1299;
+    default:
+        return ADC_FAMILY_UNKNOWN;
+    }
+}
+
+uint32_t adcConfig1ToRate(AdcFamily family, uint8_t config1) {
+    using namespace ADS129x;
+    uint8_t dr = config1 & (DR2 | DR1 | DR0);
+    switch (family) {
+    case ADC_FAMILY_ADS1292:
+        return dr <= 6 ? 125UL << dr : 0;
+    case ADC_FAMILY_ADS129X:
+        if (dr > 6)
+            return 0;
+        return (config1 & HR) ? 32000UL >> dr : 16000UL >> dr;
+    case ADC_FAMILY_ADS1299:
+        return dr <= 6 ? 16000UL >> dr : 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Computes CONFIG1 for a sample rate, keeping the daisy chain and clock
+ * output bits of the current value. The ADS129x prefer high resolution mode
+ * and only drop to low power for 250 SPS. Returns false if the chip has no
+ * such rate.
+ */
+bool adcRateToConfig1(AdcFamily family, uint32_t rate, uint8_t current, uint8_t *config1) {
+    using namespace ADS129x;
+    for (uint8_t dr = 0; dr <= 6; dr++) {
+        switch (family) {
+        case ADC_FAMILY_ADS1292:
+            // bit 7 is single shot mode, keep conversions continuous
+            if ((125UL << dr) == rate) {
+                *config1 = dr;
+                return true;
+            }
+            break;
+        case ADC_FAMILY_ADS129X:
+            if ((32000UL >> dr) == rate) {
+                *config1 = HR | (current & (DAISY_EN | CLK_EN)) | dr;
+                return true;
+            }
+            if ((16000UL >> dr) == rate && dr == 6) {
+                *config1 = (current & (DAISY_EN | CLK_EN)) | dr;
+                return true;
+            }
+            break;
+        case ADC_FAMILY_ADS1299:
+            if ((16000UL >> dr) == rate) {
+                *config1 = CONFIG1_const | (current & (DAISY_EN | CLK_EN)) | dr;
+                return true;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+// Highest rate adcRateToConfig1() accepts, 0 for an unknown chip
+uint32_t adcMaxRate(AdcFamily family) {
+    switch (family) {
+    case ADC_FAMILY_ADS1292:
+        return 8000;
+    case ADC_FAMILY_ADS129X:
+        return 32000;
+    case ADC_FAMILY_ADS1299:
+        return 16000;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * LOFF value for current source AC lead-off excitation at fDR/4 and the
+ * lowest current, ADC_LEAD_OFF_CURRENT_A. The ADS1292 lays out its lead-off
+ * registers differently and is not supported.
+ */
+bool adcAcLeadOffConfig(AdcFamily family, uint8_t *loff) {
+    using namespace ADS129x;
+    switch (family) {
+    case ADC_FAMILY_ADS129X:
+        // FLEAD_OFF 01 is AC at fDR/4, 11 is DC
+        *loff = COMP_TH_95 | FLEAD_OFF0;
+        return true;
+    case ADC_FAMILY_ADS1299:
+        // FLEAD_OFF 01 and 10 are 7.8 and 31.2 Hz, 11 is fDR/4
+        *loff = COMP_TH_95 | FLEAD_OFF1 | FLEAD_OFF0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * CONFIG2 with the internal square wave test signal on, from the current
+ * value so reference and clock bits stay as they are, and the signal's
+ * input referred amplitude (it swings between +a and -a) and period. The
+ * ADS129x run it at the faster of their two rates, fCLK / 2^20 or about
+ * 2 Hz; the ADS1292 has only 1 Hz.
+ */
+bool adcTestSignalConfig(AdcFamily family, uint8_t config2, uint8_t config3, uint8_t *test_config2, float *amplitude_v,
+                         float *period_s) {
+    using namespace ADS129x;
+    switch (family) {
+    case ADC_FAMILY_ADS1292:
+        *test_config2 = (config2 & ~(ADS1292R_INT_TEST | ADS1292R_TEST_FREQ)) | ADS1292R_INT_TEST | ADS1292R_TEST_FREQ;
+        *amplitude_v = 1e-3f;
+        *period_s = 1.0f;
+        return true;
+    case ADC_FAMILY_ADS129X:
+    case ADC_FAMILY_ADS1299: {
+        float vref = family == ADC_FAMILY_ADS1299 ? 4.5f : (config3 & VREF_4V) ? 4.0f : 2.4f;
+        *test_config2 = (config2 & ~(INT_TEST | TEST_AMP | TEST_FREQ1 | TEST_FREQ0)) | INT_TEST_8HZ;
+        *amplitude_v = vref / 2.4f * 1e-3f;
+        *period_s = (float)(1UL << 20) / ADC_FCLK_HZ;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// Input referred volts per LSB of a channel at its CHnSET gain
+float adcVoltsPerCount(AdcFamily family, uint8_t chset, uint8_t config3) {
+    using namespace ADS129x;
+    static const uint8_t ADS1299_GAINS[8] = {1, 2, 4, 6, 8, 12, 24, 24};
+    static const uint8_t ADS129X_GAINS[8] = {6, 1, 2, 3, 4, 8, 12, 12};
+    int index = (chset >> 4) & 0x07;
+    switch (family) {
+    case ADC_FAMILY_ADS1299:
+        return 4.5f / ADS1299_GAINS[index] / 8388608.0f;
+    case ADC_FAMILY_ADS129X:
+        return ((config3 & VREF_4V) ? 4.0f : 2.4f) / ADS129X_GAINS[index] / 8388608.0f;
+    case ADC_FAMILY_ADS1292:
+        return 2.42f / ADS129X_GAINS[index] / 8388608.0f;
+    default:
+        return 0;
+    }
+}
@@ -30,6 +30,50 @@ void adcWreg(int reg, int val);
 void adcSendCommand(int cmd);
 void adcSendCommandLeaveCsActive(int cmd);
 int adcRreg(int reg);
-uint8_t readData(uint8_t *status, uint8_t *data);
+
+// Shared with the data readout, which claims the bus as well
+#define ADC_BUS_WAIT_US 20000 // longest wait for a conversion read, two periods at 125 SPS
+#define ADC_BUS_YIELD_US 4000 // read periods from which the wait sleeps instead of spinning
+extern volatile bool adc_bus_claimed;
+extern volatile uint32_t adc_reads;
+extern volatile uint32_t adc_last_read_us;
+extern volatile uint32_t adc_read_interval_us;
+
+/*
+ * Claims the bus for one transaction, false if it is in use. The readout
+ * tries once from DRDY_ISR; a command transaction retries, since the
+ * readout holds the bus for one conversion at most. Nothing that waits
+ * may run under the spinlock of a critical section, and the Arduino SPI
+ * calls take a mutex, so the bus is arbitrated by this flag alone.
+ */
+static inline bool IRAM_ATTR adcBusClaim() {
+    return !__atomic_exchange_n(&adc_bus_claimed, true, __ATOMIC_ACQUIRE);
+}
+
+static inline void IRAM_ATTR adcBusRelease() {
+    __atomic_store_n(&adc_bus_claimed, false, __ATOMIC_RELEASE);
+}
+
+// Chip families that share a CONFIG1 data rate encoding
+enum AdcFamily
+{
+    ADC_FAMILY_UNKNOWN,
+    ADC_FAMILY_ADS1292, // DR = 125 SPS << n
+    ADC_FAMILY_ADS129X, // HR: 32 kSPS >> n, LP: 16 kSPS >> n
+    ADC_FAMILY_ADS1299  // 16 kSPS >> n
+};
+
+AdcFamily adcFamily(int id);
+uint32_t adcConfig1ToRate(AdcFamily family, uint8_t config1);
+bool adcRateToConfig1(AdcFamily family, uint32_t rate, uint8_t current, uint8_t *config1);
+uint32_t adcMaxRate(AdcFamily family);
+
+#define ADC_LEAD_OFF_CURRENT_A 6e-9f
+bool adcAcLeadOffConfig(AdcFamily family, uint8_t *loff);
+float adcVoltsPerCount(AdcFamily family, uint8_t chset, uint8_t config3);
+
+#define ADC_FCLK_HZ 2048000UL // internal oscillator, the test signal is derived from it
+bool adcTestSignalConfig(AdcFamily family, uint8_t config2, uint8_t config3, uint8_t *test_config2, float *amplitude_v,
+                         float *period_s);
 
 #endif // _ADS_COMMAND_H
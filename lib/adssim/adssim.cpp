@@ -0,0 +1,538 @@
+/*
+ * ADS129x device simulator for host builds
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+#include "adssim.h"
+#include "ads129x.h"
+
+using namespace ADS129x;
+
+#define ADS1292R_NUM_REGISTERS 0x0C
+
+#define ADS1299_NUM_REGISTERS 0x18
+#define ADS1298_NUM_REGISTERS 0x1A
+
+#define ADSSIM_FULL_SCALE 8388607L
+#define ADSSIM_SETTLE_PERIODS 4
+
+static const float ADS1299_GAINS[8] = {1, 2, 4, 6, 8, 12, 24, 24};
+static const float ADS1298_GAINS[8] = {6, 1, 2, 3, 4, 8, 12, 12};
+
+ADSSim::ADSSim(ADSSimChip chip) : chip_(chip)
+{
+    powerOnReset();
+}
+
+void ADSSim::setChip(ADSSimChip chip)
+{
+    chip_ = chip;
+    powerOnReset();
+}
+
+const char *ADSSim::chipName() const
+{
+    switch (chip_)
+    {
+    case ADSSIM_ADS1292R:
+        return "ADS1292R";
+    case ADSSIM_ADS1294:
+        return "ADS1294";
+    case ADSSIM_ADS1296:
+        return "ADS1296";
+    case ADSSIM_ADS1298:
+        return "ADS1298";
+    case ADSSIM_ADS1299:
+        return "ADS1299";
+    case ADSSIM_ADS1299_4:
+        return "ADS1299-4";
+    case ADSSIM_ADS1299_6:
+        return "ADS1299-6";
+    }
+    return "unknown";
+}
+
+int ADSSim::channels() const
+{
+    switch (chip_)
+    {
+    case ADSSIM_ADS1292R:
+        return 2;
+    case ADSSIM_ADS1294:
+    case ADSSIM_ADS1299_4:
+        return 4;
+    case ADSSIM_ADS1296:
+    case ADSSIM_ADS1299_6:
+        return 6;
+    default:
+        return 8;
+    }
+}
+
+int ADSSim::numRegisters() const
+{
+    switch (chip_)
+    {
+    case ADSSIM_ADS1292R:
+        return ADS1292R_NUM_REGISTERS;
+    case ADSSIM_ADS1299:
+    case ADSSIM_ADS1299_4:
+    case ADSSIM_ADS1299_6:
+        return ADS1299_NUM_REGISTERS;
+    default:
+        return ADS1298_NUM_REGISTERS;
+    }
+}
+
+void ADSSim::powerOnReset()
+{
+    memset(regs_, 0, sizeof(regs_));
+    switch (chip_)
+    {
+    case ADSSIM_ADS1292R:
+        regs_[ID] = 0x73;
+        regs_[CONFIG1] = 0x02;
+        regs_[ADS1292R_CONFIG2] = 0x80;
+        regs_[0x03] = 0x10; // LOFF
+        regs_[0x09] = 0x02; // RESP1
+        regs_[0x0A] = 0x07; // RESP2
+        regs_[ADS1292R_GPIO] = 0x0C;
+        break;
+    case ADSSIM_ADS1294:
+    case ADSSIM_ADS1296:
+    case ADSSIM_ADS1298:
+        regs_[ID] = (chip_ == ADSSIM_ADS1294) ? 0x90 : (chip_ == ADSSIM_ADS1296) ? 0x91 : 0x92;
+        regs_[CONFIG1] = 0x06;
+        regs_[CONFIG2] = 0x40;
+        regs_[CONFIG3] = 0x40;
+        regs_[GPIO] = 0x0F;
+        break;
+    default:
+        regs_[ID] = (chip_ == ADSSIM_ADS1299_4) ? 0x3C : (chip_ == ADSSIM_ADS1299_6) ? 0x3D : 0x3E;
+        regs_[CONFIG1] = 0x96;
+        regs_[CONFIG2] = CONFIG2_const;
+        regs_[CONFIG3] = CONFIG3_const;
+        for (int i = 1; i <= ADSSIM_MAX_CHANNELS; i++)
+            regs_[CHnSET + i] = GAIN_24X | SHORTED;
+        regs_[GPIO] = 0x0F;
+        break;
+    }
+
+    // The device powers up in RDATAC mode with conversions stopped
+    cs_low_ = false;
+    state_ = SERIAL_OPCODE;
+    rdatac_ = true;
+    converting_ = false;
+    standby_ = false;
+    drdy_high_ = true;
+    output_read_ = true;
+    rdata_pending_ = false;
+    output_pos_ = sizeof(output_);
+    memset(output_, 0, sizeof(output_));
+    rate_ = 0;
+    conversions_ = 0;
+    conversions_read_ = 0;
+    conversions_missed_ = 0;
+    bytes_transferred_ = 0;
+    prng_ = signal_.seed ? signal_.seed : 1;
+    memset(pink_, 0, sizeof(pink_));
+}
+
+uint8_t ADSSim::reg(uint8_t address) const
+{
+    return address < ADSSIM_MAX_REGISTERS ? regs_[address] : 0;
+}
+
+void ADSSim::setReg(uint8_t address, uint8_t value)
+{
+    if (address < ADSSIM_MAX_REGISTERS)
+        regs_[address] = value;
+}
+
+bool ADSSim::writable(uint8_t address) const
+{
+    if (address == ID || address >= numRegisters())
+        return false;
+    if (chip_ == ADSSIM_ADS1292R)
+        return address != ADS1292R_LOFF_STAT;
+    return address != LOFF_STATP && address != LOFF_STATN;
+}
+
+uint32_t ADSSim::sampleRate() const
+{
+    uint8_t dr = regs_[CONFIG1] & (DR2 | DR1 | DR0);
+    if (dr == 7)
+        dr = 6; // reserved code, treat as slowest rate
+    switch (chip_)
+    {
+    case ADSSIM_ADS1292R:
+        return 125UL << dr;
+    case ADSSIM_ADS1294:
+    case ADSSIM_ADS1296:
+    case ADSSIM_ADS1298:
+        return ((regs_[CONFIG1] & HR) ? 32000UL : 16000UL) >> dr;
+    default:
+        return 16000UL >> dr;
+    }
+}
+
+void ADSSim::select(bool cs_low, uint64_t now_ns)
+{
+    advanceTo(now_ns);
+    // Taking CS high resets the serial interface
+    if (!cs_low)
+        state_ = SERIAL_OPCODE;
+    cs_low_ = cs_low;
+}
+
+uint8_t ADSSim::transfer(uint8_t mosi, uint64_t now_ns)
+{
+    advanceTo(now_ns);
+    bytes_transferred_++;
+    if (!cs_low_)
+        return 0xFF;
+
+    // MISO is shifted out while the MOSI byte is shifted in
+    uint8_t miso = 0;
+    if (state_ == SERIAL_RREG)
+    {
+        miso = reg(reg_address_);
+        reg_address_++;
+        if (--reg_remaining_ == 0)
+            state_ = SERIAL_OPCODE;
+        return miso;
+    }
+    if ((rdatac_ || rdata_pending_) && output_pos_ < sizeof(output_))
+    {
+        size_t frame_size = ADSSIM_STATUS_SIZE + 3 * channels();
+        miso = output_pos_ < frame_size ? output_[output_pos_] : 0;
+        drdy_high_ = true;
+        if (output_pos_ == 0 && !output_read_)
+        {
+            output_read_ = true;
+            conversions_read_++;
+        }
+        output_pos_++;
+    }
+
+    switch (state_)
+    {
+    case SERIAL_OPCODE:
+        command(mosi, now_ns);
+        break;
+    case SERIAL_COUNT:
+        reg_remaining_ = (mosi & 0x1F) + 1;
+        state_ = ((opcode_ & 0xE0) == RREG) ? SERIAL_RREG : SERIAL_WREG;
+        break;
+    case SERIAL_WREG:
+        if (writable(reg_address_))
+        {
+            uint8_t previous = regs_[reg_address_];
+            regs_[reg_address_] = mosi;
+            // A data rate change restarts the digital filter
+            if (reg_address_ == CONFIG1 && converting_ && ((previous ^ mosi) & 0x87))
+                startConversions(now_ns);
+        }
+        reg_address_++;
+        if (--reg_remaining_ == 0)
+            state_ = SERIAL_OPCODE;
+        break;
+    default:
+        break;
+    }
+    return miso;
+}
+
+void ADSSim::command(uint8_t opcode, uint64_t now_ns)
+{
+    if ((opcode & 0xE0) == RREG || (opcode & 0xE0) == WREG)
+    {
+        // Register access is ignored while in RDATAC mode
+        if (rdatac_)
+            return;
+        opcode_ = opcode;
+        reg_address_ = opcode & 0x1F;
+        state_ = SERIAL_COUNT;
+        return;
+    }
+
+    switch (opcode)
+    {
+    case WAKEUP:
+        if (standby_)
+        {
+            standby_ = false;
+            startConversions(now_ns);
+        }
+        break;
+    case STANDBY:
+        standby_ = true;
+        break;
+    case RESET:
+    {
+        bool was_selected = cs_low_;
+        powerOnReset();
+        cs_low_ = was_selected;
+        break;
+    }
+    case START:
+        standby_ = false;
+        startConversions(now_ns);
+        break;
+    case STOP:
+        converting_ = false;
+        drdy_high_ = true;
+        break;
+    case RDATAC:
+        rdatac_ = true;
+        break;
+    case SDATAC:
+        rdatac_ = false;
+        break;
+    case RDATA:
+        if (!rdatac_)
+        {
+            rdata_pending_ = true;
+            output_pos_ = 0;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void ADSSim::startConversions(uint64_t now_ns)
+{
+    converting_ = true;
+    rate_ = sampleRate();
+    next_index_ = 0;
+    started_ns_ = now_ns;
+    // First DRDY after the digital filter settles
+    start_ns_ = now_ns + (ADSSIM_SETTLE_PERIODS - 1) * (1000000000ULL / rate_);
+}
+
+uint64_t ADSSim::conversionTimeNs(uint64_t index) const
+{
+    return start_ns_ + ((index + 1) * 1000000000ULL) / rate_;
+}
+
+uint64_t ADSSim::nextEventNs() const
+{
+    if (!converting_ || standby_)
+        return ADSSIM_NO_EVENT;
+    return conversionTimeNs(next_index_);
+}
+
+void ADSSim::advanceTo(uint64_t now_ns)
+{
+    while (converting_ && !standby_ && conversionTimeNs(next_index_) <= now_ns)
+    {
+        loadConversion(conversionTimeNs(next_index_));
+        next_index_++;
+    }
+}
+
+void ADSSim::loadConversion(uint64_t t_ns)
+{
+    if (!output_read_)
+        conversions_missed_++;
+    conversions_++;
+    output_read_ = false;
+    last_drdy_ns_ = t_ns;
+    drdy_high_ = false;
+    rdata_pending_ = false;
+    output_pos_ = rdatac_ ? 0 : sizeof(output_);
+
+    uint8_t loffp = 0, loffn = 0, gpio = 0;
+    if (chip_ == ADSSIM_ADS1292R)
+    {
+        loffp = regs_[ADS1292R_LOFF_STAT];
+        gpio = regs_[ADS1292R_GPIO];
+    }
+    else
+    {
+        loffp = regs_[LOFF_STATP];
+        loffn = regs_[LOFF_STATN];
+        gpio = regs_[GPIO];
+    }
+    uint32_t status = 0xC00000UL | ((uint32_t)loffp << 12) | ((uint32_t)loffn << 4) | ((gpio >> 4) & 0x0F);
+    output_[0] = status >> 16;
+    output_[1] = status >> 8;
+    output_[2] = status;
+
+    double t = t_ns * 1e-9;
+    float full_scale = vref();
+    for (int ch = 0; ch < channels(); ch++)
+    {
+        uint8_t chset = regs_[channelRegister(ch)];
+        long code = 0;
+        if (!(chset & PDn))
+        {
+            double counts = (channelVolts(ch, t) + leadOffVolts(ch, next_index_)) * gain(chset) / full_scale * (ADSSIM_FULL_SCALE + 1.0);
+            if (counts > ADSSIM_FULL_SCALE)
+                counts = ADSSIM_FULL_SCALE;
+            if (counts < -ADSSIM_FULL_SCALE - 1)
+                counts = -ADSSIM_FULL_SCALE - 1;
+            code = lround(counts);
+        }
+        uint8_t *out = &output_[ADSSIM_STATUS_SIZE + 3 * ch];
+        out[0] = (code >> 16) & 0xFF;
+        out[1] = (code >> 8) & 0xFF;
+        out[2] = code & 0xFF;
+    }
+}
+
+uint8_t ADSSim::channelRegister(int channel) const
+{
+    if (chip_ == ADSSIM_ADS1292R)
+        return ADS1292R_CH1SET + channel;
+    return CH1SET + channel;
+}
+
+float ADSSim::gain(uint8_t chset) const
+{
+    int index = (chset >> 4) & 0x07;
+    switch (chip_)
+    {
+    case ADSSIM_ADS1299:
+    case ADSSIM_ADS1299_4:
+    case ADSSIM_ADS1299_6:
+        return ADS1299_GAINS[index];
+    default:
+        return ADS1298_GAINS[index];
+    }
+}
+
+float ADSSim::vref() const
+{
+    switch (chip_)
+    {
+    case ADSSIM_ADS1292R:
+        return 2.42f;
+    case ADSSIM_ADS1294:
+    case ADSSIM_ADS1296:
+    case ADSSIM_ADS1298:
+        return (regs_[CONFIG3] & VREF_4V) ? 4.0f : 2.4f;
+    default:
+        return 4.5f;
+    }
+}
+
+float ADSSim::noise(float rms) const
+{
+    // Irwin-Hall approximation of a unit normal from four uniforms
+    float sum = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        prng_ ^= prng_ << 13;
+        prng_ ^= prng_ >> 17;
+        prng_ ^= prng_ << 5;
+        sum += (prng_ & 0xFFFFFF) / 16777216.0f;
+    }
+    return (sum - 2.0f) * 1.7320508f * rms;
+}
+
+float ADSSim::testSignalVolts(double t) const
+{
+    bool internal;
+    bool dc;
+    float amplitude;
+    double period;
+    if (chip_ == ADSSIM_ADS1292R)
+    {
+        uint8_t config2 = regs_[ADS1292R_CONFIG2];
+        internal = config2 & 0x02;
+        dc = !(config2 & 0x01);
+        amplitude = 1e-3f;
+        period = 1.0;
+    }
+    else
+    {
+        uint8_t config2 = regs_[CONFIG2];
+        internal = config2 & INT_TEST;
+        dc = (config2 & (TEST_FREQ1 | TEST_FREQ0)) == (TEST_FREQ1 | TEST_FREQ0);
+        amplitude = vref() / 2.4f * 1e-3f * ((config2 & TEST_AMP) ? 2.0f : 1.0f);
+        period = (double)((config2 & TEST_FREQ0) ? (1UL << 20) : (1UL << 21)) / ADSSIM_FCLK_HZ;
+    }
+    if (!internal)
+        return 0;
+    if (dc)
+        return amplitude;
+    return fmod(t, period) < period / 2 ? amplitude : -amplitude;
+}
+
+/**
+ * AC lead-off excitation at fDR/4 through the electrode impedance. The
+ * current source toggles every second conversion, so the decimated output
+ * reads +IZ, +IZ, -IZ, -IZ. The lower AC frequencies of the ADS1299 and DC
+ * lead-off are not modelled.
+ */
+float ADSSim::leadOffVolts(int channel, uint64_t index) const
+{
+    static const float ADS1299_CURRENTS[4] = {6e-9f, 24e-9f, 6e-6f, 24e-6f};
+    static const float ADS1298_CURRENTS[4] = {6e-9f, 12e-9f, 18e-9f, 24e-9f};
+    if (chip_ == ADSSIM_ADS1292R || !(regs_[LOFF_SENSP] & (1 << channel)))
+        return 0;
+    if ((regs_[channelRegister(channel)] & (MUXn2 | MUXn1 | MUXn0)) != ELECTRODE_INPUT)
+        return 0;
+    uint8_t loff = regs_[LOFF];
+    bool ads1299 = chip_ == ADSSIM_ADS1299 || chip_ == ADSSIM_ADS1299_4 || chip_ == ADSSIM_ADS1299_6;
+    uint8_t flead = loff & (FLEAD_OFF1 | FLEAD_OFF0);
+    if (flead != (ads1299 ? (FLEAD_OFF1 | FLEAD_OFF0) : FLEAD_OFF0))
+        return 0;
+    int current_index = (loff >> 2) & 0x03;
+    float current = ads1299 ? ADS1299_CURRENTS[current_index] : ADS1298_CURRENTS[current_index];
+    float volts = current * signal_.electrode_kohm[channel] * 1e3f;
+    return (index & 2) ? -volts : volts;
+}
+
+float ADSSim::channelVolts(int channel, double t) const
+{
+    uint8_t mux = regs_[channelRegister(channel)] & (MUXn2 | MUXn1 | MUXn0);
+    switch (mux)
+    {
+    case ELECTRODE_INPUT:
+    {
+        // Channels see the same rhythms with a per-channel phase and weight
+        double phase = channel * 0.7;
+        float weight = 1.0f - 0.08f * channel;
+        double alpha = sin(2 * M_PI * 10.0 * t + phase) * (0.6 + 0.4 * sin(2 * M_PI * 0.2 * t));
+        double beta = sin(2 * M_PI * 21.0 * t + 2 * phase);
+        double line = sin(2 * M_PI * signal_.line_hz * t);
+        pink_[channel] = 0.95f * pink_[channel] + noise(signal_.noise_uV * 0.312f);
+        float volts_uV = weight * (signal_.alpha_uV * alpha + signal_.beta_uV * beta) +
+                         signal_.line_uV * line + 0.7f * pink_[channel] +
+                         noise(signal_.noise_uV * 0.3f);
+        if (signal_.emg_mask & (1 << channel))
+            volts_uV += noise(signal_.emg_uV);
+        return signal_.offset_mV * 1e-3f + volts_uV * 1e-6f;
+    }
+    case SHORTED:
+        return noise(0.5e-6f);
+    case MVDD:
+        return 0.5f * vref();
+    case TEMP:
+        return 0.1453f;
+    case TEST_SIGNAL:
+        return testSignalVolts(t);
+    default:
+        return 0;
+    }
+}
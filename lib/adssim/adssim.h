@@ -0,0 +1,161 @@
+/*
+ * ADS129x device simulator for host builds
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Models the serial interface, register map and conversion timing of the
+ * ADS1292R, ADS1294/6/8 and ADS1299(-4/-6). The model has no notion of wall
+ * time: the host runtime passes the virtual time in nanoseconds to every
+ * call and asks for the next DRDY edge with nextEventNs().
+ */
+
+#ifndef ADSSIM_H
+#define ADSSIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ADSSIM_MAX_CHANNELS 8
+#define ADSSIM_MAX_REGISTERS 0x1A
+#define ADSSIM_STATUS_SIZE 3
+#define ADSSIM_FCLK_HZ 2048000UL
+#define ADSSIM_NO_EVENT UINT64_MAX
+
+enum ADSSimChip
+{
+    ADSSIM_ADS1292R,
+    ADSSIM_ADS1294,
+    ADSSIM_ADS1296,
+    ADSSIM_ADS1298,
+    ADSSIM_ADS1299,
+    ADSSIM_ADS1299_4,
+    ADSSIM_ADS1299_6
+};
+
+// Synthetic input applied to channels whose MUX selects the electrode input
+struct ADSSimSignal
+{
+    float alpha_uV = 20.0f;   // 10 Hz rhythm
+    float beta_uV = 5.0f;     // 21 Hz rhythm
+    float line_uV = 10.0f;    // mains interference
+    float line_hz = 50.0f;
+    float noise_uV = 2.0f;    // broadband noise, RMS
+    float offset_mV = 0.0f;   // electrode DC offset
+    float emg_uV = 0.0f;      // muscle activity, RMS, on the channels in emg_mask
+    uint8_t emg_mask = 0;     // channel 1 is bit 0
+    float electrode_kohm[ADSSIM_MAX_CHANNELS] = {5, 10, 15, 20, 30, 50, 100, 200}; // seen by lead-off current
+    uint32_t seed = 0x2545F491;
+};
+
+class ADSSim
+{
+public:
+    explicit ADSSim(ADSSimChip chip = ADSSIM_ADS1299);
+
+    // Swap the die and power cycle it
+    void setChip(ADSSimChip chip);
+    ADSSimChip chip() const { return chip_; }
+    const char *chipName() const;
+    int channels() const;
+    void powerOnReset();
+
+    // Serial interface; CS is active low
+    void select(bool cs_low, uint64_t now_ns);
+    uint8_t transfer(uint8_t mosi, uint64_t now_ns);
+
+    // Conversion timing
+    uint64_t nextEventNs() const;
+    void advanceTo(uint64_t now_ns);
+    bool drdy() const { return drdy_high_; }
+    uint32_t sampleRate() const;
+    uint64_t lastDrdyNs() const { return last_drdy_ns_; }
+    uint64_t startedNs() const { return started_ns_; } // conversions last (re)started
+    uint64_t conversionTimeNs(uint64_t index) const;   // DRDY of conversion index since START
+
+    // Backdoor register access, bypasses the serial interface
+    uint8_t reg(uint8_t address) const;
+    void setReg(uint8_t address, uint8_t value);
+    int numRegisters() const;
+
+    ADSSimSignal &signal() { return signal_; }
+    bool isRdatac() const { return rdatac_; }
+    bool isConverting() const { return converting_; }
+
+    // Counters since the last power cycle
+    uint64_t conversions() const { return conversions_; }
+    uint64_t conversionsRead() const { return conversions_read_; }
+    uint64_t conversionsMissed() const { return conversions_missed_; }
+    uint64_t bytesTransferred() const { return bytes_transferred_; }
+
+private:
+    enum SerialState
+    {
+        SERIAL_OPCODE,
+        SERIAL_COUNT,
+        SERIAL_RREG,
+        SERIAL_WREG
+    };
+
+    void command(uint8_t opcode, uint64_t now_ns);
+    void startConversions(uint64_t now_ns);
+    void loadConversion(uint64_t t_ns);
+    uint8_t channelRegister(int channel) const;
+    float gain(uint8_t chset) const;
+    float vref() const;
+    float channelVolts(int channel, double t) const;
+    float leadOffVolts(int channel, uint64_t index) const;
+    float testSignalVolts(double t) const;
+    float noise(float rms) const;
+    bool writable(uint8_t address) const;
+
+    ADSSimChip chip_;
+    ADSSimSignal signal_;
+    uint8_t regs_[ADSSIM_MAX_REGISTERS];
+
+    // serial interface
+    bool cs_low_ = false;
+    SerialState state_ = SERIAL_OPCODE;
+    uint8_t reg_address_ = 0;
+    uint8_t reg_remaining_ = 0;
+    uint8_t opcode_ = 0;
+
+    // conversion pipeline
+    bool rdatac_ = true;
+    bool converting_ = false;
+    bool standby_ = false;
+    bool drdy_high_ = true;
+    bool output_read_ = true;
+    bool rdata_pending_ = false;
+    uint8_t output_[ADSSIM_STATUS_SIZE + 3 * ADSSIM_MAX_CHANNELS];
+    size_t output_pos_ = 0;
+    uint64_t start_ns_ = 0;
+    uint64_t started_ns_ = 0;
+    uint64_t next_index_ = 0;
+    uint64_t last_drdy_ns_ = 0;
+    uint32_t rate_ = 0;
+
+    uint64_t conversions_ = 0;
+    uint64_t conversions_read_ = 0;
+    uint64_t conversions_missed_ = 0;
+    uint64_t bytes_transferred_ = 0;
+    mutable uint32_t prng_;
+    mutable float pink_[ADSSIM_MAX_CHANNELS];
+};
+
+#endif // ADSSIM_H
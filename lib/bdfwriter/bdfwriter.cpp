@@ -0,0 +1,455 @@
+/*
+ * BDF+ recording of device frames on the host
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "bdfwriter.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "frameformat.h"
+
+#define BDF_SAMPLE_BYTES 3
+#define BDF_RECORDS_OFFSET 236 // number of data records in the fixed header
+
+BdfWriter::BdfWriter()
+    : fd_(-1), started_(false), sample_rate_(0), channels_(0), record_samples_(0), record_bytes_(0), buffer_(NULL),
+      buffer_size_(0), buffer_used_(0), record_(NULL), fill_(0), start_sample_(0), start_fraction_us_(0),
+      next_sample_(0), annotation_used_(0), pending_count_(0), last_level_(0), records_(0), samples_(0),
+      samples_lost_(0), frames_skipped_(0), bytes_written_(0)
+{
+}
+
+BdfWriter::~BdfWriter()
+{
+    close();
+}
+
+bool BdfWriter::open(const char *path, const BdfConfig &config)
+{
+    close();
+    if (config.channel_mask == 0 || config.record_ms == 0)
+        return false;
+    fd_ = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0)
+        return false;
+    config_ = config;
+    channels_ = 0;
+    for (int ch = 0; ch < BDF_MAX_CHANNELS; ch++)
+        if (config.channel_mask & (1 << ch))
+            channel_index_[channels_++] = ch;
+    started_ = false;
+    record_ = NULL;
+    fill_ = 0;
+    pending_count_ = 0;
+    last_level_ = 0;
+    records_ = samples_ = samples_lost_ = frames_skipped_ = bytes_written_ = 0;
+    return true;
+}
+
+// Left aligned and space padded, as every header field is
+static void field(uint8_t *&p, const char *text, size_t width)
+{
+    size_t length = strlen(text);
+    if (length > width)
+        length = width;
+    memcpy(p, text, length);
+    memset(p + length, ' ', width - length);
+    p += width;
+}
+
+static void numberField(uint8_t *&p, double value, size_t width)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.*g", (int)width - 1, value);
+    field(p, text, width);
+}
+
+// Seconds with up to microsecond resolution, sign first as TALs want it
+static int formatSeconds(char *out, size_t size, int64_t us, bool sign)
+{
+    const char *prefix = us < 0 ? "-" : sign ? "+" : "";
+    uint64_t magnitude = us < 0 ? -us : us;
+    int n = snprintf(out, size, "%s%llu", prefix, (unsigned long long)(magnitude / 1000000));
+    if (magnitude % 1000000)
+    {
+        n += snprintf(out + n, size - n, ".%06llu", (unsigned long long)(magnitude % 1000000));
+        while (out[n - 1] == '0')
+            out[--n] = '\0';
+    }
+    return n;
+}
+
+void BdfWriter::writeHeader(int64_t start_unix_us)
+{
+    static const char *MONTHS[] = {"JAN", "FEB", "MAR", "APR", "MAY", "JUN", "JUL", "AUG", "SEP", "OCT", "NOV", "DEC"};
+    time_t seconds = start_unix_us / 1000000;
+    start_fraction_us_ = start_unix_us % 1000000;
+    struct tm start;
+    gmtime_r(&seconds, &start);
+
+    int signals = channels_ + 1;
+    uint8_t *p = buffer_;
+    char text[96];
+    *p++ = 0xFF;
+    field(p, "BIOSEMI", 7);
+    field(p, config_.patient, 80);
+    snprintf(text, sizeof(text), "Startdate %02d-%s-%04d X X %s", start.tm_mday, MONTHS[start.tm_mon],
+             start.tm_year + 1900, config_.equipment);
+    field(p, text, 80);
+    snprintf(text, sizeof(text), "%02d.%02d.%02d", start.tm_mday, start.tm_mon + 1, start.tm_year % 100);
+    field(p, text, 8);
+    snprintf(text, sizeof(text), "%02d.%02d.%02d", start.tm_hour, start.tm_min, start.tm_sec);
+    field(p, text, 8);
+    numberField(p, 256.0 * (signals + 1), 8);
+    field(p, "BDF+D", 44);
+    field(p, "-1", 8); // patched by close()
+    numberField(p, config_.record_ms / 1000.0, 8);
+    numberField(p, signals, 4);
+
+    for (int k = 0; k < channels_; k++)
+    {
+        snprintf(text, sizeof(text), "EEG %d", channel_index_[k] + 1);
+        field(p, text, 16);
+    }
+    field(p, "BDF Annotations", 16);
+    for (int k = 0; k < signals; k++)
+        field(p, "", 80); // transducer
+    for (int k = 0; k < signals; k++)
+        field(p, k < channels_ ? "uV" : "", 8);
+    for (int k = 0; k < signals; k++)
+        numberField(p, k < channels_ ? -config_.physical_max_uV : -1, 8);
+    for (int k = 0; k < signals; k++)
+        numberField(p, k < channels_ ? config_.physical_max_uV : 1, 8);
+    for (int k = 0; k < signals; k++)
+        field(p, "-8388608", 8);
+    for (int k = 0; k < signals; k++)
+        field(p, "8388607", 8);
+    for (int k = 0; k < signals; k++)
+        field(p, "", 80); // prefiltering
+    for (int k = 0; k < signals; k++)
+        numberField(p, k < channels_ ? record_samples_ : BDF_ANNOTATION_BYTES / BDF_SAMPLE_BYTES, 8);
+    for (int k = 0; k < signals; k++)
+        field(p, "", 32);
+    buffer_used_ = p - buffer_;
+}
+
+// The first frame fixes rate, record size and start time
+bool BdfWriter::begin(const uint8_t *frame)
+{
+    const FrameHeader *header = (const FrameHeader *)frame;
+    if (header->sample_rate == 0 || ((uint64_t)header->sample_rate * config_.record_ms) % 1000)
+        return false;
+    sample_rate_ = header->sample_rate;
+    record_samples_ = (uint64_t)sample_rate_ * config_.record_ms / 1000;
+    record_bytes_ = (size_t)channels_ * record_samples_ * BDF_SAMPLE_BYTES + BDF_ANNOTATION_BYTES;
+    size_t header_bytes = 256 * (channels_ + 2);
+    buffer_size_ = config_.buffer_bytes > header_bytes + record_bytes_ ? config_.buffer_bytes : header_bytes + record_bytes_;
+    buffer_ = (uint8_t *)malloc(buffer_size_);
+    if (!buffer_)
+        return false;
+
+    int64_t start_us = config_.start_unix_us;
+    if (start_us == 0 && (header->flags & FRAME_FLAG_CLOCK_SYNCED))
+        start_us = header->ref_host_us; // taken at the first sample
+    if (start_us == 0)
+    {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        start_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    }
+    writeHeader(start_us);
+    start_sample_ = next_sample_ = header->first_sample;
+    started_ = true;
+    return true;
+}
+
+int64_t BdfWriter::onsetUs(uint32_t sample_number) const
+{
+    return start_fraction_us_ + (int64_t)(int32_t)(sample_number - start_sample_) * 1000000 / sample_rate_;
+}
+
+void BdfWriter::annotate(int64_t onset_us, int64_t duration_us, const char *text)
+{
+    char tal[64];
+    int n = formatSeconds(tal, sizeof(tal), onset_us, true);
+    if (duration_us > 0)
+    {
+        tal[n++] = 0x15;
+        n += formatSeconds(tal + n, sizeof(tal) - n, duration_us, false);
+    }
+    n += snprintf(tal + n, sizeof(tal) - n, "\x14%s\x14", text);
+    size_t length = n + 1; // the terminating zero ends the TAL
+    if (record_ && annotation_used_ + length <= BDF_ANNOTATION_BYTES)
+    {
+        memcpy(record_ + record_bytes_ - BDF_ANNOTATION_BYTES + annotation_used_, tal, length);
+        annotation_used_ += length;
+    }
+    else if (pending_count_ < BDF_PENDING_ANNOTATIONS)
+        memcpy(pending_[pending_count_++], tal, length);
+}
+
+// Time keeping annotation first, then whatever earlier records had no room for
+void BdfWriter::startRecord(uint32_t sample_number)
+{
+    if (buffer_size_ - buffer_used_ < record_bytes_)
+        flush();
+    record_ = buffer_ + buffer_used_;
+    uint8_t *annotations = record_ + record_bytes_ - BDF_ANNOTATION_BYTES;
+    memset(annotations, 0, BDF_ANNOTATION_BYTES);
+    int n = formatSeconds((char *)annotations, BDF_ANNOTATION_BYTES, onsetUs(sample_number), true);
+    annotations[n++] = 0x14;
+    annotations[n++] = 0x14;
+    annotations[n++] = 0;
+    annotation_used_ = n;
+    int taken = 0;
+    while (taken < pending_count_)
+    {
+        size_t length = strlen(pending_[taken]) + 1;
+        if (annotation_used_ + length > BDF_ANNOTATION_BYTES)
+            break;
+        memcpy(annotations + annotation_used_, pending_[taken++], length);
+        annotation_used_ += length;
+    }
+    pending_count_ -= taken;
+    memmove(pending_, pending_[taken], pending_count_ * sizeof(pending_[0]));
+    fill_ = 0;
+}
+
+bool BdfWriter::endRecord()
+{
+    buffer_used_ += record_bytes_;
+    record_ = NULL;
+    fill_ = 0;
+    records_++;
+    return true;
+}
+
+bool BdfWriter::flush()
+{
+    size_t done = 0;
+    while (done < buffer_used_)
+    {
+        ssize_t n = ::write(fd_, buffer_ + done, buffer_used_ - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    bytes_written_ += done;
+    buffer_used_ = 0;
+    return true;
+}
+
+// Zeros for samples that never arrived, up to the end of the open record
+void BdfWriter::pad(uint32_t samples)
+{
+    for (uint32_t i = 0; i < samples; i++)
+    {
+        for (int k = 0; k < channels_; k++)
+            memset(record_ + ((size_t)k * record_samples_ + fill_) * BDF_SAMPLE_BYTES, 0, BDF_SAMPLE_BYTES);
+        next_sample_++;
+        if (++fill_ == record_samples_)
+            endRecord();
+    }
+}
+
+void BdfWriter::writeRaw(const uint8_t *frame, uint16_t samples)
+{
+    const uint8_t *block = frame + FRAME_BLOCK_SIZE + FRAME_SAMPLE_DATA_OFFSET;
+    const size_t column = (size_t)record_samples_ * BDF_SAMPLE_BYTES;
+    uint16_t i = 0;
+    while (i < samples)
+    {
+        if (!record_)
+            startRecord(next_sample_);
+        // The rest of the frame or of the record, whichever ends first
+        uint32_t run = record_samples_ - fill_;
+        if (run > (uint32_t)(samples - i))
+            run = samples - i;
+        for (int k = 0; k < channels_; k++)
+        {
+            const uint8_t *code = block + (size_t)i * FRAME_BLOCK_SIZE + BDF_SAMPLE_BYTES * channel_index_[k];
+            uint8_t *out = record_ + k * column + (size_t)fill_ * BDF_SAMPLE_BYTES;
+            for (uint32_t j = 0; j < run; j++)
+            {
+                out[0] = code[2];
+                out[1] = code[1];
+                out[2] = code[0];
+                code += FRAME_BLOCK_SIZE;
+                out += BDF_SAMPLE_BYTES;
+            }
+        }
+        i += run;
+        fill_ += run;
+        next_sample_ += run;
+        samples_ += run;
+        if (fill_ == record_samples_)
+            endRecord();
+    }
+}
+
+// Packed records back to one sample per conversion; a decimated record is held for all of its conversions
+void BdfWriter::writePacked(const uint8_t *frame)
+{
+    const FrameFormatBlock *format = (const FrameFormatBlock *)(frame + FRAME_BLOCK_SIZE);
+    const uint8_t *records = frame + 2 * FRAME_BLOCK_SIZE;
+    const int code_bytes = format->encoding == FRAME_ENCODING_INT24 ? 3 : 2;
+    int position[BDF_MAX_CHANNELS];
+    uint8_t shift[BDF_MAX_CHANNELS];
+    for (int k = 0; k < channels_; k++)
+    {
+        uint8_t ch = channel_index_[k];
+        position[k] = (format->channel_mask & (1 << ch))
+                          ? __builtin_popcount(format->channel_mask & ((1 << ch) - 1)) * code_bytes
+                          : -1;
+        shift[k] = format->encoding == FRAME_ENCODING_BFP16 ? frameChannelShift(format, ch) : 8;
+    }
+    const uint32_t decimation = format->decimation ? format->decimation : 1;
+    for (uint32_t conversion = 0; conversion < format->conversions; conversion++)
+    {
+        if (!record_)
+            startRecord(next_sample_);
+        const uint8_t *record = records + (conversion / decimation) * format->record_bytes;
+        for (int k = 0; k < channels_; k++)
+        {
+            uint8_t *out = record_ + ((size_t)k * record_samples_ + fill_) * BDF_SAMPLE_BYTES;
+            if (position[k] < 0)
+                memset(out, 0, BDF_SAMPLE_BYTES);
+            else if (code_bytes == 3)
+            {
+                const uint8_t *code = record + position[k];
+                out[0] = code[2];
+                out[1] = code[1];
+                out[2] = code[0];
+            }
+            else
+            {
+                // A 16 bit mantissa back to its 24 bit code
+                const uint8_t *code = record + position[k];
+                int32_t value = (int16_t)((code[0] << 8) | code[1]) * (1 << shift[k]);
+                out[0] = value;
+                out[1] = value >> 8;
+                out[2] = value >> 16;
+            }
+        }
+        next_sample_++;
+        samples_++;
+        if (++fill_ == record_samples_)
+            endRecord();
+    }
+}
+
+/**
+ * Frames must arrive in sample order. One that starts before the samples
+ * already written, a resent or recorded copy, is skipped; one that starts
+ * after them leaves a gap.
+ */
+bool BdfWriter::write(const uint8_t *frame, size_t length)
+{
+    if (fd_ < 0 || length < 2 * FRAME_BLOCK_SIZE)
+        return false;
+    const FrameHeader *header = (const FrameHeader *)frame;
+    if (header->magic != FRAME_MAGIC || length < frameLength(header))
+        return false;
+    if (!started_ && !begin(frame))
+        return false;
+    if (header->sample_rate != sample_rate_ || (int32_t)(header->first_sample - next_sample_) < 0)
+    {
+        frames_skipped_++;
+        return true;
+    }
+
+    uint32_t lost = header->first_sample - next_sample_;
+    if (lost > 0)
+    {
+        samples_lost_ += lost;
+        char text[32];
+        snprintf(text, sizeof(text), "Samples lost %u", lost);
+        annotate(onsetUs(next_sample_), (int64_t)lost * 1000000 / sample_rate_, text);
+        uint32_t room = record_ ? record_samples_ - fill_ : 0;
+        pad(lost < room ? lost : room);
+        next_sample_ = header->first_sample;
+    }
+
+    bool packed = header->flags & FRAME_FLAG_PACKED;
+    uint8_t level = packed ? ((const FrameFormatBlock *)(header + 1))->level : 0;
+    if (level != last_level_)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "Stream level %u", level);
+        annotate(onsetUs(next_sample_), 0, text);
+        last_level_ = level;
+    }
+    if (packed)
+        writePacked(frame);
+    else
+        writeRaw(frame, header->samples);
+
+    if (header->flags & FRAME_FLAG_EVENTS)
+    {
+        const FrameEventBlock *events = (const FrameEventBlock *)(frame + frameLength(header) - FRAME_BLOCK_SIZE);
+        for (int i = 0; i < events->count && i < FRAME_EVENTS_PER_BLOCK; i++)
+        {
+            const FrameEvent &event = events->events[i];
+            char text[32];
+            if (event.source == FRAME_EVENT_TRIGGER)
+                snprintf(text, sizeof(text), "Trigger");
+            else
+                snprintf(text, sizeof(text), "Mark %u", event.code);
+            // Stamped with the sample after the event and the time since the one before
+            annotate(onsetUs(event.sample_number - 1) + event.offset_us, 0, text);
+        }
+    }
+    return true;
+}
+
+/**
+ * A partly filled record is completed with zeros after a note where the
+ * recording ends, since every record holds the same number of samples.
+ */
+bool BdfWriter::close()
+{
+    if (fd_ < 0)
+        return true;
+    bool ok = true;
+    if (started_)
+    {
+        if (record_)
+        {
+            annotate(onsetUs(next_sample_), 0, "Recording ends");
+            pad(record_samples_ - fill_);
+        }
+        ok = flush();
+        char count[9];
+        snprintf(count, sizeof(count), "%-8llu", (unsigned long long)records_);
+        ok = ok && pwrite(fd_, count, 8, BDF_RECORDS_OFFSET) == 8;
+    }
+    ok = ::close(fd_) == 0 && ok;
+    fd_ = -1;
+    free(buffer_);
+    buffer_ = NULL;
+    started_ = false;
+    return ok;
+}
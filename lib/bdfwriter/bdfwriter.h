@@ -0,0 +1,116 @@
+/*
+ * BDF+ recording of device frames on the host
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * BDF stores 24 bit two's complement samples little endian, so the codes
+ * the ADS129x sends only need their bytes reversed: frames go into data
+ * records without ever becoming numbers. A data record holds record_ms of
+ * every channel, channel after channel, then the "BDF Annotations" signal.
+ * Records are assembled in place in a large output buffer and written out
+ * with one write() per buffer, so many recorders can share a core.
+ *
+ * The file is BDF+D: every record starts with a time keeping annotation
+ * taken from the sample number of its first sample, lost samples are
+ * zero filled up to the end of the record and noted, and a longer gap
+ * starts the next record at the next sample that arrived. Trigger and
+ * mark events become annotations at their sample number and offset.
+ */
+
+#ifndef BDFWRITER_H
+#define BDFWRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BDF_MAX_CHANNELS 8
+#define BDF_ANNOTATION_BYTES 240 // per record, a few events besides time keeping
+#define BDF_PENDING_ANNOTATIONS 32
+
+struct BdfConfig
+{
+    uint8_t channel_mask = 0xFF;   // channel 1 is bit 0
+    uint32_t record_ms = 1000;     // a whole number of samples at the stream's rate
+    float physical_max_uV = 187500; // at the largest code, VREF / gain; 4.5 V / 24 for the ADS1299
+    const char *patient = "X X X X";
+    const char *equipment = "OSEM";
+    int64_t start_unix_us = 0;     // 0 takes it from a synced frame, or else the host clock
+    size_t buffer_bytes = 1 << 20; // at least one record
+};
+
+class BdfWriter
+{
+public:
+    BdfWriter();
+    ~BdfWriter();
+
+    // The header is written with the first frame, which gives the rate
+    bool open(const char *path, const BdfConfig &config);
+    // One binary WebSocket message as received; false if it is no frame or cannot be written
+    bool write(const uint8_t *frame, size_t length);
+    // Writes the open record and the record count
+    bool close();
+
+    bool isOpen() const { return fd_ >= 0; }
+    uint64_t records() const { return records_; }
+    uint64_t samples() const { return samples_; }
+    uint64_t samplesLost() const { return samples_lost_; }
+    uint64_t framesSkipped() const { return frames_skipped_; }
+    uint64_t bytesWritten() const { return bytes_written_; }
+
+private:
+    bool begin(const uint8_t *frame);
+    void writeHeader(int64_t start_unix_us);
+    void startRecord(uint32_t sample_number);
+    bool endRecord();
+    bool flush();
+    void pad(uint32_t samples);
+    void annotate(int64_t onset_us, int64_t duration_us, const char *text);
+    void writeRaw(const uint8_t *frame, uint16_t samples);
+    void writePacked(const uint8_t *frame);
+    int64_t onsetUs(uint32_t sample_number) const;
+
+    int fd_;
+    BdfConfig config_;
+    bool started_;
+    uint32_t sample_rate_;
+    int channels_;
+    uint8_t channel_index_[BDF_MAX_CHANNELS]; // device channel of each signal
+    uint32_t record_samples_;
+    size_t record_bytes_;
+    uint8_t *buffer_;
+    size_t buffer_size_;
+    size_t buffer_used_; // complete records, the open one follows
+    uint8_t *record_;    // inside buffer_
+    uint32_t fill_;      // samples in the open record
+    uint32_t start_sample_;
+    int64_t start_fraction_us_; // below the header's whole second
+    uint32_t next_sample_;
+    size_t annotation_used_;
+    char pending_[BDF_PENDING_ANNOTATIONS][64]; // did not fit the record they were made for
+    int pending_count_;
+    uint8_t last_level_;
+    uint64_t records_;
+    uint64_t samples_;
+    uint64_t samples_lost_;
+    uint64_t frames_skipped_;
+    uint64_t bytes_written_;
+};
+
+#endif // BDFWRITER_H
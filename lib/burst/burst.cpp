@@ -0,0 +1,76 @@
+/*
+ * Pre-trigger burst capture
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "burst.h"
+
+BurstCapture::BurstCapture()
+{
+    buffer_ = NULL;
+    end();
+}
+
+bool BurstCapture::begin(uint8_t *buffer, uint32_t capacity, size_t record_size, uint32_t pre, uint32_t post, uint32_t rate)
+{
+    if (!buffer || post == 0 || rate == 0 || (uint64_t)pre + post > capacity)
+        return false;
+    end();
+    capacity_ = capacity;
+    record_size_ = record_size;
+    pre_ = pre;
+    post_ = post;
+    rate_ = rate;
+    buffer_ = buffer;
+    frozen_ = false;
+    return true;
+}
+
+void BurstCapture::end()
+{
+    // Frozen first, so a DRDY edge in between finds nothing to write to
+    frozen_ = true;
+    buffer_ = NULL;
+    capacity_ = 1;
+    record_size_ = 0;
+    pre_ = 0;
+    post_ = 0;
+    rate_ = 0;
+    written_ = 0;
+    trigger_pending_ = false;
+    triggered_ = false;
+    trigger_edge_us_ = 0;
+    trigger_index_ = 0;
+    trigger_us_ = 0;
+    trigger_offset_us_ = 0;
+    last_us_ = 0;
+    gaps_ = 0;
+    read_errors_ = 0;
+}
+
+uint32_t BurstCapture::first() const
+{
+    // A trigger before pre records were in leaves a shorter window
+    return trigger_index_ > pre_ ? trigger_index_ - pre_ : 0;
+}
+
+uint32_t BurstCapture::timestamp(uint32_t index) const
+{
+    int64_t offset = (int64_t)index - trigger_index_;
+    return trigger_us_ + (int32_t)(offset * 1000000 / (int64_t)rate_);
+}
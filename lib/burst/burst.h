@@ -0,0 +1,127 @@
+/*
+ * Pre-trigger burst capture
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A circular buffer of raw conversions, each the status word and the
+ * channels as the chip sends them, with no timestamp or sample number:
+ * record n is the n-th conversion since begin(). The caller fills next()
+ * and commits it from the DRDY ISR. A trigger makes the next committed
+ * record the trigger sample; once `post` records from it on are in, the
+ * buffer freezes and holds the window of up to `pre` records before the
+ * trigger sample and `post` from it, which the caller then reads out at
+ * its own pace. The ADC clock paces the conversions, so times follow from
+ * the trigger sample and the rate; a commit more than one and a half
+ * periods after the last counts as a gap.
+ */
+
+#ifndef BURST_H
+#define BURST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "Arduino.h"
+
+class BurstCapture
+{
+public:
+    BurstCapture();
+    // buffer holds capacity records of record_size bytes; false if pre + post does not fit
+    bool begin(uint8_t *buffer, uint32_t capacity, size_t record_size, uint32_t pre, uint32_t post, uint32_t rate);
+    void end();
+    bool active() const { return buffer_ != NULL; }
+
+    // Where the next conversion goes, NULL once frozen
+    inline uint8_t *IRAM_ATTR next()
+    {
+        return frozen_ ? NULL : buffer_ + (written_ % capacity_) * record_size_;
+    }
+
+    // The record next() returned is in, read at now_us
+    inline void IRAM_ATTR commit(uint32_t now_us, bool aligned)
+    {
+        if (written_ > 0 && (uint64_t)(now_us - last_us_) * rate_ * 2 > 3000000ULL)
+            gaps_++;
+        if (!aligned)
+            read_errors_++;
+        if (trigger_pending_ && !triggered_)
+        {
+            trigger_index_ = written_;
+            trigger_us_ = now_us;
+            uint32_t offset = written_ > 0 ? trigger_edge_us_ - last_us_ : 0;
+            trigger_offset_us_ = offset > UINT16_MAX ? UINT16_MAX : offset;
+            triggered_ = true;
+        }
+        last_us_ = now_us;
+        written_++;
+        if (triggered_ && written_ - trigger_index_ >= post_)
+            frozen_ = true;
+    }
+
+    // An edge at edge_us; the first one since begin() counts
+    inline void IRAM_ATTR trigger(uint32_t edge_us)
+    {
+        if (trigger_pending_)
+            return;
+        trigger_edge_us_ = edge_us;
+        trigger_pending_ = true;
+    }
+
+    bool triggered() const { return triggered_; }
+    bool frozen() const { return frozen_; }
+    uint32_t written() const { return written_; }
+    uint32_t capacity() const { return capacity_; }
+    uint32_t pre() const { return pre_; }
+    uint32_t post() const { return post_; }
+    uint32_t rate() const { return rate_; }
+    uint32_t gaps() const { return gaps_; }
+    uint32_t readErrors() const { return read_errors_; }
+
+    // The frozen window: records first() .. last() - 1, the trigger sample among them
+    uint32_t first() const;
+    uint32_t last() const { return trigger_index_ + post_; }
+    uint32_t triggerIndex() const { return trigger_index_; }
+    // Time of the edge after the record before the trigger sample, saturated
+    uint16_t triggerOffsetUs() const { return trigger_offset_us_; }
+    const uint8_t *record(uint32_t index) const { return buffer_ + (index % capacity_) * record_size_; }
+    // micros() of record index, from the trigger sample and the rate
+    uint32_t timestamp(uint32_t index) const;
+
+private:
+    uint8_t *buffer_;
+    uint32_t capacity_;
+    size_t record_size_;
+    uint32_t pre_;
+    uint32_t post_;
+    uint32_t rate_;
+
+    volatile uint32_t written_;
+    volatile bool trigger_pending_;
+    volatile bool triggered_;
+    volatile bool frozen_;
+    volatile uint32_t trigger_edge_us_;
+    uint32_t trigger_index_;
+    uint32_t trigger_us_;
+    uint16_t trigger_offset_us_;
+    uint32_t last_us_;
+    volatile uint32_t gaps_;
+    volatile uint32_t read_errors_;
+};
+
+#endif // BURST_H
@@ -0,0 +1,135 @@
+/*
+ * Host clock offset and drift estimation from timestamp exchanges
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "clocksync.h"
+
+ClockSync::ClockSync()
+{
+    reset();
+}
+
+void ClockSync::reset()
+{
+    count_ = 0;
+    next_ = 0;
+    exchanges_ = 0;
+    bucket_local_ = 0;
+    span_us_ = 0;
+    ref_local_ = 0;
+    ref_host_ = 0;
+    drift_ppb_ = 0;
+    best_rtt_ = 0;
+}
+
+/**
+ * t1 and t4 are host times, t2 and t3 device times, all in microseconds.
+ * Exchanges with a negative round trip are inconsistent and dropped.
+ */
+void ClockSync::addExchange(int64_t t1, int64_t t2, int64_t t3, int64_t t4)
+{
+    int64_t rtt = (t4 - t1) - (t3 - t2);
+    if (rtt < 0 || t3 < t2)
+        return;
+    Exchange exchange;
+    exchange.local_us = t2 + (t3 - t2) / 2;
+    exchange.host_us = t1 + (t4 - t1) / 2;
+    exchange.rtt_us = rtt > UINT32_MAX ? UINT32_MAX : (uint32_t)rtt;
+    exchanges_++;
+    int newest = (next_ + CLOCKSYNC_WINDOW - 1) % CLOCKSYNC_WINDOW;
+    if (count_ > 0 && exchange.local_us - bucket_local_ < CLOCKSYNC_SPACING_US)
+    {
+        // Same bucket as the newest pair: the faster exchange stands for it
+        if (exchange.rtt_us >= window_[newest].rtt_us)
+            return;
+        window_[newest] = exchange;
+    }
+    else
+    {
+        bucket_local_ = exchange.local_us;
+        window_[next_] = exchange;
+        next_ = (next_ + 1) % CLOCKSYNC_WINDOW;
+        if (count_ < CLOCKSYNC_WINDOW)
+            count_++;
+    }
+    fit();
+}
+
+void ClockSync::fit()
+{
+    // Queueing only ever adds delay, and a pair can be off by at most half
+    // the delay its round trip had beyond the best one, so each pair is
+    // weighted by the inverse square of that bound
+    uint32_t best = UINT32_MAX;
+    for (int i = 0; i < count_; i++)
+        if (window_[i].rtt_us < best)
+            best = window_[i].rtt_us;
+    best_rtt_ = best;
+
+    // Work relative to the newest exchange to keep the sums small
+    const Exchange &newest = window_[(next_ + CLOCKSYNC_WINDOW - 1) % CLOCKSYNC_WINDOW];
+    double weight[CLOCKSYNC_WINDOW];
+    double sum_w = 0, sum_x = 0, sum_y = 0;
+    int64_t oldest = newest.local_us;
+    for (int i = 0; i < count_; i++)
+    {
+        double bound = (window_[i].rtt_us - best) / 2.0 + CLOCKSYNC_ASYMMETRY_US;
+        weight[i] = 1.0 / (bound * bound);
+        sum_w += weight[i];
+        sum_x += weight[i] * (window_[i].local_us - newest.local_us);
+        sum_y += weight[i] * ((window_[i].host_us - newest.host_us) - (window_[i].local_us - newest.local_us));
+        if (window_[i].local_us < oldest)
+            oldest = window_[i].local_us;
+    }
+    double mean_x = sum_x / sum_w;
+    double mean_y = sum_y / sum_w;
+    double sxx = 0, sxy = 0;
+    for (int i = 0; i < count_; i++)
+    {
+        double dx = (window_[i].local_us - newest.local_us) - mean_x;
+        double dy = (window_[i].host_us - newest.host_us) - (window_[i].local_us - newest.local_us) - mean_y;
+        sxx += weight[i] * dx * dx;
+        sxy += weight[i] * dx * dy;
+    }
+
+    // Offset only until the pairs resolve a crystal's drift
+    span_us_ = newest.local_us - oldest;
+    double drift = span_us_ >= CLOCKSYNC_MIN_SPAN_US && sxx > 0 ? sxy / sxx * 1e9 : 0;
+    if (drift > CLOCKSYNC_MAX_DRIFT_PPB)
+        drift = CLOCKSYNC_MAX_DRIFT_PPB;
+    if (drift < -CLOCKSYNC_MAX_DRIFT_PPB)
+        drift = -CLOCKSYNC_MAX_DRIFT_PPB;
+    drift_ppb_ = (int32_t)drift;
+    // The fitted line passes through the mean, move along it to the newest
+    // exchange so the extrapolation to the near future is shortest
+    ref_local_ = newest.local_us;
+    ref_host_ = newest.host_us + (int64_t)(mean_y - (double)drift_ppb_ * 1e-9 * mean_x);
+}
+
+int64_t ClockSync::toHost(int64_t local_us) const
+{
+    int64_t elapsed = local_us - ref_local_;
+    return ref_host_ + elapsed + elapsed * drift_ppb_ / 1000000000LL;
+}
+
+int64_t ClockSync::toLocal(int64_t host_us) const
+{
+    int64_t elapsed = host_us - ref_host_;
+    return ref_local_ + elapsed - elapsed * drift_ppb_ / 1000000000LL;
+}
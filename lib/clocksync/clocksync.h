@@ -0,0 +1,88 @@
+/*
+ * Host clock offset and drift estimation from timestamp exchanges
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * NTP style exchange driven by the host: it sends its time t1, the device
+ * stamps arrival t2 and reply t3 in its own esp_timer microseconds, and the
+ * host reports its arrival time t4 with the next request. Each exchange gives
+ * one (local, host) pair at the midpoints and a round trip time. Of the
+ * exchanges within CLOCKSYNC_SPACING_US of each other only the one with the
+ * shortest round trip is kept, so the CLOCKSYNC_WINDOW pairs span tens of
+ * seconds however often the host asks. A least squares line through the
+ * pairs, the low-delay ones weighted most, gives offset and drift; the drift only once the pairs
+ * span CLOCKSYNC_MIN_SPAN_US, as over a few seconds network jitter swamps
+ * a crystal's tens of ppm, and the offset alone until then.
+ */
+
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+#include <stdint.h>
+
+#define CLOCKSYNC_WINDOW 64
+#define CLOCKSYNC_SPACING_US 2000000
+#define CLOCKSYNC_MIN_SPAN_US 10000000
+#define CLOCKSYNC_MIN_EXCHANGES 4
+#define CLOCKSYNC_ASYMMETRY_US 100 // path asymmetry left at the best round trip
+#define CLOCKSYNC_MAX_DRIFT_PPB 500000
+
+class ClockSync
+{
+public:
+    ClockSync();
+    void reset();
+    void addExchange(int64_t t1, int64_t t2, int64_t t3, int64_t t4);
+
+    bool synced() const { return exchanges_ >= CLOCKSYNC_MIN_EXCHANGES; }
+    int64_t toHost(int64_t local_us) const;
+    int64_t toLocal(int64_t host_us) const;
+
+    int64_t refLocalUs() const { return ref_local_; }
+    int64_t refHostUs() const { return ref_host_; }
+    int64_t offsetUs() const { return ref_host_ - ref_local_; }
+    int32_t driftPpb() const { return drift_ppb_; }
+    uint32_t rttUs() const { return best_rtt_; }
+    int exchanges() const { return exchanges_; }
+    // Local time the kept pairs span, drift is estimated from CLOCKSYNC_MIN_SPAN_US on
+    int64_t spanUs() const { return span_us_; }
+
+private:
+    struct Exchange
+    {
+        int64_t local_us;
+        int64_t host_us;
+        uint32_t rtt_us;
+    };
+
+    void fit();
+
+    Exchange window_[CLOCKSYNC_WINDOW];
+    int count_; // pairs kept
+    int next_;
+    int exchanges_;
+    int64_t bucket_local_; // first exchange the newest pair stands for
+    int64_t span_us_;
+    int64_t ref_local_;
+    int64_t ref_host_;
+    int32_t drift_ppb_;
+    uint32_t best_rtt_;
+};
+
+#endif // CLOCKSYNC_H
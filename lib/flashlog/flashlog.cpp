@@ -0,0 +1,278 @@
+/*
+ * Append-only recording of stream frames to a raw flash partition
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "flashlog.h"
+#include "frameformat.h"
+
+FlashLog::FlashLog()
+    : frames_written(0), frames_rejected(0), bytes_written(0), write_cycles(0),
+      partition_(NULL), num_segments_(0), head_(-1), sequence_(0), recording_(false),
+      write_pos_(0), erased_pos_(0), read_segment_(-1)
+{
+}
+
+/**
+ * Finds the log partition, a data partition labelled "osemlog" or else the
+ * unused SPIFFS partition of the default table, and rebuilds the index.
+ */
+bool FlashLog::begin()
+{
+    partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, FLASHLOG_PARTITION_LABEL);
+    if (!partition_)
+        partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+    if (!partition_)
+    {
+        ESP_LOGW("FLASHLOG", "No log partition");
+        return false;
+    }
+    num_segments_ = partition_->size / FLASHLOG_SEGMENT_SIZE;
+    if (num_segments_ > FLASHLOG_MAX_SEGMENTS)
+        num_segments_ = FLASHLOG_MAX_SEGMENTS;
+    if (num_segments_ < 2)
+    {
+        partition_ = NULL;
+        return false;
+    }
+
+    head_ = -1;
+    sequence_ = 0;
+    for (int i = 0; i < num_segments_; i++)
+    {
+        scanSegment(i);
+        if (segments_[i].sequence && segments_[i].sequence >= sequence_)
+        {
+            sequence_ = segments_[i].sequence;
+            head_ = i;
+        }
+    }
+    // Only the rest of the head's current sector is known to be erased
+    write_pos_ = head_ < 0 ? 0 : (uint64_t)head_ * FLASHLOG_SEGMENT_SIZE + segments_[head_].bytes;
+    erased_pos_ = (write_pos_ + FLASHLOG_SECTOR_SIZE - 1) & ~(uint64_t)(FLASHLOG_SECTOR_SIZE - 1);
+    ESP_LOGI("FLASHLOG", "%d segments, head %d, sequence %u", num_segments_, head_, sequence_);
+    return true;
+}
+
+void FlashLog::scanSegment(int index)
+{
+    Segment &segment = segments_[index];
+    size_t base = (size_t)index * FLASHLOG_SEGMENT_SIZE;
+    FlashLogSegmentHeader header;
+    memset(&segment, 0, sizeof(segment));
+    if (esp_partition_read(partition_, base, &header, sizeof(header)) != ESP_OK || header.magic != FLASHLOG_MAGIC)
+        return;
+    segment.sequence = header.sequence;
+    segment.bytes = sizeof(header);
+    bool first = true;
+    while (segment.bytes + sizeof(FrameHeader) <= FLASHLOG_SEGMENT_SIZE)
+    {
+        FrameHeader frame;
+        // Only raw frames are logged, so the header alone gives the length
+        if (esp_partition_read(partition_, base + segment.bytes, &frame, sizeof(frame)) != ESP_OK || frame.magic != FRAME_MAGIC ||
+            (frame.flags & FRAME_FLAG_PACKED))
+            break;
+        size_t length = frameLength(&frame);
+        if (frame.samples == 0 || segment.bytes + length > FLASHLOG_SEGMENT_SIZE)
+            break;
+        if (first)
+            segment.first_sample = frame.first_sample;
+        first = false;
+        segment.last_sample = frame.first_sample + frame.samples - 1;
+        segment.bytes += length;
+    }
+}
+
+void FlashLog::start()
+{
+    recording_ = partition_ != NULL;
+}
+
+void FlashLog::stop()
+{
+    recording_ = false;
+}
+
+/**
+ * Erases the sector at the erase position unless that would reach the
+ * segment being written, going once round the log at most.
+ */
+bool FlashLog::service()
+{
+    if (!recording_)
+        return false;
+    uint64_t head_start = write_pos_ - write_pos_ % FLASHLOG_SEGMENT_SIZE;
+    if (erased_pos_ >= head_start + capacity())
+        return false;
+    uint32_t offset = (uint32_t)(erased_pos_ % capacity());
+    if (offset % FLASHLOG_SEGMENT_SIZE == 0)
+        segments_[offset / FLASHLOG_SEGMENT_SIZE].sequence = 0;
+    if (esp_partition_erase_range(partition_, offset, FLASHLOG_SECTOR_SIZE) != ESP_OK)
+        return false;
+    erased_pos_ += FLASHLOG_SECTOR_SIZE;
+    return true;
+}
+
+bool FlashLog::openNextSegment(size_t length)
+{
+    uint64_t start = head_ < 0 ? write_pos_ : write_pos_ + FLASHLOG_SEGMENT_SIZE - 1;
+    start -= start % FLASHLOG_SEGMENT_SIZE;
+    if (erased_pos_ < start + sizeof(FlashLogSegmentHeader) + length)
+        return false;
+
+    int index = (int)(start % capacity()) / FLASHLOG_SEGMENT_SIZE;
+    FlashLogSegmentHeader header;
+    memset(&header, 0xFF, sizeof(header));
+    header.magic = FLASHLOG_MAGIC;
+    header.sequence = ++sequence_;
+    if (esp_partition_write(partition_, index * FLASHLOG_SEGMENT_SIZE, &header, sizeof(header)) != ESP_OK)
+        return false;
+    segments_[index].sequence = header.sequence;
+    segments_[index].bytes = sizeof(header);
+    head_ = index;
+    write_pos_ = start + sizeof(header);
+    return true;
+}
+
+/**
+ * Appends one frame (FrameHeader and its blocks). Returns false, counting
+ * the frame as rejected, when the erased space ahead is used up.
+ */
+bool FlashLog::append(const uint8_t *frame, size_t length)
+{
+    if (!recording_ || length < sizeof(FrameHeader) || length > FLASHLOG_SEGMENT_SIZE - sizeof(FlashLogSegmentHeader))
+        return false;
+    uint32_t started = ESP.getCycleCount();
+    bool fits = head_ >= 0 && segments_[head_].sequence && segments_[head_].bytes + length <= FLASHLOG_SEGMENT_SIZE;
+    if ((!fits && !openNextSegment(length)) || erased_pos_ < write_pos_ + length)
+    {
+        frames_rejected++;
+        return false;
+    }
+    if (esp_partition_write(partition_, (size_t)(write_pos_ % capacity()), frame, length) != ESP_OK)
+    {
+        frames_rejected++;
+        return false;
+    }
+
+    const FrameHeader *header = (const FrameHeader *)frame;
+    Segment &segment = segments_[head_];
+    if (segment.bytes == sizeof(FlashLogSegmentHeader))
+        segment.first_sample = header->first_sample;
+    segment.last_sample = header->first_sample + header->samples - 1;
+    segment.bytes += length;
+    write_pos_ += length;
+    frames_written++;
+    bytes_written += length;
+    write_cycles += ESP.getCycleCount() - started;
+    return true;
+}
+
+uint32_t FlashLog::usedBytes() const
+{
+    uint32_t used = 0;
+    for (int i = 0; i < num_segments_; i++)
+        if (segments_[i].sequence)
+            used += segments_[i].bytes;
+    return used;
+}
+
+bool FlashLog::oldestSample(uint32_t &sample) const
+{
+    int oldest = -1;
+    for (int i = 0; i < num_segments_; i++)
+        if (segments_[i].sequence && segments_[i].bytes > sizeof(FlashLogSegmentHeader) &&
+            (oldest < 0 || segments_[i].sequence < segments_[oldest].sequence))
+            oldest = i;
+    if (oldest >= 0)
+        sample = segments_[oldest].first_sample;
+    return oldest >= 0;
+}
+
+bool FlashLog::newestSample(uint32_t &sample) const
+{
+    int newest = -1;
+    for (int i = 0; i < num_segments_; i++)
+        if (segments_[i].sequence && segments_[i].bytes > sizeof(FlashLogSegmentHeader) &&
+            (newest < 0 || segments_[i].sequence > segments_[newest].sequence))
+            newest = i;
+    if (newest >= 0)
+        sample = segments_[newest].last_sample;
+    return newest >= 0;
+}
+
+void FlashLog::beginRead(uint32_t from, uint32_t to)
+{
+    read_from_ = from;
+    read_to_ = to;
+    read_sequence_ = 0;
+    read_segment_ = -1;
+    nextReadSegment();
+}
+
+// Moves to the oldest segment after read_sequence_ that overlaps the range
+bool FlashLog::nextReadSegment()
+{
+    int next = -1;
+    for (int i = 0; i < num_segments_; i++)
+    {
+        const Segment &segment = segments_[i];
+        if (!segment.sequence || segment.sequence <= read_sequence_ || segment.bytes <= sizeof(FlashLogSegmentHeader))
+            continue;
+        if (segment.first_sample > read_to_ || segment.last_sample < read_from_)
+            continue;
+        if (next < 0 || segment.sequence < segments_[next].sequence)
+            next = i;
+    }
+    read_segment_ = next;
+    if (next < 0)
+        return false;
+    read_sequence_ = segments_[next].sequence;
+    read_offset_ = sizeof(FlashLogSegmentHeader);
+    return true;
+}
+
+/**
+ * Copies the next frame in range into buffer and returns its length, or 0
+ * once the range is exhausted. Frames larger than capacity are skipped.
+ */
+size_t FlashLog::readNext(uint8_t *buffer, size_t capacity)
+{
+    while (read_segment_ >= 0)
+    {
+        const Segment &segment = segments_[read_segment_];
+        // The segment may have been recycled since beginRead()
+        if (segment.sequence != read_sequence_ || read_offset_ + sizeof(FrameHeader) > segment.bytes)
+        {
+            nextReadSegment();
+            continue;
+        }
+        size_t base = (size_t)read_segment_ * FLASHLOG_SEGMENT_SIZE + read_offset_;
+        FrameHeader header;
+        esp_partition_read(partition_, base, &header, sizeof(header));
+        header.flags &= ~FRAME_FLAG_PACKED; // scanSegment() stops at packed frames
+        size_t length = frameLength(&header);
+        read_offset_ += length;
+        uint32_t last = header.first_sample + header.samples - 1;
+        if (header.first_sample > read_to_ || last < read_from_ || length > capacity)
+            continue;
+        esp_partition_read(partition_, base, buffer, length);
+        return length;
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Append-only recording of stream frames to a raw flash partition
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The partition is split into FLASHLOG_SEGMENT_SIZE segments used round
+ * robin, so every sector is erased once per pass over the log. A segment
+ * starts with a header carrying a sequence number and is followed by whole
+ * frames exactly as streamed (see frameformat.h), never split across
+ * segments. The RAM index keeps the sample range of every segment and is
+ * rebuilt from the headers at boot.
+ *
+ * Flash erase and program hold interrupts off while they run, so appending
+ * frames only programs pages, and sectors are erased ahead of the write
+ * position from service() while the caller is not streaming. Recording
+ * stops taking frames once the erased space runs out.
+ */
+
+#ifndef FLASHLOG_H
+#define FLASHLOG_H
+
+#include "Arduino.h"
+#include "esp_partition.h"
+
+#define FLASHLOG_SEGMENT_SIZE 0x10000
+#define FLASHLOG_SECTOR_SIZE 0x1000
+#define FLASHLOG_MAX_SEGMENTS 64
+#define FLASHLOG_MAGIC 0x474F4C4FUL // "OLOG"
+#define FLASHLOG_PARTITION_LABEL "osemlog"
+
+struct __attribute__((packed)) FlashLogSegmentHeader
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint8_t reserved[24];
+};
+
+class FlashLog
+{
+public:
+    FlashLog();
+    bool begin();
+    bool available() const { return partition_ != NULL; }
+
+    // Arming recycles the log in ring order, oldest segment first
+    void start();
+    void stop();
+    bool recording() const { return recording_; }
+    bool append(const uint8_t *frame, size_t length);
+    // Erases one sector ahead of the write position if needed; true if it did
+    bool service();
+
+    // Frames overlapping [from, to] in recording order
+    void beginRead(uint32_t from, uint32_t to);
+    size_t readNext(uint8_t *buffer, size_t capacity);
+
+    uint32_t capacity() const { return num_segments_ * FLASHLOG_SEGMENT_SIZE; }
+    uint32_t erasedAhead() const { return (uint32_t)(erased_pos_ - write_pos_); }
+    uint32_t usedBytes() const;
+    int segments() const { return num_segments_; }
+    bool oldestSample(uint32_t &sample) const;
+    bool newestSample(uint32_t &sample) const;
+
+    uint32_t frames_written;
+    uint32_t frames_rejected; // no erased space left
+    uint32_t bytes_written;
+    uint32_t write_cycles;    // CPU cycles spent in append()
+
+private:
+    struct Segment
+    {
+        uint32_t sequence; // 0 when erased or unused
+        uint32_t first_sample;
+        uint32_t last_sample;
+        uint32_t bytes;
+    };
+
+    bool openNextSegment(size_t length);
+    void scanSegment(int index);
+    bool nextReadSegment();
+
+    const esp_partition_t *partition_;
+    Segment segments_[FLASHLOG_MAX_SEGMENTS];
+    int num_segments_;
+    int head_;
+    uint32_t sequence_;
+    bool recording_;
+    // Positions count bytes across passes; the physical offset is modulo capacity()
+    uint64_t write_pos_;
+    uint64_t erased_pos_;
+
+    uint32_t read_from_;
+    uint32_t read_to_;
+    uint32_t read_sequence_;
+    int read_segment_;
+    uint32_t read_offset_;
+};
+
+#endif // FLASHLOG_H
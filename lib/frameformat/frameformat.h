@@ -0,0 +1,183 @@
+/*
+ * Binary stream frame layout
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Every binary WebSocket message is one frame: a FrameHeader followed by
+ * `samples` blocks of FRAME_BLOCK_SIZE bytes, each holding the micros()
+ * timestamp, the sample number and the raw ADS129x channel data. All fields
+ * are little endian. The header is one block long so the ring can keep
+ * frames block aligned.
+ *
+ * Sample blocks are FRAME_BLOCK_SIZE for every chip, and a chip with fewer
+ * than eight channels leaves the remaining channel bytes zero. There is no
+ * block size field because a raw frame is never rewritten to a smaller
+ * stride. DRDY_ISR reads into the ring at fixed block offsets. The montage,
+ * the pipeline, quality, impedance and self-test then work on the slot in
+ * place at that stride, and the timestamp and sample number stay 4 byte
+ * aligned. Blocks of 14, 20 or 26 bytes would give each of them a runtime
+ * stride and leave those fields unaligned. Dropping the unused bytes is
+ * left to the packed format below: its format block carries channel_mask
+ * and record_bytes, and adaptive level 1 sends 3 bytes per active channel
+ * and nothing for the missing ones.
+ *
+ * With FRAME_FLAG_EVENTS set, one FrameEventBlock follows the samples. Its
+ * events are stamped with the first sample taken at or after the event,
+ * which may lie in an earlier frame, and the time since the sample before.
+ *
+ * With FRAME_FLAG_CLOCK_SYNCED set, a block timestamp ts maps to host time
+ *   host_us = ref_host_us + d + d * drift_ppb / 1e9,  d = (int32_t)(ts - ref_local_us)
+ *
+ * With FRAME_FLAG_PACKED set, the samples are records instead of blocks: a
+ * FrameFormatBlock follows the header, then payload_blocks blocks of
+ * records, the last one zero padded, then the event block if any. A record
+ * holds the channels in channel_mask, lowest first, each the mean of
+ * `decimation` conversions (fewer for the last record when conversions is
+ * not a multiple). samples counts records; record i starts at sample number
+ * first_sample + i * decimation. Conversion times follow by interpolating
+ * linearly between first_timestamp and last_timestamp.
+ *
+ * FRAME_ENCODING_BFP16 is block floating point: every channel keeps one
+ * shift for the frame, the smallest its largest record fits 16 bits with,
+ * and a record holds code >> shift rounded to nearest. The code is the
+ * mantissa times 2^shift, within 2^shift / 2 of the original.
+ *
+ * With FRAME_FLAG_DERIVED set, channel slot k holds output k of the montage
+ * the montage command set up instead of channel k + 1, in the same 24 bit
+ * code units.
+ *
+ * With FRAME_FLAG_FILTERED set, the samples went through the stages of the
+ * pipeline command. sample_rate is then the rate after decimation and
+ * sample numbers count output samples: output n stands for input samples
+ * n * N .. n * N + N - 1, N being the product of the decimation factors.
+ * Event sample numbers are divided by N the same way. Onset and offset
+ * events of the emg command are found on those outputs and carry their
+ * numbers as they are.
+ *
+ * With FRAME_FLAG_BURST set, the frame is part of a window the burst
+ * command captured at sample_rate and sent after the trigger. Sample
+ * numbers count conversions since the capture started, and the window
+ * carries its trigger as a FRAME_EVENT_TRIGGER event. Block timestamps
+ * follow from the trigger sample and the rate rather than from the clock.
+ */
+
+#ifndef FRAMEFORMAT_H
+#define FRAMEFORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_MAGIC 0x4D45534FUL // "OSEM"
+#define FRAME_VERSION 1
+#define FRAME_BLOCK_SIZE 32
+
+#define FRAME_FLAG_CLOCK_SYNCED 0x01
+#define FRAME_FLAG_RECORDED 0x02 // replayed from the flash log
+#define FRAME_FLAG_RESENT 0x04   // replayed from the retention window
+#define FRAME_FLAG_EVENTS 0x08   // a FrameEventBlock follows the samples
+#define FRAME_FLAG_PACKED 0x10   // a FrameFormatBlock follows the header
+#define FRAME_FLAG_DERIVED 0x20  // channel slots hold montage outputs
+#define FRAME_FLAG_FILTERED 0x40 // samples went through the pipeline stages
+#define FRAME_FLAG_BURST 0x80    // drained from a burst capture
+
+#define FRAME_EVENTS_PER_BLOCK 3
+#define FRAME_EVENT_TRIGGER 1 // edge on the trigger input
+#define FRAME_EVENT_MARK 2    // mark command
+#define FRAME_EVENT_ONSET 3   // muscle activation began, code: channel slot
+#define FRAME_EVENT_OFFSET 4  // and ended
+
+#define FRAME_SAMPLE_DATA_OFFSET 8 // channel data in a sample block, after timestamp and sample number
+#define FRAME_ENCODING_INT24 1     // 24 bit big endian codes as the chip sends them
+#define FRAME_ENCODING_INT16 2     // the upper 16 bits of each code, big endian
+#define FRAME_ENCODING_BFP16 3     // 16 bit big endian mantissas, a shift per channel in the format block
+
+struct __attribute__((packed)) FrameHeader
+{
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t samples;
+    uint32_t first_sample;
+    uint32_t sample_rate;
+    uint32_t ref_local_us; // device micros() at ref_host_us
+    int32_t drift_ppb;     // device clock rate error against the host
+    int64_t ref_host_us;
+};
+
+static_assert(sizeof(FrameHeader) == FRAME_BLOCK_SIZE, "frame header must be one block");
+
+struct __attribute__((packed)) FrameEvent
+{
+    uint32_t sample_number;
+    uint8_t source;     // FRAME_EVENT_*
+    uint8_t code;       // mark command argument, channel slot of an onset or offset
+    uint16_t offset_us; // after the timestamp of sample_number - 1, saturated
+};
+
+struct __attribute__((packed)) FrameEventBlock
+{
+    uint8_t count;
+    uint8_t reserved[7];
+    FrameEvent events[FRAME_EVENTS_PER_BLOCK];
+};
+
+static_assert(sizeof(FrameEventBlock) == FRAME_BLOCK_SIZE, "event block must be one block");
+
+struct __attribute__((packed)) FrameFormatBlock
+{
+    uint8_t encoding;     // FRAME_ENCODING_*
+    uint8_t channel_mask; // channel 1 is bit 0
+    uint8_t decimation;   // conversions averaged into one record
+    uint8_t record_bytes;
+    uint16_t conversions; // taken for this frame, samples holds the records
+    uint16_t payload_blocks;
+    uint32_t first_timestamp; // micros() of the first and the last conversion
+    uint32_t last_timestamp;
+    uint8_t level; // adaptive stream level that chose this format
+    uint8_t shifts[4]; // FRAME_ENCODING_BFP16: shift of channel slot k in byte k / 2, low nibble first
+    uint8_t reserved[11];
+};
+
+static_assert(sizeof(FrameFormatBlock) == FRAME_BLOCK_SIZE, "format block must be one block");
+
+// Bytes in the frame starting with header; a packed frame's format block must follow it
+static inline size_t frameLength(const FrameHeader *header)
+{
+    size_t blocks = 1 + header->samples;
+    if (header->flags & FRAME_FLAG_PACKED)
+        blocks = 2 + ((const FrameFormatBlock *)(header + 1))->payload_blocks;
+    if (header->flags & FRAME_FLAG_EVENTS)
+        blocks++;
+    return blocks * FRAME_BLOCK_SIZE;
+}
+
+static inline uint8_t frameChannelShift(const FrameFormatBlock *format, int channel)
+{
+    return (format->shifts[channel / 2] >> (4 * (channel % 2))) & 0x0F;
+}
+
+// Sample number of the last conversion in the frame, same condition
+static inline uint32_t frameLastSample(const FrameHeader *header)
+{
+    if (header->flags & FRAME_FLAG_PACKED)
+        return header->first_sample + ((const FrameFormatBlock *)(header + 1))->conversions - 1;
+    return header->first_sample + header->samples - 1;
+}
+
+#endif // FRAMEFORMAT_H
@@ -0,0 +1,143 @@
+/*
+ * Arduino-ESP32 core subset for host builds
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Only what the firmware uses is declared here. Time is virtual: every call
+ * that waits or talks to hardware advances the simulated clock, and DRDY
+ * interrupts are dispatched from inside those calls.
+ */
+
+#ifndef HOSTSIM_ARDUINO_H
+#define HOSTSIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "binary.h"
+#include "WString.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define LOW 0x0
+#define HIGH 0x1
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define PULLUP 0x04
+#define INPUT_PULLUP 0x05
+
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define SPI_MODE0 0
+#define SPI_MODE1 1
+#define SPI_MODE2 2
+#define SPI_MODE3 3
+
+#define IRAM_ATTR
+#define digitalPinToInterrupt(p) (p)
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode);
+void detachInterrupt(uint8_t pin);
+
+unsigned long micros();
+unsigned long millis();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+// FreeRTOS
+typedef uint32_t TickType_t;
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY 0xFFFFFFFF
+void vTaskDelay(TickType_t ticks);
+// Interrupts are held off inside; there is one core, so the lock itself is only a token
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+void portENTER_CRITICAL(portMUX_TYPE *mux);
+void portEXIT_CRITICAL(portMUX_TYPE *mux);
+#define portENTER_CRITICAL_ISR(mux) ((void)(mux))
+#define portEXIT_CRITICAL_ISR(mux) ((void)(mux))
+
+// Logging, gated by CORE_DEBUG_LEVEL like the Arduino-ESP32 core
+#ifndef CORE_DEBUG_LEVEL
+#define CORE_DEBUG_LEVEL 2
+#endif
+void hostsimLog(char level, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+#define HOSTSIM_LOG_DISCARD(...) \
+    do                           \
+    {                            \
+    } while (0)
+#if CORE_DEBUG_LEVEL >= 1
+#define ESP_LOGE(tag, format, ...) hostsimLog('E', tag, format, ##__VA_ARGS__)
+#else
+#define ESP_LOGE HOSTSIM_LOG_DISCARD
+#endif
+#if CORE_DEBUG_LEVEL >= 2
+#define ESP_LOGW(tag, format, ...) hostsimLog('W', tag, format, ##__VA_ARGS__)
+#else
+#define ESP_LOGW HOSTSIM_LOG_DISCARD
+#endif
+#if CORE_DEBUG_LEVEL >= 3
+#define ESP_LOGI(tag, format, ...) hostsimLog('I', tag, format, ##__VA_ARGS__)
+#else
+#define ESP_LOGI HOSTSIM_LOG_DISCARD
+#endif
+#if CORE_DEBUG_LEVEL >= 4
+#define ESP_LOGD(tag, format, ...) hostsimLog('D', tag, format, ##__VA_ARGS__)
+#else
+#define ESP_LOGD HOSTSIM_LOG_DISCARD
+#endif
+#define ESP_LOGV HOSTSIM_LOG_DISCARD
+
+class HardwareSerial
+{
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    operator bool() const { return true; }
+    size_t print(const char *s);
+    size_t println(const char *s = "");
+};
+extern HardwareSerial Serial;
+
+class EspClass
+{
+public:
+    void restart();
+    uint32_t getCycleCount();
+    uint32_t getCpuFreqMHz() { return 160; }
+    uint32_t getHeapSize() { return 327680; }
+    uint32_t getFreeHeap() { return 214016; }
+    uint32_t getMinFreeHeap() { return 196608; }
+};
+extern EspClass ESP;
+
+#endif // HOSTSIM_ARDUINO_H
@@ -0,0 +1,44 @@
+/*
+ * mDNS responder shim for host builds
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef HOSTSIM_ESPMDNS_H
+#define HOSTSIM_ESPMDNS_H
+
+#include "Arduino.h"
+
+class MDNSResponder
+{
+public:
+    bool begin(const char *hostName)
+    {
+        (void)hostName;
+        return true;
+    }
+    void addService(const char *service, const char *proto, uint16_t port)
+    {
+        (void)service;
+        (void)proto;
+        (void)port;
+    }
+};
+extern MDNSResponder MDNS;
+
+#endif // HOSTSIM_ESPMDNS_H
@@ -0,0 +1,53 @@
+/*
+ * SPI library shim routed to the ADS129x simulator
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef HOSTSIM_SPI_H
+#define HOSTSIM_SPI_H
+
+#include "Arduino.h"
+
+// The bus handle of the HAL, which the simulator has only one of
+typedef struct spi_struct_t spi_t;
+
+class SPIClass
+{
+public:
+    void begin() {}
+    spi_t *bus() { return (spi_t *)this; }
+    void end() {}
+    void setBitOrder(uint8_t bitOrder) { (void)bitOrder; }
+    void setDataMode(uint8_t dataMode) { (void)dataMode; }
+    void setFrequency(uint32_t freq);
+    uint32_t frequency() const { return frequency_; }
+    uint8_t transfer(uint8_t data);
+    void transfer(void *data, uint32_t size);
+    void transferBytes(const uint8_t *data, uint8_t *out, uint32_t size);
+    void writeBytes(const uint8_t *data, uint32_t size);
+
+private:
+    uint32_t frequency_ = 1000000;
+};
+extern SPIClass SPI;
+
+// The HAL transfer without the bus mutex, for interrupt handlers
+void spiTransferBytesNL(spi_t *spi, const void *data_in, uint8_t *data_out, uint32_t len);
+
+#endif // HOSTSIM_SPI_H
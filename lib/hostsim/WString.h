@@ -0,0 +1,122 @@
+/*
+ * Minimal Arduino String for host builds
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HOSTSIM_WSTRING_H
+#define HOSTSIM_WSTRING_H
+
+#include <stdio.h>
+#include <string>
+
+// Covers what the firmware and ArduinoJson's String adapter use
+class String
+{
+public:
+    String(const char *cstr = "") : s_(cstr ? cstr : "") {}
+    String(const String &other) = default;
+    explicit String(char c) : s_(1, c) {}
+    explicit String(unsigned char value, unsigned char base = 10) : s_(format(value, base)) {}
+    explicit String(int value, unsigned char base = 10) : s_(format(value, base)) {}
+    explicit String(unsigned int value, unsigned char base = 10) : s_(format(value, base)) {}
+    explicit String(long value, unsigned char base = 10) : s_(format(value, base)) {}
+    explicit String(unsigned long value, unsigned char base = 10) : s_(format(value, base)) {}
+
+    String &operator=(const String &other) = default;
+    String &operator=(const char *cstr)
+    {
+        s_ = cstr ? cstr : "";
+        return *this;
+    }
+
+    unsigned char concat(const char *cstr)
+    {
+        if (cstr)
+            s_ += cstr;
+        return 1;
+    }
+    unsigned char concat(const char *cstr, unsigned int length)
+    {
+        if (cstr)
+            s_.append(cstr, length);
+        return 1;
+    }
+    unsigned char concat(const String &other)
+    {
+        s_ += other.s_;
+        return 1;
+    }
+    unsigned char concat(char c)
+    {
+        s_ += c;
+        return 1;
+    }
+    String &operator+=(const char *cstr)
+    {
+        concat(cstr);
+        return *this;
+    }
+    String &operator+=(const String &other)
+    {
+        concat(other);
+        return *this;
+    }
+    String &operator+=(char c)
+    {
+        concat(c);
+        return *this;
+    }
+
+    bool operator==(const char *cstr) const { return s_ == (cstr ? cstr : ""); }
+    bool operator==(const String &other) const { return s_ == other.s_; }
+    bool operator!=(const char *cstr) const { return !(*this == cstr); }
+    char operator[](unsigned int index) const { return index < s_.size() ? s_[index] : 0; }
+
+    const char *c_str() const { return s_.c_str(); }
+    unsigned int length() const { return s_.size(); }
+    bool reserve(unsigned int size)
+    {
+        s_.reserve(size);
+        return true;
+    }
+
+private:
+    template <typename T>
+    static std::string format(T value, unsigned char base)
+    {
+        char buffer[72];
+        if (base == 16)
+            snprintf(buffer, sizeof(buffer), "%llx", (unsigned long long)value);
+        else if (value < 0)
+            snprintf(buffer, sizeof(buffer), "%lld", (long long)value);
+        else
+            snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)value);
+        return buffer;
+    }
+
+    std::string s_;
+};
+
+class StringSumHelper : public String
+{
+public:
+    StringSumHelper(const String &s) : String(s) {}
+    StringSumHelper(const char *p) : String(p) {}
+};
+
+#endif // HOSTSIM_WSTRING_H
@@ -0,0 +1,75 @@
+/*
+ * WebSockets server shim connected to the host loopback client
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HOSTSIM_WEBSOCKETSSERVER_H
+#define HOSTSIM_WEBSOCKETSSERVER_H
+
+#include <functional>
+#include "Arduino.h"
+
+// Bytes reserved ahead of the payload when headerToPayload is used
+#define WEBSOCKETS_MAX_HEADER_SIZE (14)
+
+typedef enum
+{
+    WStype_ERROR,
+    WStype_DISCONNECTED,
+    WStype_CONNECTED,
+    WStype_TEXT,
+    WStype_BIN,
+    WStype_FRAGMENT_TEXT_START,
+    WStype_FRAGMENT_BIN_START,
+    WStype_FRAGMENT,
+    WStype_FRAGMENT_FIN,
+    WStype_PING,
+    WStype_PONG,
+} WStype_t;
+
+class WebSocketsServer
+{
+public:
+    typedef std::function<void(uint8_t num, WStype_t type, uint8_t *payload, size_t length)> WebSocketServerEvent;
+
+    WebSocketsServer(uint16_t port, const String &origin = "", const String &protocol = "arduino");
+
+    void begin();
+    void close();
+    void loop();
+    void onEvent(WebSocketServerEvent cbEvent);
+
+    bool sendTXT(uint8_t num, uint8_t *payload, size_t length = 0, bool headerToPayload = false);
+    bool sendTXT(uint8_t num, const uint8_t *payload, size_t length = 0);
+    bool sendTXT(uint8_t num, char *payload, size_t length = 0, bool headerToPayload = false);
+    bool sendTXT(uint8_t num, const char *payload, size_t length = 0);
+    bool sendTXT(uint8_t num, String &payload);
+
+    bool sendBIN(uint8_t num, uint8_t *payload, size_t length, bool headerToPayload = false);
+    bool sendBIN(uint8_t num, const uint8_t *payload, size_t length);
+
+    void disconnect(uint8_t num);
+    uint8_t connectedClients(bool ping = false);
+    bool clientIsConnected(uint8_t num);
+
+private:
+    WebSocketServerEvent cbEvent_;
+    bool running_ = false;
+};
+
+#endif // HOSTSIM_WEBSOCKETSSERVER_H
@@ -0,0 +1,39 @@
+/*
+ * WiFiManager shim for host builds
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef HOSTSIM_WIFIMANAGER_H
+#define HOSTSIM_WIFIMANAGER_H
+
+#include "WiFi.h"
+
+class WiFiManager
+{
+public:
+    void resetSettings() {}
+    bool autoConnect(const char *apName, const char *apPassword = NULL)
+    {
+        (void)apName;
+        (void)apPassword;
+        return true;
+    }
+};
+
+#endif // HOSTSIM_WIFIMANAGER_H
@@ -0,0 +1,1115 @@
+/*
+ * Streaming throughput and latency benchmark on the simulated device
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Each configuration power cycles the simulated chip, brings the firmware up
+ * through its own command set (reset, wreg, rdatac) and streams for a fixed
+ * virtual duration while rreg/wreg round trips are timed. Results are
+ * printed as one JSON object per line so runs of different firmware builds
+ * can be diffed or loaded straight into a notebook. Whether a feature works
+ * is for the unit tests under test/; the benches here only measure.
+ */
+
+#include <algorithm>
+#include <math.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "bdfwriter.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+#include "montage.h"
+#include "osemboard.h"
+#include "pipeline.h"
+#include "quality.h"
+#include "streamformat.h"
+#include "tasklayer.h"
+#include "tracejson.h"
+
+namespace hostsim
+{
+    struct BenchConfig
+    {
+        std::vector<ADSSimChip> chips;
+        std::vector<uint32_t> rates;
+        double seconds = 10;
+        uint32_t command_interval_ms = 500;
+    };
+
+    static void benchStream(BenchClient &bench, const std::string &firmware, ADSSimChip chip, uint32_t rate, const BenchConfig &settings)
+    {
+        using namespace ADS129x;
+        char json[96];
+        uint8_t config1 = 0;
+        if (!config1ForRate(chip, rate, config1))
+            return;
+
+        // Quiesce the previous run and let in-flight frames drain
+        bench.command("{\"command\":\"sdatac\"}");
+        bench.runFor(500000000ULL);
+
+        ads().setChip(chip);
+        bench.command("{\"command\":\"reset\"}");
+        bench.command("{\"command\":\"sdatac\"}");
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CONFIG1, config1);
+        bench.command(json);
+        uint8_t first_chset = chip == ADSSIM_ADS1292R ? 0x04 : CH1SET;
+        for (int ch = 0; ch < ads().channels(); ch++)
+        {
+            snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", first_chset + ch, 0x60);
+            bench.command(json);
+        }
+
+        // Firmware side counters, if the firmware has them
+        bench.command("{\"command\":\"stats\",\"parameters\":[1]}");
+        bench.clear();
+        bench.command("{\"command\":\"rdatac\"}");
+        std::string rdatac_reply = replyField(bench.reply);
+        // Frames are retained for resend while the pool has room behind the ring
+        bench.command("{\"command\":\"resend\"}");
+        bool retaining = bench.reply.find("\"window_ms\":0,") == std::string::npos &&
+                         bench.reply.find("\"window_ms\":0}") == std::string::npos;
+        uint64_t conversions_start = ads().conversions();
+        uint64_t missed_start = ads().conversionsMissed();
+        uint64_t start_ns = nowNs();
+        bench.start_us = start_ns / 1000;
+        uint64_t isr_lost_start = stats().isr_lost;
+        uint64_t copied_start = stats().bytes_copied;
+        uint64_t writes_start = stats().tcp_writes;
+        uint64_t messages_start = stats().ws_messages_sent;
+        uint64_t isr_calls_start = stats().isr_calls;
+        uint64_t isr_ns_start = stats().isr_ns;
+        uint64_t spi_calls_start = stats().spi_calls;
+        uint64_t gpio_writes_start = stats().gpio_writes;
+
+        std::vector<uint32_t> rreg_rtt;
+        std::vector<uint32_t> wreg_rtt;
+        uint64_t end_ns = start_ns + (uint64_t)(settings.seconds * 1e9);
+        // retainFrame() copies every live frame behind the ring with a plain
+        // memcpy the simulator does not see, so it is charged from here
+        uint64_t retained = 0;
+        if (retaining)
+            bench.on_frame = [&](const Message &message) {
+                bool live = message.data.size() > 5 && !(message.data[5] & (FRAME_FLAG_RESENT | FRAME_FLAG_RECORDED | FRAME_FLAG_BURST));
+                if (live && message.sent_ns >= start_ns && message.sent_ns < end_ns)
+                {
+                    chargeCopy(message.data.size());
+                    retained += message.data.size();
+                }
+            };
+        bool read = true;
+        while (nowNs() < end_ns)
+        {
+            uint64_t next = nowNs() + (uint64_t)settings.command_interval_ms * 1000000;
+            bench.runFor(std::min(next, end_ns) - nowNs());
+            if (nowNs() >= end_ns)
+                break;
+            if (read)
+            {
+                snprintf(json, sizeof(json), "{\"command\":\"rreg\",\"parameters\":[%d]}", ID);
+                uint32_t rtt = bench.command(json);
+                if (rtt)
+                    rreg_rtt.push_back(rtt);
+            }
+            else
+            {
+                snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", GPIO, 0);
+                uint32_t rtt = bench.command(json);
+                if (rtt)
+                    wreg_rtt.push_back(rtt);
+            }
+            read = !read;
+        }
+
+        // Samples converted after this point are not counted
+        uint64_t generated = ads().conversions() - conversions_start;
+        uint64_t not_read = ads().conversionsMissed() - missed_start;
+        uint64_t isr_lost = stats().isr_lost - isr_lost_start;
+        bench.on_frame = nullptr;
+        // Frames and command replies alike, and the retention copy
+        uint64_t copied = stats().bytes_copied - copied_start;
+        uint64_t messages = stats().ws_messages_sent - messages_start;
+        double writes_per_message = messages ? (double)(stats().tcp_writes - writes_start) / messages : 0;
+        // DRDY_ISR at 160 MHz; SPI and GPIO calls include the few commands in between
+        uint64_t isr_calls = stats().isr_calls - isr_calls_start;
+        double isr_cycles = isr_calls ? (double)(stats().isr_ns - isr_ns_start) * 4 / 25 / isr_calls : 0;
+        double spi_per_sample = generated ? (double)(stats().spi_calls - spi_calls_start) / generated : 0;
+        double gpio_per_sample = generated ? (double)(stats().gpio_writes - gpio_writes_start) / generated : 0;
+        double elapsed = (nowNs() - start_ns) / 1e9;
+        // Keep streaming until a sample taken after the window arrives, so the
+        // frame that was open at the end of the window is delivered too
+        bench.stop_us = nowNs() / 1000;
+        uint64_t drain_end = nowNs() + 5000000000ULL;
+        while (!bench.past_stop && nowNs() < drain_end)
+            bench.step();
+        bench.command("{\"command\":\"stats\"}");
+        std::string firmware_stats = bench.reply.compare(0, 2, "{\"") == 0 && bench.reply.find("\"response\"") == std::string::npos ? bench.reply : "null";
+        bench.command("{\"command\":\"sdatac\"}");
+
+        double drop_rate = generated > bench.samples ? 1.0 - (double)bench.samples / generated : 0;
+        printf("{\"bench\":\"stream\",\"firmware\":\"%s\",\"chip\":\"%s\",\"channels\":%d,\"rate\":%u,"
+               "\"samples_per_frame\":%u,\"seconds\":%.3f,\"link_kbps\":%u,\"rdatac\":\"%s\","
+               "\"generated\":%llu,\"delivered\":%llu,\"frames\":%llu,\"drop_rate\":%.6f,"
+               "\"samples_per_s\":%.1f,\"not_read\":%llu,\"isr_lost\":%llu,\"sample_gaps\":%llu,"
+               "\"bytes_copied_per_sample\":%.1f,\"bytes_retained_per_sample\":%.1f,\"tcp_writes_per_message\":%.2f,\"isr_cycles_per_sample\":%.0f,"
+               "\"spi_calls_per_sample\":%.2f,\"gpio_writes_per_sample\":%.2f,",
+               firmware.c_str(), ads().chipName(), ads().channels(), rate, bench.samples_per_frame, elapsed,
+               config().link_kbps, rdatac_reply.c_str(), (unsigned long long)generated,
+               (unsigned long long)bench.samples, (unsigned long long)bench.frames, drop_rate,
+               bench.samples / elapsed, (unsigned long long)not_read, (unsigned long long)isr_lost,
+               (unsigned long long)bench.sample_gaps, generated ? (double)copied / generated : 0,
+               generated ? (double)retained / generated : 0, writes_per_message,
+               isr_cycles, spi_per_sample, gpio_per_sample);
+        printPercentiles("latency_us", bench.latency_us);
+        printf(",");
+        printPercentiles("rreg_rtt_us", rreg_rtt);
+        printf(",");
+        printPercentiles("wreg_rtt_us", wreg_rtt);
+        printf(",\"firmware_stats\":%s}\n", firmware_stats.c_str());
+        fflush(stdout);
+    }
+
+    int runBench(const std::vector<ADSSimChip> &chips, const std::vector<uint32_t> &rates, double seconds)
+    {
+        BenchConfig settings;
+        settings.chips = chips;
+        settings.rates = rates;
+        settings.seconds = seconds;
+        if (settings.chips.empty())
+            settings.chips = {ADSSIM_ADS1299_4, ADSSIM_ADS1299_6, ADSSIM_ADS1299};
+        if (settings.rates.empty())
+            settings.rates = {250, 500, 1000, 2000, 4000, 8000, 16000};
+
+        BenchClient bench;
+        client().connect();
+        while (!client().connected())
+            bench.step();
+        bench.command("{\"command\":\"version\"}");
+        std::string firmware = replyField(bench.reply);
+
+        for (size_t c = 0; c < settings.chips.size(); c++)
+            for (size_t r = 0; r < settings.rates.size(); r++)
+                benchStream(bench, firmware, settings.chips[c], settings.rates[r], settings);
+        return 0;
+    }
+
+    // Stand-ins for the firmware's two steps, for runTaskBench()
+    namespace taskbench
+    {
+        const int SLOTS = 16;
+        const int SAMPLES = 40;
+        const int CHANNELS = 8;
+        const size_t FRAME_BYTES = FRAME_BLOCK_SIZE * (SAMPLES + 1);
+
+        uint8_t slots[SLOTS][FRAME_BYTES];
+        uint8_t socket_buffer[FRAME_BYTES];
+        volatile bool framed[SLOTS];
+        volatile bool sent[SLOTS];
+        uint64_t framed_ns[SLOTS];
+        int to_frame, to_send;
+        uint32_t sample_number, prng, checksum;
+        float state[CHANNELS][2];
+        std::vector<uint32_t> handoff_us;
+        uint64_t frames;
+
+        uint64_t wallNs()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+
+        void reset()
+        {
+            to_frame = to_send = 0;
+            sample_number = 0;
+            prng = 0x2545F491;
+            checksum = 0;
+            frames = 0;
+            memset(state, 0, sizeof(state));
+            handoff_us.clear();
+            for (int i = 0; i < SLOTS; i++)
+            {
+                framed[i] = false;
+                sent[i] = true;
+            }
+        }
+
+        // Conversions, header and a biquad per channel, as DRDY_ISR and framing would
+        bool acquisitionStep()
+        {
+            if (!taskAcquire(sent[to_frame]))
+                return false;
+            uint8_t *frame = slots[to_frame];
+            FrameHeader *header = (FrameHeader *)frame;
+            memset(header, 0, sizeof(*header));
+            header->magic = FRAME_MAGIC;
+            header->samples = SAMPLES;
+            header->first_sample = sample_number;
+            for (int n = 0; n < SAMPLES; n++)
+            {
+                uint8_t *block = frame + FRAME_BLOCK_SIZE * (n + 1);
+                memcpy(block + 4, &sample_number, 4);
+                sample_number++;
+                for (int ch = 0; ch < CHANNELS; ch++)
+                {
+                    prng = prng * 1664525 + 1013904223;
+                    float x = (int32_t)(prng >> 8) - 8388608;
+                    float y = 0.2066f * x + state[ch][0];
+                    state[ch][0] = 0.4131f * x + 0.3695f * y + state[ch][1];
+                    state[ch][1] = 0.2066f * x - 0.1958f * y;
+                    int32_t value = (int32_t)y;
+                    block[8 + ch * 3] = value >> 16;
+                    block[9 + ch * 3] = value >> 8;
+                    block[10 + ch * 3] = value;
+                }
+            }
+            sent[to_frame] = false;
+            framed_ns[to_frame] = wallNs();
+            taskRelease(framed[to_frame], true);
+            to_frame = (to_frame + 1) % SLOTS;
+            return true;
+        }
+
+        // The copy into the socket and a CRC over it, as sendBIN would
+        bool networkStep()
+        {
+            if (!taskAcquire(framed[to_send]))
+                return false;
+            handoff_us.push_back((uint32_t)((wallNs() - framed_ns[to_send]) / 1000));
+            memcpy(socket_buffer, slots[to_send], FRAME_BYTES);
+            uint32_t crc = 0xFFFFFFFF;
+            for (size_t i = 0; i < FRAME_BYTES; i++)
+            {
+                crc ^= socket_buffer[i];
+                for (int bit = 0; bit < 8; bit++)
+                    crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+            }
+            checksum ^= crc;
+            framed[to_send] = false;
+            taskRelease(sent[to_send], true);
+            to_send = (to_send + 1) % SLOTS;
+            frames++;
+            return true;
+        }
+    }
+
+    /*
+     * Runs stand-ins for acquisitionStep() and networkStep() through the
+     * task layer's POSIX backend on real threads and the wall clock, first
+     * taking turns on one core as on the ESP32-C3, then pinned to two CPUs
+     * as on the ESP32-S3, and reports frames per second and how long a
+     * framed buffer waits for the network side. The speedup needs a machine
+     * with at least two CPUs.
+     */
+    int runTaskBench(double seconds)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        double rates[2] = {0, 0};
+        for (int cores = 1; cores <= 2; cores++)
+        {
+            taskbench::reset();
+            TaskLayer layer;
+            layer.add("acquisition", taskbench::acquisitionStep, ACQUISITION_CORE, 2, 0);
+            layer.add("network", taskbench::networkStep, NETWORK_CORE, 1, 0);
+            uint64_t start = taskbench::wallNs();
+            uint64_t end = start + (uint64_t)(seconds * 1e9);
+            if (!layer.begin(cores))
+            {
+                printf("{\"bench\":\"tasks\",\"cores\":%d,\"error\":\"begin failed\"}\n", cores);
+                return 1;
+            }
+            if (cores == 1)
+            {
+                while (taskbench::wallNs() < end)
+                    layer.run();
+            }
+            else
+            {
+                while (taskbench::wallNs() < end)
+                    usleep(10000);
+            }
+            double elapsed = (taskbench::wallNs() - start) / 1e9;
+            // Counters before end(), which drops back to one core
+            int used_cores = layer.cores();
+            double idle[2];
+            for (int t = 0; t < 2; t++)
+                idle[t] = layer.steps(t) ? (double)layer.idleSteps(t) / layer.steps(t) : 0;
+            layer.end();
+            rates[cores - 1] = taskbench::frames / elapsed;
+            printf("{\"bench\":\"tasks\",\"cores\":%d,\"cpus\":%ld,\"seconds\":%.2f,\"frames\":%llu,\"frames_per_s\":%.0f,"
+                   "\"samples_per_s\":%.0f,\"idle_steps\":{\"acquisition\":%.3f,\"network\":%.3f},",
+                   used_cores, cpus, elapsed, (unsigned long long)taskbench::frames, rates[cores - 1],
+                   rates[cores - 1] * taskbench::SAMPLES, idle[0], idle[1]);
+            printPercentiles("handoff_us", taskbench::handoff_us);
+            printf(",\"checksum\":\"%08x\"}\n", taskbench::checksum);
+            fflush(stdout);
+        }
+        printf("{\"bench\":\"tasks_summary\",\"cpus\":%ld,\"speedup\":%.2f}\n", cpus, rates[0] > 0 ? rates[1] / rates[0] : 0);
+        fflush(stdout);
+        return 0;
+    }
+
+    /*
+     * Streams for a while undisturbed, then for as long again while the
+     * client fires bursts of commands with request IDs, as fast as it can
+     * write them, reset among them. A frame meets its deadline when it
+     * arrives no later after its last sample than the slowest frame of the
+     * quiet run plus STORM_SLACK_US, room for a command's wait for the SPI
+     * bus but not for the 100 ms reset waits for the chip. Every command
+     * has to be answered, with its result, Busy or a refusal, and no
+     * conversion may be lost or read out of step.
+     */
+    int runCommandBench(const std::vector<uint32_t> &rates, double seconds)
+    {
+        static const char *storm[] = {
+            "{\"command\":\"rreg\",\"parameters\":[0],\"id\":%u}",
+            "{\"command\":\"wreg\",\"parameters\":[20,0],\"id\":%u}",
+            "{\"command\":\"status\",\"id\":%u}",
+            "{\"command\":\"stats\",\"id\":%u}",
+            "{\"command\":\"micros\",\"id\":%u}",
+            "{\"command\":\"version\",\"id\":%u}",
+            "{\"command\":\"boardledon\",\"id\":%u}",
+            "{\"command\":\"nop\",\"id\":%u}",
+            "{\"command\":\"reset\",\"id\":%u}",
+        };
+        const size_t storm_commands = sizeof(storm) / sizeof(storm[0]);
+        const int burst = 24;
+        const uint64_t burst_interval_ns = 100000000ULL;
+        const uint32_t STORM_SLACK_US = 10000; // two sample periods at 250 SPS
+
+        using namespace ADS129x;
+        std::vector<uint32_t> bench_rates = rates;
+        if (bench_rates.empty())
+            bench_rates = {250, 1000, 4000, 16000};
+
+        BenchClient bench;
+        client().connect();
+        while (!client().connected())
+            bench.step();
+        bench.command("{\"command\":\"version\"}");
+        std::string firmware = replyField(bench.reply);
+
+        char json[96];
+        int failures = 0;
+        for (size_t r = 0; r < bench_rates.size(); r++)
+        {
+            uint32_t rate = bench_rates[r];
+            bench.command("{\"command\":\"sdatac\"}");
+            bench.runFor(500000000ULL);
+            ads().setChip(ADSSIM_ADS1299);
+            bench.command("{\"command\":\"reset\"}");
+            bench.command("{\"command\":\"sdatac\"}");
+            snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+            bench.command(json);
+            for (int ch = 0; ch < ads().channels(); ch++)
+            {
+                snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+                bench.command(json);
+            }
+            bench.command("{\"command\":\"stats\",\"parameters\":[1]}");
+
+            bool storming = false;
+            std::vector<uint32_t> frame_quiet_us, frame_storm_us;
+            bench.on_frame = [&](const Message &message) {
+                FrameHeader header;
+                if (message.data.size() < sizeof(header))
+                    return;
+                memcpy(&header, message.data.data(), sizeof(header));
+                if (header.magic != FRAME_MAGIC || header.samples == 0 ||
+                    message.data.size() < frameLength((const FrameHeader *)message.data.data()))
+                    return;
+                uint32_t last = readLE32(&message.data[FRAME_BLOCK_SIZE * header.samples]);
+                (storming ? frame_storm_us : frame_quiet_us).push_back((uint32_t)(message.delivered_ns / 1000) - last);
+            };
+            std::vector<uint64_t> sent_ns;
+            std::vector<bool> answered;
+            std::vector<uint32_t> reply_us;
+            uint64_t busy = 0, unexpected = 0;
+            bench.on_text = [&](const Message &message) {
+                std::string text(message.data.begin(), message.data.end());
+                if (text.find("\"id\":") == std::string::npos)
+                    return;
+                uint32_t id = (uint32_t)replyNumber(text, "id");
+                if (id >= sent_ns.size() || answered[id])
+                {
+                    unexpected++;
+                    return;
+                }
+                answered[id] = true;
+                if (text.find("\"Busy\"") != std::string::npos)
+                    busy++;
+                else
+                    reply_us.push_back((uint32_t)((message.delivered_ns - sent_ns[id]) / 1000));
+            };
+
+            bench.clear();
+            bench.command("{\"command\":\"rdatac\"}");
+            uint64_t isr_lost_start = stats().isr_lost;
+            bench.runFor((uint64_t)(seconds * 1e9));
+
+            storming = true;
+            uint64_t end_ns = nowNs() + (uint64_t)(seconds * 1e9);
+            size_t next_command = 0;
+            while (nowNs() < end_ns)
+            {
+                for (int i = 0; i < burst; i++)
+                {
+                    uint32_t id = (uint32_t)sent_ns.size();
+                    snprintf(json, sizeof(json), storm[next_command++ % storm_commands], id);
+                    sent_ns.push_back(nowNs());
+                    answered.push_back(false);
+                    client().sendText(json);
+                }
+                bench.runFor(burst_interval_ns);
+            }
+            // Replies still on their way
+            bench.runFor(1000000000ULL);
+            storming = false;
+            uint64_t isr_lost = stats().isr_lost - isr_lost_start;
+
+            bench.on_text = nullptr;
+            bench.command("{\"command\":\"stats\"}");
+            int64_t read_errors = replyNumber(bench.reply, "read_errors");
+            int64_t firmware_busy = replyNumber(bench.reply, "commands_busy");
+            bench.command("{\"command\":\"sdatac\"}");
+            bench.on_frame = nullptr;
+
+            uint64_t unanswered = 0;
+            for (size_t i = 0; i < answered.size(); i++)
+                if (!answered[i])
+                    unanswered++;
+            std::vector<uint32_t> quiet = frame_quiet_us;
+            Percentiles quiet_p = percentiles(quiet);
+            uint32_t deadline_us = (uint32_t)quiet_p.max + STORM_SLACK_US;
+            uint64_t late = 0;
+            for (size_t i = 0; i < frame_storm_us.size(); i++)
+                if (frame_storm_us[i] > deadline_us)
+                    late++;
+            bool met = late == 0 && bench.sample_gaps == 0 && isr_lost == 0 && read_errors == 0 && unanswered == 0 && unexpected == 0;
+            if (!met)
+                failures++;
+            printf("{\"bench\":\"commands\",\"firmware\":\"%s\",\"rate\":%u,\"seconds\":%.1f,\"commands\":%zu,"
+                   "\"answered\":%zu,\"busy\":%llu,\"firmware_busy\":%lld,\"unanswered\":%llu,\"unexpected\":%llu,",
+                   firmware.c_str(), rate, seconds, sent_ns.size(), reply_us.size(), (unsigned long long)busy,
+                   (long long)firmware_busy, (unsigned long long)unanswered, (unsigned long long)unexpected);
+            printPercentiles("reply_us", reply_us);
+            printf(",");
+            printPercentiles("frame_quiet_us", frame_quiet_us);
+            printf(",");
+            printPercentiles("frame_storm_us", frame_storm_us);
+            printf(",\"deadline_us\":%u,\"late_frames\":%llu,\"sample_gaps\":%llu,\"isr_lost\":%llu,\"read_errors\":%lld,"
+                   "\"deadlines_met\":%s}\n",
+                   deadline_us, (unsigned long long)late, (unsigned long long)bench.sample_gaps,
+                   (unsigned long long)isr_lost, (long long)read_errors, met ? "true" : "false");
+            fflush(stdout);
+        }
+        return failures ? 1 : 0;
+    }
+
+    /*
+     * Streams eight channels while the link drops to a third of what raw
+     * frames need and then comes back, once with adaptive formats off and
+     * once on. Off, the ring overflows and the client sees gaps; on, the
+     * stream has to step down far enough to lose nothing and climb back to
+     * raw frames once the link has recovered.
+     */
+    int runAdaptiveBench(const std::vector<uint32_t> &rates, double seconds)
+    {
+        using namespace ADS129x;
+        std::vector<uint32_t> bench_rates = rates;
+        if (bench_rates.empty())
+            bench_rates = {1000, 4000};
+        const uint32_t full_kbps = config().link_kbps;
+
+        BenchClient bench;
+        client().connect();
+        while (!client().connected())
+            bench.step();
+        bench.command("{\"command\":\"version\"}");
+        std::string firmware = replyField(bench.reply);
+
+        char json[96];
+        int failures = 0;
+        for (size_t r = 0; r < bench_rates.size(); r++)
+        {
+            uint32_t rate = bench_rates[r];
+            uint32_t throttled_kbps = rate * FRAME_BLOCK_SIZE * 8 / 1000 / 3;
+            for (int adaptive = 0; adaptive <= 1; adaptive++)
+            {
+                config().link_kbps = full_kbps;
+                bench.command("{\"command\":\"sdatac\"}");
+                bench.runFor(500000000ULL);
+                ads().setChip(ADSSIM_ADS1299);
+                bench.command("{\"command\":\"reset\"}");
+                bench.command("{\"command\":\"sdatac\"}");
+                snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+                bench.command(json);
+                for (int ch = 0; ch < ads().channels(); ch++)
+                {
+                    snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+                    bench.command(json);
+                }
+                snprintf(json, sizeof(json), "{\"command\":\"adaptive\",\"parameters\":[%d]}", adaptive);
+                bench.command(json);
+                bench.command("{\"command\":\"stats\",\"parameters\":[1]}");
+                bench.clear();
+                bench.command("{\"command\":\"rdatac\"}");
+                uint64_t conversions_start = ads().conversions();
+                uint64_t start_ns = nowNs();
+                bench.start_us = start_ns / 1000;
+
+                bench.runFor((uint64_t)(seconds * 1e9));
+                config().link_kbps = throttled_kbps;
+                bench.runFor((uint64_t)(2 * seconds * 1e9));
+                config().link_kbps = full_kbps;
+                bench.runFor((uint64_t)(4 * seconds * 1e9));
+
+                uint64_t generated = ads().conversions() - conversions_start;
+                bench.stop_us = nowNs() / 1000;
+                uint64_t drain_end = nowNs() + 5000000000ULL;
+                while (!bench.past_stop && nowNs() < drain_end)
+                    bench.step();
+                bench.command("{\"command\":\"adaptive\"}");
+                int64_t switches = replyNumber(bench.reply, "switches");
+                int64_t final_level = replyNumber(bench.reply, "level");
+                bench.command("{\"command\":\"stats\"}");
+                int64_t dropped = replyNumber(bench.reply, "samples_dropped");
+                bench.command("{\"command\":\"sdatac\"}");
+
+                bool ok = !adaptive || (bench.sample_gaps == 0 && dropped == 0 && final_level == 0);
+                if (!ok)
+                    failures++;
+                printf("{\"bench\":\"adaptive\",\"firmware\":\"%s\",\"rate\":%u,\"adaptive\":%s,\"link_kbps\":%u,"
+                       "\"throttled_kbps\":%u,\"generated\":%llu,\"delivered\":%llu,\"sample_gaps\":%llu,"
+                       "\"samples_dropped\":%lld,\"switches\":%lld,\"final_level\":%lld,\"frames_per_level\":[",
+                       firmware.c_str(), rate, adaptive ? "true" : "false", full_kbps, throttled_kbps,
+                       (unsigned long long)generated, (unsigned long long)bench.samples,
+                       (unsigned long long)bench.sample_gaps, (long long)dropped, (long long)switches,
+                       (long long)final_level);
+                for (int level = 0; level < STREAM_LEVELS; level++)
+                    printf("%s%llu", level ? "," : "", (unsigned long long)bench.level_frames[level]);
+                printf("],");
+                printPercentiles("latency_us", bench.latency_us);
+                printf(",\"ok\":%s}\n", ok ? "true" : "false");
+                fflush(stdout);
+            }
+        }
+        config().link_kbps = full_kbps;
+        return failures ? 1 : 0;
+    }
+
+    // What recorders do today: every sample to physical units and back, one small write per value
+    namespace bdfbench
+    {
+        struct NaiveWriter
+        {
+            FILE *file = NULL;
+            uint32_t record_samples = 0;
+            double uV_per_count = 0;
+            std::vector<std::vector<double>> columns;
+
+            bool open(const char *path, uint32_t rate, double physical_max_uV)
+            {
+                file = fopen(path, "wb");
+                record_samples = rate;
+                uV_per_count = physical_max_uV / 8388607.0;
+                columns.assign(8, std::vector<double>());
+                return file != NULL;
+            }
+
+            void write(const uint8_t *frame)
+            {
+                const FrameHeader *header = (const FrameHeader *)frame;
+                for (int i = 0; i < header->samples; i++)
+                {
+                    const uint8_t *data = frame + FRAME_BLOCK_SIZE * (1 + i) + FRAME_SAMPLE_DATA_OFFSET;
+                    for (int ch = 0; ch < 8; ch++)
+                    {
+                        const uint8_t *code = data + 3 * ch;
+                        int32_t counts = (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+                        columns[ch].push_back(counts * uV_per_count);
+                    }
+                    if (columns[0].size() == record_samples)
+                        writeRecord();
+                }
+            }
+
+            void writeRecord()
+            {
+                for (int ch = 0; ch < 8; ch++)
+                {
+                    for (size_t i = 0; i < columns[ch].size(); i++)
+                    {
+                        int32_t digital = (int32_t)lround(columns[ch][i] / uV_per_count);
+                        uint8_t bytes[3] = {(uint8_t)digital, (uint8_t)(digital >> 8), (uint8_t)(digital >> 16)};
+                        fwrite(bytes, 1, 3, file);
+                    }
+                    columns[ch].clear();
+                }
+                static const uint8_t annotations[BDF_ANNOTATION_BYTES] = {0};
+                fwrite(annotations, 1, sizeof(annotations), file);
+            }
+
+            void close()
+            {
+                if (file)
+                    fclose(file);
+                file = NULL;
+            }
+        };
+
+        // A captured frame renumbered as frame `index` of a longer stream
+        void renumber(std::vector<uint8_t> &frame, uint32_t original_first, uint32_t first)
+        {
+            FrameHeader *header = (FrameHeader *)frame.data();
+            int32_t shift = first - original_first;
+            int32_t applied = header->first_sample - original_first;
+            header->first_sample = first;
+            if (header->flags & FRAME_FLAG_EVENTS)
+            {
+                FrameEventBlock *events = (FrameEventBlock *)(frame.data() + frameLength(header) - FRAME_BLOCK_SIZE);
+                for (int i = 0; i < events->count; i++)
+                    events->events[i].sample_number += shift - applied;
+            }
+        }
+    }
+
+    /*
+     * Captures a second of eight channel frames with marks from the
+     * simulated firmware, then replays them as `streams` concurrent device
+     * streams of `seconds` each into BDF+ files, once through BdfWriter and
+     * once decoding every sample to microvolts and writing it back value by
+     * value. Both run on one core; streams_per_core is how many real time
+     * streams that core could keep recording. The data records of the two
+     * files of the first stream have to match byte for byte.
+     */
+    int runBdfBench(const std::vector<uint32_t> &rates, double seconds, int streams)
+    {
+        using namespace ADS129x;
+        std::vector<uint32_t> bench_rates = rates;
+        if (bench_rates.empty())
+            bench_rates = {1000, 4000};
+        const double PHYSICAL_MAX_UV = 187500;
+
+        BenchClient bench;
+        client().connect();
+        while (!client().connected())
+            bench.step();
+        bench.command("{\"command\":\"version\"}");
+        std::string firmware = replyField(bench.reply);
+
+        char directory[] = "/tmp/osem-bdf-XXXXXX";
+        if (!mkdtemp(directory))
+            return 1;
+        char json[96];
+        int failures = 0;
+        for (size_t r = 0; r < bench_rates.size(); r++)
+        {
+            uint32_t rate = bench_rates[r];
+            bench.command("{\"command\":\"sdatac\"}");
+            bench.runFor(500000000ULL);
+            ads().setChip(ADSSIM_ADS1299);
+            bench.command("{\"command\":\"reset\"}");
+            bench.command("{\"command\":\"sdatac\"}");
+            snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+            bench.command(json);
+            for (int ch = 0; ch < ads().channels(); ch++)
+            {
+                snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+                bench.command(json);
+            }
+            std::vector<std::vector<uint8_t>> captured;
+            bench.on_frame = [&](const Message &message) {
+                if (message.data.size() >= sizeof(FrameHeader) && readLE32(&message.data[0]) == FRAME_MAGIC)
+                    captured.push_back(message.data);
+            };
+            bench.command("{\"command\":\"rdatac\"}");
+            for (int mark = 1; mark <= 3; mark++)
+            {
+                bench.runFor(300000000ULL);
+                snprintf(json, sizeof(json), "{\"command\":\"mark\",\"parameters\":[%d]}", mark);
+                bench.command(json);
+            }
+            bench.runFor(300000000ULL);
+            bench.command("{\"command\":\"sdatac\"}");
+            bench.runFor(200000000ULL);
+            bench.on_frame = nullptr;
+            if (captured.size() < 2)
+            {
+                failures++;
+                continue;
+            }
+            std::vector<uint32_t> original_first;
+            for (size_t f = 0; f < captured.size(); f++)
+                original_first.push_back(((const FrameHeader *)captured[f].data())->first_sample);
+            uint32_t samples_per_frame = ((const FrameHeader *)captured[0].data())->samples;
+            size_t frames = (size_t)ceil(seconds * rate / samples_per_frame);
+
+            double cpu_s[2] = {0, 0};
+            uint64_t bytes[2] = {0, 0};
+            std::string first_file[2];
+            for (int path = 0; path < 2; path++)
+            {
+                std::vector<BdfWriter> writers(path == 0 ? streams : 0);
+                std::vector<bdfbench::NaiveWriter> naive(path == 1 ? streams : 0);
+                std::vector<std::string> files;
+                for (int s = 0; s < streams; s++)
+                {
+                    char file[128];
+                    snprintf(file, sizeof(file), "%s/%s-%u-%d.bdf", directory, path ? "naive" : "direct", rate, s);
+                    files.push_back(file);
+                }
+                double start = cpuSeconds();
+                BdfConfig config;
+                config.physical_max_uV = PHYSICAL_MAX_UV;
+                config.start_unix_us = 1700000000000000LL;
+                for (int s = 0; s < streams; s++)
+                {
+                    bool opened = path ? naive[s].open(files[s].c_str(), rate, PHYSICAL_MAX_UV) : writers[s].open(files[s].c_str(), config);
+                    if (!opened)
+                        return 1;
+                }
+                for (size_t f = 0; f < frames; f++)
+                {
+                    std::vector<uint8_t> &frame = captured[f % captured.size()];
+                    bdfbench::renumber(frame, original_first[f % captured.size()], f * samples_per_frame);
+                    for (int s = 0; s < streams; s++)
+                    {
+                        if (path)
+                            naive[s].write(frame.data());
+                        else
+                            writers[s].write(frame.data(), frame.size());
+                    }
+                }
+                for (int s = 0; s < streams; s++)
+                {
+                    if (path)
+                        naive[s].close();
+                    else
+                        writers[s].close();
+                }
+                cpu_s[path] = cpuSeconds() - start;
+                for (int s = 0; s < streams; s++)
+                {
+                    FILE *file = fopen(files[s].c_str(), "rb");
+                    if (file)
+                    {
+                        fseek(file, 0, SEEK_END);
+                        bytes[path] += ftell(file);
+                        fclose(file);
+                    }
+                    if (s == 0)
+                        first_file[path] = files[s];
+                    else
+                        unlink(files[s].c_str());
+                }
+            }
+
+            // Data records of both, the direct file has the header and annotations in front of and between them
+            bool identical = false;
+            {
+                std::vector<uint8_t> direct, naive;
+                for (int path = 0; path < 2; path++)
+                {
+                    FILE *file = fopen(first_file[path].c_str(), "rb");
+                    std::vector<uint8_t> &data = path ? naive : direct;
+                    if (file)
+                    {
+                        uint8_t chunk[65536];
+                        size_t n;
+                        while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+                            data.insert(data.end(), chunk, chunk + n);
+                        fclose(file);
+                    }
+                    unlink(first_file[path].c_str());
+                }
+                size_t header = 256 * 10;
+                size_t samples_bytes = (size_t)8 * rate * 3;
+                size_t record = samples_bytes + BDF_ANNOTATION_BYTES;
+                size_t records = naive.size() / record;
+                identical = records > 0 && direct.size() >= header + records * record;
+                for (size_t i = 0; identical && i < records; i++)
+                    identical = memcmp(&direct[header + i * record], &naive[i * record], samples_bytes) == 0;
+            }
+
+            uint64_t samples = (uint64_t)frames * samples_per_frame * streams;
+            for (int path = 0; path < 2; path++)
+            {
+                double per_s = cpu_s[path] > 0 ? samples / cpu_s[path] : 0;
+                printf("{\"bench\":\"bdf\",\"firmware\":\"%s\",\"path\":\"%s\",\"rate\":%u,\"streams\":%d,\"seconds\":%.1f,"
+                       "\"samples\":%llu,\"mbytes\":%.1f,\"cpu_s\":%.3f,\"samples_per_cpu_s\":%.0f,\"streams_per_core\":%.0f}\n",
+                       firmware.c_str(), path ? "naive" : "direct", rate, streams, seconds, (unsigned long long)samples,
+                       bytes[path] / 1e6, cpu_s[path], per_s, per_s / rate);
+            }
+            if (!identical)
+                failures++;
+            printf("{\"bench\":\"bdf_summary\",\"rate\":%u,\"speedup\":%.1f,\"identical\":%s}\n", rate,
+                   cpu_s[0] > 0 ? cpu_s[1] / cpu_s[0] : 0, identical ? "true" : "false");
+            fflush(stdout);
+        }
+        rmdir(directory);
+        return failures ? 1 : 0;
+    }
+
+    /*
+     * Times Montage::apply on one core for each kind of montage over a
+     * million random 24 bit codes, full scale and near it; cycles are TSC
+     * ticks where there is one. test/test_montage checks the outputs
+     * against their definition.
+     */
+    int runMontageBench()
+    {
+        const int SAMPLES = 1 << 20;
+        std::vector<montagebench::Case> cases = montagebench::cases();
+        std::vector<int32_t> codes = montagebench::codes(SAMPLES);
+        std::vector<int32_t> out((size_t)SAMPLES * MONTAGE_MAX_CHANNELS);
+        for (size_t c = 0; c < cases.size(); c++)
+        {
+            const Montage &montage = cases[c].montage;
+            double start = cpuSeconds();
+            uint64_t start_cycles = cycles();
+            for (int i = 0; i < SAMPLES; i++)
+                montage.apply(&codes[(size_t)i * MONTAGE_MAX_CHANNELS], &out[(size_t)i * MONTAGE_MAX_CHANNELS]);
+            uint64_t spent_cycles = cycles() - start_cycles;
+            double spent = cpuSeconds() - start;
+            printf("{\"bench\":\"montage\",\"montage\":\"%s\",\"outputs\":%d,\"terms\":%d,\"samples\":%d,"
+                   "\"ns_per_sample\":%.1f,\"cycles_per_sample\":%.1f}\n",
+                   cases[c].name, __builtin_popcount(montage.outputMask()), montage.terms(), SAMPLES,
+                   spent * 1e9 / SAMPLES, (double)spent_cycles / SAMPLES);
+            fflush(stdout);
+        }
+        return 0;
+    }
+
+    /*
+     * Times streamPack() and streamDecode() per frame on one core at the
+     * block floating point levels, for signals from a few codes to the
+     * rails; neither should depend on the amplitude. test/test_bfp checks
+     * the records against the means they stand for.
+     */
+    int runBfpBench()
+    {
+        const int32_t amplitudes[] = {100, 30000, 1 << 20, 8388607};
+        const int FRAMES = 4096;
+        uint32_t prng = 0x9E3779B9;
+        for (uint8_t level = 2; level < STREAM_LEVELS; level++)
+        {
+            for (size_t a = 0; a < sizeof(amplitudes) / sizeof(amplitudes[0]); a++)
+            {
+                std::vector<std::vector<uint8_t>> packed(FRAMES);
+                for (int f = 0; f < FRAMES; f++)
+                    bfpbench::rawFrame(packed[f], amplitudes[a], f * bfpbench::CONVERSIONS, prng);
+                std::vector<int32_t> decoded(bfpbench::CONVERSIONS * 8);
+                double start = cpuSeconds();
+                for (int f = 0; f < FRAMES; f++)
+                    streamPack(packed[f].data(), level, 0xFF);
+                double encode = cpuSeconds() - start;
+                start = cpuSeconds();
+                for (int f = 0; f < FRAMES; f++)
+                    streamDecode(packed[f].data(), decoded.data(), bfpbench::CONVERSIONS);
+                double decode = cpuSeconds() - start;
+                printf("{\"bench\":\"bfp\",\"level\":%u,\"decimation\":%u,\"amplitude\":%d,"
+                       "\"encode_ns_per_frame\":%.0f,\"decode_ns_per_frame\":%.0f}\n",
+                       level, stream_levels[level].decimation, amplitudes[a], encode * 1e9 / FRAMES, decode * 1e9 / FRAMES);
+                fflush(stdout);
+            }
+        }
+        return 0;
+    }
+
+    /*
+     * Times QualityMeter per sample over eight channels on one core, with
+     * a sine at the line frequency on channels from quiet to clipped.
+     * test/test_quality checks every statistic against its definition.
+     */
+    int runQualityBench()
+    {
+        const uint32_t rates[] = {250, 1000, 16000};
+        const float lines[] = {50, 60};
+        for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+            for (size_t l = 0; l < 2; l++)
+            {
+                uint32_t rate = rates[r];
+                std::vector<std::vector<int32_t>> codes;
+                qualitybench::window(rate, lines[l], codes);
+                uint32_t window = codes[0].size();
+                std::vector<int32_t> interleaved((size_t)window * 8);
+                for (uint32_t i = 0; i < window; i++)
+                    for (int ch = 0; ch < 8; ch++)
+                        interleaved[(size_t)i * 8 + ch] = codes[ch][i];
+                QualityMeter meter;
+                meter.begin(rate, 8, lines[l]);
+                const int REPEATS = std::max<int>(1, 1000000 / window);
+                double start = cpuSeconds();
+                for (int k = 0; k < REPEATS; k++)
+                    for (uint32_t i = 0; i < window; i++)
+                        meter.addSample(k * window + i, &interleaved[(size_t)i * 8]);
+                double spent = cpuSeconds() - start;
+                printf("{\"bench\":\"quality\",\"rate\":%u,\"line_hz\":%.0f,\"window\":%u,\"ns_per_sample\":%.1f}\n",
+                       rate, lines[l], window, spent * 1e9 / ((double)REPEATS * window));
+                fflush(stdout);
+            }
+        return 0;
+    }
+
+    namespace pipelinebench
+    {
+        static uint32_t cycles32()
+        {
+            return (uint32_t)cycles();
+        }
+    }
+
+    /*
+     * Captures raw frames from the simulated firmware at each rate, with a
+     * 20 mV electrode offset for the high pass stages to take out, and runs
+     * each chain over them a few times from a reset state: the cycles of
+     * convert, each stage and encode per input sample and the share of a
+     * sample period they take on this host; cycles are TSC ticks where
+     * there is one. test/test_pipeline checks the outputs against a
+     * reference.
+     */
+    int runPipelineBench(const std::vector<uint32_t> &rates, const std::vector<std::string> &chains, double seconds)
+    {
+        std::vector<uint32_t> bench_rates(rates);
+        if (bench_rates.empty())
+            bench_rates = {1000, 4000};
+        std::vector<std::string> bench_chains(chains);
+        if (bench_chains.empty())
+            bench_chains = {"hp:0.5", "notch:50", "lp:100", "dec:4", "hp:0.5+notch:50+lp:40",
+                            "hp:0.5+notch:50+lp:100+dec:4", "montage+hp:0.5+dec:2+lp:100+dec:2", "hp:20+env:6+dec:10"};
+        int failures = 0;
+        ADSSimSignal saved = ads().signal();
+        ads().signal().offset_mV = 20;
+
+        BenchClient bench;
+        std::string firmware = connectBench(bench);
+        Montage montage;
+        montage.commonAverage(0xFF);
+        for (size_t r = 0; r < bench_rates.size(); r++)
+        {
+            uint32_t rate = bench_rates[r];
+            std::vector<std::vector<uint8_t>> frames;
+            pipelinebench::capture(bench, rate, seconds, frames);
+
+            for (size_t c = 0; c < bench_chains.size(); c++)
+            {
+                std::vector<pipelinebench::Step> steps;
+                if (!pipelinebench::parseChain(bench_chains[c], steps))
+                {
+                    printf("{\"bench\":\"pipeline\",\"chain\":\"%s\",\"error\":\"cannot parse\"}\n", bench_chains[c].c_str());
+                    failures++;
+                    continue;
+                }
+                Pipeline pipeline;
+                bool appended = true;
+                for (size_t i = 0; i < steps.size(); i++)
+                    appended = appended && pipeline.append(steps[i].kind, steps[i].value, rate);
+                if (!appended)
+                {
+                    printf("{\"bench\":\"pipeline\",\"chain\":\"%s\",\"rate\":%u,\"error\":\"rejected\"}\n", bench_chains[c].c_str(), rate);
+                    failures++;
+                    continue;
+                }
+
+                pipeline.setCycleCounter(pipelinebench::cycles32);
+                std::vector<uint8_t> frame;
+                double spent = 0;
+                uint64_t ticks = 0;
+                const int PASSES = 8;
+                for (int pass = 0; pass < PASSES; pass++)
+                {
+                    pipeline.reset();
+                    for (size_t f = 0; f < frames.size(); f++)
+                    {
+                        frame = frames[f];
+                        frame.resize(frame.size() + FRAME_BLOCK_SIZE);
+                        uint64_t start_ticks = cycles();
+                        double start = cpuSeconds();
+                        pipeline.process(frame.data(), &montage);
+                        spent += cpuSeconds() - start;
+                        ticks += cycles() - start_ticks;
+                    }
+                }
+                uint64_t samples_in = pipeline.samplesIn();
+                double ns_per_sample = samples_in ? spent * 1e9 / samples_in : 0;
+                std::string per_stage = "{\"convert\":" + std::to_string(samples_in ? (double)pipeline.cycles(0) / samples_in : 0);
+                for (int i = 0; i < pipeline.stages(); i++)
+                    per_stage += ",\"" + std::to_string(i + 1) + "_" + pipelinebench::stageName(pipeline.kind(i)) + "\":" +
+                                 std::to_string(samples_in ? (double)pipeline.cycles(1 + i) / samples_in : 0);
+                per_stage += ",\"encode\":" + std::to_string(samples_in ? (double)pipeline.cycles(1 + pipeline.stages()) / samples_in : 0) + "}";
+                printf("{\"bench\":\"pipeline\",\"firmware\":\"%s\",\"chain\":\"%s\",\"rate\":%u,\"output_rate\":%u,\"frames\":%zu,"
+                       "\"samples_in\":%llu,\"cycles_per_sample\":%s,\"total_cycles_per_sample\":%.1f,\"ns_per_sample\":%.1f,"
+                       "\"period_share\":%.5f}\n",
+                       firmware.c_str(), bench_chains[c].c_str(), rate, pipeline.outputRate(rate), frames.size(),
+                       (unsigned long long)samples_in, per_stage.c_str(), samples_in ? (double)ticks / samples_in : 0,
+                       ns_per_sample, ns_per_sample * rate / 1e9);
+                fflush(stdout);
+            }
+        }
+        ads().signal() = saved;
+        return failures ? 1 : 0;
+    }
+
+    /**
+     * Converts replies to {"command":"trace","parameters":[2, first]} saved
+     * one per line, as a client would log them, into a Chrome trace.
+     */
+    int convertTrace(const char *in_path, const char *out_path)
+    {
+        FILE *in = fopen(in_path, "r");
+        if (!in)
+        {
+            fprintf(stderr, "cannot read %s\n", in_path);
+            return 1;
+        }
+        TraceDecoder decoder;
+        std::string line;
+        int c;
+        int pages = 0;
+        while ((c = fgetc(in)) != EOF)
+        {
+            if (c != '\n')
+            {
+                line += (char)c;
+                continue;
+            }
+            pages += decoder.addReply(line);
+            line.clear();
+        }
+        pages += decoder.addReply(line);
+        fclose(in);
+        std::string trace = decoder.chromeJson();
+        FILE *out = out_path ? fopen(out_path, "w") : stdout;
+        if (!out || fwrite(trace.data(), 1, trace.size(), out) != trace.size())
+        {
+            fprintf(stderr, "cannot write %s\n", out_path);
+            return 1;
+        }
+        if (out != stdout)
+            fclose(out);
+        fprintf(stderr, "%d pages, %zu records, %llu lost\n", pages, decoder.records(), (unsigned long long)decoder.lost());
+        return pages ? 0 : 1;
+    }
+}
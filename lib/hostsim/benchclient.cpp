@@ -0,0 +1,342 @@
+/*
+ * Client side of the host benches and tests: frames, replies and fixtures
+ *
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ads129x.h"
+#include "benchclient.h"
+#include "pipeline.h"
+#include "quality.h"
+
+namespace hostsim
+{
+    Percentiles percentiles(std::vector<uint32_t> &values)
+    {
+        Percentiles p = {0, 0, 0, 0};
+        if (values.empty())
+            return p;
+        std::sort(values.begin(), values.end());
+        size_t n = values.size();
+        p.p50 = values[(n - 1) * 50 / 100];
+        p.p90 = values[(n - 1) * 90 / 100];
+        p.p99 = values[(n - 1) * 99 / 100];
+        p.max = values[n - 1];
+        return p;
+    }
+
+    void printPercentiles(const char *name, std::vector<uint32_t> &values)
+    {
+        Percentiles p = percentiles(values);
+        printf("\"%s\":{\"n\":%zu,\"p50\":%.0f,\"p90\":%.0f,\"p99\":%.0f,\"max\":%.0f}",
+               name, values.size(), p.p50, p.p90, p.p99, p.max);
+    }
+
+    uint32_t readLE32(const uint8_t *p)
+    {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    int64_t replyNumber(const std::string &reply, const char *key)
+    {
+        std::string pattern = std::string("\"") + key + "\":";
+        size_t at = reply.find(pattern);
+        if (at == std::string::npos)
+            return 0;
+        return strtoll(reply.c_str() + at + pattern.size(), NULL, 10);
+    }
+
+    bool config1ForRate(ADSSimChip chip, uint32_t rate, uint8_t &config1)
+    {
+        using namespace ADS129x;
+        for (uint8_t dr = 0; dr <= 6; dr++)
+        {
+            switch (chip)
+            {
+            case ADSSIM_ADS1292R:
+                if ((125UL << dr) == rate)
+                {
+                    config1 = dr;
+                    return true;
+                }
+                break;
+            case ADSSIM_ADS1294:
+            case ADSSIM_ADS1296:
+            case ADSSIM_ADS1298:
+                if ((32000UL >> dr) == rate)
+                {
+                    config1 = HR | dr;
+                    return true;
+                }
+                if ((16000UL >> dr) == rate)
+                {
+                    config1 = dr;
+                    return true;
+                }
+                break;
+            default:
+                if ((16000UL >> dr) == rate)
+                {
+                    config1 = 0x90 | dr;
+                    return true;
+                }
+                break;
+            }
+        }
+        return false;
+    }
+
+    std::string replyField(const std::string &reply)
+    {
+        size_t colon = reply.find(':');
+        if (colon == std::string::npos)
+            return reply;
+        std::string value = reply.substr(colon + 1);
+        value.erase(std::remove(value.begin(), value.end(), '}'), value.end());
+        value.erase(std::remove(value.begin(), value.end(), '"'), value.end());
+        return value;
+    }
+
+    std::string connectBench(BenchClient &bench)
+    {
+        if (!client().connected())
+            client().connect();
+        while (!client().connected())
+            bench.step();
+        // Replies an earlier run left on the link must not answer the version
+        bench.runFor(100000000ULL);
+        bench.command("{\"command\":\"version\"}");
+        return replyField(bench.reply);
+    }
+
+    std::string syncClock(BenchClient &bench, int exchanges, uint64_t interval_ns)
+    {
+        SyncClient sync;
+        for (int i = 0; i < exchanges; i++)
+        {
+            sync.exchange(bench);
+            bench.runFor(interval_ns);
+        }
+        return sync.exchange(bench);
+    }
+
+    double cpuSeconds()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    uint64_t cycles()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        return 0;
+#endif
+    }
+
+    namespace montagebench
+    {
+        std::vector<Case> cases()
+        {
+            std::vector<Case> cases(8);
+            cases[0].name = "car8";
+            cases[0].montage.commonAverage(0xFF);
+            cases[1].name = "car7";
+            cases[1].montage.commonAverage(0x7F);
+            cases[2].name = "car6";
+            cases[2].montage.commonAverage(0x3F);
+            cases[3].name = "bipolar8";
+            cases[3].montage.bipolar(0xFF);
+            cases[4].name = "linked_ref";
+            cases[4].montage.reference(0xFF, 0xC0);
+            cases[5].name = "ref3";
+            cases[5].montage.reference(0xFF, 0x07);
+            cases[6].name = "laplacian";
+            {
+                int8_t row[MONTAGE_MAX_CHANNELS] = {4, -1, -1, -1, -1, 0, 0, 0};
+                cases[6].montage.setRow(0, row, 4);
+                cases[6].montage.compile();
+            }
+            cases[7].name = "custom_d255";
+            {
+                int8_t row[MONTAGE_MAX_CHANNELS] = {32, -8, -8, -8, -8, 0, 0, 0};
+                int8_t row2[MONTAGE_MAX_CHANNELS] = {-3, 7, 0, 0, 0, 0, 5, -1};
+                cases[7].montage.setRow(0, row, 255);
+                cases[7].montage.setRow(1, row2, 13);
+                cases[7].montage.compile();
+            }
+            return cases;
+        }
+
+        std::vector<int32_t> codes(int samples)
+        {
+            std::vector<int32_t> codes((size_t)samples * MONTAGE_MAX_CHANNELS);
+            uint32_t prng = 0x2545F491;
+            for (size_t i = 0; i < codes.size(); i++)
+            {
+                prng = prng * 1664525 + 1013904223;
+                int32_t code = (int32_t)(prng << 8) >> 8;
+                // Every fourth sample pinned to the rails or just inside
+                if (i / MONTAGE_MAX_CHANNELS % 4 == 3)
+                    code = (prng >> 30) == 0 ? MONTAGE_CODE_MAX : (prng >> 30) == 1 ? MONTAGE_CODE_MIN : code >> 12;
+                codes[i] = code;
+            }
+            return codes;
+        }
+    }
+
+    namespace bfpbench
+    {
+        void rawFrame(std::vector<uint8_t> &frame, int32_t amplitude, uint32_t first_sample, uint32_t &prng)
+        {
+            frame.assign(FRAME_BLOCK_SIZE * (2 + CONVERSIONS), 0);
+            FrameHeader header;
+            memset(&header, 0, sizeof(header));
+            header.magic = FRAME_MAGIC;
+            header.version = FRAME_VERSION;
+            header.samples = CONVERSIONS;
+            header.first_sample = first_sample;
+            memcpy(&frame[0], &header, sizeof(header));
+            for (int i = 0; i < CONVERSIONS; i++)
+            {
+                uint8_t *block = &frame[FRAME_BLOCK_SIZE * (1 + i)];
+                uint32_t timestamp = (first_sample + i) * 1000;
+                uint32_t sample_number = first_sample + i;
+                memcpy(block, &timestamp, 4);
+                memcpy(block + 4, &sample_number, 4);
+                for (int ch = 0; ch < 8; ch++)
+                {
+                    prng = prng * 1664525 + 1013904223;
+                    double phase = 2 * M_PI * ((first_sample + i) / 50.0 + ch / 8.0);
+                    int64_t code = llround(amplitude * sin(phase)) + (int32_t)(prng >> 28) - 8;
+                    code = std::max<int64_t>(-8388608, std::min<int64_t>(8388607, code));
+                    block[FRAME_SAMPLE_DATA_OFFSET + 3 * ch] = (uint8_t)(code >> 16);
+                    block[FRAME_SAMPLE_DATA_OFFSET + 3 * ch + 1] = (uint8_t)(code >> 8);
+                    block[FRAME_SAMPLE_DATA_OFFSET + 3 * ch + 2] = (uint8_t)code;
+                }
+            }
+        }
+    }
+
+    namespace qualitybench
+    {
+        void window(uint32_t rate, float line_hz, std::vector<std::vector<int32_t>> &codes)
+        {
+            codes.assign(8, std::vector<int32_t>(rate * QUALITY_WINDOW_MS / 1000));
+            uint32_t prng = 0x2545F491;
+            for (uint32_t i = 0; i < codes[0].size(); i++)
+                for (int ch = 0; ch < 8; ch++)
+                {
+                    prng = prng * 1664525 + 1013904223;
+                    double t = (double)i / rate;
+                    double amplitude = 100.0 * pow(8.0, ch); // up to past full scale on channel 8
+                    double code = (ch * 1e5 - 3e5) + amplitude * sin(2 * M_PI * line_hz * t + ch) +
+                                  0.3 * amplitude * sin(2 * M_PI * 7 * t) + (int32_t)(prng >> 22) - 512;
+                    codes[ch][i] = (int32_t)std::max(-8388608.0, std::min(8388607.0, round(code)));
+                }
+        }
+    }
+
+    namespace pipelinebench
+    {
+        bool parseChain(const std::string &text, std::vector<Step> &steps)
+        {
+            static const struct
+            {
+                const char *name;
+                uint8_t kind;
+            } names[] = {{"hp", PIPELINE_HIGHPASS}, {"lp", PIPELINE_LOWPASS}, {"notch", PIPELINE_NOTCH}, {"dec", PIPELINE_DECIMATE}, {"montage", PIPELINE_MONTAGE}, {"env", PIPELINE_ENVELOPE}};
+            steps.clear();
+            size_t at = 0;
+            while (at <= text.size())
+            {
+                size_t end = text.find('+', at);
+                std::string item = text.substr(at, end == std::string::npos ? std::string::npos : end - at);
+                size_t colon = item.find(':');
+                std::string name = item.substr(0, colon);
+                Step step = {0, colon == std::string::npos ? 0.0f : (float)atof(item.c_str() + colon + 1)};
+                for (size_t n = 0; n < sizeof(names) / sizeof(names[0]); n++)
+                    if (name == names[n].name)
+                        step.kind = names[n].kind;
+                if (step.kind == 0)
+                    return false;
+                steps.push_back(step);
+                if (end == std::string::npos)
+                    break;
+                at = end + 1;
+            }
+            return !steps.empty();
+        }
+
+        const char *stageName(uint8_t kind)
+        {
+            switch (kind)
+            {
+            case PIPELINE_HIGHPASS:
+                return "hp";
+            case PIPELINE_LOWPASS:
+                return "lp";
+            case PIPELINE_NOTCH:
+                return "notch";
+            case PIPELINE_DECIMATE:
+                return "dec";
+            case PIPELINE_ENVELOPE:
+                return "env";
+            default:
+                return "montage";
+            }
+        }
+
+        void capture(BenchClient &bench, uint32_t rate, double seconds, std::vector<std::vector<uint8_t>> &frames)
+        {
+            using namespace ADS129x;
+            char json[96];
+            bench.command("{\"command\":\"sdatac\"}");
+            bench.runFor(500000000ULL);
+            ads().setChip(ADSSIM_ADS1299);
+            bench.command("{\"command\":\"reset\"}");
+            bench.command("{\"command\":\"sdatac\"}");
+            snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+            bench.command(json);
+            for (int ch = 0; ch < ads().channels(); ch++)
+            {
+                snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+                bench.command(json);
+            }
+            bench.command("{\"command\":\"adaptive\",\"parameters\":[0]}");
+            bench.command("{\"command\":\"pipeline\",\"parameters\":[0]}");
+            frames.clear();
+            bench.clear();
+            bench.on_frame = [&](const Message &message) {
+                if (message.data.size() >= FRAME_BLOCK_SIZE && readLE32(&message.data[0]) == FRAME_MAGIC &&
+                    !(message.data[5] & (FRAME_FLAG_PACKED | FRAME_FLAG_RESENT)))
+                    frames.push_back(message.data);
+            };
+            bench.command("{\"command\":\"rdatac\"}");
+            bench.runFor((uint64_t)(seconds * 1e9));
+            bench.command("{\"command\":\"sdatac\"}");
+            bench.on_frame = nullptr;
+        }
+    }
+}
@@ -0,0 +1,273 @@
+/*
+ * Client side of the host benches and tests: frames, replies and fixtures
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * What lib/hostsim/bench.cpp and the unit tests under test/ share: a
+ * client that steps the firmware and takes its frames and replies apart,
+ * clock sync exchanges, and the synthetic inputs the throughput benches
+ * time and the tests check against their references. Everything runs on
+ * the virtual clock of hostsim.h, so the firmware's setup() has to have
+ * run first.
+ */
+
+#ifndef BENCHCLIENT_H
+#define BENCHCLIENT_H
+
+#include <algorithm>
+#include <functional>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "frameformat.h"
+#include "hostsim.h"
+#include "montage.h"
+#include "streamformat.h"
+
+void loop();
+
+namespace hostsim
+{
+    struct Percentiles
+    {
+        double p50, p90, p99, max;
+    };
+
+    Percentiles percentiles(std::vector<uint32_t> &values); // sorts values
+    void printPercentiles(const char *name, std::vector<uint32_t> &values);
+    uint32_t readLE32(const uint8_t *p);
+
+    // Receives frames and command replies while the firmware runs
+    class BenchClient
+    {
+    public:
+        uint64_t samples = 0;
+        uint64_t frames = 0;
+        uint64_t sample_gaps = 0;
+        uint64_t level_frames[STREAM_LEVELS] = {0}; // frames by the stream level they were packed at
+        uint32_t samples_per_frame = 0;
+        uint64_t start_us = 0;
+        uint64_t stop_us = UINT64_MAX;
+        bool past_stop = false;
+        std::vector<uint32_t> latency_us;
+        std::string reply;
+        uint64_t reply_ns = 0;
+        bool have_reply = false;
+        std::function<void(const Message &)> on_frame;
+        std::function<void(const Message &)> on_text;
+
+        void clear()
+        {
+            samples = frames = sample_gaps = 0;
+            memset(level_frames, 0, sizeof(level_frames));
+            samples_per_frame = 0;
+            start_us = 0;
+            stop_us = UINT64_MAX;
+            past_stop = false;
+            latency_us.clear();
+            have_contiguous_ = false;
+        }
+
+        void step()
+        {
+            loop();
+            Message message;
+            while (client().poll(message))
+            {
+                if (!message.binary)
+                {
+                    reply.assign(message.data.begin(), message.data.end());
+                    reply_ns = message.delivered_ns;
+                    have_reply = true;
+                    if (on_text)
+                        on_text(message);
+                    continue;
+                }
+                if (on_frame)
+                    on_frame(message);
+                frames++;
+                // Frames from firmware before the header was introduced are bare blocks
+                size_t first = message.data.size() >= BLOCK && readLE32(&message.data[0]) == FRAME_MAGIC ? BLOCK : 0;
+                uint32_t delivered_us = (uint32_t)(message.delivered_ns / 1000);
+                if (first && (message.data[5] & FRAME_FLAG_PACKED) && message.data.size() >= 2 * BLOCK)
+                {
+                    countPacked(message, delivered_us);
+                    continue;
+                }
+                if (first)
+                    level_frames[0]++;
+                // An event block may follow the samples
+                size_t end = message.data.size();
+                if (first)
+                    end = std::min(end, BLOCK * (1 + (message.data[6] | (message.data[7] << 8))));
+                samples_per_frame = (end - first) / BLOCK;
+                for (size_t offset = first; offset + BLOCK <= end; offset += BLOCK)
+                    count(readLE32(&message.data[offset]), readLE32(&message.data[offset + 4]), delivered_us);
+            }
+        }
+
+        void runFor(uint64_t ns)
+        {
+            uint64_t end = nowNs() + ns;
+            while (nowNs() < end)
+                step();
+        }
+
+        // Sends a command and returns the round trip in microseconds, 0 on timeout
+        uint32_t command(const char *json)
+        {
+            have_reply = false;
+            uint64_t sent = nowNs();
+            client().sendText(json);
+            while (!have_reply && nowNs() - sent < 2000000000ULL)
+                step();
+            return have_reply ? (uint32_t)((nowNs() - sent) / 1000) : 0;
+        }
+
+    private:
+        static const size_t BLOCK = 32;
+        bool have_contiguous_ = false;
+        uint32_t last_sample_ = 0;
+
+        void count(uint32_t timestamp, uint32_t sample_number, uint32_t delivered_us)
+        {
+            if (have_contiguous_ && sample_number != last_sample_ + 1)
+                sample_gaps++;
+            have_contiguous_ = true;
+            last_sample_ = sample_number;
+            if (timestamp < start_us)
+                return;
+            if (timestamp >= stop_us)
+            {
+                past_stop = true;
+                return;
+            }
+            samples++;
+            latency_us.push_back(delivered_us - timestamp);
+        }
+
+        // Every conversion a packed frame was made from, timed by interpolation
+        void countPacked(const Message &message, uint32_t delivered_us)
+        {
+            FrameHeader header;
+            FrameFormatBlock format;
+            memcpy(&header, &message.data[0], sizeof(header));
+            memcpy(&format, &message.data[BLOCK], sizeof(format));
+            if (format.level < STREAM_LEVELS)
+                level_frames[format.level]++;
+            samples_per_frame = format.conversions;
+            uint32_t span = format.last_timestamp - format.first_timestamp;
+            for (uint32_t i = 0; i < format.conversions; i++)
+            {
+                uint32_t offset = format.conversions > 1 ? (uint32_t)((uint64_t)span * i / (format.conversions - 1)) : 0;
+                count(format.first_timestamp + offset, header.first_sample + i, delivered_us);
+            }
+        }
+    };
+
+    int64_t replyNumber(const std::string &reply, const char *key); // 0 when the key is missing
+    std::string replyField(const std::string &reply);                // the first value, quotes and braces stripped
+    bool config1ForRate(ADSSimChip chip, uint32_t rate, uint8_t &config1);
+
+    // Connects the client unless it is and returns the firmware version
+    std::string connectBench(BenchClient &bench);
+
+    // Sync exchanges against the firmware with the simulator's true time as host time
+    class SyncClient
+    {
+    public:
+        // Sends the next request, which reports the previous reply; the reply carries the model so far
+        std::string exchange(BenchClient &bench)
+        {
+            char json[160];
+            int64_t t1 = nowNs() / 1000;
+            if (!started_)
+                snprintf(json, sizeof(json), "{\"command\":\"sync\",\"parameters\":[%lld]}", (long long)t1);
+            else
+                snprintf(json, sizeof(json), "{\"command\":\"sync\",\"parameters\":[%lld,%lld,%lld]}",
+                         (long long)t1, (long long)previous_t1_, (long long)previous_t4_);
+            bench.command(json);
+            started_ = true;
+            previous_t1_ = t1;
+            previous_t4_ = bench.reply_ns / 1000;
+            return bench.reply;
+        }
+
+    private:
+        bool started_ = false;
+        int64_t previous_t1_ = 0;
+        int64_t previous_t4_ = 0;
+    };
+
+    /*
+     * Runs sync exchanges from a fresh start. Returns the reply to a last
+     * request, which carries the model after the last full exchange.
+     */
+    std::string syncClock(BenchClient &bench, int exchanges, uint64_t interval_ns);
+
+    double cpuSeconds(); // CPU time of this process
+    uint64_t cycles();   // TSC ticks, 0 where there is none
+
+    namespace montagebench
+    {
+        struct Case
+        {
+            const char *name;
+            Montage montage;
+        };
+
+        // Common average, bipolar, reference, Laplacian and custom rows
+        std::vector<Case> cases();
+        // Random 24 bit codes, every fourth sample at the rails or just inside
+        std::vector<int32_t> codes(int samples);
+    }
+
+    namespace bfpbench
+    {
+        const int CONVERSIONS = 32;
+
+        // A raw frame of CONVERSIONS blocks, every channel a sine of amplitude plus a little noise
+        void rawFrame(std::vector<uint8_t> &frame, int32_t amplitude, uint32_t first_sample, uint32_t &prng);
+    }
+
+    namespace qualitybench
+    {
+        // A window of eight channels with a line frequency sine, from quiet to past full scale on channel 8
+        void window(uint32_t rate, float line_hz, std::vector<std::vector<int32_t>> &codes);
+    }
+
+    namespace pipelinebench
+    {
+        struct Step
+        {
+            uint8_t kind;
+            float value;
+        };
+
+        // "hp:0.5+notch:50+dec:4": hp, lp, notch, dec, montage and env, in order
+        bool parseChain(const std::string &text, std::vector<Step> &steps);
+        const char *stageName(uint8_t kind);
+
+        // Raw frames streamed from a reset ADS1299 at rate, adaptive formats and the pipeline off
+        void capture(BenchClient &bench, uint32_t rate, double seconds, std::vector<std::vector<uint8_t>> &frames);
+    }
+}
+
+#endif // BENCHCLIENT_H
@@ -0,0 +1,78 @@
+/*
+ * Legacy RMT driver subset for host builds
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef HOSTSIM_DRIVER_RMT_H
+#define HOSTSIM_DRIVER_RMT_H
+
+#include <stdint.h>
+#include "Arduino.h"
+#include "esp_err.h"
+#include "hal/gpio_ll.h"
+
+typedef enum
+{
+    RMT_CHANNEL_0,
+    RMT_CHANNEL_1,
+    RMT_CHANNEL_MAX
+} rmt_channel_t;
+
+typedef enum
+{
+    RMT_MODE_TX,
+    RMT_MODE_RX
+} rmt_mode_t;
+
+typedef struct
+{
+    union
+    {
+        struct
+        {
+            uint32_t duration0 : 15;
+            uint32_t level0 : 1;
+            uint32_t duration1 : 15;
+            uint32_t level1 : 1;
+        };
+        uint32_t val;
+    };
+} rmt_item32_t;
+
+typedef struct
+{
+    rmt_mode_t rmt_mode;
+    rmt_channel_t channel;
+    gpio_num_t gpio_num;
+    uint8_t clk_div;
+    uint8_t mem_block_num;
+    uint32_t flags;
+} rmt_config_t;
+
+#define RMT_DEFAULT_CONFIG_TX(gpio, channel_id) \
+    {RMT_MODE_TX, channel_id, gpio, 80, 1, 0}
+
+esp_err_t rmt_config(const rmt_config_t *rmt_param);
+esp_err_t rmt_driver_install(rmt_channel_t channel, size_t rx_buf_size, int intr_alloc_flags);
+// Returns once the items are in RMT memory, see hostsim::Config::rmt_write_ns
+esp_err_t rmt_write_items(rmt_channel_t channel, const rmt_item32_t *rmt_item, int item_num, bool wait_tx_done);
+// ESP_ERR_TIMEOUT while the channel is still sending after wait_time
+esp_err_t rmt_wait_tx_done(rmt_channel_t channel, TickType_t wait_time);
+
+#endif // HOSTSIM_DRIVER_RMT_H
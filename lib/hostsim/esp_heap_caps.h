@@ -0,0 +1,41 @@
+/*
+ * heap_caps subset for host builds
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Two heaps: internal RAM, whose largest free block after WiFi has come up
+ * is Config::heap_free_block, and PSRAM of Config::psram_size bytes, none
+ * by default. Allocations come out of the one the caps select and shrink it.
+ */
+
+#ifndef HOSTSIM_ESP_HEAP_CAPS_H
+#define HOSTSIM_ESP_HEAP_CAPS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+void *heap_caps_malloc(size_t size, uint32_t caps);
+void heap_caps_free(void *ptr);
+
+#endif // HOSTSIM_ESP_HEAP_CAPS_H
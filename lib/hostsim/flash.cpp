@@ -0,0 +1,112 @@
+/*
+ * Simulated SPI NOR flash behind the partition API
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <vector>
+#include "esp_partition.h"
+#include "hostsim.h"
+
+namespace hostsim
+{
+    static std::vector<uint8_t> flash_data;
+    static esp_partition_t flash_partition;
+
+    static void flashInit()
+    {
+        if (!flash_data.empty())
+            return;
+        flash_data.assign(config().flash_size, 0xFF);
+        flash_partition.type = ESP_PARTITION_TYPE_DATA;
+        flash_partition.subtype = ESP_PARTITION_SUBTYPE_DATA_SPIFFS;
+        flash_partition.address = 0x290000; // spiffs in the default 4 MB table
+        flash_partition.size = config().flash_size;
+        flash_partition.erase_size = 4096;
+        strcpy(flash_partition.label, "spiffs");
+        flash_partition.encrypted = false;
+    }
+
+    static bool inRange(const esp_partition_t *partition, size_t offset, size_t size)
+    {
+        return partition == &flash_partition && offset <= flash_data.size() && size <= flash_data.size() - offset;
+    }
+}
+
+using namespace hostsim;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    flashInit();
+    if (config().flash_size == 0 || type != ESP_PARTITION_TYPE_DATA)
+        return NULL;
+    if (subtype != ESP_PARTITION_SUBTYPE_ANY && subtype != flash_partition.subtype)
+        return NULL;
+    if (label && strcmp(label, flash_partition.label) != 0)
+        return NULL;
+    return &flash_partition;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if (!inRange(partition, src_offset, size))
+        return ESP_ERR_INVALID_ARG;
+    memcpy(dst, &flash_data[src_offset], size);
+    chargeCopy(size);
+    return ESP_OK;
+}
+
+// Programs page by page; interrupts are serviced between pages
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    if (!inRange(partition, dst_offset, size))
+        return ESP_ERR_INVALID_ARG;
+    const uint8_t *bytes = (const uint8_t *)src;
+    while (size > 0)
+    {
+        size_t chunk = 256 - (dst_offset & 255);
+        if (chunk > size)
+            chunk = size;
+        for (size_t i = 0; i < chunk; i++)
+            flash_data[dst_offset + i] &= bytes[i];
+        stats().flash_bytes_written += chunk;
+        uint64_t busy = config().flash_page_ns + (uint64_t)chunk * config().flash_byte_ns;
+        stats().flash_busy_ns += busy;
+        criticalSection(busy);
+        dst_offset += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (!inRange(partition, offset, size))
+        return ESP_ERR_INVALID_ARG;
+    if (offset % partition->erase_size || size % partition->erase_size)
+        return ESP_ERR_INVALID_SIZE;
+    for (size_t sector = offset; sector < offset + size; sector += partition->erase_size)
+    {
+        memset(&flash_data[sector], 0xFF, partition->erase_size);
+        stats().flash_sectors_erased++;
+        stats().flash_busy_ns += config().flash_erase_ns;
+        criticalSection(config().flash_erase_ns);
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,37 @@
+/*
+ * gpio_ll subset for host builds
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HOSTSIM_GPIO_LL_H
+#define HOSTSIM_GPIO_LL_H
+
+#include <stdint.h>
+
+typedef int gpio_num_t;
+
+struct gpio_dev_t
+{
+    uint32_t out; // stands in for the register block, unused
+};
+extern gpio_dev_t GPIO;
+
+// One write to the set or clear register, see hostsim::Config::gpio_register_ns
+void gpio_ll_set_level(gpio_dev_t *hw, gpio_num_t gpio_num, uint32_t level);
+
+#endif // HOSTSIM_GPIO_LL_H
@@ -0,0 +1,286 @@
+/*
+ * Entry point of the native build: runs setup() and loop() on the simulator
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string>
+#include <strings.h>
+#include "Arduino.h"
+#include "hostsim.h"
+
+void setup();
+void loop();
+
+namespace hostsim
+{
+    static const struct
+    {
+        const char *name;
+        ADSSimChip chip;
+    } CHIP_NAMES[] = {
+        {"ADS1292R", ADSSIM_ADS1292R},
+        {"ADS1294", ADSSIM_ADS1294},
+        {"ADS1296", ADSSIM_ADS1296},
+        {"ADS1298", ADSSIM_ADS1298},
+        {"ADS1299", ADSSIM_ADS1299},
+        {"ADS1299-4", ADSSIM_ADS1299_4},
+        {"ADS1299-6", ADSSIM_ADS1299_6},
+    };
+
+    static bool parseChip(const char *name, ADSSimChip &chip)
+    {
+        for (size_t i = 0; i < sizeof(CHIP_NAMES) / sizeof(CHIP_NAMES[0]); i++)
+        {
+            if (strcasecmp(name, CHIP_NAMES[i].name) == 0)
+            {
+                chip = CHIP_NAMES[i].chip;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void usage(const char *program)
+    {
+        fprintf(stderr,
+                "usage: %s [options] [json-command ...]\n"
+                "  --chip NAME        ADS1292R, ADS1294, ADS1296, ADS1298, ADS1299, ADS1299-4, ADS1299-6\n"
+                "  --seconds S        virtual time to run after setup() (default 2)\n"
+                "  --link-kbps N      simulated WiFi goodput (default %u)\n"
+                "  --latency-us N     simulated one way link latency (default %u)\n"
+                "  --bench            run the streaming benchmark, one JSON line per configuration\n"
+                "  --chips A,B        chips to benchmark (default ADS1299-4,ADS1299-6,ADS1299)\n"
+                "  --rates A,B        sample rates to benchmark (default 250 to 16000 SPS)\n"
+                "  --jitter-us N      simulated one way link jitter (default 0)\n"
+                "  --task-bench       acquisition and network steps on one core, then two, on this machine\n"
+                "  --command-bench    bursts of commands while streaming, frames against their deadline\n"
+                "  --adaptive-bench   link throttled to a third of the raw stream, adaptive formats off and on\n"
+                "  --bdf-bench        BDF+ recording of many device streams, direct and decoded\n"
+                "  --streams N        concurrent streams for --bdf-bench (default 256)\n"
+                "  --montage-bench    montage cost per sample on this machine\n"
+                "  --bfp-bench        block floating point encode and decode cost per frame\n"
+                "  --quality-bench    channel statistics cost per sample\n"
+                "  --pipeline-bench   stage chains over captured frames, cycles per stage\n"
+                "  --chains LIST      chains for --pipeline-bench, e.g. hp:0.5+notch:50+dec:4,lp:40\n"
+                "  --trace-json FILE  convert trace command replies saved one per line to a Chrome trace\n"
+                "  --trace-out FILE   where --trace-json writes, stdout without it\n"
+                "With --bench, --seconds is the streaming time per configuration (default 10),\n"
+                "with --task-bench the wall clock time per configuration (default 2), with\n"
+                "--command-bench the streaming time with and without commands (default 3), with\n"
+                "--adaptive-bench the time before the throttle, half its length (default 3), with\n"
+                "--bdf-bench the recording length per stream (default 5), with --pipeline-bench\n"
+                "the capture time per rate (default 2). Feature checks are unit tests under\n"
+                "test/, run with pio test -e native.\n"
+                "Commands are sent in order once the client is connected, each after\n"
+                "the reply to the previous one, e.g. '{\"command\":\"rreg\",\"parameters\":[0]}'\n",
+                program, config().link_kbps, config().link_latency_us);
+    }
+
+    static std::vector<std::string> splitList(const char *list)
+    {
+        std::vector<std::string> items;
+        std::string item;
+        for (const char *p = list;; p++)
+        {
+            if (*p == ',' || *p == '\0')
+            {
+                if (!item.empty())
+                    items.push_back(item);
+                item.clear();
+                if (*p == '\0')
+                    break;
+            }
+            else
+                item += *p;
+        }
+        return items;
+    }
+
+    int run(int argc, char **argv)
+    {
+        ADSSimChip chip = ADSSIM_ADS1299;
+        double seconds = 0;
+        bool bench = false;
+        bool task_bench = false;
+        bool command_bench = false;
+        bool adaptive_bench = false;
+        bool bdf_bench = false;
+        bool montage_bench = false;
+        bool bfp_bench = false;
+        bool quality_bench = false;
+        bool pipeline_bench = false;
+        const char *trace_out = NULL;
+        const char *trace_json = NULL;
+        int streams = 256;
+        std::vector<ADSSimChip> bench_chips;
+        std::vector<uint32_t> bench_rates;
+        std::vector<std::string> chains;
+        std::vector<std::string> commands;
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--chip" && has_value)
+            {
+                if (!parseChip(argv[++i], chip))
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+            }
+            else if (arg == "--seconds" && has_value)
+                seconds = atof(argv[++i]);
+            else if (arg == "--link-kbps" && has_value)
+                config().link_kbps = strtoul(argv[++i], NULL, 0);
+            else if (arg == "--latency-us" && has_value)
+                config().link_latency_us = strtoul(argv[++i], NULL, 0);
+            else if (arg == "--bench")
+                bench = true;
+            else if (arg == "--task-bench")
+                task_bench = true;
+            else if (arg == "--command-bench")
+                command_bench = true;
+            else if (arg == "--adaptive-bench")
+                adaptive_bench = true;
+            else if (arg == "--bdf-bench")
+                bdf_bench = true;
+            else if (arg == "--montage-bench")
+                montage_bench = true;
+            else if (arg == "--bfp-bench")
+                bfp_bench = true;
+            else if (arg == "--quality-bench")
+                quality_bench = true;
+            else if (arg == "--pipeline-bench")
+                pipeline_bench = true;
+            else if (arg == "--trace-out" && has_value)
+                trace_out = argv[++i];
+            else if (arg == "--trace-json" && has_value)
+                trace_json = argv[++i];
+            else if (arg == "--chains" && has_value)
+                chains = splitList(argv[++i]);
+            else if (arg == "--streams" && has_value)
+                streams = atoi(argv[++i]);
+            else if (arg == "--jitter-us" && has_value)
+                config().link_jitter_us = strtoul(argv[++i], NULL, 0);
+            else if (arg == "--chips" && has_value)
+            {
+                std::vector<std::string> names = splitList(argv[++i]);
+                for (size_t n = 0; n < names.size(); n++)
+                {
+                    if (!parseChip(names[n].c_str(), chip))
+                    {
+                        usage(argv[0]);
+                        return 1;
+                    }
+                    bench_chips.push_back(chip);
+                }
+            }
+            else if (arg == "--rates" && has_value)
+            {
+                std::vector<std::string> rates = splitList(argv[++i]);
+                for (size_t n = 0; n < rates.size(); n++)
+                    bench_rates.push_back(strtoul(rates[n].c_str(), NULL, 0));
+            }
+            else if (arg.compare(0, 2, "--") == 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            else
+                commands.push_back(arg);
+        }
+
+        // Offline, without the firmware
+        if (trace_json)
+            return convertTrace(trace_json, trace_out);
+
+        ads().setChip(chip);
+        setup();
+        if (bench)
+            return runBench(bench_chips, bench_rates, seconds > 0 ? seconds : 10);
+        if (task_bench)
+            return runTaskBench(seconds > 0 ? seconds : 2);
+        if (command_bench)
+            return runCommandBench(bench_rates, seconds > 0 ? seconds : 3);
+        if (adaptive_bench)
+            return runAdaptiveBench(bench_rates, seconds > 0 ? seconds : 3);
+        if (bdf_bench)
+            return runBdfBench(bench_rates, seconds > 0 ? seconds : 5, streams > 0 ? streams : 1);
+        if (montage_bench)
+            return runMontageBench();
+        if (bfp_bench)
+            return runBfpBench();
+        if (quality_bench)
+            return runQualityBench();
+        if (pipeline_bench)
+            return runPipelineBench(bench_rates, chains, seconds > 0 ? seconds : 2);
+        client().connect();
+
+        uint64_t end_ns = nowNs() + (uint64_t)((seconds > 0 ? seconds : 2) * 1e9);
+        uint64_t sent_ns = 0;
+        size_t next_command = 0;
+        bool awaiting_reply = false;
+        uint64_t frames = 0;
+        uint64_t frame_bytes = 0;
+        while (nowNs() < end_ns)
+        {
+            loop();
+
+            Message message;
+            while (client().poll(message))
+            {
+                if (message.binary)
+                {
+                    frames++;
+                    frame_bytes += message.data.size();
+                    continue;
+                }
+                printf("%10.3f ms <- %.*s\n", message.delivered_ns / 1e6, (int)message.data.size(), (const char *)message.data.data());
+                awaiting_reply = false;
+            }
+            if (awaiting_reply && nowNs() - sent_ns > 1000000000ULL)
+            {
+                printf("%10.3f ms    no reply\n", nowNs() / 1e6);
+                awaiting_reply = false;
+            }
+            if (!awaiting_reply && next_command < commands.size() && client().connected())
+            {
+                const char *command = commands[next_command++].c_str();
+                printf("%10.3f ms -> %s\n", nowNs() / 1e6, command);
+                client().sendText(command);
+                sent_ns = nowNs();
+                awaiting_reply = true;
+            }
+        }
+
+        printf("chip %s, %u SPS, %llu conversions, %llu read, %llu missed, %llu frames (%llu bytes) received\n",
+               ads().chipName(), ads().sampleRate(),
+               (unsigned long long)ads().conversions(), (unsigned long long)ads().conversionsRead(),
+               (unsigned long long)ads().conversionsMissed(), (unsigned long long)frames,
+               (unsigned long long)frame_bytes);
+        return 0;
+    }
+}
+
+// The unit tests under test/ bring their own
+#ifndef PIO_UNIT_TESTING
+int main(int argc, char **argv)
+{
+    return hostsim::run(argc, argv);
+}
+#endif
@@ -0,0 +1,507 @@
+/*
+ * Host runtime: virtual clock, GPIO, interrupts and core shims
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <map>
+#include "Arduino.h"
+#include "SPI.h"
+#include "WiFi.h"
+#include "ESPmDNS.h"
+#include "esp_timer.h"
+#include "hal/gpio_ll.h"
+#include "driver/rmt.h"
+#include "esp_heap_caps.h"
+#include "osemboard.h"
+#include "hostsim.h"
+
+#define HOSTSIM_NUM_PINS 64
+
+HardwareSerial Serial;
+EspClass ESP;
+SPIClass SPI;
+WiFiClass WiFi;
+MDNSResponder MDNS;
+
+namespace hostsim
+{
+    static Config sim_config;
+    static Stats sim_stats;
+    static ADSSim sim_ads;
+    static uint64_t now_ns = 0;
+
+    static uint8_t pin_levels[HOSTSIM_NUM_PINS];
+    static void (*pin_handlers[HOSTSIM_NUM_PINS])(void);
+    static int pin_modes[HOSTSIM_NUM_PINS];
+
+    static bool isr_active = false;
+    static int irq_masked = 0;
+    static bool irq_pending[HOSTSIM_NUM_PINS];
+    static uint64_t irq_edge_ns[HOSTSIM_NUM_PINS]; // when the pending edge arrived
+
+    // Scheduled input levels, ordered by time
+    struct PinEdge
+    {
+        uint64_t at_ns;
+        uint8_t pin;
+        uint8_t level;
+    };
+    static std::vector<PinEdge> pin_edges;
+
+    static std::vector<EventSource *> sources;
+
+    Config &config() { return sim_config; }
+    Stats &stats() { return sim_stats; }
+    ADSSim &ads() { return sim_ads; }
+    uint64_t nowNs() { return now_ns; }
+
+    int64_t deviceMicros()
+    {
+        int64_t true_us = (int64_t)(now_ns / 1000);
+        return sim_config.clock_offset_us + true_us + true_us * sim_config.clock_ppm / 1000000;
+    }
+    bool inIsr() { return isr_active; }
+
+    void addEventSource(EventSource *source)
+    {
+        sources.push_back(source);
+    }
+
+    void chargeCopy(size_t bytes)
+    {
+        sim_stats.bytes_copied += bytes;
+        advanceNs((uint64_t)bytes * sim_config.copy_ns_per_byte);
+    }
+
+    static void runInterrupt(uint8_t pin, uint64_t edge_ns)
+    {
+        void (*handler)(void) = pin_handlers[pin];
+        if (!handler)
+            return;
+        if (isr_active || irq_masked)
+        {
+            if (irq_pending[pin])
+                sim_stats.isr_lost++;
+            else
+            {
+                sim_stats.isr_latched++;
+                irq_edge_ns[pin] = edge_ns;
+            }
+            irq_pending[pin] = true;
+            return;
+        }
+        isr_active = true;
+        advanceNs(sim_config.isr_entry_ns);
+        sim_stats.isr_calls++;
+        uint64_t start_ns = now_ns;
+        if (start_ns - edge_ns > sim_stats.isr_delay_max_ns)
+            sim_stats.isr_delay_max_ns = start_ns - edge_ns;
+        handler();
+        sim_stats.isr_ns += now_ns - start_ns;
+        isr_active = false;
+    }
+
+    static void serviceLatched()
+    {
+        // A handler may latch another edge, go round until none is left
+        bool serviced = true;
+        while (serviced && !isr_active && !irq_masked)
+        {
+            serviced = false;
+            for (uint8_t pin = 0; pin < HOSTSIM_NUM_PINS; pin++)
+            {
+                if (!irq_pending[pin])
+                    continue;
+                irq_pending[pin] = false;
+                runInterrupt(pin, irq_edge_ns[pin]);
+                serviced = true;
+            }
+        }
+    }
+
+    void schedulePinLevel(uint8_t pin, uint64_t at_ns, uint8_t level)
+    {
+        if (pin >= HOSTSIM_NUM_PINS)
+            return;
+        PinEdge edge = {at_ns, pin, level};
+        std::vector<PinEdge>::iterator it = pin_edges.begin();
+        while (it != pin_edges.end() && it->at_ns <= at_ns)
+            ++it;
+        pin_edges.insert(it, edge);
+    }
+
+    static void applyPinEdge()
+    {
+        PinEdge edge = pin_edges.front();
+        pin_edges.erase(pin_edges.begin());
+        uint8_t previous = pin_levels[edge.pin];
+        pin_levels[edge.pin] = edge.level;
+        int mode = pin_modes[edge.pin];
+        bool fell = previous == HIGH && edge.level == LOW;
+        bool rose = previous == LOW && edge.level == HIGH;
+        if ((fell && (mode & FALLING)) || (rose && (mode & RISING)))
+            runInterrupt(edge.pin, now_ns);
+    }
+
+    void advanceNs(uint64_t ns)
+    {
+        uint64_t target = now_ns + ns;
+        for (;;)
+        {
+            // Pick the earliest pending event within the window
+            uint64_t next = sim_ads.nextEventNs();
+            EventSource *next_source = NULL;
+            for (size_t i = 0; i < sources.size(); i++)
+            {
+                uint64_t t = sources[i]->nextEventNs();
+                if (t < next)
+                {
+                    next = t;
+                    next_source = sources[i];
+                }
+            }
+            bool pin_edge = !pin_edges.empty() && pin_edges.front().at_ns < next;
+            if (pin_edge)
+                next = pin_edges.front().at_ns;
+            if (next > target)
+                break;
+            if (next > now_ns)
+                now_ns = next;
+            if (pin_edge)
+            {
+                applyPinEdge();
+                serviceLatched();
+                continue;
+            }
+            if (next_source)
+            {
+                next_source->fire(now_ns);
+                continue;
+            }
+            // Every conversion is a falling DRDY edge, the pin returns high
+            // on its own before the next one even when nobody reads it
+            sim_ads.advanceTo(now_ns);
+            if (pin_modes[PIN_DRDY] & FALLING)
+                runInterrupt(PIN_DRDY, now_ns);
+            serviceLatched();
+        }
+        if (target > now_ns)
+            now_ns = target;
+        sim_ads.advanceTo(now_ns);
+    }
+
+    void maskInterrupts()
+    {
+        irq_masked++;
+    }
+
+    void unmaskInterrupts()
+    {
+        irq_masked--;
+        serviceLatched();
+    }
+
+    void criticalSection(uint64_t ns)
+    {
+        maskInterrupts();
+        advanceNs(ns);
+        unmaskInterrupts();
+    }
+}
+
+using namespace hostsim;
+
+void hostsimLog(char level, const char *tag, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "[%10.3f ms][%c][%s] ", now_ns / 1e6, level, tag);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    if (pin >= HOSTSIM_NUM_PINS)
+        return;
+    if (mode == INPUT_PULLUP)
+        pin_levels[pin] = HIGH;
+}
+
+static void setPin(uint8_t pin, uint8_t val, uint32_t cost_ns)
+{
+    if (pin >= HOSTSIM_NUM_PINS)
+        return;
+    sim_stats.gpio_writes++;
+    advanceNs(cost_ns);
+    uint8_t previous = pin_levels[pin];
+    pin_levels[pin] = val ? HIGH : LOW;
+    if (pin == PIN_CS)
+        sim_ads.select(val == LOW, now_ns);
+    else if (pin == PIN_RST && previous == LOW && val == HIGH)
+        sim_ads.powerOnReset();
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+    setPin(pin, val, sim_config.gpio_write_ns);
+}
+
+gpio_dev_t GPIO;
+
+void gpio_ll_set_level(gpio_dev_t *hw, gpio_num_t gpio_num, uint32_t level)
+{
+    (void)hw;
+    setPin((uint8_t)gpio_num, level ? HIGH : LOW, sim_config.gpio_register_ns);
+}
+
+int digitalRead(uint8_t pin)
+{
+    if (pin == PIN_DRDY)
+    {
+        sim_ads.advanceTo(now_ns);
+        return sim_ads.drdy() ? HIGH : LOW;
+    }
+    return pin < HOSTSIM_NUM_PINS ? pin_levels[pin] : LOW;
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode)
+{
+    if (pin >= HOSTSIM_NUM_PINS)
+        return;
+    pin_handlers[pin] = handler;
+    pin_modes[pin] = mode;
+}
+
+void detachInterrupt(uint8_t pin)
+{
+    if (pin >= HOSTSIM_NUM_PINS)
+        return;
+    pin_handlers[pin] = NULL;
+    pin_modes[pin] = 0;
+}
+
+unsigned long micros()
+{
+    // unsigned long is 32 bits on the target, keep the same wrap around
+    return (uint32_t)hostsim::deviceMicros();
+}
+
+unsigned long millis()
+{
+    return (uint32_t)(hostsim::deviceMicros() / 1000);
+}
+
+int64_t esp_timer_get_time()
+{
+    return hostsim::deviceMicros();
+}
+
+void delay(uint32_t ms)
+{
+    advanceNs((uint64_t)ms * 1000000);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    advanceNs((uint64_t)us * 1000);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    advanceNs((uint64_t)ticks * portTICK_PERIOD_MS * 1000000);
+}
+
+void portENTER_CRITICAL(portMUX_TYPE *mux)
+{
+    maskInterrupts();
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE *mux)
+{
+    unmaskInterrupts();
+}
+
+size_t HardwareSerial::print(const char *s)
+{
+    return fputs(s, stderr) < 0 ? 0 : strlen(s);
+}
+
+size_t HardwareSerial::println(const char *s)
+{
+    size_t n = print(s);
+    fputc('\n', stderr);
+    return n + 1;
+}
+
+void EspClass::restart()
+{
+    hostsimLog('E', "hostsim", "ESP.restart() requested, exiting");
+    exit(2);
+}
+
+// 160 MHz core clock; reading the counter costs nothing
+uint32_t EspClass::getCycleCount()
+{
+    return (uint32_t)(hostsim::nowNs() * 4 / 25);
+}
+
+void SPIClass::setFrequency(uint32_t freq)
+{
+    frequency_ = freq ? freq : 1;
+}
+
+static void spiCharge(uint32_t bytes, uint32_t frequency)
+{
+    sim_stats.spi_calls++;
+    sim_stats.spi_bytes += bytes;
+    advanceNs(sim_config.spi_call_ns + (uint64_t)bytes * 8 * 1000000000ULL / frequency);
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+    spiCharge(1, frequency_);
+    return sim_ads.transfer(data, now_ns);
+}
+
+void SPIClass::transfer(void *data, uint32_t size)
+{
+    transferBytes((const uint8_t *)data, (uint8_t *)data, size);
+}
+
+void SPIClass::transferBytes(const uint8_t *data, uint8_t *out, uint32_t size)
+{
+    spiCharge(size, frequency_);
+    for (uint32_t i = 0; i < size; i++)
+    {
+        uint8_t miso = sim_ads.transfer(data ? data[i] : 0xFF, now_ns);
+        if (out)
+            out[i] = miso;
+    }
+}
+
+void SPIClass::writeBytes(const uint8_t *data, uint32_t size)
+{
+    transferBytes(data, NULL, size);
+}
+
+void spiTransferBytesNL(spi_t *spi, const void *data_in, uint8_t *data_out, uint32_t len)
+{
+    ((SPIClass *)spi)->transferBytes((const uint8_t *)data_in, data_out, len);
+}
+
+// One channel is enough for the status LED
+static uint64_t rmt_busy_until_ns;
+static uint32_t rmt_color;
+
+uint32_t hostsim::ledColor()
+{
+    return rmt_color;
+}
+
+esp_err_t rmt_config(const rmt_config_t *rmt_param)
+{
+    return rmt_param->channel < RMT_CHANNEL_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t rmt_driver_install(rmt_channel_t channel, size_t rx_buf_size, int intr_alloc_flags)
+{
+    (void)rx_buf_size;
+    (void)intr_alloc_flags;
+    return channel < RMT_CHANNEL_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+// The CPU only fills RMT memory, the peripheral drives the pin from there
+esp_err_t rmt_write_items(rmt_channel_t channel, const rmt_item32_t *rmt_item, int item_num, bool wait_tx_done)
+{
+    if (channel >= RMT_CHANNEL_MAX || item_num <= 0)
+        return ESP_ERR_INVALID_ARG;
+    if (now_ns < rmt_busy_until_ns)
+        advanceNs(rmt_busy_until_ns - now_ns); // the driver waits for the last transmission
+    sim_stats.rmt_writes++;
+    advanceNs(sim_config.rmt_write_ns);
+    // A high part longer than the low part is a one
+    uint32_t color = 0;
+    int bits = 0;
+    for (int i = 0; i < item_num; i++)
+    {
+        if (!rmt_item[i].level0)
+            continue;
+        color = (color << 1) | (rmt_item[i].duration0 > rmt_item[i].duration1 ? 1 : 0);
+        bits++;
+    }
+    if (bits == 24)
+        rmt_color = color;
+    rmt_busy_until_ns = now_ns + (uint64_t)item_num * sim_config.rmt_bit_ns;
+    if (wait_tx_done)
+        advanceNs(rmt_busy_until_ns - now_ns);
+    return ESP_OK;
+}
+
+esp_err_t rmt_wait_tx_done(rmt_channel_t channel, TickType_t wait_time)
+{
+    if (channel >= RMT_CHANNEL_MAX)
+        return ESP_ERR_INVALID_ARG;
+    if (now_ns >= rmt_busy_until_ns)
+        return ESP_OK;
+    uint64_t wait_ns = (uint64_t)wait_time * portTICK_PERIOD_MS * 1000000ULL;
+    if (wait_time != portMAX_DELAY && now_ns + wait_ns < rmt_busy_until_ns)
+    {
+        advanceNs(wait_ns);
+        return ESP_ERR_TIMEOUT;
+    }
+    advanceNs(rmt_busy_until_ns - now_ns);
+    return ESP_OK;
+}
+
+// Bytes taken from each heap, by allocation
+static std::map<void *, std::pair<size_t, bool> > heap_allocations;
+static size_t heap_used[2];
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    bool psram = caps & MALLOC_CAP_SPIRAM;
+    size_t size = psram ? sim_config.psram_size : sim_config.heap_free_block;
+    return size > heap_used[psram] ? size - heap_used[psram] : 0;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    bool psram = caps & MALLOC_CAP_SPIRAM;
+    if (size == 0 || size > heap_caps_get_largest_free_block(caps))
+        return NULL;
+    void *ptr = malloc(size);
+    if (!ptr)
+        return NULL;
+    heap_allocations[ptr] = std::make_pair(size, psram);
+    heap_used[psram] += size;
+    return ptr;
+}
+
+void heap_caps_free(void *ptr)
+{
+    auto it = heap_allocations.find(ptr);
+    if (it == heap_allocations.end())
+        return;
+    heap_used[it->second.second] -= it->second.first;
+    heap_allocations.erase(it);
+    free(ptr);
+}
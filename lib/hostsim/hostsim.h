@@ -0,0 +1,149 @@
+/*
+ * Host runtime: virtual clock, GPIO, interrupts and the loopback client
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The firmware runs single threaded against a virtual clock. Calls that
+ * cost time on the target (delays, SPI and GPIO access, WebSocket sends)
+ * advance the clock by the amount given in Config, and any DRDY edge that
+ * falls inside that window runs the attached ISR at the edge time plus the
+ * interrupt entry latency. Edges arriving while an ISR runs or interrupts
+ * are masked are latched once, as the GPIO interrupt status bit would be.
+ */
+
+#ifndef HOSTSIM_H
+#define HOSTSIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "adssim.h"
+
+namespace hostsim
+{
+    // Cost model of the ESP32-C3 target
+    struct Config
+    {
+        uint32_t gpio_write_ns = 250;      // digitalWrite()
+        uint32_t gpio_register_ns = 25;    // gpio_ll_set_level(), one register write
+        uint32_t spi_call_ns = 1500;       // SPIClass call overhead
+        uint32_t isr_entry_ns = 2000;      // GPIO edge to first ISR instruction
+        uint32_t loop_idle_ns = 20000;     // WebSocketsServer::loop() without traffic
+        uint32_t send_call_ns = 30000;     // WebSocket frame write, fixed part
+        uint32_t copy_ns_per_byte = 8;     // memcpy into library and lwIP buffers
+        uint32_t neopixel_show_ns = 80000; // interrupts masked while bit-banging
+        uint32_t rmt_write_ns = 3000;      // rmt_write_items() filling RMT memory
+        uint32_t rmt_bit_ns = 1250;        // one WS2812 bit on the wire
+        uint32_t link_kbps = 8000;         // sustained WiFi TCP goodput
+        uint32_t link_latency_us = 3000;   // one way
+        uint32_t link_jitter_us = 0;       // extra one way delay, uniform in [0, jitter]
+        uint32_t tcp_snd_buf = 5744;       // lwIP TCP_SND_BUF
+        int32_t clock_ppm = 0;             // device crystal error against true time
+        int64_t clock_offset_us = 0;       // device clock at true time zero
+        uint32_t flash_size = 0x170000;    // data partition, 0 for none
+        uint32_t flash_page_ns = 100000;   // page program, fixed part
+        uint32_t flash_byte_ns = 2000;     // page program, per byte
+        uint32_t flash_erase_ns = 45000000; // 4 KB sector erase
+        uint32_t heap_free_block = 110592;  // largest free internal block with WiFi up
+        uint32_t psram_size = 0;            // ESP32-S3 modules with PSRAM
+    };
+
+    struct Stats
+    {
+        uint64_t isr_calls;
+        uint64_t isr_ns; // spent in handlers, not counting entry
+        uint64_t isr_latched; // edges served late because interrupts were masked
+        uint64_t isr_lost;    // edges that never reached the ISR
+        uint64_t isr_delay_max_ns; // edge to first handler instruction, worst case
+        uint64_t spi_calls;
+        uint64_t spi_bytes;
+        uint64_t gpio_writes;
+        uint64_t bytes_copied;
+        uint64_t tcp_writes; // client writes into lwIP, a separate header counts too
+        uint64_t ws_messages_sent;
+        uint64_t ws_bytes_sent;
+        uint64_t flash_bytes_written;
+        uint64_t flash_sectors_erased;
+        uint64_t flash_busy_ns; // interrupts held off by flash operations
+        uint64_t rmt_writes;
+    };
+
+    class EventSource
+    {
+    public:
+        virtual ~EventSource() {}
+        virtual uint64_t nextEventNs() = 0;
+        virtual void fire(uint64_t now_ns) = 0;
+    };
+
+    struct Message
+    {
+        bool binary;
+        std::vector<uint8_t> data;
+        uint64_t sent_ns;
+        uint64_t delivered_ns;
+    };
+
+    // The WebSocket client on the far side of the simulated link
+    class LoopbackClient
+    {
+    public:
+        void connect();
+        void disconnect();
+        bool connected() const;
+        void sendText(const char *text);
+        bool poll(Message &message);
+    };
+
+    Config &config();
+    Stats &stats();
+    ADSSim &ads();
+    LoopbackClient &client();
+
+    uint64_t nowNs();
+    int64_t deviceMicros(); // esp_timer_get_time() and micros() of the device
+    void advanceNs(uint64_t ns);
+    void criticalSection(uint64_t ns);
+    void maskInterrupts(); // nests, the last unmask serves latched edges
+    void unmaskInterrupts();
+    bool inIsr();
+    void addEventSource(EventSource *source);
+    void schedulePinLevel(uint8_t pin, uint64_t at_ns, uint8_t level); // drive an input, firing its interrupt
+    void chargeCopy(size_t bytes);
+    uint32_t ledColor(); // GRB the RMT last sent to the status LED
+
+    // Network side, implemented with the WebSocketsServer shim
+    void linkReset();
+    bool linkWrite(bool binary, const uint8_t *data, size_t length);
+
+    int run(int argc, char **argv);
+    int runBench(const std::vector<ADSSimChip> &chips, const std::vector<uint32_t> &rates, double seconds);
+    int runTaskBench(double seconds);
+    int runCommandBench(const std::vector<uint32_t> &rates, double seconds);
+    int runAdaptiveBench(const std::vector<uint32_t> &rates, double seconds);
+    int runBdfBench(const std::vector<uint32_t> &rates, double seconds, int streams);
+    int runMontageBench();
+    int runBfpBench();
+    int runQualityBench();
+    int runPipelineBench(const std::vector<uint32_t> &rates, const std::vector<std::string> &chains, double seconds);
+    int convertTrace(const char *in_path, const char *out_path); // NULL out_path for stdout
+}
+
+#endif // HOSTSIM_H
@@ -0,0 +1,272 @@
+/*
+ * WebSocketsServer shim, simulated TCP link and loopback client
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <deque>
+#include "WebSocketsServer.h"
+#include "hostsim.h"
+
+namespace hostsim
+{
+    struct Inbound
+    {
+        WStype_t type;
+        std::vector<uint8_t> data;
+        uint64_t arrival_ns;
+    };
+
+    static bool client_connected = false;
+    static std::deque<Inbound> to_server;
+    static std::deque<Message> to_client;
+    static uint64_t link_free_ns = 0;
+    static LoopbackClient loopback;
+
+    LoopbackClient &client() { return loopback; }
+
+    static uint64_t linkLatencyNs()
+    {
+        static uint32_t prng = 0x9E3779B9;
+        uint64_t jitter_ns = 0;
+        if (config().link_jitter_us)
+        {
+            prng ^= prng << 13;
+            prng ^= prng >> 17;
+            prng ^= prng << 5;
+            jitter_ns = (uint64_t)(prng % (config().link_jitter_us + 1)) * 1000;
+        }
+        return (uint64_t)config().link_latency_us * 1000 + jitter_ns;
+    }
+
+    // TCP delivers in order, jitter can delay a message but not reorder it
+    static uint64_t toServerArrivalNs()
+    {
+        uint64_t arrival_ns = nowNs() + linkLatencyNs();
+        if (!to_server.empty() && to_server.back().arrival_ns > arrival_ns)
+            return to_server.back().arrival_ns;
+        return arrival_ns;
+    }
+
+    static uint64_t linkTimeNs(size_t bytes)
+    {
+        return (uint64_t)bytes * 8000000ULL / config().link_kbps;
+    }
+
+    void linkReset()
+    {
+        to_server.clear();
+        to_client.clear();
+        link_free_ns = 0;
+        client_connected = false;
+    }
+
+    bool linkWrite(bool binary, const uint8_t *data, size_t length)
+    {
+        if (!client_connected)
+            return false;
+        advanceNs(config().send_call_ns);
+
+        // WebSocket framing: 2 byte header, 4 for 16 bit and 10 for 64 bit lengths
+        size_t header = length < 126 ? 2 : length < 65536 ? 4 : 10;
+        uint64_t start = nowNs() > link_free_ns ? nowNs() : link_free_ns;
+        link_free_ns = start + linkTimeNs(header + length);
+
+        Message message;
+        message.binary = binary;
+        message.data.assign(data, data + length);
+        message.sent_ns = nowNs();
+        message.delivered_ns = link_free_ns + linkLatencyNs();
+        if (!to_client.empty() && to_client.back().delivered_ns > message.delivered_ns)
+            message.delivered_ns = to_client.back().delivered_ns;
+        to_client.push_back(message);
+        stats().ws_messages_sent++;
+        stats().tcp_writes++;
+        stats().ws_bytes_sent += length;
+
+        // The writer blocks until the rest fits in the TCP send buffer
+        uint64_t buffered = linkTimeNs(config().tcp_snd_buf);
+        if (link_free_ns > nowNs() + buffered)
+            advanceNs(link_free_ns - buffered - nowNs());
+        return true;
+    }
+
+    void LoopbackClient::connect()
+    {
+        Inbound event;
+        event.type = WStype_CONNECTED;
+        event.data.assign((const uint8_t *)"/", (const uint8_t *)"/" + 2);
+        event.arrival_ns = toServerArrivalNs();
+        to_server.push_back(event);
+    }
+
+    void LoopbackClient::disconnect()
+    {
+        Inbound event;
+        event.type = WStype_DISCONNECTED;
+        event.arrival_ns = toServerArrivalNs();
+        to_server.push_back(event);
+        // Whatever is still in flight towards the client is lost
+        to_client.clear();
+    }
+
+    bool LoopbackClient::connected() const
+    {
+        return client_connected;
+    }
+
+    void LoopbackClient::sendText(const char *text)
+    {
+        Inbound event;
+        event.type = WStype_TEXT;
+        event.data.assign((const uint8_t *)text, (const uint8_t *)text + strlen(text) + 1);
+        event.arrival_ns = toServerArrivalNs();
+        to_server.push_back(event);
+    }
+
+    bool LoopbackClient::poll(Message &message)
+    {
+        if (to_client.empty() || to_client.front().delivered_ns > nowNs())
+            return false;
+        message = to_client.front();
+        to_client.pop_front();
+        return true;
+    }
+}
+
+using namespace hostsim;
+
+WebSocketsServer::WebSocketsServer(uint16_t port, const String &origin, const String &protocol)
+{
+    (void)port;
+    (void)origin;
+    (void)protocol;
+}
+
+void WebSocketsServer::begin()
+{
+    running_ = true;
+}
+
+void WebSocketsServer::close()
+{
+    running_ = false;
+    linkReset();
+}
+
+void WebSocketsServer::onEvent(WebSocketServerEvent cbEvent)
+{
+    cbEvent_ = cbEvent;
+}
+
+void WebSocketsServer::loop()
+{
+    advanceNs(config().loop_idle_ns);
+    if (!running_)
+        return;
+    while (!to_server.empty() && to_server.front().arrival_ns <= nowNs())
+    {
+        Inbound event = to_server.front();
+        to_server.pop_front();
+        if (event.type == WStype_CONNECTED)
+            client_connected = true;
+        else if (event.type == WStype_DISCONNECTED)
+            client_connected = false;
+        size_t length = event.data.empty() ? 0 : event.data.size() - 1;
+        if (cbEvent_)
+            cbEvent_(0, event.type, event.data.empty() ? NULL : event.data.data(), length);
+    }
+}
+
+bool WebSocketsServer::sendTXT(uint8_t num, uint8_t *payload, size_t length, bool headerToPayload)
+{
+    if (headerToPayload)
+        payload += WEBSOCKETS_MAX_HEADER_SIZE;
+    return sendTXT(num, (const uint8_t *)payload, length);
+}
+
+bool WebSocketsServer::sendTXT(uint8_t num, const uint8_t *payload, size_t length)
+{
+    if (!clientIsConnected(num))
+        return false;
+    if (length == 0)
+        length = strlen((const char *)payload);
+    // Short frames are assembled in a library buffer, then copied into lwIP
+    chargeCopy(2 * length);
+    return linkWrite(false, payload, length);
+}
+
+bool WebSocketsServer::sendTXT(uint8_t num, char *payload, size_t length, bool headerToPayload)
+{
+    return sendTXT(num, (uint8_t *)payload, length, headerToPayload);
+}
+
+bool WebSocketsServer::sendTXT(uint8_t num, const char *payload, size_t length)
+{
+    return sendTXT(num, (const uint8_t *)payload, length);
+}
+
+bool WebSocketsServer::sendTXT(uint8_t num, String &payload)
+{
+    return sendTXT(num, (const uint8_t *)payload.c_str(), payload.length());
+}
+
+bool WebSocketsServer::sendBIN(uint8_t num, uint8_t *payload, size_t length, bool headerToPayload)
+{
+    if (!clientIsConnected(num))
+        return false;
+    if (headerToPayload)
+    {
+        // Header is written into the reserved headroom, only lwIP copies
+        chargeCopy(length);
+        return linkWrite(true, payload + WEBSOCKETS_MAX_HEADER_SIZE, length);
+    }
+    return sendBIN(num, (const uint8_t *)payload, length);
+}
+
+bool WebSocketsServer::sendBIN(uint8_t num, const uint8_t *payload, size_t length)
+{
+    if (!clientIsConnected(num))
+        return false;
+    // Like the WebSockets library, frames under 1400 bytes are merged with
+    // their header in a temporary buffer before lwIP copies them again;
+    // larger ones go out as a write of the header and one of the payload
+    chargeCopy(length < 1400 ? 2 * length : length);
+    if (length >= 1400 && clientIsConnected(num))
+        stats().tcp_writes++;
+    return linkWrite(true, payload, length);
+}
+
+void WebSocketsServer::disconnect(uint8_t num)
+{
+    (void)num;
+    if (client_connected && cbEvent_)
+        cbEvent_(0, WStype_DISCONNECTED, NULL, 0);
+    client_connected = false;
+    to_client.clear();
+}
+
+uint8_t WebSocketsServer::connectedClients(bool ping)
+{
+    (void)ping;
+    return client_connected ? 1 : 0;
+}
+
+bool WebSocketsServer::clientIsConnected(uint8_t num)
+{
+    return num == 0 && client_connected;
+}
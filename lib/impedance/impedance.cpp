@@ -0,0 +1,97 @@
+/*
+ * Electrode impedance from AC lead-off excitation
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+#include "impedance.h"
+
+ImpedanceMeter::ImpedanceMeter() : channels_(0), window_(0), ready_(false), windows_(0), current_a_(0)
+{
+    memset(volts_per_count_, 0, sizeof(volts_per_count_));
+    reset();
+}
+
+void ImpedanceMeter::begin(uint32_t sample_rate, int channels, const float *volts_per_count, float current_a)
+{
+    channels_ = channels > IMPEDANCE_MAX_CHANNELS ? IMPEDANCE_MAX_CHANNELS : channels;
+    window_ = (uint32_t)((uint64_t)sample_rate * IMPEDANCE_WINDOW_MS / 1000) & ~3UL;
+    if (window_ < 8)
+        window_ = 8;
+    current_a_ = current_a;
+    memset(volts_per_count_, 0, sizeof(volts_per_count_));
+    memcpy(volts_per_count_, volts_per_count, channels_ * sizeof(float));
+    memset(magnitude_, 0, sizeof(magnitude_));
+    windows_ = 0;
+    ready_ = false;
+    reset();
+}
+
+void ImpedanceMeter::reset()
+{
+    count_ = 0;
+    memset(s1_, 0, sizeof(s1_));
+    memset(s2_, 0, sizeof(s2_));
+}
+
+/**
+ * Feeds one sample. A gap in the sample numbers breaks the excitation
+ * phase, so the window starts over.
+ */
+void ImpedanceMeter::addSample(uint32_t sample_number, const int32_t *counts)
+{
+    if (!window_)
+        return;
+    if (count_ > 0 && sample_number != last_sample_ + 1)
+        reset();
+    last_sample_ = sample_number;
+    for (int ch = 0; ch < channels_; ch++)
+    {
+        int64_t s0 = counts[ch] - s2_[ch];
+        s2_[ch] = s1_[ch];
+        s1_[ch] = s0;
+    }
+    if (++count_ < window_)
+        return;
+    for (int ch = 0; ch < channels_; ch++)
+        magnitude_[ch] = sqrtf((float)s1_[ch] * (float)s1_[ch] + (float)s2_[ch] * (float)s2_[ch]);
+    reset();
+    ready_ = true;
+    windows_++;
+}
+
+bool ImpedanceMeter::poll()
+{
+    bool ready = ready_;
+    ready_ = false;
+    return ready;
+}
+
+/**
+ * Sampled at fDR/4 the square wave reads +a, +a, -a, -a, whose bin
+ * magnitude over N samples is N*a/sqrt(2); a is I*Z. The decimation filter
+ * response at fDR/4 is not corrected for.
+ */
+float ImpedanceMeter::kohm(int channel) const
+{
+    if (channel < 0 || channel >= channels_ || !window_ || current_a_ <= 0)
+        return 0;
+    float amplitude = 1.41421356f * magnitude_[channel] / window_ * volts_per_count_[channel];
+    return amplitude / current_a_ / 1000.0f;
+}
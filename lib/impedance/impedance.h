@@ -0,0 +1,76 @@
+/*
+ * Electrode impedance from AC lead-off excitation
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The ADS129x inject a square wave lead-off current at fDR/4 into the
+ * positive input of every channel enabled in LOFF_SENSP, so each sample
+ * carries +-I*Z of the electrode. A Goertzel filter per channel picks that
+ * bin out of the raw samples. At a quarter of the sample rate its
+ * coefficient 2cos(2*pi/4) is zero and the recurrence needs no multiply:
+ * s[n] = x[n] - s[n-2], and |X|^2 = s[N-1]^2 + s[N-2]^2 once N samples are
+ * in. N is a multiple of four, so DC cancels, and spans IMPEDANCE_WINDOW_MS,
+ * which fits whole cycles of the difference between fDR/4 and 50 or 60 Hz
+ * mains and their harmonics at the usual data rates.
+ */
+
+#ifndef IMPEDANCE_H
+#define IMPEDANCE_H
+
+#include <stdint.h>
+
+#define IMPEDANCE_MAX_CHANNELS 8
+#define IMPEDANCE_WINDOW_MS 400
+
+class ImpedanceMeter
+{
+public:
+    ImpedanceMeter();
+    // volts_per_count[ch] is 0 for channels without excitation
+    void begin(uint32_t sample_rate, int channels, const float *volts_per_count, float current_a);
+    void reset();
+    bool active() const { return window_ > 0; }
+
+    // counts holds one ADC code per channel
+    void addSample(uint32_t sample_number, const int32_t *counts);
+    // True once per completed window
+    bool poll();
+    // Electrode impedance over the last completed window
+    float kohm(int channel) const;
+    bool excited(int channel) const { return volts_per_count_[channel] > 0; }
+    int channels() const { return channels_; }
+    uint32_t lastSample() const { return last_sample_; }
+    uint32_t windows() const { return windows_; }
+    void end() { window_ = 0; }
+
+private:
+    int channels_;
+    uint32_t window_;
+    uint32_t count_;
+    uint32_t last_sample_;
+    bool ready_;
+    uint32_t windows_;
+    float current_a_;
+    float volts_per_count_[IMPEDANCE_MAX_CHANNELS];
+    int64_t s1_[IMPEDANCE_MAX_CHANNELS];
+    int64_t s2_[IMPEDANCE_MAX_CHANNELS];
+    float magnitude_[IMPEDANCE_MAX_CHANNELS]; // |X| of the last full window
+};
+
+#endif // IMPEDANCE_H
@@ -0,0 +1,168 @@
+/*
+ * Re-referencing and montage derivations on the device
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include "montage.h"
+
+// Numerators stay below 2^MONTAGE_NUMERATOR_BITS, see montage.h
+#define MONTAGE_NUMERATOR_BITS 30
+
+Montage::Montage()
+{
+    clear();
+    compile();
+}
+
+void Montage::clear()
+{
+    memset(weights_, 0, sizeof(weights_));
+    memset(divisor_, 0, sizeof(divisor_));
+}
+
+bool Montage::setRow(int output, const int8_t *weights, uint8_t divisor)
+{
+    if (output < 0 || output >= MONTAGE_MAX_CHANNELS || divisor == 0)
+        return false;
+    int sum = 0;
+    for (int input = 0; input < MONTAGE_MAX_CHANNELS; input++)
+        sum += weights[input] < 0 ? -weights[input] : weights[input];
+    if (sum == 0 || sum > MONTAGE_MAX_WEIGHT)
+        return false;
+    memcpy(weights_[output], weights, MONTAGE_MAX_CHANNELS);
+    divisor_[output] = divisor;
+    return true;
+}
+
+/**
+ * Turns the rows into term lists and reciprocals. For d > 1 with 2^l >= d,
+ * m = ceil(2^(30+l) / d) gives floor(n / d) = (n * m) >> (30+l) for every
+ * n below 2^30 (Granlund and Montgomery), and m < 2^31.
+ */
+bool Montage::compile()
+{
+    int count = 0;
+    output_mask_ = 0;
+    for (int output = 0; output < MONTAGE_MAX_CHANNELS; output++)
+    {
+        uint8_t d = divisor_[output];
+        multiplier_[output] = 0;
+        shift_[output] = 0;
+        if (d)
+        {
+            output_mask_ |= 1 << output;
+            for (int input = 0; input < MONTAGE_MAX_CHANNELS; input++)
+                if (weights_[output][input])
+                    terms_[count++] = {(uint8_t)input, weights_[output][input]};
+            int l = 0;
+            while ((1U << l) < d)
+                l++;
+            shift_[output] = MONTAGE_NUMERATOR_BITS + l;
+            multiplier_[output] = d > 1 ? (uint32_t)(((1ULL << shift_[output]) + d - 1) / d) : 0;
+        }
+        row_end_[output] = count;
+    }
+    return output_mask_ != 0;
+}
+
+bool Montage::commonAverage(uint8_t input_mask)
+{
+    int n = __builtin_popcount(input_mask);
+    if (n < 2)
+        return false;
+    clear();
+    for (int output = 0; output < MONTAGE_MAX_CHANNELS; output++)
+    {
+        if (!(input_mask & (1 << output)))
+            continue;
+        int8_t weights[MONTAGE_MAX_CHANNELS] = {0};
+        for (int input = 0; input < MONTAGE_MAX_CHANNELS; input++)
+            if (input_mask & (1 << input))
+                weights[input] = input == output ? n - 1 : -1;
+        setRow(output, weights, n);
+    }
+    return compile();
+}
+
+bool Montage::bipolar(uint8_t input_mask)
+{
+    if (__builtin_popcount(input_mask) < 2)
+        return false;
+    clear();
+    int output = 0;
+    int previous = -1;
+    for (int input = 0; input < MONTAGE_MAX_CHANNELS; input++)
+    {
+        if (!(input_mask & (1 << input)))
+            continue;
+        if (previous >= 0)
+        {
+            int8_t weights[MONTAGE_MAX_CHANNELS] = {0};
+            weights[previous] = 1;
+            weights[input] = -1;
+            setRow(output++, weights, 1);
+        }
+        previous = input;
+    }
+    return compile();
+}
+
+bool Montage::reference(uint8_t input_mask, uint8_t reference_mask)
+{
+    int n = __builtin_popcount(reference_mask);
+    if (n < 1 || !(input_mask & ~reference_mask))
+        return false;
+    clear();
+    for (int output = 0; output < MONTAGE_MAX_CHANNELS; output++)
+    {
+        if (!(input_mask & ~reference_mask & (1 << output)))
+            continue;
+        int8_t weights[MONTAGE_MAX_CHANNELS] = {0};
+        weights[output] = n;
+        for (int input = 0; input < MONTAGE_MAX_CHANNELS; input++)
+            if (reference_mask & (1 << input))
+                weights[input] = -1;
+        setRow(output, weights, n);
+    }
+    return compile();
+}
+
+void Montage::apply(const int32_t *in, int32_t *out) const
+{
+    int32_t result[MONTAGE_MAX_CHANNELS];
+    const Term *term = terms_;
+#pragma GCC unroll 8
+    for (int output = 0; output < MONTAGE_MAX_CHANNELS; output++)
+    {
+        const Term *end = terms_ + row_end_[output];
+        int32_t sum = 0;
+        for (; term < end; term++)
+            sum += term->weight * in[term->input];
+        if (multiplier_[output])
+        {
+            // Half away from zero: floor((|sum| + d/2) / d) with the sign put back
+            uint32_t d = divisor_[output];
+            uint32_t n = (uint32_t)(sum < 0 ? -sum : sum) + d / 2;
+            int32_t q = (int32_t)(((uint64_t)n * multiplier_[output]) >> shift_[output]);
+            sum = sum < 0 ? -q : q;
+        }
+        result[output] = sum > MONTAGE_CODE_MAX ? MONTAGE_CODE_MAX : sum < MONTAGE_CODE_MIN ? MONTAGE_CODE_MIN : sum;
+    }
+    memcpy(out, result, sizeof(result));
+}
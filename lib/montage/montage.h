@@ -0,0 +1,90 @@
+/*
+ * Re-referencing and montage derivations on the device
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A montage is a small integer matrix: output k is the sum of w[k][j] times
+ * input channel j, divided by the row's divisor d[k] and rounded half away
+ * from zero. A common average reference is w = N-1 on the channel itself,
+ * -1 on the other N-1 and d = N; a bipolar derivation +1 and -1 with d = 1.
+ * Rows are stored as lists of their nonzero terms, and the division is a
+ * multiply by a precomputed reciprocal and a shift. With the sum of |w| in
+ * a row at most MONTAGE_MAX_WEIGHT, a 24 bit code times the weights stays
+ * below 2^30, where that reciprocal gives the exact quotient, so every
+ * output equals the rational result rounded once.
+ */
+
+#ifndef MONTAGE_H
+#define MONTAGE_H
+
+#include <stdint.h>
+
+#define MONTAGE_MAX_CHANNELS 8
+#define MONTAGE_MAX_WEIGHT 64   // sum of |w| over a row
+#define MONTAGE_MAX_DIVISOR 255
+#define MONTAGE_CODE_MAX 8388607 // outputs saturate to 24 bits
+#define MONTAGE_CODE_MIN (-8388608)
+
+class Montage
+{
+public:
+    Montage();
+    void clear();
+    // The row of output k over the inputs, false if out of range; takes effect at compile()
+    bool setRow(int output, const int8_t *weights, uint8_t divisor);
+    bool compile();
+
+    // Ready made montages over the channels in input_mask, channel 1 is bit 0
+    bool commonAverage(uint8_t input_mask);
+    // Consecutive channels, lowest first: 1-2, 2-3, ...; output k in slot k
+    bool bipolar(uint8_t input_mask);
+    // Every other channel against the mean of the channels in reference_mask
+    bool reference(uint8_t input_mask, uint8_t reference_mask);
+
+    bool active() const { return output_mask_ != 0; }
+    uint8_t outputMask() const { return output_mask_; }
+    int terms() const { return row_end_[MONTAGE_MAX_CHANNELS - 1]; }
+    int8_t weight(int output, int input) const { return weights_[output][input]; }
+    uint8_t divisor(int output) const { return divisor_[output]; }
+
+    /**
+     * One sample: in holds MONTAGE_MAX_CHANNELS codes, out gets an output
+     * per slot, zero for slots outside outputMask(). in and out may alias.
+     */
+    void apply(const int32_t *in, int32_t *out) const;
+
+private:
+    struct Term
+    {
+        uint8_t input;
+        int8_t weight;
+    };
+
+    int8_t weights_[MONTAGE_MAX_CHANNELS][MONTAGE_MAX_CHANNELS];
+    uint8_t divisor_[MONTAGE_MAX_CHANNELS]; // 0 for a slot without a row
+
+    // Compiled: the terms of row k are terms_[row_end_[k-1] .. row_end_[k])
+    uint8_t output_mask_;
+    Term terms_[MONTAGE_MAX_CHANNELS * MONTAGE_MAX_CHANNELS];
+    uint8_t row_end_[MONTAGE_MAX_CHANNELS];
+    uint32_t multiplier_[MONTAGE_MAX_CHANNELS]; // ceil(2^shift / d), 0 for d = 1
+    uint8_t shift_[MONTAGE_MAX_CHANNELS];
+};
+
+#endif // MONTAGE_H
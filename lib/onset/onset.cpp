@@ -0,0 +1,184 @@
+/*
+ * Muscle activation onset and offset detection on envelopes
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include "onset.h"
+
+OnsetDetector::OnsetDetector() : channel_mask_(0), k_on_(0), k_off_(0), hold_ms_(0), dropped_(0)
+{
+    reset();
+}
+
+bool OnsetDetector::begin(uint8_t channel_mask, float k_on, float k_off, uint32_t hold_ms)
+{
+    if (channel_mask == 0 || !(k_off > 0) || k_off > k_on || k_on > 64 || hold_ms == 0)
+        return false;
+    channel_mask_ = channel_mask;
+    k_on_ = (int32_t)(k_on * 256 + 0.5f);
+    k_off_ = (int32_t)(k_off * 256 + 0.5f);
+    hold_ms_ = hold_ms;
+    dropped_ = 0;
+    reset();
+    return true;
+}
+
+void OnsetDetector::end()
+{
+    channel_mask_ = 0;
+    reset();
+}
+
+void OnsetDetector::reset()
+{
+    rate_ = 0;
+    hold_ = 1;
+    shift_ = 1;
+    warmup_ = 0;
+    learnt_ = 0;
+    queued_ = 0;
+    memset(channels_, 0, sizeof(channels_));
+}
+
+void OnsetDetector::configure(uint32_t rate)
+{
+    reset();
+    rate_ = rate;
+    uint32_t hold = hold_ms_ * rate / 1000;
+    hold_ = hold < 1 ? 1 : hold > UINT16_MAX ? UINT16_MAX : hold;
+    // The power of two nearest the time constant in samples
+    uint32_t samples = ONSET_BASELINE_MS * rate / 1000;
+    shift_ = 1;
+    while (shift_ < 30 && (1UL << shift_) + (1UL << (shift_ - 1)) <= samples)
+        shift_++;
+    warmup_ = ONSET_WARMUP_MS * rate / 1000;
+}
+
+void OnsetDetector::queue(uint32_t number, uint8_t source, uint8_t channel)
+{
+    if (queued_ >= ONSET_QUEUE_SIZE)
+    {
+        dropped_++;
+        return;
+    }
+    FrameEvent &event = queue_[queued_++];
+    event.sample_number = number;
+    event.source = source;
+    event.code = channel;
+    event.offset_us = 0;
+}
+
+void OnsetDetector::update(uint32_t number, const int32_t *envelope)
+{
+    // Weighted like a plain mean until 2^shift_ samples are in
+    uint8_t shift = 0;
+    while (shift < shift_ && (1UL << (shift + 1)) <= learnt_ + 1)
+        shift++;
+    bool learning = warmup_ > 0;
+    for (int ch = 0; ch < ONSET_CHANNELS; ch++)
+    {
+        if (!(channel_mask_ & (1 << ch)))
+            continue;
+        Channel &channel = channels_[ch];
+        int64_t level = (int64_t)envelope[ch] << 8;
+        int64_t deviation = channel.deviation > ONSET_MIN_DEVIATION ? channel.deviation : ONSET_MIN_DEVIATION;
+        if (channel.active)
+        {
+            if (level < channel.mean + ((k_off_ * deviation) >> 8))
+            {
+                if (channel.run++ == 0)
+                    channel.run_start = number;
+                if (channel.run >= hold_)
+                {
+                    channel.active = false;
+                    channel.run = 0;
+                    queue(channel.run_start, FRAME_EVENT_OFFSET, ch);
+                }
+            }
+            else
+                channel.run = 0;
+            continue;
+        }
+        if (!learning && level > channel.mean + ((k_on_ * deviation) >> 8))
+        {
+            if (channel.run++ == 0)
+                channel.run_start = number;
+            if (channel.run >= hold_)
+            {
+                channel.active = true;
+                channel.run = 0;
+                channel.onsets++;
+                queue(channel.run_start, FRAME_EVENT_ONSET, ch);
+            }
+            continue;
+        }
+        channel.run = 0;
+        if (learnt_ == 0)
+        {
+            channel.mean = level;
+            continue;
+        }
+        int64_t error = level - channel.mean;
+        channel.mean += error >> shift;
+        channel.deviation += ((error < 0 ? -error : error) - channel.deviation) >> shift;
+    }
+    if (learnt_ < UINT32_MAX)
+        learnt_++;
+    if (warmup_ > 0)
+        warmup_--;
+}
+
+void OnsetDetector::attach(uint8_t *frame)
+{
+    if (queued_ == 0)
+        return;
+    FrameHeader *header = (FrameHeader *)frame;
+    FrameEventBlock *block = (FrameEventBlock *)(frame + (1 + header->samples) * FRAME_BLOCK_SIZE);
+    if (!(header->flags & FRAME_FLAG_EVENTS))
+    {
+        memset(block, 0, sizeof(*block));
+        header->flags |= FRAME_FLAG_EVENTS;
+    }
+    int taken = 0;
+    while (block->count < FRAME_EVENTS_PER_BLOCK && taken < queued_)
+        block->events[block->count++] = queue_[taken++];
+    queued_ -= taken;
+    memmove(queue_, queue_ + taken, queued_ * sizeof(FrameEvent));
+}
+
+void OnsetDetector::process(uint8_t *frame)
+{
+    FrameHeader *header = (FrameHeader *)frame;
+    if (!enabled() || (header->flags & FRAME_FLAG_PACKED))
+        return;
+    if (header->sample_rate != rate_)
+        configure(header->sample_rate);
+    const uint8_t *block = frame + FRAME_BLOCK_SIZE;
+    for (int i = 0; i < header->samples; i++, block += FRAME_BLOCK_SIZE)
+    {
+        uint32_t number;
+        memcpy(&number, block + 4, sizeof(number));
+        int32_t envelope[ONSET_CHANNELS];
+        const uint8_t *code = block + FRAME_SAMPLE_DATA_OFFSET;
+        for (int ch = 0; ch < ONSET_CHANNELS; ch++, code += 3)
+            envelope[ch] = (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+        update(number, envelope);
+    }
+    attach(frame);
+}
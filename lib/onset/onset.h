@@ -0,0 +1,110 @@
+/*
+ * Muscle activation onset and offset detection on envelopes
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Runs over frames of envelopes, e.g. the output of an envelope stage of
+ * the pipeline, and learns per channel the resting level: the mean and the
+ * mean absolute deviation of the envelope, exponentially weighted with a
+ * time constant of about ONSET_BASELINE_MS and held while the channel is
+ * active or on its way there. A channel turns active once it stays above
+ * mean + k_on deviations for hold_ms and back once it stays below mean +
+ * k_off deviations as long. Each change is an event stamped with the first
+ * sample of the run that made it. All of it is integer arithmetic on the 24
+ * bit codes with Q8 levels, a shift per update instead of a division.
+ */
+
+#ifndef ONSET_H
+#define ONSET_H
+
+#include <stdint.h>
+#include "frameformat.h"
+
+#define ONSET_CHANNELS 8
+#define ONSET_QUEUE_SIZE 16     // events waiting for room in a frame
+#define ONSET_BASELINE_MS 2000
+#define ONSET_WARMUP_MS 500     // learning only, no events
+#define ONSET_MIN_DEVIATION 256 // Q8, one code: thresholds stay above a flat baseline
+#define ONSET_DEFAULT_K_ON 6.0f
+#define ONSET_DEFAULT_K_OFF 3.0f
+#define ONSET_DEFAULT_HOLD_MS 50
+
+class OnsetDetector
+{
+public:
+    OnsetDetector();
+    // Channels in channel_mask, slot 0 is bit 0; k_off below k_on gives the hysteresis
+    bool begin(uint8_t channel_mask, float k_on, float k_off, uint32_t hold_ms);
+    void end();
+    bool enabled() const { return channel_mask_ != 0; }
+    // Learns the baseline again, e.g. when the stream restarts
+    void reset();
+
+    /**
+     * Feeds the samples of an unpacked frame at its sample_rate and adds
+     * the events found so far to its event block, as many as there is room
+     * for; the rest wait for the next frame.
+     */
+    void process(uint8_t *frame);
+
+    uint8_t channelMask() const { return channel_mask_; }
+    float kOn() const { return k_on_ / 256.0f; }
+    float kOff() const { return k_off_ / 256.0f; }
+    uint32_t holdMs() const { return hold_ms_; }
+    uint32_t rate() const { return rate_; }
+    bool active(int channel) const { return channels_[channel].active; }
+    bool learning() const { return warmup_ > 0; }
+    // In codes
+    float baseline(int channel) const { return channels_[channel].mean / 256.0f; }
+    float deviation(int channel) const { return channels_[channel].deviation / 256.0f; }
+    uint32_t onsets(int channel) const { return channels_[channel].onsets; }
+    uint32_t dropped() const { return dropped_; }
+
+private:
+    struct Channel
+    {
+        int64_t mean;      // Q8
+        int64_t deviation; // Q8
+        bool active;
+        uint16_t run;        // samples in a row past the threshold that would change the state
+        uint32_t run_start;  // sample number of the first of them
+        uint32_t onsets;
+    };
+
+    void configure(uint32_t rate);
+    void update(uint32_t number, const int32_t *envelope);
+    void queue(uint32_t number, uint8_t source, uint8_t channel);
+    void attach(uint8_t *frame);
+
+    uint8_t channel_mask_;
+    int32_t k_on_; // Q8
+    int32_t k_off_;
+    uint32_t hold_ms_;
+    uint32_t rate_; // of the envelopes the levels were learnt at, 0 before the first frame
+    uint16_t hold_;
+    uint8_t shift_;       // baseline time constant as a power of two samples
+    uint32_t warmup_;     // samples left before events
+    uint32_t learnt_;     // samples the baseline has taken, for the faster start
+    Channel channels_[ONSET_CHANNELS];
+    FrameEvent queue_[ONSET_QUEUE_SIZE];
+    uint8_t queued_;
+    uint32_t dropped_;
+};
+
+#endif // ONSET_H
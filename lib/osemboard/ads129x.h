@@ -91,6 +91,27 @@ namespace ADS129x
         WCT2 = 0x19
     };
 
+    // The ADS1292R map is shorter: two channels from 0x04 and no CONFIG3
+    enum ADS1292R_reg
+    {
+        ADS1292R_CONFIG2 = 0x02,
+        ADS1292R_CH1SET = 0x04,
+        ADS1292R_LOFF_STAT = 0x08,
+        ADS1292R_GPIO = 0x0B
+    };
+
+    enum ADS1292R_CONFIG2_bits
+    {
+        ADS1292R_PDB_LOFF_COMP = 0x40,
+        ADS1292R_PDB_REFBUF = 0x20,
+        ADS1292R_VREF_4V = 0x10,
+        ADS1292R_CLK_EN = 0x08,
+        ADS1292R_INT_TEST = 0x02,
+        ADS1292R_TEST_FREQ = 0x01,
+
+        ADS1292R_CONFIG2_const = 0x80
+    };
+
     enum ID_bits
     {
         DEV_ID7 = 0x80,
@@ -125,14 +146,11 @@ namespace ADS129x
         DR1 = 0x02,
         DR0 = 0x01,
 
-        // correct for ADS1298/1294; incorrect for ADS1299
-        // TODO: Fix for ADS1299
-
         // ADS1298
-        // CONFIG1_const = 0x00,
+        ADS1298_CONFIG1_const = 0x00,
 
-        // ADS1299
-        CONFIG1_const = 0xE0,
+        // ADS1299, bit 7 and bits 4:3 = 10 are reserved
+        CONFIG1_const = 0x90,
 
         // ADS1298
         ADS1298_HIGH_RES_32k_SPS = HR,
@@ -44,6 +44,8 @@
 
 #define SPI_CLK 20000000 // SCLK
 
+#define TASK_CORES 1 // ESP32-C3: the steps share its one core as tasks
+
 #elif ESP32_S3
 
 #define PIN_CS 18 // active low
@@ -58,8 +60,20 @@
 #define PIXEL_BRIGHTNESS 7
 #define TRIGGER_PIN 0          // This pin will be checked for to go in OTA mode
 
-#define spiClk 8000000 //2Mhz  // 1.5Mhz to 2.4Mhz according to ADS1299 datasheet page 12
+#define SPI_CLK 8000000 //2Mhz  // 1.5Mhz to 2.4Mhz according to ADS1299 datasheet page 12
+
+#define TASK_CORES 2
 
 #endif
 
+// Every step is a task, also on one core, so a command waiting for the
+// chip or the SPI bus does not hold up framing and sending
+#define TASK_THREADED 1
+
+// Used when TASK_CORES > 1: the WiFi stack runs on core 0, setup() and with
+// it the DRDY interrupt on core 1
+#define ACQUISITION_CORE 1
+#define NETWORK_CORE 0
+#define CONTROL_CORE 1 // commands, below acquisition in priority
+
 #endif // OSEMBOARD_H
\ No newline at end of file
@@ -0,0 +1,70 @@
+/*
+ * ISR-safe runtime performance counters and timing histograms
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include "perfstats.h"
+
+PerfStats perfStats;
+
+void perfStatsBegin()
+{
+    memset((void *)&perfStats, 0, sizeof(perfStats));
+    perfStats.cycles_per_us = ESP.getCpuFreqMHz();
+    if (perfStats.cycles_per_us == 0)
+        perfStats.cycles_per_us = 1;
+}
+
+/**
+ * Clears counters and histograms. The DRDY estimator and the cycle scale
+ * behind it are left alone: the ISR owns them and divides by
+ * cycles_per_us, so a reset while streaming must not zero it. A count
+ * the ISR adds during the reset may survive it.
+ */
+void perfStatsReset()
+{
+    memset((void *)&perfStats, 0, offsetof(PerfStats, cycles_per_us));
+}
+
+static void histogramToJson(JsonObject object, const PerfHistogram &histogram)
+{
+    object["count"] = histogram.count;
+    object["max"] = histogram.max;
+    JsonArray buckets = object["buckets"].to<JsonArray>();
+    for (int i = 0; i < PERF_HISTOGRAM_BUCKETS; i++)
+        buckets.add(histogram.buckets[i]);
+}
+
+void perfStatsToJson(JsonDocument &doc)
+{
+    histogramToJson(doc["drdy_latency_us"].to<JsonObject>(), perfStats.drdy_latency);
+    histogramToJson(doc["isr_duration_us"].to<JsonObject>(), perfStats.isr_duration);
+    histogramToJson(doc["drdy_jitter_us"].to<JsonObject>(), perfStats.drdy_jitter);
+    histogramToJson(doc["send_duration_us"].to<JsonObject>(), perfStats.send_duration);
+    histogramToJson(doc["command_latency_us"].to<JsonObject>(), perfStats.command_latency);
+    doc["drdy_period_us"] = (float)(perfStats.period_q4 >> 4) / perfStats.cycles_per_us;
+    doc["ring_high_water"] = perfStats.ring_high_water;
+    doc["frames_sent"] = perfStats.frames_sent;
+    doc["frames_failed"] = perfStats.frames_failed;
+    doc["samples_dropped"] = perfStats.samples_dropped;
+    doc["read_errors"] = perfStats.read_errors;
+    doc["commands_busy"] = perfStats.commands_busy;
+    doc["heap_free"] = ESP.getFreeHeap();
+    doc["heap_min_free"] = ESP.getMinFreeHeap();
+}
@@ -0,0 +1,138 @@
+/*
+ * ISR-safe runtime performance counters and timing histograms
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PERFSTATS_H
+#define PERFSTATS_H
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+
+#define PERF_HISTOGRAM_BUCKETS 16
+
+/*
+ * Log2 histogram in microseconds. Bucket k counts values of bit length k,
+ * so bucket 0 is 0 us, bucket 1 is 1 us, bucket 2 is 2-3 us and so on; the
+ * last bucket also takes everything above its range. Every histogram and
+ * counter has a single writer (the DRDY ISR or one step), readers may see a
+ * sample half way through an update but never a corrupted word.
+ */
+struct PerfHistogram
+{
+    volatile uint32_t buckets[PERF_HISTOGRAM_BUCKETS];
+    volatile uint32_t count;
+    volatile uint32_t max;
+};
+
+struct PerfStats
+{
+    PerfHistogram drdy_latency; // ISR entry behind the tracked DRDY phase
+    PerfHistogram isr_duration; // whole DRDY_ISR including the SPI readout
+    PerfHistogram drdy_jitter;  // |inter-DRDY interval - mean interval|
+    PerfHistogram send_duration; // webSocket.sendBIN()
+    PerfHistogram command_latency; // command received to its reply queued
+    volatile uint32_t ring_high_water;
+    volatile uint32_t frames_sent;
+    volatile uint32_t frames_failed;
+    volatile uint32_t samples_dropped;
+    volatile uint32_t read_errors;   // conversions read without the status prefix
+    volatile uint32_t commands_busy; // refused with the command queue full
+
+    // DRDY timing estimator, owned by the ISR; cycle counter units. Kept
+    // last, perfStatsReset() clears everything in front of it
+    uint32_t cycles_per_us;
+    uint32_t last_entry;
+    uint32_t edge;
+    uint32_t period_q4;
+    bool have_entry;
+};
+
+extern PerfStats perfStats;
+
+void perfStatsBegin();
+void perfStatsReset();
+void perfStatsToJson(JsonDocument &doc);
+
+static inline void perfRecord(PerfHistogram &histogram, uint32_t value)
+{
+    uint32_t bucket = value ? 32 - __builtin_clz(value) : 0;
+    if (bucket >= PERF_HISTOGRAM_BUCKETS)
+        bucket = PERF_HISTOGRAM_BUCKETS - 1;
+    histogram.buckets[bucket] = histogram.buckets[bucket] + 1;
+    histogram.count = histogram.count + 1;
+    if (value > histogram.max)
+        histogram.max = value;
+}
+
+static inline void perfRecordCycles(PerfHistogram &histogram, uint32_t cycles)
+{
+    perfRecord(histogram, cycles / perfStats.cycles_per_us);
+}
+
+/*
+ * Called first thing in the DRDY ISR with the cycle counter. The chip gives
+ * no edge timestamp, so the edge is predicted one mean period after the
+ * previous one: an entry earlier than predicted re-anchors the phase, a late
+ * one is recorded and pulls the phase up by 1/16. The latency reported is
+ * therefore the excess over the best case entry time, which is what grows
+ * when WiFi or a masked section holds the interrupt off.
+ */
+static inline void perfDrdyEntry(uint32_t now)
+{
+    PerfStats &s = perfStats;
+    if (!s.have_entry)
+    {
+        s.have_entry = true;
+        s.edge = now;
+        s.last_entry = now;
+        return;
+    }
+    uint32_t interval = now - s.last_entry;
+    s.last_entry = now;
+    if (s.period_q4 == 0)
+        s.period_q4 = interval << 4;
+    uint32_t period = s.period_q4 >> 4;
+    if (interval > 2 * period)
+    {
+        // Streaming was paused or samples were lost, start over
+        s.edge = now;
+        return;
+    }
+    s.period_q4 += (int32_t)((interval << 4) - s.period_q4) >> 6;
+    perfRecordCycles(s.drdy_jitter, interval > period ? interval - period : period - interval);
+
+    uint32_t predicted = s.edge + period;
+    int32_t late = (int32_t)(now - predicted);
+    if (late < 0)
+    {
+        s.edge = now;
+        late = 0;
+    }
+    else
+        s.edge = predicted + (late >> 4);
+    perfRecordCycles(s.drdy_latency, late);
+}
+
+static inline void perfRingOccupancy(uint32_t occupancy)
+{
+    if (occupancy > perfStats.ring_high_water)
+        perfStats.ring_high_water = occupancy;
+}
+
+#endif // PERFSTATS_H
@@ -0,0 +1,435 @@
+/*
+ * Block processing between readout and framing
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+#include "frameformat.h"
+#include "pipeline.h"
+
+#define PIPELINE_COEFFICIENT_BITS 30
+#define PIPELINE_CODE_MAX 8388607 // outputs saturate to 24 bits
+#define PIPELINE_CODE_MIN (-8388608)
+
+Pipeline::Pipeline() : count_(0), rate_(0), decimation_(1), decimate_stages_(0), cycle_counter_(NULL)
+{
+    memset(stages_, 0, sizeof(stages_));
+    clearCycles();
+}
+
+void Pipeline::clear()
+{
+    count_ = 0;
+    rate_ = 0;
+    clearCycles();
+}
+
+void Pipeline::clearCycles()
+{
+    memset(cycles_, 0, sizeof(cycles_));
+    samples_in_ = 0;
+}
+
+bool Pipeline::append(uint8_t kind, float value, uint32_t sample_rate)
+{
+    if (count_ >= PIPELINE_MAX_STAGES || sample_rate == 0)
+        return false;
+    uint32_t rate = outputRate(sample_rate);
+    switch (kind)
+    {
+    case PIPELINE_HIGHPASS:
+    case PIPELINE_LOWPASS:
+    case PIPELINE_NOTCH:
+    case PIPELINE_ENVELOPE:
+        if (!(value > 0) || !fits(value, rate))
+            return false;
+        break;
+    case PIPELINE_DECIMATE:
+        if (value != (int)value || value < 2 || value > PIPELINE_MAX_DECIMATION)
+            return false;
+        break;
+    case PIPELINE_MONTAGE:
+        value = 0;
+        break;
+    default:
+        return false;
+    }
+    memset(&stages_[count_], 0, sizeof(Stage));
+    stages_[count_].kind = kind;
+    stages_[count_].value = value;
+    count_++;
+    // Designed for the next frame's rate
+    rate_ = 0;
+    return true;
+}
+
+/*
+ * In Q30 the poles of a biquad at w0 sit w0^2 from the coefficients of a
+ * double pole at DC; below rate / PIPELINE_MAX_CORNER_RATIO rounding them
+ * moves the corner by more than a percent.
+ */
+bool Pipeline::fits(float hz, uint32_t rate)
+{
+    return hz < rate / 2.0f && hz * PIPELINE_MAX_CORNER_RATIO >= rate;
+}
+
+int Pipeline::unfitStage(uint32_t sample_rate) const
+{
+    uint32_t rate = sample_rate;
+    for (int i = 0; i < count_; i++)
+    {
+        switch (stages_[i].kind)
+        {
+        case PIPELINE_HIGHPASS:
+        case PIPELINE_LOWPASS:
+        case PIPELINE_NOTCH:
+        case PIPELINE_ENVELOPE:
+            if (!fits(stages_[i].value, rate))
+                return i;
+            break;
+        case PIPELINE_DECIMATE:
+            rate /= (uint32_t)stages_[i].value;
+            break;
+        }
+    }
+    return -1;
+}
+
+bool Pipeline::hasMontage() const
+{
+    for (int i = 0; i < count_; i++)
+        if (stages_[i].kind == PIPELINE_MONTAGE)
+            return true;
+    return false;
+}
+
+uint32_t Pipeline::outputRate(uint32_t sample_rate) const
+{
+    for (int i = 0; i < count_; i++)
+        if (stages_[i].kind == PIPELINE_DECIMATE)
+            sample_rate /= (uint32_t)stages_[i].value;
+    return sample_rate;
+}
+
+void Pipeline::reset()
+{
+    for (int i = 0; i < count_; i++)
+    {
+        Stage &stage = stages_[i];
+        memset(stage.x1, 0, sizeof(stage.x1));
+        memset(stage.x2, 0, sizeof(stage.x2));
+        memset(stage.y1, 0, sizeof(stage.y1));
+        memset(stage.y2, 0, sizeof(stage.y2));
+        memset(stage.e1, 0, sizeof(stage.e1));
+        memset(stage.e2, 0, sizeof(stage.e2));
+        stage.primed = false;
+        stage.pending = false;
+    }
+}
+
+/**
+ * RBJ cookbook biquads, normalised by a0 and rounded to Q30. Designed in
+ * double precision: 1 - cos(w0) of a corner near DC would be lost in
+ * single precision.
+ */
+void Pipeline::design(Stage &stage, uint32_t rate)
+{
+    double w0 = 2 * M_PI * stage.value / rate;
+    double cosw = cos(w0);
+    double q = stage.kind == PIPELINE_NOTCH ? PIPELINE_NOTCH_Q : M_SQRT1_2;
+    double alpha = sin(w0) / (2 * q);
+    double b[3], a0 = 1 + alpha;
+    switch (stage.kind)
+    {
+    case PIPELINE_HIGHPASS:
+        b[0] = b[2] = (1 + cosw) / 2;
+        b[1] = -(1 + cosw);
+        break;
+    case PIPELINE_LOWPASS:
+    case PIPELINE_ENVELOPE:
+        b[0] = b[2] = (1 - cosw) / 2;
+        b[1] = 1 - cosw;
+        break;
+    default:
+        b[0] = b[2] = 1;
+        b[1] = -2 * cosw;
+        break;
+    }
+    const double one = (double)(1L << PIPELINE_COEFFICIENT_BITS);
+    stage.a[0] = (int32_t)llround(-2 * cosw / a0 * one);
+    stage.a[1] = (int32_t)llround((1 - alpha) / a0 * one);
+    // b1 is b0 times -2, 2 or a1 exactly, keeping the zeros at DC, Nyquist and on the circle
+    stage.b[0] = stage.b[2] = (int32_t)llround(b[0] / a0 * one);
+    stage.b[1] = stage.kind == PIPELINE_NOTCH ? stage.a[0] : b[1] < 0 ? -2 * stage.b[0] : 2 * stage.b[0];
+}
+
+void Pipeline::configure(uint32_t sample_rate)
+{
+    uint32_t rate = sample_rate;
+    decimation_ = 1;
+    decimate_stages_ = 0;
+    for (int i = 0; i < count_; i++)
+    {
+        Stage &stage = stages_[i];
+        switch (stage.kind)
+        {
+        case PIPELINE_HIGHPASS:
+        case PIPELINE_LOWPASS:
+        case PIPELINE_NOTCH:
+        case PIPELINE_ENVELOPE:
+            stage.active = rate > 0 && fits(stage.value, rate);
+            if (stage.active)
+                design(stage, rate);
+            break;
+        case PIPELINE_DECIMATE:
+            stage.active = true;
+            rate /= (uint32_t)stage.value;
+            decimation_ *= (uint32_t)stage.value;
+            decimate_stages_++;
+            break;
+        default:
+            stage.active = true;
+            break;
+        }
+    }
+    rate_ = sample_rate;
+    reset();
+}
+
+void Pipeline::runBiquad(Stage &stage, const Batch &in, Batch &out)
+{
+    const bool rectify = stage.kind == PIPELINE_ENVELOPE;
+    // From rest, as if the first sample had always been there: a high pass
+    // would otherwise ring for seconds on an electrode offset
+    if (!stage.primed && in.count > 0)
+    {
+        for (int ch = 0; ch < PIPELINE_CHANNELS; ch++)
+        {
+            int32_t first = rectify && in.data[ch][0] < 0 ? -in.data[ch][0] : in.data[ch][0];
+            stage.x1[ch] = stage.x2[ch] = first;
+            stage.y1[ch] = stage.y2[ch] = stage.kind == PIPELINE_HIGHPASS ? 0 : first;
+        }
+        stage.primed = true;
+    }
+    const int64_t b0 = stage.b[0], b1 = stage.b[1], b2 = stage.b[2], a1 = stage.a[0], a2 = stage.a[1];
+    const int64_t half = 1LL << (PIPELINE_COEFFICIENT_BITS - 1);
+    for (int ch = 0; ch < PIPELINE_CHANNELS; ch++)
+    {
+        int32_t x1 = stage.x1[ch], x2 = stage.x2[ch], y1 = stage.y1[ch], y2 = stage.y2[ch];
+        int64_t e1 = stage.e1[ch], e2 = stage.e2[ch];
+        const int32_t *x = in.data[ch];
+        int32_t *y = out.data[ch];
+        for (int i = 0; i < in.count; i++)
+        {
+            int32_t x0 = rectify && x[i] < 0 ? -x[i] : x[i];
+            // e1 and e2 are the parts of y1 and y2 rounding took off, in Q30
+            int64_t acc = b0 * x0 + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2 - ((a1 * e1 + a2 * e2) >> PIPELINE_COEFFICIENT_BITS);
+            int32_t y0 = (int32_t)((acc + half) >> PIPELINE_COEFFICIENT_BITS);
+            e2 = e1;
+            e1 = acc - ((int64_t)y0 << PIPELINE_COEFFICIENT_BITS);
+            x2 = x1;
+            x1 = x0;
+            y2 = y1;
+            y1 = y0;
+            y[i] = y0;
+        }
+        stage.x1[ch] = x1;
+        stage.x2[ch] = x2;
+        stage.y1[ch] = y1;
+        stage.y2[ch] = y2;
+        stage.e1[ch] = e1;
+        stage.e2[ch] = e2;
+    }
+    memcpy(out.number, in.number, in.count * sizeof(uint32_t));
+    memcpy(out.timestamp, in.timestamp, in.count * sizeof(uint32_t));
+    out.count = in.count;
+}
+
+void Pipeline::emit(Stage &stage, Batch &out)
+{
+    int k = out.count++;
+    out.number[k] = stage.group;
+    out.timestamp[k] = stage.timestamp;
+    int64_t half = stage.summed / 2;
+    for (int ch = 0; ch < PIPELINE_CHANNELS; ch++)
+    {
+        int64_t sum = stage.sum[ch];
+        out.data[ch][k] = (int32_t)((sum < 0 ? sum - half : sum + half) / stage.summed);
+    }
+    stage.pending = false;
+}
+
+/*
+ * Group g holds sample numbers g * N .. g * N + N - 1 and leaves when a
+ * later group starts, so a group cut short by a gap still leaves and every
+ * input makes at most one output. flush also lets a pending group leave
+ * once its last sample is in; one cut by the end of the frame waits.
+ */
+void Pipeline::runDecimate(Stage &stage, const Batch &in, Batch &out, bool flush)
+{
+    const uint32_t factor = (uint32_t)stage.value;
+    out.count = 0;
+    for (int i = 0; i < in.count; i++)
+    {
+        uint32_t group = in.number[i] / factor;
+        if (stage.pending && group != stage.group)
+            emit(stage, out);
+        if (!stage.pending)
+        {
+            stage.pending = true;
+            stage.group = group;
+            stage.summed = 0;
+            memset(stage.sum, 0, sizeof(stage.sum));
+        }
+        for (int ch = 0; ch < PIPELINE_CHANNELS; ch++)
+            stage.sum[ch] += in.data[ch][i];
+        stage.summed++;
+        stage.timestamp = in.timestamp[i];
+        stage.last = in.number[i];
+    }
+    if (flush && stage.pending && stage.last % factor == factor - 1)
+        emit(stage, out);
+}
+
+void Pipeline::runMontage(const Montage *montage, const Batch &in, Batch &out)
+{
+    for (int i = 0; i < in.count; i++)
+    {
+        int32_t sample[PIPELINE_CHANNELS];
+        for (int ch = 0; ch < PIPELINE_CHANNELS; ch++)
+            sample[ch] = in.data[ch][i];
+        if (montage)
+            montage->apply(sample, sample);
+        for (int ch = 0; ch < PIPELINE_CHANNELS; ch++)
+            out.data[ch][i] = sample[ch];
+    }
+    memcpy(out.number, in.number, in.count * sizeof(uint32_t));
+    memcpy(out.timestamp, in.timestamp, in.count * sizeof(uint32_t));
+    out.count = in.count;
+}
+
+Pipeline::Batch *Pipeline::runStages(Batch *in, const Montage *montage, bool flush, uint32_t &mark)
+{
+    for (int s = 0; s < count_; s++)
+    {
+        Stage &stage = stages_[s];
+        if (!stage.active)
+            continue;
+        Batch *out = in == &batch_[0] ? &batch_[1] : &batch_[0];
+        if (stage.kind == PIPELINE_DECIMATE)
+            runDecimate(stage, *in, *out, flush);
+        else if (stage.kind == PIPELINE_MONTAGE)
+            runMontage(montage, *in, *out);
+        else
+            runBiquad(stage, *in, *out);
+        in = out;
+        uint32_t after = now();
+        cycles_[1 + s] += after - mark;
+        mark = after;
+    }
+    return in;
+}
+
+void Pipeline::encode(uint8_t *blocks, const Batch &batch)
+{
+    for (int i = 0; i < batch.count; i++)
+    {
+        uint8_t *block = blocks + i * FRAME_BLOCK_SIZE;
+        memcpy(block, &batch.timestamp[i], sizeof(uint32_t));
+        memcpy(block + 4, &batch.number[i], sizeof(uint32_t));
+        uint8_t *code = block + FRAME_SAMPLE_DATA_OFFSET;
+        for (int ch = 0; ch < PIPELINE_CHANNELS; ch++, code += 3)
+        {
+            int32_t value = batch.data[ch][i];
+            value = value > PIPELINE_CODE_MAX ? PIPELINE_CODE_MAX : value < PIPELINE_CODE_MIN ? PIPELINE_CODE_MIN : value;
+            code[0] = (uint8_t)(value >> 16);
+            code[1] = (uint8_t)(value >> 8);
+            code[2] = (uint8_t)value;
+        }
+    }
+}
+
+/*
+ * Output k goes to block k. A batch is read in full before its outputs are
+ * written and no stage makes more outputs than the inputs it has taken,
+ * counting a group carried over from the last frame as one, so the writes
+ * stay behind the reads. Groups completed by the last samples leave in a
+ * flush pass, which may add one output per decimate stage; it only runs
+ * while those fit in the blocks the inputs took.
+ */
+void Pipeline::process(uint8_t *frame, const Montage *montage)
+{
+    FrameHeader *header = (FrameHeader *)frame;
+    if (count_ == 0 || (header->flags & FRAME_FLAG_PACKED))
+        return;
+    if (header->sample_rate != rate_)
+        configure(header->sample_rate);
+    uint8_t *blocks = frame + FRAME_BLOCK_SIZE;
+    const uint32_t samples = header->samples;
+    FrameEventBlock events;
+    const bool has_events = header->flags & FRAME_FLAG_EVENTS;
+    if (has_events)
+        memcpy(&events, blocks + samples * FRAME_BLOCK_SIZE, sizeof(events));
+
+    uint32_t written = 0;
+    uint32_t first_output = header->first_sample / decimation_;
+    for (uint32_t start = 0;; start += PIPELINE_BATCH)
+    {
+        const bool flush = start >= samples;
+        if (flush && (decimate_stages_ == 0 || written + decimate_stages_ > samples))
+            break;
+        uint32_t mark = now();
+        Batch *in = &batch_[0];
+        in->count = flush ? 0 : samples - start < PIPELINE_BATCH ? samples - start : PIPELINE_BATCH;
+        for (int i = 0; i < in->count; i++)
+        {
+            const uint8_t *block = blocks + (start + i) * FRAME_BLOCK_SIZE;
+            memcpy(&in->timestamp[i], block, sizeof(uint32_t));
+            memcpy(&in->number[i], block + 4, sizeof(uint32_t));
+            const uint8_t *code = block + FRAME_SAMPLE_DATA_OFFSET;
+            for (int ch = 0; ch < PIPELINE_CHANNELS; ch++, code += 3)
+                in->data[ch][i] = (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+        }
+        uint32_t after = now();
+        cycles_[0] += after - mark;
+        mark = after;
+
+        Batch *out = runStages(in, montage, flush, mark);
+        encode(blocks + written * FRAME_BLOCK_SIZE, *out);
+        if (written == 0 && out->count > 0)
+            first_output = out->number[0];
+        written += out->count;
+        cycles_[1 + count_] += now() - mark;
+        if (flush)
+            break;
+    }
+    samples_in_ += samples;
+
+    header->samples = written;
+    header->first_sample = first_output;
+    header->sample_rate = outputRate(header->sample_rate);
+    header->flags |= FRAME_FLAG_FILTERED;
+    if (has_events)
+    {
+        // Events point at output samples too
+        for (int i = 0; i < events.count && i < FRAME_EVENTS_PER_BLOCK; i++)
+            events.events[i].sample_number /= decimation_;
+        memcpy(blocks + written * FRAME_BLOCK_SIZE, &events, sizeof(events));
+    }
+}
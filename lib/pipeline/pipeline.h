@@ -0,0 +1,150 @@
+/*
+ * Block processing between readout and framing
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A pipeline is a short chain of stages run over a completed raw frame in
+ * place. Samples are converted from the 24 bit big endian blocks into
+ * channel planar batches of PIPELINE_BATCH samples, each stage reads one
+ * batch and writes the other, and the result is encoded back into blocks at
+ * the front of the frame. Nothing is allocated: the stages, their state and
+ * the two batches live in the object.
+ *
+ * Filters are biquads in direct form I with Q30 coefficients and 64 bit
+ * accumulators. What rounding takes off the last two outputs is kept and
+ * fed back through the feedback coefficients, so the poles see the outputs
+ * at full precision and do not amplify the rounding noise: a high pass a
+ * fraction of a hertz above DC or a narrow notch stays within about a code
+ * of the exact filter. Each starts from the steady state of its first
+ * sample. They are designed from the RBJ cookbook for the rate their stage
+ * sees. An envelope stage is a low pass over the absolute value of its
+ * input, the amplitude envelope of a high passed signal such as EMG. A decimate
+ * stage averages the samples whose numbers fall in one group of N and
+ * numbers its output by group, so sample numbers stay consecutive at the
+ * lower rate and a gap stays a gap. A montage stage applies the montage
+ * the caller passes in at that point of the chain.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include "montage.h"
+
+#define PIPELINE_MAX_STAGES 6
+#define PIPELINE_CHANNELS 8
+#define PIPELINE_BATCH 32
+#define PIPELINE_MAX_DECIMATION 16
+#define PIPELINE_MAX_CORNER_RATIO 20000 // filter rate over corner, decimate first for lower corners
+
+#define PIPELINE_HIGHPASS 1 // value: corner in Hz
+#define PIPELINE_LOWPASS 2  // value: corner in Hz
+#define PIPELINE_NOTCH 3    // value: centre in Hz, Q of PIPELINE_NOTCH_Q
+#define PIPELINE_DECIMATE 4 // value: factor, 2 to PIPELINE_MAX_DECIMATION
+#define PIPELINE_MONTAGE 5  // value unused
+#define PIPELINE_ENVELOPE 6 // value: low pass corner in Hz over the rectified input
+#define PIPELINE_NOTCH_Q 30.0f
+
+class Pipeline
+{
+public:
+    Pipeline();
+    void clear();
+    // Appends a stage; false if the chain is full, sample_rate is 0 or value does not suit the rate the stage would see
+    bool append(uint8_t kind, float value, uint32_t sample_rate);
+    // First stage whose value does not suit the rate it sees at sample_rate, -1 if all do
+    int unfitStage(uint32_t sample_rate) const;
+    int stages() const { return count_; }
+    uint8_t kind(int stage) const { return stages_[stage].kind; }
+    float value(int stage) const { return stages_[stage].value; }
+    bool hasMontage() const;
+    // Input rate over the product of the decimation factors
+    uint32_t outputRate(uint32_t sample_rate) const;
+
+    /**
+     * Runs the chain over a raw frame and rewrites it with the outputs:
+     * fewer samples after decimation, header sample_rate the output rate,
+     * FRAME_FLAG_FILTERED set and the event block moved behind them.
+     * montage may be NULL, montage stages then pass samples through.
+     */
+    void process(uint8_t *frame, const Montage *montage);
+    // Drops filter and decimation state, e.g. when the stream restarts
+    void reset();
+
+    // Optional clock for the per stage budget, e.g. the CPU cycle counter
+    void setCycleCounter(uint32_t (*counter)()) { cycle_counter_ = counter; }
+    // Slot 0 is convert, 1..stages() the stages, stages() + 1 encode
+    uint64_t cycles(int slot) const { return cycles_[slot]; }
+    uint64_t samplesIn() const { return samples_in_; }
+    void clearCycles();
+
+private:
+    struct Batch
+    {
+        uint16_t count;
+        uint32_t number[PIPELINE_BATCH];
+        uint32_t timestamp[PIPELINE_BATCH];
+        int32_t data[PIPELINE_CHANNELS][PIPELINE_BATCH];
+    };
+
+    struct Stage
+    {
+        uint8_t kind;
+        float value;
+        bool active; // false when value does not suit the rate, the stage passes samples through
+        // Biquad: Q30 b0, b1, b2, a1, a2 and per channel x[n-1], x[n-2], y[n-1], y[n-2] and their rounding errors
+        int32_t b[3];
+        int32_t a[2];
+        int32_t x1[PIPELINE_CHANNELS], x2[PIPELINE_CHANNELS];
+        int32_t y1[PIPELINE_CHANNELS], y2[PIPELINE_CHANNELS];
+        int64_t e1[PIPELINE_CHANNELS], e2[PIPELINE_CHANNELS];
+        bool primed; // state set from the first sample since reset()
+        // Decimate: the group being summed
+        bool pending;
+        uint32_t group;
+        uint32_t last; // number of the latest sample summed
+        uint32_t timestamp;
+        uint16_t summed;
+        int64_t sum[PIPELINE_CHANNELS];
+    };
+
+    void configure(uint32_t sample_rate);
+    static bool fits(float hz, uint32_t rate);
+    void design(Stage &stage, uint32_t rate);
+    void runBiquad(Stage &stage, const Batch &in, Batch &out);
+    void runDecimate(Stage &stage, const Batch &in, Batch &out, bool flush);
+    void emit(Stage &stage, Batch &out);
+    void runMontage(const Montage *montage, const Batch &in, Batch &out);
+    // Runs in through the active stages, charging each its cycles since mark
+    Batch *runStages(Batch *in, const Montage *montage, bool flush, uint32_t &mark);
+    void encode(uint8_t *blocks, const Batch &batch);
+    uint32_t now() const { return cycle_counter_ ? cycle_counter_() : 0; }
+
+    Stage stages_[PIPELINE_MAX_STAGES];
+    int count_;
+    uint32_t rate_; // input rate the stages were designed for, 0 before the first frame
+    uint32_t decimation_;  // product of the decimation factors
+    int decimate_stages_;
+    Batch batch_[2];
+    uint32_t (*cycle_counter_)();
+    uint64_t cycles_[PIPELINE_MAX_STAGES + 2];
+    uint64_t samples_in_;
+};
+
+#endif // PIPELINE_H
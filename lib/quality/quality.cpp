@@ -0,0 +1,150 @@
+/*
+ * Running signal-quality statistics per channel
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+#include "quality.h"
+
+#define QUALITY_RENORMALIZE 256 // samples between corrections of the phasor length
+
+QualityMeter::QualityMeter() : channels_(0), window_(0), line_hz_(50), ready_(false), windows_(0)
+{
+    memset(report_, 0, sizeof(report_));
+    report_samples_ = report_missed_ = report_last_sample_ = 0;
+    reset();
+}
+
+void QualityMeter::begin(uint32_t sample_rate, int channels, float line_hz)
+{
+    channels_ = channels > QUALITY_MAX_CHANNELS ? QUALITY_MAX_CHANNELS : channels;
+    window_ = (uint32_t)((uint64_t)sample_rate * QUALITY_WINDOW_MS / 1000);
+    line_hz_ = line_hz;
+    float omega = sample_rate ? 2 * (float)M_PI * line_hz / sample_rate : 0;
+    step_re_ = cosf(omega);
+    step_im_ = -sinf(omega);
+    memset(report_, 0, sizeof(report_));
+    report_samples_ = report_missed_ = report_last_sample_ = 0;
+    windows_ = 0;
+    ready_ = false;
+    reset();
+}
+
+void QualityMeter::reset()
+{
+    count_ = 0;
+    missed_ = 0;
+    span_ = 0;
+    phasor_re_ = 1;
+    phasor_im_ = 0;
+    memset(state_, 0, sizeof(state_));
+}
+
+// Over a gap the phasor turns on as if the missing samples had come
+void QualityMeter::advancePhasor(uint32_t steps)
+{
+    float angle = atan2f(step_im_, step_re_) * steps;
+    float re = cosf(angle), im = sinf(angle);
+    float next_re = phasor_re_ * re - phasor_im_ * im;
+    phasor_im_ = phasor_re_ * im + phasor_im_ * re;
+    phasor_re_ = next_re;
+}
+
+void QualityMeter::addSample(uint32_t sample_number, const int32_t *counts)
+{
+    if (!window_)
+        return;
+    if (count_ > 0 && sample_number != last_sample_ + 1)
+    {
+        uint32_t gap = sample_number - last_sample_ - 1;
+        if (gap >= window_)
+            reset(); // nothing of this window is left to compare with
+        else
+        {
+            missed_ += gap;
+            span_ += gap;
+            advancePhasor(gap);
+        }
+    }
+    last_sample_ = sample_number;
+    const bool first = count_ == 0;
+    const float weight = 1.0f / ++count_;
+    span_++;
+#pragma GCC unroll 8
+    for (int ch = 0; ch < channels_; ch++)
+    {
+        Channel &state = state_[ch];
+        int32_t code = counts[ch];
+        if (first)
+        {
+            state.minimum = state.maximum = state.first = code;
+        }
+        float delta = (float)code - state.mean;
+        state.mean += delta * weight;
+        state.m2 += delta * ((float)code - state.mean);
+        state.minimum = code < state.minimum ? code : state.minimum;
+        state.maximum = code > state.maximum ? code : state.maximum;
+        state.clipped += code >= QUALITY_CODE_MAX || code <= QUALITY_CODE_MIN;
+        float x = (float)(code - state.first);
+        state.line_re += x * phasor_re_;
+        state.line_im += x * phasor_im_;
+    }
+    float next_re = phasor_re_ * step_re_ - phasor_im_ * step_im_;
+    phasor_im_ = phasor_re_ * step_im_ + phasor_im_ * step_re_;
+    phasor_re_ = next_re;
+    if (count_ % QUALITY_RENORMALIZE == 0)
+    {
+        // One Newton step towards unit length
+        float scale = 1.5f - 0.5f * (phasor_re_ * phasor_re_ + phasor_im_ * phasor_im_);
+        phasor_re_ *= scale;
+        phasor_im_ *= scale;
+    }
+    if (span_ < window_)
+        return;
+    memcpy(report_, state_, sizeof(report_));
+    report_samples_ = count_;
+    report_missed_ = missed_;
+    report_last_sample_ = sample_number;
+    windows_++;
+    ready_ = true;
+    reset();
+}
+
+bool QualityMeter::poll()
+{
+    bool ready = ready_;
+    ready_ = false;
+    return ready;
+}
+
+float QualityMeter::rms(int channel) const
+{
+    if (channel < 0 || channel >= channels_ || report_samples_ == 0)
+        return 0;
+    return sqrtf(report_[channel].m2 / report_samples_);
+}
+
+// A sine of amplitude a sums to N a / 2 against the phasor, its RMS is a / sqrt(2)
+float QualityMeter::lineRms(int channel) const
+{
+    if (channel < 0 || channel >= channels_ || report_samples_ == 0)
+        return 0;
+    const Channel &state = report_[channel];
+    return 1.41421356f * sqrtf(state.line_re * state.line_re + state.line_im * state.line_im) / report_samples_;
+}
@@ -0,0 +1,106 @@
+/*
+ * Running signal-quality statistics per channel
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Each sample updates, per channel, a Welford mean and sum of squared
+ * deviations, the minimum and maximum, a count of codes at the 24 bit
+ * rails and the line frequency component: the code minus the first code of
+ * the window times a unit phasor at the line frequency, summed. The phasor
+ * is one complex multiply per sample shared by all channels. A window is
+ * QUALITY_WINDOW_MS long, a whole number of 50 and of 60 Hz cycles, so DC
+ * and the other harmonics of the line cancel from its sum; the line RMS is
+ * sqrt(2) |sum| / N. Welford keeps the variance of 24 bit codes accurate
+ * in single precision, where a sum of squares would not be.
+ */
+
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include <stdint.h>
+
+#define QUALITY_MAX_CHANNELS 8
+#define QUALITY_WINDOW_MS 1000
+#define QUALITY_CODE_MAX 8388607 // a code here or at QUALITY_CODE_MIN is clipped
+#define QUALITY_CODE_MIN (-8388608)
+
+class QualityMeter
+{
+public:
+    QualityMeter();
+    void begin(uint32_t sample_rate, int channels, float line_hz);
+    bool active() const { return window_ > 0; }
+    void end() { window_ = 0; }
+
+    // counts holds one ADC code per channel
+    void addSample(uint32_t sample_number, const int32_t *counts);
+    // True once per completed window
+    bool poll();
+
+    // Over the last completed window, in ADC codes
+    int channels() const { return channels_; }
+    float lineHz() const { return line_hz_; }
+    uint32_t windows() const { return windows_; }
+    uint32_t samples() const { return report_samples_; }
+    uint32_t missed() const { return report_missed_; }
+    uint32_t lastSample() const { return report_last_sample_; }
+    float mean(int channel) const { return report_[channel].mean; }
+    float rms(int channel) const; // about the mean
+    int32_t minimum(int channel) const { return report_[channel].minimum; }
+    int32_t maximum(int channel) const { return report_[channel].maximum; }
+    uint32_t clipped(int channel) const { return report_[channel].clipped; }
+    float lineRms(int channel) const;
+
+private:
+    struct Channel
+    {
+        float mean;
+        float m2; // sum of squared deviations from the mean
+        int32_t minimum;
+        int32_t maximum;
+        uint32_t clipped;
+        int32_t first; // code the line sums are taken against
+        float line_re;
+        float line_im;
+    };
+
+    void reset();
+    void advancePhasor(uint32_t steps);
+
+    int channels_;
+    uint32_t window_; // samples, 0 while off
+    float line_hz_;
+    float step_re_; // phasor rotation per sample
+    float step_im_;
+    float phasor_re_;
+    float phasor_im_;
+    uint32_t count_;
+    uint32_t missed_;
+    uint32_t span_; // sample numbers since the window began
+    uint32_t last_sample_;
+    bool ready_;
+    uint32_t windows_;
+    Channel state_[QUALITY_MAX_CHANNELS];
+    Channel report_[QUALITY_MAX_CHANNELS];
+    uint32_t report_samples_;
+    uint32_t report_missed_;
+    uint32_t report_last_sample_;
+};
+
+#endif // QUALITY_H
@@ -0,0 +1,198 @@
+/*
+ * Loopback self-test on the internal test signal
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+#include "selftest.h"
+
+SelfTest::SelfTest() : channels_(0), sample_rate_(0), target_(0), done_(false), half_period_(0)
+{
+    memset(expected_, 0, sizeof(expected_));
+    memset(state_, 0, sizeof(state_));
+    samples_ = missed_ = late_ = last_sample_ = last_timestamp_us_ = 0;
+    interval_sum_us_ = 0;
+    intervals_ = max_deviation_us_ = 0;
+}
+
+void SelfTest::begin(uint32_t sample_rate, int channels, const float *expected_counts, float period_s, uint32_t samples)
+{
+    channels_ = channels > SELFTEST_MAX_CHANNELS ? SELFTEST_MAX_CHANNELS : channels;
+    sample_rate_ = sample_rate;
+    half_period_ = sample_rate * period_s / 2;
+    memset(expected_, 0, sizeof(expected_));
+    memcpy(expected_, expected_counts, channels_ * sizeof(float));
+    memset(state_, 0, sizeof(state_));
+    samples_ = missed_ = late_ = last_sample_ = last_timestamp_us_ = 0;
+    interval_sum_us_ = 0;
+    intervals_ = max_deviation_us_ = 0;
+    done_ = false;
+    target_ = samples;
+}
+
+void SelfTest::addSample(uint32_t sample_number, uint32_t timestamp_us, const int32_t *counts)
+{
+    if (!active())
+        return;
+    if (samples_ > 0)
+    {
+        if (sample_number == last_sample_ + 1)
+        {
+            uint32_t interval = timestamp_us - last_timestamp_us_;
+            interval_sum_us_ += interval;
+            intervals_++;
+            uint32_t nominal = (uint32_t)lroundf(nominalPeriodUs());
+            uint32_t deviation = interval > nominal ? interval - nominal : nominal - interval;
+            if (deviation > max_deviation_us_)
+                max_deviation_us_ = deviation;
+        }
+        else
+        {
+            // The phase is lost across the gap, edges are timed afresh
+            missed_ += sample_number - last_sample_ - 1;
+            for (int ch = 0; ch < channels_; ch++)
+            {
+                state_[ch].level = 0;
+                state_[ch].candidate = 0;
+                state_[ch].timed = false;
+                state_[ch].suspects = 0;
+            }
+        }
+    }
+    last_sample_ = sample_number;
+    last_timestamp_us_ = timestamp_us;
+    for (int ch = 0; ch < channels_; ch++)
+        addChannel(state_[ch], expected_[ch], counts[ch], sample_number);
+    // A gap spends its sample numbers, the test still covers the same span
+    if (++samples_ + missed_ >= target_)
+        done_ = true;
+}
+
+/**
+ * Follows one channel through a sample. Off-level settled samples are held
+ * as suspects: the sinc filter spreads an edge over a sample or two, so
+ * they count as glitches only once the level comes back without an edge.
+ */
+void SelfTest::addChannel(Channel &state, float expected, int32_t code, uint32_t sample_number)
+{
+    if (expected <= 0)
+        return;
+    int8_t level = code > expected / 2 ? 1 : code < -expected / 2 ? -1 : 0;
+    state.since_edge++;
+    if (state.level == 0)
+    {
+        // Anywhere in a half period at first, or just after a gap
+        if (level != 0)
+        {
+            state.level = level;
+            state.since_edge = 0;
+        }
+        return;
+    }
+    if (level == -state.level)
+    {
+        if (state.candidate != level)
+        {
+            state.candidate = level;
+            state.candidate_sample = sample_number;
+            state.held = 0;
+        }
+        if (++state.held < SELFTEST_SETTLE)
+            return;
+        if (state.timed)
+        {
+            float error = fabsf((float)(state.candidate_sample - state.edge_sample) - half_period_);
+            if (error > state.edge_error)
+                state.edge_error = (uint32_t)ceilf(error);
+        }
+        state.edges++;
+        state.timed = true;
+        state.edge_sample = state.candidate_sample;
+        state.since_edge = state.held;
+        state.level = level;
+        state.candidate = 0;
+        state.suspects = 0;
+        return;
+    }
+    if (state.candidate != 0)
+    {
+        if (level == 0)
+            return;
+        // Back at the old level before the new one held
+        state.glitches += 1 + state.suspects;
+        state.suspects = 0;
+        state.candidate = 0;
+    }
+    if (state.since_edge < SELFTEST_SETTLE)
+        return;
+    if (fabsf(code - state.level * expected) > SELFTEST_GLITCH * expected)
+    {
+        state.suspects++;
+        return;
+    }
+    state.glitches += state.suspects;
+    state.suspects = 0;
+    state.sum[state.level > 0] += code;
+    state.count[state.level > 0]++;
+}
+
+void SelfTest::end()
+{
+    if (!done_ && samples_ + missed_ < target_)
+        late_ = target_ - samples_ - missed_;
+    done_ = true;
+}
+
+float SelfTest::amplitude(int channel) const
+{
+    const Channel &state = state_[channel];
+    if (!state.count[0] || !state.count[1])
+        return 0;
+    return ((float)state.sum[1] / state.count[1] - (float)state.sum[0] / state.count[0]) / 2;
+}
+
+float SelfTest::offset(int channel) const
+{
+    const Channel &state = state_[channel];
+    if (!state.count[0] || !state.count[1])
+        return 0;
+    return ((float)state.sum[1] / state.count[1] + (float)state.sum[0] / state.count[0]) / 2;
+}
+
+bool SelfTest::channelPassed(int channel) const
+{
+    const Channel &state = state_[channel];
+    float expected = expected_[channel];
+    return expected > 0 && fabsf(amplitude(channel) - expected) <= SELFTEST_AMPLITUDE_TOLERANCE * expected &&
+           state.edges >= 2 && state.edge_error <= SELFTEST_EDGE_TOLERANCE && state.glitches == 0;
+}
+
+// read_errors counts conversions DRDY_ISR read without the status prefix meanwhile
+bool SelfTest::passed(uint32_t read_errors) const
+{
+    if (late_ > 0 || missed_ > 0 || read_errors > 0 || intervals_ == 0)
+        return false;
+    float nominal = nominalPeriodUs();
+    if (fabsf(meanPeriodUs() - nominal) > SELFTEST_PERIOD_TOLERANCE * nominal)
+        return false;
+    for (int ch = 0; ch < channels_; ch++)
+        if (!channelPassed(ch))
+            return false;
+    return channels_ > 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Loopback self-test on the internal test signal
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * With every channel muxed to the internal square wave, each sample is
+ * known up to its phase: +a or -a, changing level every half period. The
+ * checker follows the level of each channel with a hysteresis of a/2 and
+ * takes an edge only once the new level has held for SELFTEST_SETTLE
+ * samples, so a corrupted code shows up as a glitch rather than a pair of
+ * edges. Samples SELFTEST_SETTLE or more after an edge are settled; they
+ * give the amplitude and offset, and one further than SELFTEST_GLITCH of
+ * a from its level is a glitch too. Gaps in the sample numbers and the
+ * spacing of the DRDY timestamps are checked across all channels.
+ */
+
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+#include <stdint.h>
+
+#define SELFTEST_MAX_CHANNELS 8
+#define SELFTEST_SETTLE 4             // samples after an edge before the level counts
+#define SELFTEST_GLITCH 0.25f         // of the amplitude, off the level of a settled sample
+#define SELFTEST_AMPLITUDE_TOLERANCE 0.1f
+#define SELFTEST_PERIOD_TOLERANCE 0.03f // of the mean DRDY period
+#define SELFTEST_EDGE_TOLERANCE 2     // samples, off half a period
+
+class SelfTest
+{
+public:
+    SelfTest();
+    // expected_counts[ch] is the test signal amplitude in ADC codes
+    void begin(uint32_t sample_rate, int channels, const float *expected_counts, float period_s, uint32_t samples);
+    bool active() const { return target_ > 0 && !done_; }
+
+    // timestamp_us is when DRDY_ISR read the sample, counts one code per channel
+    void addSample(uint32_t sample_number, uint32_t timestamp_us, const int32_t *counts);
+    // Ends early; samples that were due and never came count as late
+    void end();
+    bool passed(uint32_t read_errors) const;
+
+    int channels() const { return channels_; }
+    uint32_t samples() const { return samples_; }
+    uint32_t missed() const { return missed_; }
+    uint32_t late() const { return late_; }
+    float expectedHalfPeriod() const { return half_period_; }
+    float meanPeriodUs() const { return intervals_ ? (float)interval_sum_us_ / intervals_ : 0; }
+    float nominalPeriodUs() const { return sample_rate_ ? 1e6f / sample_rate_ : 0; }
+    uint32_t maxPeriodDeviationUs() const { return max_deviation_us_; }
+
+    // Per channel, amplitude and offset in ADC codes
+    float amplitude(int channel) const;
+    float offset(int channel) const;
+    float expected(int channel) const { return expected_[channel]; }
+    uint32_t edges(int channel) const { return state_[channel].edges; }
+    uint32_t glitches(int channel) const { return state_[channel].glitches; }
+    // Largest distance of an edge from where half a period after the last put it, in samples
+    uint32_t edgeError(int channel) const { return state_[channel].edge_error; }
+    bool channelPassed(int channel) const;
+
+private:
+    struct Channel
+    {
+        int8_t level;         // +1 or -1 once known, 0 before
+        int8_t candidate;     // level a possible edge goes to, 0 for none
+        uint8_t held;         // samples the candidate has held
+        bool timed;           // edge_sample is an edge seen without a gap since
+        uint32_t candidate_sample;
+        uint32_t since_edge;  // samples since the last edge
+        uint32_t edge_sample; // sample number of the last edge
+        uint32_t suspects;    // settled samples off their level, glitches unless an edge follows
+        uint32_t edges;
+        uint32_t glitches;
+        uint32_t edge_error;
+        int64_t sum[2]; // settled samples at -a and +a
+        uint32_t count[2];
+    };
+
+    void addChannel(Channel &state, float expected, int32_t code, uint32_t sample_number);
+
+    int channels_;
+    uint32_t sample_rate_;
+    uint32_t target_;
+    bool done_;
+    float half_period_; // in samples
+    float expected_[SELFTEST_MAX_CHANNELS];
+    Channel state_[SELFTEST_MAX_CHANNELS];
+    uint32_t samples_;
+    uint32_t missed_;
+    uint32_t late_;
+    uint32_t last_sample_;
+    uint32_t last_timestamp_us_;
+    uint64_t interval_sum_us_;
+    uint32_t intervals_;
+    uint32_t max_deviation_us_;
+};
+
+#endif // SELFTEST_H
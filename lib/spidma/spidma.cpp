@@ -28,6 +28,10 @@
 #if USE_ARDUINO_SPI_LIBRARY
 
 #include <SPI.h>
+#include "spidma.h"
+
+// Clocked out by spiRead(): DIN stays low, where no byte reads as a command
+static const uint8_t spi_zeros[SPI_READ_MAX] = {0};
 
 void spiBegin(uint8_t csPin)
 {
@@ -56,6 +60,16 @@ uint8_t spiRec(uint8_t *buf, size_t len)
     return 0;
 }
 
+/**
+ * SPI receive up to SPI_READ_MAX bytes in one transfer, without clearing
+ * buf first. DRDY_ISR reads with it, so it goes through the HAL call that
+ * skips the bus mutex; the caller has claimed the bus with adcBusClaim().
+ */
+void IRAM_ATTR spiRead(uint8_t *buf, size_t len)
+{
+    spiTransferBytesNL(SPI.bus(), spi_zeros, buf, len);
+}
+
 /** SPI send a byte */
 void spiSend(uint8_t b)
 {
@@ -32,4 +32,8 @@ void spiSend(uint8_t b);
 
 void spiSend(const uint8_t *buf, size_t len);
 
+#define SPI_READ_MAX 32
+
+void spiRead(uint8_t *buf, size_t len);
+
 #endif // SPI_DMA_H
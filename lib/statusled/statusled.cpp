@@ -0,0 +1,137 @@
+/*
+ * Status LED driven by the RMT peripheral
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <driver/rmt.h>
+#include "statusled.h"
+
+// 80 MHz APB over 2: one tick is 25 ns
+#define STATUS_LED_CHANNEL RMT_CHANNEL_0
+#define STATUS_LED_CLK_DIV 2
+// WS2812 bit timing in ticks: 0.4/0.85 us for a zero, 0.8/0.45 us for a one
+#define STATUS_LED_T0H 16
+#define STATUS_LED_T0L 34
+#define STATUS_LED_T1H 32
+#define STATUS_LED_T1L 18
+// Low for 2 x 25 us after the last bit latches the colour
+#define STATUS_LED_RESET 1000
+#define STATUS_LED_ITEMS 25
+
+// Red, green and blue per state, each 0 or 1 times the brightness
+static const uint8_t state_rgb[STATUS_LED_STATES][3] = {
+    {0, 0, 0}, // off
+    {1, 0, 0}, // boot
+    {1, 0, 1}, // WiFi manager
+    {0, 0, 1}, // WiFi reset
+    {0, 1, 0}, // starting
+    {1, 0, 0}, // failed
+    {0, 1, 1}, // connected
+    {1, 1, 0}, // waiting
+    {0, 1, 0}, // streaming
+};
+
+StatusLed::StatusLed()
+    : ready_(false), brightness_(0), lock_(portMUX_INITIALIZER_UNLOCKED), head_(0), count_(0),
+      last_posted_(STATUS_LED_OFF), shown_(STATUS_LED_OFF), shown_ms_(0), posted_(0), coalesced_(0), transmitted_(0)
+{
+}
+
+bool StatusLed::begin(uint8_t pin, uint8_t brightness)
+{
+    rmt_config_t config = RMT_DEFAULT_CONFIG_TX((gpio_num_t)pin, STATUS_LED_CHANNEL);
+    config.clk_div = STATUS_LED_CLK_DIV;
+    if (rmt_config(&config) != ESP_OK || rmt_driver_install(STATUS_LED_CHANNEL, 0, 0) != ESP_OK)
+        return false;
+    brightness_ = brightness;
+    ready_ = true;
+    transmit(STATUS_LED_OFF);
+    return true;
+}
+
+void StatusLed::post(StatusLedState state)
+{
+    portENTER_CRITICAL(&lock_);
+    posted_++;
+    if (state == last_posted_)
+        coalesced_++;
+    else if (count_ == STATUS_LED_QUEUE_SIZE)
+    {
+        // The newest entry would only show for the hold time, take its place
+        queue_[(head_ + count_ - 1) % STATUS_LED_QUEUE_SIZE] = state;
+        coalesced_++;
+    }
+    else
+        queue_[(head_ + count_++) % STATUS_LED_QUEUE_SIZE] = state;
+    last_posted_ = state;
+    portEXIT_CRITICAL(&lock_);
+}
+
+void StatusLed::service()
+{
+    if (!ready_ || count_ == 0 || millis() - shown_ms_ < STATUS_LED_HOLD_MS)
+        return;
+    // Still sending the last one: try again on the next pass instead of waiting
+    if (rmt_wait_tx_done(STATUS_LED_CHANNEL, 0) != ESP_OK)
+        return;
+    portENTER_CRITICAL(&lock_);
+    StatusLedState state = queue_[head_];
+    head_ = (head_ + 1) % STATUS_LED_QUEUE_SIZE;
+    count_--;
+    portEXIT_CRITICAL(&lock_);
+    transmit(state);
+}
+
+void StatusLed::flush()
+{
+    if (!ready_)
+        return;
+    portENTER_CRITICAL(&lock_);
+    StatusLedState state = last_posted_;
+    count_ = 0;
+    portEXIT_CRITICAL(&lock_);
+    rmt_wait_tx_done(STATUS_LED_CHANNEL, portMAX_DELAY);
+    transmit(state);
+    rmt_wait_tx_done(STATUS_LED_CHANNEL, portMAX_DELAY);
+}
+
+// Encodes the colour, green first, and leaves the RMT to send it. The items
+// fit one RMT memory block, so the driver has copied them when it returns.
+void StatusLed::transmit(StatusLedState state)
+{
+    const uint8_t *rgb = state_rgb[state];
+    uint32_t grb = ((uint32_t)(rgb[1] * brightness_) << 16) | ((uint32_t)(rgb[0] * brightness_) << 8) | (rgb[2] * brightness_);
+    rmt_item32_t items[STATUS_LED_ITEMS];
+    for (int bit = 0; bit < 24; bit++)
+    {
+        bool one = grb & (1UL << (23 - bit));
+        items[bit].level0 = 1;
+        items[bit].duration0 = one ? STATUS_LED_T1H : STATUS_LED_T0H;
+        items[bit].level1 = 0;
+        items[bit].duration1 = one ? STATUS_LED_T1L : STATUS_LED_T0L;
+    }
+    items[24].level0 = 0;
+    items[24].duration0 = STATUS_LED_RESET;
+    items[24].level1 = 0;
+    items[24].duration1 = STATUS_LED_RESET;
+    rmt_write_items(STATUS_LED_CHANNEL, items, STATUS_LED_ITEMS, false);
+    shown_ = state;
+    shown_ms_ = millis();
+    transmitted_++;
+}
@@ -0,0 +1,85 @@
+/*
+ * Status LED driven by the RMT peripheral
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The status LED is a single WS2812 pixel. Its 24 bits go out through the
+ * RMT peripheral, which times the pulses itself, so showing a colour takes
+ * a few microseconds to encode and never masks interrupts the way
+ * bit-banging the pixel does. Callers post a state; service() shows posted
+ * states in order, each for at least STATUS_LED_HOLD_MS so a short one is
+ * seen. A state equal to the last one posted is dropped, and one posted to
+ * a full queue replaces the newest entry, so a burst shrinks to its last
+ * state instead of backing up.
+ */
+
+#ifndef STATUSLED_H
+#define STATUSLED_H
+
+#include <stdint.h>
+#include "Arduino.h"
+
+#define STATUS_LED_QUEUE_SIZE 4
+#define STATUS_LED_HOLD_MS 100
+
+enum StatusLedState : uint8_t
+{
+    STATUS_LED_OFF,
+    STATUS_LED_BOOT,          // red
+    STATUS_LED_WIFI_MANAGER,  // magenta, the trigger was held at boot
+    STATUS_LED_WIFI_RESET,    // blue, WiFi settings cleared
+    STATUS_LED_STARTING,      // green
+    STATUS_LED_FAILED,        // red, about to restart
+    STATUS_LED_CONNECTED,     // cyan, a client is connected or the access point is up
+    STATUS_LED_WAITING,       // yellow, ready for a client
+    STATUS_LED_STREAMING,     // green, RDATAC
+    STATUS_LED_STATES
+};
+
+class StatusLed
+{
+public:
+    StatusLed();
+    // Claims an RMT channel for the pixel on pin, brightness out of 255
+    bool begin(uint8_t pin, uint8_t brightness);
+    // From task context, never from an ISR; does not touch the pixel
+    void post(StatusLedState state);
+    // Hands the next due state to the RMT if it is idle; call from a step that may take a few microseconds
+    void service();
+    // Shows the last posted state now and waits for it to go out, e.g. before a restart
+    void flush();
+    StatusLedState shown() const { return shown_; }
+    uint32_t posted() const { return posted_; }
+    uint32_t coalesced() const { return coalesced_; }
+    uint32_t transmitted() const { return transmitted_; }
+
+private:
+    void transmit(StatusLedState state);
+
+    bool ready_;
+    uint8_t brightness_;
+    portMUX_TYPE lock_;
+    StatusLedState queue_[STATUS_LED_QUEUE_SIZE];
+    uint8_t head_, count_;
+    StatusLedState last_posted_, shown_;
+    uint32_t shown_ms_;
+    uint32_t posted_, coalesced_, transmitted_;
+};
+
+#endif // STATUSLED_H
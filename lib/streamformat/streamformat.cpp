@@ -0,0 +1,293 @@
+/*
+ * Stream formats chosen by link congestion
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "streamformat.h"
+#include <string.h>
+#include "frameformat.h"
+
+#define STREAM_CHANNELS 8
+#define STREAM_MAX_DECIMATION 4
+#define STREAM_PREFETCH 3 // records whose output can overlap blocks not read yet
+
+const StreamLevel stream_levels[STREAM_LEVELS] = {
+    {0, 1},
+    {FRAME_ENCODING_INT24, 1},
+    {FRAME_ENCODING_BFP16, 1},
+    {FRAME_ENCODING_BFP16, 2},
+    {FRAME_ENCODING_BFP16, 4},
+};
+
+static inline int32_t code24(const uint8_t *code)
+{
+    return (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+}
+
+static inline int channelCount(uint8_t channel_mask)
+{
+    return __builtin_popcount(channel_mask);
+}
+
+// Mean of count conversions from first on, per channel in channel_mask
+static inline void recordValues(const uint8_t *blocks, const uint8_t (*early)[STREAM_CHANNELS * 3], uint32_t prefetched,
+                                uint32_t first, uint32_t count, uint8_t channel_mask, int32_t *value)
+{
+    int32_t sum[STREAM_CHANNELS] = {0};
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        const uint8_t *data = i < prefetched ? early[i] : blocks + i * FRAME_BLOCK_SIZE + FRAME_SAMPLE_DATA_OFFSET;
+        for (int ch = 0; ch < STREAM_CHANNELS; ch++)
+            if (channel_mask & (1 << ch))
+                sum[ch] += code24(data + 3 * ch);
+    }
+    for (int ch = 0; ch < STREAM_CHANNELS; ch++)
+        value[ch] = sum[ch] / (int32_t)count;
+}
+
+// Smallest shift that rounds every value in [low, high] into 16 bits
+static inline uint8_t bfpShift(int32_t low, int32_t high)
+{
+    uint8_t shift = 0;
+    while (((high + ((1 << shift) >> 1)) >> shift) > INT16_MAX || ((low + ((1 << shift) >> 1)) >> shift) < INT16_MIN)
+        shift++;
+    return shift;
+}
+
+float streamBytesPerSample(uint8_t level, int channels)
+{
+    if (level == 0 || level >= STREAM_LEVELS)
+        return FRAME_BLOCK_SIZE;
+    const StreamLevel &format = stream_levels[level];
+    int bytes = format.encoding == FRAME_ENCODING_INT24 ? 3 : 2;
+    return (float)(bytes * channels) / format.decimation;
+}
+
+/*
+ * Record r is written at 2 * FRAME_BLOCK_SIZE + r * record_bytes and reads
+ * conversions r * d .. r * d + d - 1, whose data start at block 1 + r * d.
+ * With record_bytes <= 24 the output stays behind the input from the fourth
+ * record on, so only the conversions of the first three are copied out first.
+ */
+size_t streamPack(uint8_t *frame, uint8_t level, uint8_t channel_mask)
+{
+    FrameHeader *header = (FrameHeader *)frame;
+    if (level == 0 || level >= STREAM_LEVELS || (header->flags & FRAME_FLAG_PACKED) || header->samples == 0 ||
+        channel_mask == 0)
+        return frameLength(header);
+
+    const StreamLevel &format = stream_levels[level];
+    const int channels = channelCount(channel_mask);
+    const int code_bytes = format.encoding == FRAME_ENCODING_INT24 ? 3 : 2;
+    const uint32_t decimation = format.decimation;
+    const uint32_t conversions = header->samples;
+    const uint32_t records = (conversions + decimation - 1) / decimation;
+    const uint32_t record_bytes = channels * code_bytes;
+    const uint32_t payload_blocks = (records * record_bytes + FRAME_BLOCK_SIZE - 1) / FRAME_BLOCK_SIZE;
+    if (1 + payload_blocks >= conversions)
+        return frameLength(header);
+
+    uint8_t *blocks = frame + FRAME_BLOCK_SIZE;
+    FrameEventBlock events;
+    const bool has_events = header->flags & FRAME_FLAG_EVENTS;
+    if (has_events)
+        memcpy(&events, blocks + conversions * FRAME_BLOCK_SIZE, sizeof(events));
+
+    FrameFormatBlock block;
+    memset(&block, 0, sizeof(block));
+    uint8_t shift[STREAM_CHANNELS] = {0};
+    if (format.encoding == FRAME_ENCODING_BFP16)
+    {
+        // A first pass over the untouched frame finds each channel's range
+        int32_t low[STREAM_CHANNELS] = {0}, high[STREAM_CHANNELS] = {0};
+        for (uint32_t first = 0; first < conversions; first += decimation)
+        {
+            int32_t value[STREAM_CHANNELS];
+            uint32_t count = conversions - first < decimation ? conversions - first : decimation;
+            recordValues(blocks, NULL, 0, first, count, channel_mask, value);
+            for (int ch = 0; ch < STREAM_CHANNELS; ch++)
+            {
+                low[ch] = value[ch] < low[ch] ? value[ch] : low[ch];
+                high[ch] = value[ch] > high[ch] ? value[ch] : high[ch];
+            }
+        }
+        for (int ch = 0; ch < STREAM_CHANNELS; ch++)
+        {
+            if (!(channel_mask & (1 << ch)))
+                continue;
+            shift[ch] = bfpShift(low[ch], high[ch]);
+            block.shifts[ch / 2] |= shift[ch] << (4 * (ch % 2));
+        }
+    }
+    block.encoding = format.encoding;
+    block.channel_mask = channel_mask;
+    block.decimation = decimation;
+    block.record_bytes = record_bytes;
+    block.conversions = conversions;
+    block.payload_blocks = payload_blocks;
+    memcpy(&block.first_timestamp, blocks, sizeof(uint32_t));
+    memcpy(&block.last_timestamp, blocks + (conversions - 1) * FRAME_BLOCK_SIZE, sizeof(uint32_t));
+    block.level = level;
+
+    const uint32_t prefetched = conversions < STREAM_PREFETCH * decimation ? conversions : STREAM_PREFETCH * decimation;
+    uint8_t early[STREAM_PREFETCH * STREAM_MAX_DECIMATION][STREAM_CHANNELS * 3];
+    for (uint32_t i = 0; i < prefetched; i++)
+        memcpy(early[i], blocks + i * FRAME_BLOCK_SIZE + FRAME_SAMPLE_DATA_OFFSET, sizeof(early[i]));
+
+    memcpy(blocks, &block, sizeof(block));
+    uint8_t *out = blocks + FRAME_BLOCK_SIZE;
+    for (uint32_t r = 0; r < records; r++)
+    {
+        uint32_t first = r * decimation;
+        uint32_t count = conversions - first < decimation ? conversions - first : decimation;
+        int32_t values[STREAM_CHANNELS];
+        recordValues(blocks, early, prefetched, first, count, channel_mask, values);
+        for (int ch = 0; ch < STREAM_CHANNELS; ch++)
+        {
+            if (!(channel_mask & (1 << ch)))
+                continue;
+            int32_t value = values[ch];
+            if (format.encoding == FRAME_ENCODING_INT24)
+            {
+                *out++ = value >> 16;
+                *out++ = value >> 8;
+                *out++ = value;
+            }
+            else if (format.encoding == FRAME_ENCODING_BFP16)
+            {
+                int32_t mantissa = (value + ((1 << shift[ch]) >> 1)) >> shift[ch];
+                *out++ = mantissa >> 8;
+                *out++ = mantissa;
+            }
+            else
+            {
+                *out++ = value >> 16;
+                *out++ = value >> 8;
+            }
+        }
+    }
+    uint8_t *end = blocks + (1 + payload_blocks) * FRAME_BLOCK_SIZE;
+    memset(out, 0, end - out);
+    if (has_events)
+        memcpy(end, &events, sizeof(events));
+
+    header->samples = records;
+    header->flags |= FRAME_FLAG_PACKED;
+    return frameLength(header);
+}
+
+/*
+ * The inverse of streamPack() for a client: INT24 records as they are,
+ * INT16 ones shifted back up by 8 bits and BFP16 mantissas by the shift of
+ * their channel. Both loops have a fixed trip count per record.
+ */
+uint32_t streamDecode(const uint8_t *frame, int32_t *codes, uint32_t max_records)
+{
+    const FrameHeader *header = (const FrameHeader *)frame;
+    if (!(header->flags & FRAME_FLAG_PACKED))
+        return 0;
+    FrameFormatBlock format;
+    memcpy(&format, frame + FRAME_BLOCK_SIZE, sizeof(format));
+    const int code_bytes = format.encoding == FRAME_ENCODING_INT24 ? 3 : 2;
+    uint8_t shift[STREAM_CHANNELS] = {0};
+    for (int ch = 0; ch < STREAM_CHANNELS; ch++)
+        shift[ch] = format.encoding == FRAME_ENCODING_BFP16 ? frameChannelShift(&format, ch)
+                    : format.encoding == FRAME_ENCODING_INT16 ? 8
+                                                              : 0;
+    const uint32_t records = header->samples < max_records ? header->samples : max_records;
+    const uint8_t *in = frame + 2 * FRAME_BLOCK_SIZE;
+    for (uint32_t r = 0; r < records; r++)
+    {
+        int32_t *record = codes + r * STREAM_CHANNELS;
+        for (int ch = 0; ch < STREAM_CHANNELS; ch++)
+        {
+            if (!(format.channel_mask & (1 << ch)))
+            {
+                record[ch] = 0;
+                continue;
+            }
+            int32_t value = code_bytes == 3 ? code24(in) : (int16_t)((in[0] << 8) | in[1]);
+            record[ch] = value * (1 << shift[ch]);
+            in += code_bytes;
+        }
+    }
+    return records;
+}
+
+StreamAdapter::StreamAdapter()
+    : enabled_(false), level_(0), min_level_(0), max_level_(STREAM_LEVELS - 1), switches_(0), changed_ms_(0), calm_ms_(0),
+      up_hold_ms_(STREAM_UP_HOLD_MS), probing_(false)
+{
+}
+
+void StreamAdapter::begin(bool enabled, uint8_t max_level, uint8_t min_level)
+{
+    enabled_ = enabled;
+    max_level_ = max_level < STREAM_LEVELS ? max_level : STREAM_LEVELS - 1;
+    min_level_ = min_level < max_level_ ? min_level : max_level_;
+    level_ = min_level_;
+    switches_ = 0;
+    up_hold_ms_ = STREAM_UP_HOLD_MS;
+    probing_ = false;
+}
+
+void StreamAdapter::change(uint8_t level, uint32_t now_ms)
+{
+    level_ = level;
+    switches_++;
+    changed_ms_ = now_ms;
+    calm_ms_ = now_ms;
+}
+
+/**
+ * Pressure is a failed send, or at least two frames waiting behind a slow
+ * send or filling a quarter of the ring; a frame or two queued on a fast
+ * link does not count.
+ */
+uint8_t StreamAdapter::update(uint32_t now_ms, uint32_t waiting, uint32_t ring_size, bool failed, bool slow)
+{
+    if (!enabled_)
+        return level_;
+    bool pressure = failed || (waiting >= 2 && (slow || waiting * 4 >= ring_size));
+    if (pressure)
+    {
+        calm_ms_ = now_ms;
+        if (probing_)
+        {
+            // The level above did not hold, back off before trying it again
+            probing_ = false;
+            up_hold_ms_ = up_hold_ms_ * 2 < STREAM_UP_HOLD_MAX_MS ? up_hold_ms_ * 2 : STREAM_UP_HOLD_MAX_MS;
+            if (level_ < max_level_)
+                change(level_ + 1, now_ms);
+        }
+        else if (level_ < max_level_ && now_ms - changed_ms_ >= STREAM_DOWN_HOLD_MS)
+            change(level_ + 1, now_ms);
+        return level_;
+    }
+    if (probing_ && now_ms - changed_ms_ >= up_hold_ms_)
+    {
+        probing_ = false;
+        up_hold_ms_ = STREAM_UP_HOLD_MS;
+    }
+    if (level_ > min_level_ && now_ms - calm_ms_ >= up_hold_ms_)
+    {
+        change(level_ - 1, now_ms);
+        probing_ = true;
+    }
+    return level_;
+}
@@ -0,0 +1,110 @@
+/*
+ * Stream formats chosen by link congestion
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * When the link cannot keep up, the ring fills and the ISR starts dropping
+ * conversions. Instead, frames can leave in a cheaper representation: only
+ * the active channels, then 16 bit block floating point, then the mean of
+ * two or four conversions. streamPack() rewrites a framed slot in place
+ * into the level the adapter picked; level 0 leaves it raw. The header's
+ * FRAME_FLAG_PACKED and format block tell the client which representation
+ * each frame uses.
+ *
+ * Block floating point keeps 16 bits of each code but picks, per channel
+ * and frame, the smallest shift that fits the frame's largest record, so a
+ * quiet channel arrives exact and a loud one loses only the bits below its
+ * shift. The first pass over the frame finds the range, the second writes
+ * the rounded mantissas; streamDecode() undoes it on the client.
+ *
+ * The adapter steps down a level when the ring backs up or a send fails,
+ * waits for the ring to drain before stepping again, and after a calm
+ * period probes a level up. A probe that meets pressure again is undone at
+ * once and the calm period doubles, so a link that is steady just below a
+ * level does not flap.
+ */
+
+#ifndef STREAMFORMAT_H
+#define STREAMFORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STREAM_LEVELS 5
+#define STREAM_DOWN_HOLD_MS 500    // after stepping down, for the ring to drain
+#define STREAM_UP_HOLD_MS 2000     // without pressure before probing a level up
+#define STREAM_UP_HOLD_MAX_MS 32000
+
+struct StreamLevel
+{
+    uint8_t encoding;   // FRAME_ENCODING_*, 0 for raw blocks
+    uint8_t decimation; // conversions averaged into one record
+};
+
+extern const StreamLevel stream_levels[STREAM_LEVELS];
+
+/**
+ * Packs the raw frame in place into level, keeping the channels in
+ * channel_mask. A frame that would not get shorter stays raw. Returns the
+ * frame length.
+ */
+size_t streamPack(uint8_t *frame, uint8_t level, uint8_t channel_mask);
+
+/**
+ * Unpacks a packed frame into codes[r * 8 + k] for record r and channel
+ * slot k, zero for slots outside the channel mask. Returns the records
+ * decoded, at most max_records, or 0 for a raw frame.
+ */
+uint32_t streamDecode(const uint8_t *frame, int32_t *codes, uint32_t max_records);
+
+// Bytes per conversion the level costs with channels active, headers aside
+float streamBytesPerSample(uint8_t level, int channels);
+
+class StreamAdapter
+{
+public:
+    StreamAdapter();
+    // Starts at min_level and never goes below it; min_level == max_level pins the level
+    void begin(bool enabled, uint8_t max_level, uint8_t min_level = 0);
+
+    // After each send: frames waiting in a ring of ring_size, whether the
+    // send failed and whether it took longer than the frame took to fill
+    uint8_t update(uint32_t now_ms, uint32_t waiting, uint32_t ring_size, bool failed, bool slow);
+
+    bool enabled() const { return enabled_; }
+    uint8_t level() const { return level_; }
+    uint8_t minLevel() const { return min_level_; }
+    uint8_t maxLevel() const { return max_level_; }
+    uint32_t switches() const { return switches_; }
+
+private:
+    void change(uint8_t level, uint32_t now_ms);
+
+    bool enabled_;
+    volatile uint8_t level_;
+    uint8_t min_level_;
+    uint8_t max_level_;
+    uint32_t switches_;
+    uint32_t changed_ms_;
+    uint32_t calm_ms_; // since the last pressure
+    uint32_t up_hold_ms_;
+    bool probing_;
+};
+
+#endif // STREAMFORMAT_H
@@ -0,0 +1,223 @@
+/*
+ * Task partitioning across the cores of the ESP32
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "tasklayer.h"
+
+#if TASKLAYER_FREERTOS
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#elif TASKLAYER_POSIX
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+TaskLayer::TaskLayer() : count_(0), cores_(1), running_(false), mutex_(0)
+{
+}
+
+bool TaskLayer::add(const char *name, TaskStep step, int core, uint8_t priority, uint32_t stack_bytes)
+{
+    if (running_ || count_ >= TASKLAYER_MAX_TASKS)
+        return false;
+    Task &task = tasks_[count_++];
+    task.name = name;
+    task.step = step;
+    task.core = core;
+    task.priority = priority;
+    task.stack_bytes = stack_bytes;
+    task.steps = 0;
+    task.idle_steps = 0;
+    task.handle = 0;
+    task.done = false;
+    task.layer = this;
+    return true;
+}
+
+void TaskLayer::taskMain(void *arg)
+{
+    Task *task = (Task *)arg;
+    while (task->layer->running_)
+    {
+        task->steps++;
+        if (!task->step())
+        {
+            task->idle_steps++;
+            yieldTick();
+        }
+    }
+    task->done = true;
+#if TASKLAYER_FREERTOS
+    vTaskDelete(NULL);
+#endif
+}
+
+void *TaskLayer::threadMain(void *arg)
+{
+    taskMain(arg);
+    return 0;
+}
+
+/**
+ * Starts one task per step when cores > 1, or when threaded, all on one
+ * core where the scheduler preempts a step by priority; if any cannot be
+ * created, the layer stays on one core and run() steps them all instead.
+ */
+bool TaskLayer::begin(int cores, bool threaded)
+{
+    if (running_)
+        return false;
+    cores_ = cores > 1 ? cores : 1;
+    if (cores_ == 1 && !threaded)
+        return true;
+
+#if TASKLAYER_FREERTOS
+    mutex_ = xSemaphoreCreateMutex();
+    if (!mutex_)
+    {
+        cores_ = 1;
+        return false;
+    }
+    running_ = true;
+    for (int i = 0; i < count_; i++)
+    {
+        Task &task = tasks_[i];
+        TaskHandle_t handle = NULL;
+        if (xTaskCreatePinnedToCore(taskMain, task.name, task.stack_bytes, &task, task.priority, &handle,
+                                    task.core % cores_) != pdPASS)
+        {
+            end();
+            return false;
+        }
+        task.handle = handle;
+    }
+#elif TASKLAYER_POSIX
+    pthread_mutex_t *mutex = new pthread_mutex_t;
+    pthread_mutex_init(mutex, NULL);
+    mutex_ = mutex;
+    running_ = true;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < count_; i++)
+    {
+        Task &task = tasks_[i];
+        pthread_t *thread = new pthread_t;
+        if (pthread_create(thread, NULL, threadMain, &task) != 0)
+        {
+            delete thread;
+            end();
+            return false;
+        }
+        task.handle = thread;
+        // Pinning is best effort, a machine with fewer CPUs shares them
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(task.core % (cpus > 0 ? cpus : 1), &set);
+        pthread_setaffinity_np(*thread, sizeof(set), &set);
+    }
+#endif
+    return true;
+}
+
+// One pass over every step on one core; with tasks running, only sleeps
+void TaskLayer::run()
+{
+    if (running_)
+    {
+        yieldTick();
+        return;
+    }
+    for (int i = 0; i < count_; i++)
+    {
+        tasks_[i].steps++;
+        if (!tasks_[i].step())
+            tasks_[i].idle_steps++;
+    }
+}
+
+void TaskLayer::end()
+{
+    if (!running_ && !mutex_)
+        return;
+    running_ = false;
+#if TASKLAYER_FREERTOS
+    // Tasks delete themselves once they see running_ drop
+    for (int i = 0; i < count_; i++)
+    {
+        while (tasks_[i].handle && !tasks_[i].done)
+            vTaskDelay(1);
+        tasks_[i].handle = 0;
+        tasks_[i].done = false;
+    }
+    if (mutex_)
+        vSemaphoreDelete((SemaphoreHandle_t)mutex_);
+#elif TASKLAYER_POSIX
+    for (int i = 0; i < count_; i++)
+    {
+        pthread_t *thread = (pthread_t *)tasks_[i].handle;
+        if (!thread)
+            continue;
+        pthread_join(*thread, NULL);
+        delete thread;
+        tasks_[i].handle = 0;
+        tasks_[i].done = false;
+    }
+    if (mutex_)
+    {
+        pthread_mutex_destroy((pthread_mutex_t *)mutex_);
+        delete (pthread_mutex_t *)mutex_;
+    }
+#endif
+    mutex_ = 0;
+    cores_ = 1;
+}
+
+void TaskLayer::lock()
+{
+    if (!mutex_)
+        return;
+#if TASKLAYER_FREERTOS
+    xSemaphoreTake((SemaphoreHandle_t)mutex_, portMAX_DELAY);
+#elif TASKLAYER_POSIX
+    pthread_mutex_lock((pthread_mutex_t *)mutex_);
+#endif
+}
+
+void TaskLayer::unlock()
+{
+    if (!mutex_)
+        return;
+#if TASKLAYER_FREERTOS
+    xSemaphoreGive((SemaphoreHandle_t)mutex_);
+#elif TASKLAYER_POSIX
+    pthread_mutex_unlock((pthread_mutex_t *)mutex_);
+#endif
+}
+
+void TaskLayer::yieldTick()
+{
+#if TASKLAYER_FREERTOS
+    vTaskDelay(1);
+#elif TASKLAYER_POSIX
+    struct timespec tick = {0, 1000000};
+    nanosleep(&tick, NULL);
+#endif
+}
@@ -0,0 +1,124 @@
+/*
+ * Task partitioning across the cores of the ESP32
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The firmware's work is a set of steps, each a function that does one
+ * unit of work and returns whether there was any. With one core, run()
+ * calls every step in turn from loop(), exactly like a hand written loop.
+ * With more, or when asked to on one core, begin() gives every step its
+ * own task pinned to its core that calls it forever and sleeps a tick
+ * whenever it comes back idle; a step that waits then lets the others run.
+ *
+ * FreeRTOS tasks on the ESP32, POSIX threads with CPU affinity on the
+ * host, so the same partitioning can be measured on a Linux machine. The
+ * lock serialises state that steps on different tasks share; with the
+ * steps run from loop() it costs nothing. It is not recursive, and a step
+ * holds it only around that state, never while it waits.
+ */
+
+#ifndef TASKLAYER_H
+#define TASKLAYER_H
+
+#include <stdint.h>
+
+#define TASKLAYER_MAX_TASKS 4
+
+#ifdef OSEM_NATIVE
+#define TASKLAYER_POSIX 1
+#else
+#define TASKLAYER_FREERTOS 1
+#endif
+
+typedef bool (*TaskStep)(void);
+
+class TaskLayer
+{
+public:
+    TaskLayer();
+
+    // Register before begin(); core is ignored when running on one core
+    bool add(const char *name, TaskStep step, int core, uint8_t priority, uint32_t stack_bytes);
+    bool begin(int cores, bool threaded = false);
+    void run();
+    void end();
+
+    void lock();
+    void unlock();
+
+    int cores() const { return cores_; }
+    int tasks() const { return count_; }
+    const char *name(int task) const { return tasks_[task].name; }
+    int core(int task) const { return cores_ > 1 ? tasks_[task].core : 0; }
+    uint64_t steps(int task) const { return tasks_[task].steps; }
+    uint64_t idleSteps(int task) const { return tasks_[task].idle_steps; }
+
+private:
+    struct Task
+    {
+        const char *name;
+        TaskStep step;
+        int core;
+        uint8_t priority;
+        uint32_t stack_bytes;
+        volatile uint64_t steps;
+        volatile uint64_t idle_steps;
+        void *handle;
+        volatile bool done;
+        TaskLayer *layer;
+    };
+
+    static void taskMain(void *arg);
+    static void *threadMain(void *arg);
+    static void yieldTick();
+
+    Task tasks_[TASKLAYER_MAX_TASKS];
+    int count_;
+    int cores_;
+    volatile bool running_;
+    void *mutex_;
+};
+
+// Holds the layer's lock until the end of the scope
+class TaskLock
+{
+public:
+    explicit TaskLock(TaskLayer &layer) : layer_(layer) { layer_.lock(); }
+    ~TaskLock() { layer_.unlock(); }
+
+private:
+    TaskLock(const TaskLock &);
+    TaskLock &operator=(const TaskLock &);
+
+    TaskLayer &layer_;
+};
+
+// Flags that hand a buffer to a step on another core: everything written
+// to the buffer before release() is visible after acquire() sees the flag
+static inline void taskRelease(volatile bool &flag, bool value)
+{
+    __atomic_store_n(&flag, value, __ATOMIC_RELEASE);
+}
+
+static inline bool taskAcquire(const volatile bool &flag)
+{
+    return __atomic_load_n(&flag, __ATOMIC_ACQUIRE);
+}
+
+#endif // TASKLAYER_H
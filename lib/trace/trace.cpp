@@ -0,0 +1,55 @@
+/*
+ * ISR-safe binary trace ring
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "trace.h"
+
+TraceRecord trace_ring[TRACE_SIZE];
+volatile uint32_t trace_head = 0;
+volatile bool trace_enabled = false;
+
+void traceBegin()
+{
+    traceClear();
+}
+
+void traceClear()
+{
+    trace_enabled = false;
+    // Lap 255 matches no record of the first lap
+    for (int i = 0; i < TRACE_SIZE; i++)
+        trace_ring[i] = {0, 0xFF000000};
+    trace_head = 0;
+    trace_enabled = TRACE_ENABLED;
+}
+
+bool traceRead(uint32_t index, TraceRecord &out)
+{
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_SEQ_CST);
+    if (index >= head || head - index > TRACE_SIZE)
+        return false;
+    const TraceRecord &record = trace_ring[index % TRACE_SIZE];
+    out.word = __atomic_load_n(&record.word, __ATOMIC_ACQUIRE);
+    out.cycles = record.cycles;
+    if ((out.word >> 24) != ((index / TRACE_SIZE) & 0xFF))
+        return false;
+    // A writer that claimed the slot again may have changed cycles already
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&trace_head, __ATOMIC_SEQ_CST) - index <= TRACE_SIZE;
+}
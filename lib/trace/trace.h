@@ -0,0 +1,111 @@
+/*
+ * ISR-safe binary trace ring
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A fixed ring of TRACE_SIZE records, each the cycle counter, an event ID
+ * and a 16 bit argument in 8 bytes. Writers claim a slot with one atomic
+ * add and never wait, so the DRDY ISR, the steps and the bus code can trace
+ * at the same time; the oldest records are overwritten. A record's second
+ * word carries the lap of the ring it was written in and is stored last,
+ * so a reader can tell a finished record from one still being written, and
+ * one whose slot has been claimed again since from the head. Timestamps are CPU cycles since boot and wrap
+ * about every 27 s at 160 MHz; on two cores each core has its own counter.
+ *
+ * Build with TRACE_ENABLED 0 to compile every trace point out.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "Arduino.h"
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 2048 // records, a power of two; 16 KB
+#endif
+#define TRACE_RECORD_SIZE 8
+
+// Event IDs; a _BEGIN is always followed by its _END on the same context
+enum TraceId : uint8_t
+{
+    TRACE_NONE,
+    TRACE_DRDY,            // DRDY_ISR entry, arg: sample number
+    TRACE_READ_BEGIN,      // conversion readout over SPI
+    TRACE_READ_END,        // arg: 1 if the status word was valid
+    TRACE_FRAME_COMPLETE,  // DRDY_ISR filled a buffer, arg: ring index
+    TRACE_FRAME_BEGIN,     // acquisitionStep() framing, arg: ring index
+    TRACE_FRAME_END,
+    TRACE_SEND_BEGIN,      // frame handed to the WebSocket, arg: length
+    TRACE_SEND_END,        // arg: 1 if delivered
+    TRACE_COMMAND_RECEIVED, // queued by webSocketEvent(), arg: length
+    TRACE_COMMAND_BEGIN,   // executed by controlStep()
+    TRACE_COMMAND_END,
+    TRACE_BUS_WAIT_BEGIN,  // command transaction waiting for the readout
+    TRACE_BUS_WAIT_END,
+    TRACE_BUS_BEGIN,       // command transaction holding the bus
+    TRACE_BUS_END,
+    TRACE_IDS
+};
+
+struct TraceRecord
+{
+    uint32_t cycles;
+    uint32_t word; // arg in bits 0-15, ID in 16-23, lap in 24-31
+};
+
+extern TraceRecord trace_ring[TRACE_SIZE];
+extern volatile uint32_t trace_head; // records ever claimed
+extern volatile bool trace_enabled;
+
+void traceBegin();
+// Drops what was recorded and starts again
+void traceClear();
+
+/**
+ * Copies record index (counted since the last traceClear()) into out.
+ * Returns false if it has not been written completely yet or has already
+ * been overwritten.
+ */
+bool traceRead(uint32_t index, TraceRecord &out);
+
+static inline uint8_t traceId(const TraceRecord &record) { return (uint8_t)(record.word >> 16); }
+static inline uint16_t traceArg(const TraceRecord &record) { return (uint16_t)record.word; }
+
+static inline void IRAM_ATTR traceEvent(TraceId id, uint32_t arg)
+{
+#if TRACE_ENABLED
+    if (!trace_enabled)
+        return;
+    uint32_t cycles = ESP.getCycleCount();
+    uint32_t index = __atomic_fetch_add(&trace_head, 1, __ATOMIC_SEQ_CST);
+    TraceRecord &record = trace_ring[index % TRACE_SIZE];
+    record.cycles = cycles;
+    __atomic_store_n(&record.word, ((index / TRACE_SIZE) << 24) | ((uint32_t)id << 16) | (arg & 0xFFFF), __ATOMIC_RELEASE);
+#else
+    (void)id;
+    (void)arg;
+#endif
+}
+
+#endif // TRACE_H
@@ -0,0 +1,222 @@
+/*
+ * Host side converter from trace dumps to the Chrome trace format
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tracejson.h"
+
+#define TRACK_ISR 1
+#define TRACK_ACQUISITION 2
+#define TRACK_NETWORK 3
+#define TRACK_CONTROL 4
+
+enum Role
+{
+    INSTANT,
+    BEGIN,
+    END
+};
+
+struct TraceKind
+{
+    const char *name;
+    int track;
+    Role role;
+    const char *arg; // NULL if the argument means nothing
+};
+
+static const TraceKind kinds[TRACE_IDS] = {
+    {"none", 0, INSTANT, NULL},
+    {"drdy", TRACK_ISR, INSTANT, "sample"},
+    {"read", TRACK_ISR, BEGIN, NULL},
+    {"read", TRACK_ISR, END, "ok"},
+    {"frame complete", TRACK_ISR, INSTANT, "index"},
+    {"frame", TRACK_ACQUISITION, BEGIN, "index"},
+    {"frame", TRACK_ACQUISITION, END, NULL},
+    {"send", TRACK_NETWORK, BEGIN, "bytes"},
+    {"send", TRACK_NETWORK, END, "delivered"},
+    {"command received", TRACK_NETWORK, INSTANT, "bytes"},
+    {"command", TRACK_CONTROL, BEGIN, NULL},
+    {"command", TRACK_CONTROL, END, NULL},
+    {"bus wait", TRACK_CONTROL, BEGIN, NULL},
+    {"bus wait", TRACK_CONTROL, END, "waited_us"},
+    {"bus", TRACK_CONTROL, BEGIN, NULL},
+    {"bus", TRACK_CONTROL, END, NULL},
+};
+
+static const char *track_names[] = {"", "DRDY_ISR", "acquisition", "network", "control"};
+
+TraceDecoder::TraceDecoder()
+    : cycles_per_us_(0), have_next_(false), next_(0), last_cycles_(0), last_time_(0), lost_(0)
+{
+}
+
+const char *TraceDecoder::name(uint8_t id)
+{
+    return id < TRACE_IDS ? kinds[id].name : "unknown";
+}
+
+int TraceDecoder::track(uint8_t id)
+{
+    return id < TRACE_IDS ? kinds[id].track : 0;
+}
+
+// The number after "key": in a flat reply, -1 if there is none
+static int64_t replyNumber(const std::string &reply, const char *key)
+{
+    std::string pattern = std::string("\"") + key + "\":";
+    size_t at = reply.find(pattern);
+    if (at == std::string::npos)
+        return -1;
+    return strtoll(reply.c_str() + at + pattern.size(), NULL, 10);
+}
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+bool TraceDecoder::addReply(const std::string &reply)
+{
+    const std::string key = "\"records\":\"";
+    size_t at = reply.find(key);
+    int64_t first = replyNumber(reply, "first");
+    int64_t cycles_per_us = replyNumber(reply, "cycles_per_us");
+    if (at == std::string::npos || first < 0)
+        return false;
+    if (cycles_per_us > 0)
+        cycles_per_us_ = (uint32_t)cycles_per_us;
+    if (have_next_ && (uint32_t)first > next_)
+        lost_ += (uint32_t)first - next_;
+    at += key.size();
+    size_t end = reply.find('"', at);
+    if (end == std::string::npos)
+        return false;
+    uint32_t index = (uint32_t)first;
+    for (; at + 2 * TRACE_RECORD_SIZE <= end; at += 2 * TRACE_RECORD_SIZE, index++)
+    {
+        uint8_t bytes[TRACE_RECORD_SIZE];
+        for (int i = 0; i < TRACE_RECORD_SIZE; i++)
+        {
+            int high = hexDigit(reply[at + 2 * i]), low = hexDigit(reply[at + 2 * i + 1]);
+            if (high < 0 || low < 0)
+                return false;
+            bytes[i] = (uint8_t)(high << 4 | low);
+        }
+        // Little endian cycles, then arg, ID and lap
+        uint32_t cycles = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+        if (ids_.empty())
+            last_time_ = 0;
+        else
+            last_time_ += (int32_t)(cycles - last_cycles_);
+        last_cycles_ = cycles;
+        cycles_.push_back(last_time_);
+        args_.push_back((uint16_t)(bytes[4] | bytes[5] << 8));
+        ids_.push_back(bytes[6]);
+    }
+    have_next_ = true;
+    next_ = index;
+    return true;
+}
+
+std::vector<TraceSpan> TraceDecoder::spans() const
+{
+    std::vector<TraceSpan> spans;
+    double per_us = cycles_per_us_ ? cycles_per_us_ : 1;
+    // Open _BEGINs per track, innermost last
+    std::vector<size_t> open[TRACK_CONTROL + 1];
+    for (size_t i = 0; i < ids_.size(); i++)
+    {
+        uint8_t id = ids_[i];
+        if (id == TRACE_NONE || id >= TRACE_IDS)
+            continue;
+        const TraceKind &kind = kinds[id];
+        double at_us = cycles_[i] / per_us;
+        if (kind.role == INSTANT)
+        {
+            spans.push_back({id, at_us, 0, args_[i], 0});
+            continue;
+        }
+        std::vector<size_t> &stack = open[kind.track];
+        if (kind.role == BEGIN)
+        {
+            stack.push_back(i);
+            continue;
+        }
+        // An _END closes the innermost _BEGIN of its kind, those inside it lost their _END
+        for (size_t depth = stack.size(); depth-- > 0;)
+        {
+            size_t begin = stack[depth];
+            if (ids_[begin] != id - 1)
+                continue;
+            double start_us = cycles_[begin] / per_us;
+            spans.push_back({ids_[begin], start_us, at_us - start_us, args_[begin], args_[i]});
+            stack.resize(depth);
+            break;
+        }
+    }
+    std::stable_sort(spans.begin(), spans.end(),
+                     [](const TraceSpan &a, const TraceSpan &b) { return a.start_us < b.start_us; });
+    return spans;
+}
+
+std::string TraceDecoder::chromeJson() const
+{
+    std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    char event[256];
+    for (int track = TRACK_ISR; track <= TRACK_CONTROL; track++)
+    {
+        snprintf(event, sizeof(event), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                 track == TRACK_ISR ? "" : ",", track, track_names[track]);
+        json += event;
+    }
+    std::vector<TraceSpan> all = spans();
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        const TraceSpan &span = all[i];
+        const TraceKind &kind = kinds[span.id];
+        int n;
+        if (kind.role == INSTANT)
+            n = snprintf(event, sizeof(event), ",{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+                         kind.name, kind.track, span.start_us);
+        else
+            n = snprintf(event, sizeof(event), ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                         kind.name, kind.track, span.start_us, span.duration_us);
+        const char *begin_arg = kind.arg;
+        const char *end_arg = kind.role == BEGIN ? kinds[span.id + 1].arg : NULL;
+        if (begin_arg && end_arg)
+            n += snprintf(event + n, sizeof(event) - n, ",\"args\":{\"%s\":%u,\"%s\":%u}", begin_arg, span.arg, end_arg, span.end_arg);
+        else if (begin_arg)
+            n += snprintf(event + n, sizeof(event) - n, ",\"args\":{\"%s\":%u}", begin_arg, span.arg);
+        else if (end_arg)
+            n += snprintf(event + n, sizeof(event) - n, ",\"args\":{\"%s\":%u}", end_arg, span.end_arg);
+        snprintf(event + n, sizeof(event) - n, "}");
+        json += event;
+    }
+    json += "]}\n";
+    return json;
+}
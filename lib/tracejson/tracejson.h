@@ -0,0 +1,78 @@
+/*
+ * Host side converter from trace dumps to the Chrome trace format
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Collects the pages of records {"command":"trace","parameters":[2, first]}
+ * returns and writes them in the Chrome trace event format, which
+ * chrome://tracing and ui.perfetto.dev load. Cycle counts are unwrapped
+ * record to record, so gaps longer than half the counter's period (about
+ * 13 s at 160 MHz) shift what follows. Every event goes on the track of
+ * the context that records it; a _BEGIN and the next _END of the same kind
+ * on a track become one complete event, one whose partner was overwritten
+ * or not yet written is left out.
+ */
+
+#ifndef TRACEJSON_H
+#define TRACEJSON_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "trace.h"
+
+struct TraceSpan
+{
+    uint8_t id; // the _BEGIN, or the event itself for instants
+    double start_us;
+    double duration_us; // 0 for instants
+    uint16_t arg;
+    uint16_t end_arg;
+};
+
+class TraceDecoder
+{
+public:
+    TraceDecoder();
+    // One page reply as sent; false if it has no records field
+    bool addReply(const std::string &reply);
+    size_t records() const { return ids_.size(); }
+    uint64_t lost() const { return lost_; } // skipped between pages, overwritten before they were read
+    uint32_t cyclesPerUs() const { return cycles_per_us_; }
+
+    // Microseconds from the first record
+    std::vector<TraceSpan> spans() const;
+    std::string chromeJson() const;
+
+    static const char *name(uint8_t id);
+    static int track(uint8_t id); // 0 for an unknown ID
+
+private:
+    uint32_t cycles_per_us_;
+    bool have_next_;
+    uint32_t next_;
+    uint32_t last_cycles_;
+    int64_t last_time_;
+    uint64_t lost_;
+    std::vector<int64_t> cycles_; // unwrapped
+    std::vector<uint8_t> ids_;
+    std::vector<uint16_t> args_;
+};
+
+#endif // TRACEJSON_H
@@ -26,7 +26,26 @@
 /**
  * Constructor makes sure some things are set.
  */
-WSCommand::WSCommand() : commandList(NULL), commandCount(0) {}
+WSCommand::WSCommand()
+    : commandList(NULL), commandCount(0), queue_head(0), queue_tail(0), has_request_id(false), request_id(0),
+      received_us(0) {}
+
+/**
+ * Grows the list by one entry named command, both handlers unset. A name
+ * longer than the entry holds is cut short, still terminated.
+ */
+WSCommand::WSCommandCallback &WSCommand::appendCommand(const char *command)
+{
+    ESP_LOGD("COMMAND", "Adding command (%d): %s", commandCount, command);
+    commandList = (WSCommandCallback *)realloc(commandList, (commandCount + 1) * sizeof(WSCommandCallback));
+    WSCommandCallback &entry = commandList[commandCount++];
+    size_t length = strnlen(command, WSCOMMAND_MAXCOMMANDLENGTH - 1);
+    memcpy(entry.command, command, length);
+    entry.command[length] = '\0';
+    entry.command_function = NULL;
+    entry.json_command_function = NULL;
+    return entry;
+}
 
 /**
  * Adds a "command" and a handler function to the list of available commands.
@@ -35,11 +54,16 @@ WSCommand::WSCommand() : commandList(NULL), commandCount(0) {}
  */
 void WSCommand::addCommand(const char *command, void (*function)(unsigned char register_number, unsigned char register_value))
 {
-    ESP_LOGD("COMMAND", "Adding command (%d): %s", commandCount, command);
-    commandList = (WSCommandCallback *)realloc(commandList, (commandCount + 1) * sizeof(WSCommandCallback));
-    strncpy(commandList[commandCount].command, command, WSCOMMAND_MAXCOMMANDLENGTH);
-    commandList[commandCount].command_function = function;
-    commandCount++;
+    appendCommand(command).command_function = function;
+}
+
+/**
+ * Same as above, but the handler gets the "parameters" array as sent, which
+ * may be null.
+ */
+void WSCommand::addCommand(const char *command, void (*function)(JsonArray parameters))
+{
+    appendCommand(command).json_command_function = function;
 }
 
 void WSCommand::setDefaultHandler(void (*function)(const char *))
@@ -56,6 +80,7 @@ void WSCommand::executeCommand(uint8_t *payload)
 {
     // try to decipher the JSON string received
     JsonDocument json_command;
+    has_request_id = false;
     DeserializationError error = deserializeJson(json_command, payload);
 
     if (error)
@@ -64,6 +89,8 @@ void WSCommand::executeCommand(uint8_t *payload)
         return;
     }
     JsonObject command_object = json_command.as<JsonObject>();
+    has_request_id = command_object["id"].is<uint32_t>();
+    request_id = has_request_id ? command_object["id"].as<uint32_t>() : 0;
     JsonVariant command_name_variant = command_object["command"];
     const char *command = command_name_variant.as<const char *>();
     ESP_LOGD("COMMAND", "command: %s", String(command));
@@ -77,6 +104,11 @@ void WSCommand::executeCommand(uint8_t *payload)
 
     JsonVariant parameters_variant = json_command["parameters"];
     JsonArray params_array = parameters_variant.as<JsonArray>();
+    if (commandList[command_num].json_command_function)
+    {
+        (*commandList[command_num].json_command_function)(params_array);
+        return;
+    }
     unsigned char register_number = 0;
     unsigned char register_value = 0;
     if (!parameters_variant.isNull())
@@ -98,6 +130,54 @@ void WSCommand::executeCommand(uint8_t *payload)
     (*commandList[command_num].command_function)(register_number, register_value);
 }
 
+/**
+ * Copies a command to be executed later by executeQueued(), stamped with
+ * the time it arrived. Returns false if the queue is full or the payload
+ * does not fit a slot. Safe against executeQueued() running on another core.
+ */
+bool WSCommand::queueCommand(const uint8_t *payload, size_t length, int64_t received_us)
+{
+    uint32_t head = queue_head;
+    if (length >= WSCOMMAND_MAXPAYLOADLENGTH || head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE) >= WSCOMMAND_QUEUE_SIZE)
+        return false;
+    QueuedCommand &slot = queue[head % WSCOMMAND_QUEUE_SIZE];
+    memcpy(slot.payload, payload, length);
+    slot.payload[length] = 0;
+    slot.received_us = received_us;
+    __atomic_store_n(&queue_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Executes the oldest queued command. Returns false if there was none.
+ */
+bool WSCommand::executeQueued()
+{
+    uint32_t tail = queue_tail;
+    if (tail == __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE))
+        return false;
+    QueuedCommand &slot = queue[tail % WSCOMMAND_QUEUE_SIZE];
+    received_us = slot.received_us;
+    executeCommand((uint8_t *)slot.payload);
+    __atomic_store_n(&queue_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t WSCommand::queued() const
+{
+    return queue_head - queue_tail;
+}
+
+// For replying to a command that is not going to be executed
+bool WSCommand::parseRequestId(const uint8_t *payload, size_t length, uint32_t *id)
+{
+    JsonDocument json_command;
+    if (deserializeJson(json_command, (const char *)payload, length) || !json_command["id"].is<uint32_t>())
+        return false;
+    *id = json_command["id"].as<uint32_t>();
+    return true;
+}
+
 int WSCommand::findCommand(const char *command)
 {
     int result = -1;
@@ -36,29 +36,58 @@
 #include <ArduinoJson.h>
 
 #define WSCOMMAND_MAXCOMMANDLENGTH 32
+#define WSCOMMAND_MAXPAYLOADLENGTH 256
+#define WSCOMMAND_QUEUE_SIZE 16
 
 typedef void (*command_func)(unsigned char, unsigned char);
+typedef void (*json_command_func)(JsonArray);
 
 class WSCommand
 {
 public:
     WSCommand(); // Constructor
     void addCommand(const char *command, void (*function)(unsigned char register_number, unsigned char register_value));
+    void addCommand(const char *command, void (*function)(JsonArray parameters)); // For parameters that do not fit a byte
     void executeCommand(uint8_t *payload);
+    bool queueCommand(const uint8_t *payload, size_t length, int64_t received_us);
+    bool executeQueued();
+    size_t queued() const;
+    static bool parseRequestId(const uint8_t *payload, size_t length, uint32_t *id);
     int findCommand(const char *command);
     void printCommands(); // Prints the list of commands.
     void setDefaultHandler(void (*function)(const char *));
 
+    // The command being executed: its "id", if it had one, and when it arrived
+    bool hasRequestId() const { return has_request_id; }
+    uint32_t requestId() const { return request_id; }
+    int64_t receivedUs() const { return received_us; }
+
 private:
     // Command/handler dictionary
     struct WSCommandCallback
     {
         char command[WSCOMMAND_MAXCOMMANDLENGTH];
         command_func command_function;
+        json_command_func json_command_function;
     }; // Data structure to hold Command/Handler function key-value pairs
+    WSCommandCallback &appendCommand(const char *command);
     void (*defaultHandler)(const char *);
     WSCommandCallback *commandList; // Actual definition for command/handler array
     byte commandCount;
+
+    // Commands received but not yet executed, one producer and one consumer
+    struct QueuedCommand
+    {
+        char payload[WSCOMMAND_MAXPAYLOADLENGTH];
+        int64_t received_us;
+    };
+    QueuedCommand queue[WSCOMMAND_QUEUE_SIZE];
+    volatile uint32_t queue_head;
+    volatile uint32_t queue_tail;
+
+    bool has_request_id;
+    uint32_t request_id;
+    int64_t received_us;
 };
 
 #endif // WSCOMMAND_H
\ No newline at end of file
@@ -22,42 +22,129 @@
 
 #include <ads129x.h>
 #include <adscommand.h>
+#include <adschip.h>
 #include <wscommand.h>
 #include <spidma.h>
+#include <perfstats.h>
+#include <trace.h>
+#include <clocksync.h>
+#include <frameformat.h>
+#include <flashlog.h>
+#include <impedance.h>
+#include <quality.h>
+#include <selftest.h>
+#include <montage.h>
+#include <pipeline.h>
+#include <onset.h>
+#include <burst.h>
+#include <streamformat.h>
+#include <tasklayer.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
 #include <WiFi.h>
 #include <WebSocketsServer.h>
 #include <WiFiManager.h>
 #include <ESPmDNS.h>
-#include <Adafruit_NeoPixel.h>
+#include <statusled.h>
 
 const char *ssid = "ORIC-EEG";
 const char *password = "";
 
 #define BAUD_RATE 2000000
 #define BOARD_NAME "OctaEEG"
-#define CHANNELS 8
-#define ADS_DATA_SIZE (CHANNELS * 3)
-#define ADS_STATUS_SIZE 3
-#define BLOCK_SIZE 32 // Data + Timestamp + Counter
-#define SAMPLES_PER_BUFFER 250
-#define PACKET_SIZE (BLOCK_SIZE * SAMPLES_PER_BUFFER)
-#define NUM_BUFFERS 20
+#define BLOCK_SIZE FRAME_BLOCK_SIZE // Data + Timestamp + Counter
 #define MAX_PAYLOAD_SIZE 256
 
-uint8_t data_buffers[NUM_BUFFERS][PACKET_SIZE];
+// The ring is carved out of one pool at rdatac time, sized for the sample rate.
+// Each frame starts with a FrameHeader block.
+#define SAMPLE_POOL_SIZE (BLOCK_SIZE * 250 * 20)
+#define MAX_BUFFERS 64
+#ifndef TARGET_FRAME_MS
+#define TARGET_FRAME_MS 40 // time to fill one frame, i.e. the added latency
+#endif
+#ifndef TARGET_BUFFER_MS
+#define TARGET_BUFFER_MS 1000 // how long a network stall the ring can absorb
+#endif
+#define SEND_DELAY_MS 20 // networkStep() yields this long after every frame
+
+// Every ring and retained slot starts with room for the WebSocket header, so
+// a frame goes out with its header written in front of it instead of being
+// copied next to a header in a library buffer first. 0 builds the old path.
+#ifndef SEND_IN_PLACE
+#define SEND_IN_PLACE 1
+#endif
+#if SEND_IN_PLACE
+#define SLOT_HEADROOM BLOCK_SIZE // frames stay block aligned
+static_assert(SLOT_HEADROOM >= WEBSOCKETS_MAX_HEADER_SIZE, "slot headroom must fit a WebSocket header");
+#else
+#define SLOT_HEADROOM 0
+#endif
+
+// Budget used to refuse sample rates the device cannot sustain
+#define ISR_OVERHEAD_US 10 // DRDY_ISR time besides the SPI transfer
+#define MAX_ISR_LOAD 0.5f
+#define LINK_BUDGET_KBPS 6000 // sustained soft AP throughput for one TCP stream
+#define FRAME_OVERHEAD_BYTES 66 // WebSocket, TCP, IP and 802.11 headers
+
+struct StreamGeometry
+{
+    uint32_t sample_rate;
+    int samples_per_buffer;
+    int num_buffers;
+    float isr_load;     // fraction of CPU time spent in DRDY_ISR
+    uint32_t link_kbps; // payload plus per frame overhead
+};
+
+uint8_t sample_pool[SAMPLE_POOL_SIZE];
+int samples_per_buffer = 250;
+int num_buffers = 20;
+size_t packet_size = SLOT_HEADROOM + BLOCK_SIZE * (250 + 2); // ring slot: headroom, then the largest frame
+uint32_t sample_rate = 0;
 volatile int current_buffer_index = 0;
 volatile int current_sample_index = 0;
-volatile bool buffer_completed[NUM_BUFFERS] = {false};
+volatile bool buffer_completed[MAX_BUFFERS] = {false}; // filled by DRDY_ISR
+volatile bool buffer_framed[MAX_BUFFERS] = {false};    // header and events written, ready to send
+uint8_t buffer_to_frame = 0;
 uint8_t buffer_to_send = 0;
+bool frame_in_flight = false; // networkStep() sends buffer_to_send; under the layer lock
+
+// acquisitionStep(), controlStep() and networkStep() run as tasks, pinned
+// to their own cores where there are two, or in turn from loop(); commands
+// take the layer lock only around the state the other steps read
+#ifdef OSEM_NATIVE
+#undef TASK_CORES
+#undef TASK_THREADED
+#define TASK_CORES 1 // the simulator's virtual clock runs on one thread
+#define TASK_THREADED 0
+#endif
+#define ACQUISITION_STACK_BYTES 4096
+#define CONTROL_STACK_BYTES 8192
+#define NETWORK_STACK_BYTES 8192
+TaskLayer task_layer;
+
+// Replies to queued commands, sent by networkStep() which owns the WebSocket
+#define REPLY_QUEUE_SIZE 4
+#define TRACE_PAGE_RECORDS 128 // per trace command reply, 2 KB of hex
+String reply_queue[REPLY_QUEUE_SIZE];
+volatile uint32_t reply_head = 0; // moved on by the control task only
+volatile uint32_t reply_tail = 0; // moved on by the network task only
 
 const char *STATUS_TEXT_OK = "Ok";
 const char *STATUS_TEXT_BAD_REQUEST = "Bad request";
 const char *STATUS_TEXT_ERROR = "Error";
 const char *STATUS_TEXT_NOT_IMPLEMENTED = "Not Implemented";
 const char *STATUS_TEXT_NO_ACTIVE_CHANNELS = "No Active Channels";
+const char *STATUS_TEXT_BANDWIDTH_EXCEEDED = "Bandwidth Exceeded";
+const char *STATUS_TEXT_STREAMING = "Not Allowed While Streaming";
+const char *STATUS_TEXT_NOT_SYNCED = "Clock Not Synced";
+const char *STATUS_TEXT_NO_LOG = "No Log Partition";
+const char *STATUS_TEXT_BUSY = "Busy";
+const char *STATUS_TEXT_PIPELINE_RATE = "Pipeline Does Not Suit Rate";
 bool wm = false;
 
 int max_channels = 0;
+AdcFamily adc_family = ADC_FAMILY_UNKNOWN;
+const AdcChip *adc_chip = NULL; // set by adsSetup(), NULL for an unknown chip
 int num_active_channels = 0;
 boolean active_channels[9];
 boolean is_rdatac = false;
@@ -72,20 +159,161 @@ union
 
 // sample number counter
 #define SAMPLE_NUMBER_SIZE_IN_BYTES 4
+// AdsReadout::read() puts the status word in front of the channels, where the sample number goes
+static_assert(ADS_STATUS_SIZE <= SAMPLE_NUMBER_SIZE_IN_BYTES, "the status word must not reach the timestamp");
 union
 {
     uint8_t sample_number_bytes[SAMPLE_NUMBER_SIZE_IN_BYTES];
     uint32_t sample_number = 0;
 } sample_number_union;
 
+// DRDY_ISR bumps it before and after it moves the timestamp and sample
+// number on, so it is odd in between and a reader on the other core sees a
+// matching pair when it reads the same even value on both sides
+volatile uint32_t sample_generation = 0;
+
+static inline void IRAM_ATTR sampleGenerationBump()
+{
+    __atomic_fetch_add(&sample_generation, 1, __ATOMIC_SEQ_CST);
+}
+
+static_assert(TIMESTAMP_SIZE_IN_BYTES + SAMPLE_NUMBER_SIZE_IN_BYTES + ADS_MAX_DATA_SIZE == BLOCK_SIZE,
+              "a block holds timestamp, sample number and every channel");
+
 const char *hardware_type = "OSEM-DEVICE";
 const char *board_name = BOARD_NAME;
 const char *maker_name = "OriginInterconnect PVT. LTD.";
 const char *driver_version = "v0.0.1";
 
+// Host clock model fed by the sync command, see lib/clocksync
+#define START_MIN_LEAD_US 50000
+#define START_MAX_LEAD_US 60000000
+ClockSync clock_sync;
+int64_t last_sync_t1 = 0;
+int64_t last_sync_t2 = 0;
+int64_t last_sync_t3 = 0;
+bool have_last_sync = false;
+int64_t start_at_local_us = 0;
+bool start_pending = false;
+
+// Flash recording; a page program holds DRDY off for about 0.6 ms
+#define RECORD_MAX_RATE 1000
+FlashLog flash_log;
+bool downloading = false;
+uint32_t download_frames = 0;
+uint32_t download_bytes = 0;
+
+// Sent frames are copied into the pool space behind the ring and kept for
+// resend; retained_total counts frames ever retained, slot = total % slots
+int retained_slots = 0;
+int retained_count = 0;
+uint32_t retained_total = 0;
+bool resending = false;
+uint32_t resend_from = 0;
+uint32_t resend_to = 0;
+uint32_t resend_cursor = 0;
+uint32_t resend_frames = 0;
+
+// Electrode impedance from AC lead-off excitation, reported between frames
+#define IMPEDANCE_OFF 0
+#define IMPEDANCE_ONLY 1        // raw frames are not sent
+#define IMPEDANCE_WITH_FRAMES 2
+ImpedanceMeter impedance_meter;
+uint8_t impedance_mode = IMPEDANCE_OFF;
+volatile bool impedance_report = false; // a window is ready for networkStep() to send
+
+// Running signal quality of the raw channels, see lib/quality
+#define QUALITY_OFF 0
+#define QUALITY_ON 1          // reported on request
+#define QUALITY_WITH_SUMMARY 2 // and sent after every window
+QualityMeter quality_meter;
+uint8_t quality_mode = QUALITY_OFF;
+float quality_line_hz = 50;
+float quality_uv_per_count[QUALITY_MAX_CHANNELS] = {0}; // 0 for shorted channels
+volatile bool quality_report = false; // a window is ready for networkStep() to send
+
+// Cheaper frame formats while the link backs up: networkStep() picks the
+// level after each send, acquisitionStep() packs the frames it completes
+StreamAdapter stream_adapter;
+uint8_t active_channel_mask = 0; // channel 1 is bit 0
+
+// Derived channels for the stream, see lib/montage; acquisitionStep() applies
+// them after the flash log and the meters have taken the raw channels
+#define MONTAGE_RAW 0
+#define MONTAGE_COMMON_AVERAGE 1
+#define MONTAGE_BIPOLAR 2
+#define MONTAGE_REFERENCE 3
+#define MONTAGE_CUSTOM 4
+Montage montage;
+uint8_t montage_mode = MONTAGE_RAW;
+
+// Filter, decimate and montage stages set up by the pipeline command; they
+// run in acquisitionStep() on what the log and the meters have taken
+Pipeline pipeline;
+
+// EMG mode of the emg command: the pipeline turns each channel into its
+// envelope at about EMG_OUTPUT_RATE and the detector streams onset and
+// offset events on it, the envelopes in place of the raw channels
+#define EMG_HIGHPASS_HZ 20 // below the muscle band: motion and cable artifacts
+#define EMG_ENVELOPE_HZ 6  // low pass over the rectified signal
+#define EMG_OUTPUT_RATE 50
+OnsetDetector emg_onsets;
+
+// Loopback self-test on the internal test signal: acquisitionStep() checks
+// the samples, controlStep() stops it and puts the registers back and
+// networkStep() sends the report
+#define SELFTEST_DEFAULT_SECONDS 2
+#define SELFTEST_MAX_SECONDS 30
+#define SELFTEST_GRACE_MS 1000 // beyond its length before a stalled test gives up
+SelfTest self_test;
+bool self_testing = false;
+bool self_test_aborted = false;
+uint8_t self_test_config2 = 0; // registers the test overwrote
+uint8_t self_test_chset[ADS_MAX_CHANNELS];
+uint32_t self_test_read_errors = 0; // perfStats.read_errors when it started, the errors during it once ended
+uint32_t self_test_dropped = 0;     // the same for perfStats.samples_dropped
+uint32_t self_test_deadline_ms = 0;
+volatile bool self_test_report = false; // the result is ready for networkStep() to send
+
+// Pre-trigger burst capture, see lib/burst: DRDY_ISR keeps the latest
+// conversions at the chip's top rate in a buffer from the heap until a
+// trigger edge or the burst command freezes the window around it, then
+// controlStep() leaves RDATAC and networkStep() drains the window as frames
+#define BURST_OFF 0
+#define BURST_CAPTURING 1
+#define BURST_DRAINING 2
+#define BURST_FRAME_SAMPLES 200
+#if ESP32_S3
+#define BURST_HEAP_CAPS MALLOC_CAP_SPIRAM
+#define BURST_HEAP_RESERVE 0
+#else
+#define BURST_HEAP_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#define BURST_HEAP_RESERVE 32768 // left to WiFi and lwIP
+#endif
+BurstCapture burst;
+volatile uint8_t burst_state = BURST_OFF;
+uint8_t *burst_buffer = NULL;
+uint8_t burst_config1 = 0; // CONFIG1 before the capture
+uint32_t burst_cursor = 0; // next record to drain
+uint32_t burst_frames = 0;
+bool burst_aborted = false;
+
+// Trigger edges are queued by TRIGGER_ISR, marks by the command handler;
+// acquisitionStep() moves both into the event block of the next frame
+#define EVENT_QUEUE_SIZE 16
+#define TRIGGER_HOLDOFF_US 2000 // ignore bounce after an edge
+FrameEvent trigger_events[EVENT_QUEUE_SIZE];
+volatile uint8_t trigger_head = 0;
+uint8_t trigger_tail = 0;
+volatile uint32_t trigger_last_us = 0;
+FrameEvent mark_events[EVENT_QUEUE_SIZE];
+uint8_t mark_count = 0;
+volatile uint32_t events_dropped = 0;
+
 WSCommand wsCommand;
 WebSocketsServer webSocket = WebSocketsServer(81);
-Adafruit_NeoPixel pixels(1, PIN_NEO, NEO_GRB + NEO_KHZ800);
+// Posted from any task, shown by networkStep() through the RMT, see lib/statusled
+StatusLed status_led;
 void webSocketEvent(byte num, WStype_t type, uint8_t *payload, size_t length);
 
 void espSetup();
@@ -111,6 +339,44 @@ void sdatacCommand(unsigned char unused1, unsigned char unused2);
 void readRegisterCommand(unsigned char unused1, unsigned char unused2);
 void writeRegisterCommand(unsigned char register_number, unsigned char register_value);
 void helpCommand(unsigned char unused1, unsigned char unused2);
+void statsCommand(unsigned char reset, unsigned char unused1);
+void sampleRateCommand(JsonArray parameters);
+void syncCommand(JsonArray parameters);
+void startAtCommand(JsonArray parameters);
+void recordCommand(JsonArray parameters);
+void downloadCommand(JsonArray parameters);
+void resendCommand(JsonArray parameters);
+void impedanceCommand(JsonArray parameters);
+void qualityCommand(JsonArray parameters);
+void markCommand(JsonArray parameters);
+void adaptiveCommand(JsonArray parameters);
+void selfTestCommand(JsonArray parameters);
+void montageCommand(JsonArray parameters);
+void pipelineCommand(JsonArray parameters);
+void emgCommand(JsonArray parameters);
+void traceCommand(JsonArray parameters);
+void burstCommand(JsonArray parameters);
+uint32_t cycleCount();
+void serviceSelfTest();
+void selfTestToJson(JsonDocument &doc);
+void serviceBurst();
+void sendBurstFrame();
+static inline int completedBuffers();
+void IRAM_ATTR TRIGGER_ISR(void);
+bool frameNextBuffer();
+bool acquisitionStep();
+bool controlStep();
+bool networkStep();
+void showStatus(StatusLedState state);
+void send_json_respose(JsonDocument &doc);
+void send_json_message(JsonDocument &doc);
+void refuseCommand(uint8_t *payload, size_t length);
+uint32_t streamRate();
+StreamGeometry streamGeometry(uint32_t rate);
+void applyStreamGeometry(const StreamGeometry &geometry);
+void lockIdleRing();
+void prepareStreaming();
+void endStreaming();
 
 void setup()
 {
@@ -122,7 +388,11 @@ void setup()
 
     // Hardware setup
     espSetup();
+    perfStatsBegin();
+    traceBegin();
     adsSetup();
+    flash_log.begin();
+    pipeline.setCycleCounter(cycleCount);
 
     // Setup callbacks for SerialCommand commands
     wsCommand.addCommand("nop", nopCommand);                   // No operation (does nothing)
@@ -143,6 +413,23 @@ void setup()
     wsCommand.addCommand("sdatac", sdatacCommand);             // Stop read data continuous mode; ringbuffer data is still available
     wsCommand.addCommand("rreg", readRegisterCommand);         // Read ADS129x register, argument in hex, print contents in hex
     wsCommand.addCommand("wreg", writeRegisterCommand);        // Write ADS129x register, arguments in hex
+    wsCommand.addCommand("stats", statsCommand);               // Runtime counters and timing histograms, argument 1 resets them
+    wsCommand.addCommand("samplerate", sampleRateCommand);     // Set the sample rate in SPS and resize frames to match, no argument reports it
+    wsCommand.addCommand("sync", syncCommand);                 // Clock sync exchange: [t1] starts over, [t1, previous t1, previous t4] continues
+    wsCommand.addCommand("startat", startAtCommand);           // STOP now and START at the given host time in microseconds
+    wsCommand.addCommand("record", recordCommand);             // [1] records frames to flash, [0] stops, no argument reports the log
+    wsCommand.addCommand("download", downloadCommand);         // Send recorded frames overlapping [first sample, last sample]
+    wsCommand.addCommand("resend", resendCommand);             // Send retained frames overlapping [first sample, last sample] between live frames
+    wsCommand.addCommand("quality", qualityCommand);           // [1] running channel statistics, [2] with a summary every second, [n, 60] for 60 Hz mains, [0] off; no argument reports them
+    wsCommand.addCommand("impedance", impedanceCommand);       // [1] electrode impedance only, [2] with raw frames, [0] off; no argument reports it
+    wsCommand.addCommand("mark", markCommand);                 // Event marker [code] now, or [code, host time in microseconds]
+    wsCommand.addCommand("adaptive", adaptiveCommand);         // [1] cheaper frames while the link backs up, [1, max level, min level], [0] raw only, [0, level] fixed; no argument reports it
+    wsCommand.addCommand("montage", montageCommand);           // [1] common average, [2] bipolar chain, [3, reference mask], [4, output, weights..., divisor] custom row, [0] raw; no argument reports it
+    wsCommand.addCommand("pipeline", pipelineCommand);         // Append a stage [kind, value]: 1 high pass, 2 low pass, 3 notch at value Hz, 4 decimate by value, 5 montage, 6 envelope; [0] clears; no argument reports the stages and their cycles
+    wsCommand.addCommand("emg", emgCommand);                   // [1] envelopes and onset events, [1, k on, k off, hold ms] with other thresholds, [0] off; no argument reports it
+    wsCommand.addCommand("trace", traceCommand);               // [1] clears and starts the trace ring, [0] stops it, [2, first] sends its records from first on; no argument reports it
+    wsCommand.addCommand("burst", burstCommand);               // [1, pre, post] keeps samples at the top rate until a trigger, [2] triggers, [0] aborts; no argument reports it
+    wsCommand.addCommand("selftest", selfTestCommand);         // Stream the internal test signal on every channel for [seconds] and check it; no argument reports the last result
     wsCommand.addCommand("help", helpCommand);                 // Print list of commands
     wsCommand.setDefaultHandler(unrecognized);
     pinMode(TRIGGER_PIN, INPUT_PULLUP);
@@ -151,9 +438,9 @@ void setup()
     WiFiManager wifiManager;
 
     // Set new pixel
-    pixels.begin();
-    pixels.setPixelColor(0, pixels.Color(PIXEL_BRIGHTNESS, 0, 0)); // RED
-    pixels.show();
+    if (!status_led.begin(PIN_NEO, PIXEL_BRIGHTNESS))
+        ESP_LOGE("LED", "RMT channel for the status LED not available");
+    showStatus(STATUS_LED_BOOT);
     vTaskDelay(100 / portTICK_PERIOD_MS);
 
     for (int i = 0; i < 10; i++)
@@ -162,8 +449,7 @@ void setup()
         if (digitalRead(TRIGGER_PIN) == LOW)
         {
             wm = true;
-            pixels.setPixelColor(0, pixels.Color(PIXEL_BRIGHTNESS, 0, PIXEL_BRIGHTNESS));
-            pixels.show();
+            showStatus(STATUS_LED_WIFI_MANAGER);
         }
         vTaskDelay(1 / portTICK_PERIOD_MS);
     }
@@ -175,14 +461,12 @@ void setup()
         if (digitalRead(TRIGGER_PIN) == LOW)
         {
             wifiManager.resetSettings();
-            pixels.setPixelColor(0, pixels.Color(0, 0, PIXEL_BRIGHTNESS)); // BLUE
-            pixels.show();
+            showStatus(STATUS_LED_WIFI_RESET);
         }
         vTaskDelay(1 / portTICK_PERIOD_MS);
     }
 
-    pixels.setPixelColor(0, pixels.Color(0, PIXEL_BRIGHTNESS, 0)); // Green
-    pixels.show();
+    showStatus(STATUS_LED_STARTING);
 
     // Try to connect
     if (wm and !wifiManager.autoConnect("ORIC-OSEM-DEVICE-OTA", "awesomeness"))
@@ -199,16 +483,14 @@ void setup()
             while (1)
             {
                 vTaskDelay(1 / portTICK_PERIOD_MS);
-                pixels.setPixelColor(0, pixels.Color(PIXEL_BRIGHTNESS, 0, 0)); // RED
-                pixels.show();
+                showStatus(STATUS_LED_FAILED);
                 ESP.restart();
             }
         }
         else
         {
             ESP_LOGD("APMode", "APModeStatus: soft AP creation success!");
-            pixels.setPixelColor(0, pixels.Color(0, PIXEL_BRIGHTNESS, PIXEL_BRIGHTNESS)); // cyan
-            pixels.show();
+            showStatus(STATUS_LED_CONNECTED);
         }
     }
     // Initiate MDNS
@@ -218,40 +500,538 @@ void setup()
         while (1)
         {
             vTaskDelay(1 / portTICK_PERIOD_MS);
-            pixels.setPixelColor(0, pixels.Color(PIXEL_BRIGHTNESS, 0, 0)); // RED
-            pixels.show();
+            showStatus(STATUS_LED_FAILED);
             ESP.restart();
         }
     }
     else
     {
         ESP_LOGD("mdns", "mDNS responder started");
-        pixels.setPixelColor(0, pixels.Color(PIXEL_BRIGHTNESS, PIXEL_BRIGHTNESS, 0)); // Yellow
-        pixels.show();
+        showStatus(STATUS_LED_WAITING);
     }
 
+    // After the boot time checks the trigger input marks events
+    attachInterrupt(digitalPinToInterrupt(TRIGGER_PIN), TRIGGER_ISR, FALLING);
+
     // Create weboscket connection
     webSocket.begin();
     webSocket.onEvent(webSocketEvent);
     MDNS.addService("http", "tcp", 80);
+
+    // DRDY_ISR was attached here, so acquisition stays on this core
+    task_layer.add("acquisition", acquisitionStep, ACQUISITION_CORE, 2, ACQUISITION_STACK_BYTES);
+    task_layer.add("control", controlStep, CONTROL_CORE, 1, CONTROL_STACK_BYTES);
+    task_layer.add("network", networkStep, NETWORK_CORE, 1, NETWORK_STACK_BYTES);
+    if (!task_layer.begin(TASK_CORES, TASK_THREADED))
+        ESP_LOGE("SETUP", "Could not start tasks, running on one core");
     ESP_LOGD("SETUP", "Ready");
 }
 
-void loop()
+void fillFrameHeader(uint8_t *frame)
+{
+    FrameHeader *header = (FrameHeader *)frame;
+    const uint8_t *first_block = frame + BLOCK_SIZE;
+    uint32_t first_timestamp;
+    memcpy(&first_timestamp, first_block, sizeof(first_timestamp));
+
+    header->magic = FRAME_MAGIC;
+    header->version = FRAME_VERSION;
+    header->flags = 0;
+    header->samples = samples_per_buffer;
+    memcpy(&header->first_sample, first_block + TIMESTAMP_SIZE_IN_BYTES, sizeof(header->first_sample));
+    header->sample_rate = sample_rate;
+    header->ref_local_us = first_timestamp;
+    header->drift_ppb = 0;
+    header->ref_host_us = 0;
+    if (clock_sync.synced())
+    {
+        // Extend the 32 bit block timestamp to the 64 bit clock
+        int64_t now = esp_timer_get_time();
+        int64_t local = now - (uint32_t)((uint32_t)now - first_timestamp);
+        header->flags |= FRAME_FLAG_CLOCK_SYNCED;
+        header->drift_ppb = clock_sync.driftPpb();
+        header->ref_host_us = clock_sync.toHost(local);
+    }
+}
+
+/**
+ * Issues a START armed by startat. On one core loop() may be away for a
+ * frame send plus SEND_DELAY_MS, so once the start is closer than that the
+ * rest is waited out here with a busy delay.
+ */
+void serviceScheduledStart()
+{
+    using namespace ADS129x;
+    if (!start_pending)
+        return;
+    int64_t remaining = start_at_local_us - esp_timer_get_time();
+    if (remaining > 2 * SEND_DELAY_MS * 1000)
+        return;
+    if (remaining > 0)
+        delayMicroseconds(remaining);
+    adcSendCommand(START);
+    sample_number_union.sample_number = 0;
+    start_pending = false;
+}
+
+// Frame in ring slot index, behind the slot's headroom
+static inline uint8_t *ringFrame(int index)
+{
+    return &sample_pool[index * packet_size + SLOT_HEADROOM];
+}
+
+// Sends a frame that has SLOT_HEADROOM bytes free in front of it
+bool sendFrame(uint8_t *frame, size_t length)
+{
+#if SEND_IN_PLACE
+    return webSocket.sendBIN(0, frame - WEBSOCKETS_MAX_HEADER_SIZE, length, true);
+#else
+    return webSocket.sendBIN(0, frame, length);
+#endif
+}
+
+/**
+ * Sends one recorded frame per call while a download runs. Otherwise, with
+ * recording armed and no stream running, erases one sector ahead of the
+ * log; erasing holds interrupts off for tens of milliseconds, so it never
+ * runs while sampling.
+ */
+void serviceFlashLog()
+{
+    if (downloading)
+    {
+        // The ring is idle while not streaming; the pool behind it is retained frames
+        uint8_t *frame = ringFrame(0);
+        size_t length = flash_log.readNext(frame, num_buffers * packet_size - SLOT_HEADROOM);
+        if (length > 0)
+        {
+            ((FrameHeader *)frame)->flags |= FRAME_FLAG_RECORDED;
+            if (sendFrame(frame, length))
+            {
+                download_frames++;
+                download_bytes += length;
+            }
+            return;
+        }
+        downloading = false;
+        JsonDocument doc;
+        doc["response"] = STATUS_TEXT_OK;
+        doc["download"] = "done";
+        doc["frames"] = download_frames;
+        doc["bytes"] = download_bytes;
+        send_json_message(doc);
+        return;
+    }
+    if (!is_rdatac)
+        flash_log.service();
+}
+
+static inline uint8_t *retainedFrame(uint32_t sequence)
+{
+    return ringFrame(num_buffers + sequence % retained_slots);
+}
+
+// resendCommand() reads the retained count from the control core; the caller holds the lock
+void retainFrame(const uint8_t *frame)
+{
+    if (retained_slots == 0)
+        return;
+    memcpy(retainedFrame(retained_total), frame, frameLength((const FrameHeader *)frame));
+    retained_total++;
+    if (retained_count < retained_slots)
+        retained_count++;
+}
+
+/**
+ * Sends the next retained frame overlapping the resend range, or reports
+ * the resend done. Called only when no live frame is waiting, so replayed
+ * frames take the link between live frames. resendCommand() moves the
+ * cursor from the control core, so the caller holds the lock.
+ */
+void serviceResend()
+{
+    if (!resending)
+        return;
+    // Frames overwritten while the resend was running are gone
+    if (retained_total - resend_cursor > (uint32_t)retained_count)
+        resend_cursor = retained_total - retained_count;
+    while (resend_cursor != retained_total)
+    {
+        uint8_t *frame = retainedFrame(resend_cursor++);
+        FrameHeader *header = (FrameHeader *)frame;
+        uint32_t last = frameLastSample(header);
+        if (header->first_sample > resend_to || last < resend_from)
+            continue;
+        // Flagged in the copy sent, the retained frame stays as it was sent live
+        uint8_t flags = header->flags;
+        header->flags |= FRAME_FLAG_RESENT;
+        if (sendFrame(frame, frameLength(header)))
+            resend_frames++;
+        header->flags = flags;
+        return;
+    }
+    resending = false;
+    JsonDocument doc;
+    doc["response"] = STATUS_TEXT_OK;
+    doc["resend"] = "done";
+    doc["frames"] = resend_frames;
+    send_json_message(doc);
+}
+
+void impedanceToJson(JsonDocument &doc)
+{
+    JsonArray kohm = doc["impedance_kohm"].to<JsonArray>();
+    for (int ch = 0; ch < impedance_meter.channels(); ch++)
+    {
+        if (impedance_meter.excited(ch))
+            kohm.add(roundf(impedance_meter.kohm(ch) * 10) / 10);
+        else
+            kohm.add(nullptr);
+    }
+    doc["last_sample"] = impedance_meter.lastSample();
+}
+
+// Runs the Goertzel filters over a completed frame and reports each window
+void processImpedance(const uint8_t *frame)
+{
+    if (!impedance_meter.active())
+        return;
+    const FrameHeader *header = (const FrameHeader *)frame;
+    int32_t counts[ADS_MAX_CHANNELS];
+    for (int i = 1; i <= header->samples; i++)
+    {
+        const uint8_t *block = frame + i * BLOCK_SIZE;
+        uint32_t number;
+        memcpy(&number, block + TIMESTAMP_SIZE_IN_BYTES, sizeof(number));
+        adc_chip->counts(block + TIMESTAMP_SIZE_IN_BYTES + SAMPLE_NUMBER_SIZE_IN_BYTES, counts);
+        impedance_meter.addSample(number, counts);
+    }
+    if (impedance_meter.poll())
+        impedance_report = true;
+}
+
+void qualityToJson(JsonDocument &doc)
+{
+    JsonObject quality = doc["quality"].to<JsonObject>();
+    quality["line_hz"] = quality_meter.lineHz();
+    quality["samples"] = quality_meter.samples();
+    quality["missed"] = quality_meter.missed();
+    quality["last_sample"] = quality_meter.lastSample();
+    // One entry per channel, null for the shorted ones
+    JsonArray dc = quality["dc_uv"].to<JsonArray>();
+    JsonArray rms = quality["rms_uv"].to<JsonArray>();
+    JsonArray min = quality["min_uv"].to<JsonArray>();
+    JsonArray max = quality["max_uv"].to<JsonArray>();
+    JsonArray line = quality["line_uv"].to<JsonArray>();
+    JsonArray clipped = quality["clipped"].to<JsonArray>();
+    for (int ch = 0; ch < quality_meter.channels(); ch++)
+    {
+        float scale = quality_uv_per_count[ch];
+        if (scale <= 0)
+        {
+            dc.add(nullptr);
+            rms.add(nullptr);
+            min.add(nullptr);
+            max.add(nullptr);
+            line.add(nullptr);
+            clipped.add(nullptr);
+            continue;
+        }
+        dc.add(roundf(quality_meter.mean(ch) * scale * 10) / 10);
+        rms.add(roundf(quality_meter.rms(ch) * scale * 100) / 100);
+        min.add(roundf(quality_meter.minimum(ch) * scale * 10) / 10);
+        max.add(roundf(quality_meter.maximum(ch) * scale * 10) / 10);
+        line.add(roundf(quality_meter.lineRms(ch) * scale * 100) / 100);
+        clipped.add(quality_meter.clipped(ch));
+    }
+}
+
+// Adds a completed frame to the channel statistics and reports each window
+void processQuality(const uint8_t *frame)
+{
+    if (!quality_meter.active())
+        return;
+    const FrameHeader *header = (const FrameHeader *)frame;
+    int32_t counts[ADS_MAX_CHANNELS];
+    for (int i = 1; i <= header->samples; i++)
+    {
+        const uint8_t *block = frame + i * BLOCK_SIZE;
+        uint32_t number;
+        memcpy(&number, block + TIMESTAMP_SIZE_IN_BYTES, sizeof(number));
+        adc_chip->counts(block + TIMESTAMP_SIZE_IN_BYTES + SAMPLE_NUMBER_SIZE_IN_BYTES, counts);
+        quality_meter.addSample(number, counts);
+    }
+    if (quality_meter.poll() && quality_mode == QUALITY_WITH_SUMMARY)
+        quality_report = true;
+}
+
+// Checks the test signal in a completed frame; the last sample ends the test
+void processSelfTest(const uint8_t *frame)
+{
+    if (!self_test.active())
+        return;
+    const FrameHeader *header = (const FrameHeader *)frame;
+    int32_t counts[ADS_MAX_CHANNELS];
+    for (int i = 1; i <= header->samples; i++)
+    {
+        const uint8_t *block = frame + i * BLOCK_SIZE;
+        uint32_t timestamp;
+        uint32_t number;
+        memcpy(&timestamp, block, sizeof(timestamp));
+        memcpy(&number, block + TIMESTAMP_SIZE_IN_BYTES, sizeof(number));
+        adc_chip->counts(block + TIMESTAMP_SIZE_IN_BYTES + SAMPLE_NUMBER_SIZE_IN_BYTES, counts);
+        self_test.addSample(number, timestamp, counts);
+    }
+}
+
+// Runs the pipeline stages; a montage stage takes the montage in its place
+void processPipeline(uint8_t *frame)
+{
+    pipeline.process(frame, montage_mode != MONTAGE_RAW ? &montage : NULL);
+}
+
+// Replaces the channels of every sample with the montage outputs
+void processMontage(uint8_t *frame)
+{
+    if (montage_mode == MONTAGE_RAW || pipeline.hasMontage())
+        return;
+    FrameHeader *header = (FrameHeader *)frame;
+    int32_t counts[ADS_MAX_CHANNELS] = {0}; // a chip with fewer channels leaves the rest zero
+    for (int i = 1; i <= header->samples; i++)
+    {
+        uint8_t *data = frame + i * BLOCK_SIZE + TIMESTAMP_SIZE_IN_BYTES + SAMPLE_NUMBER_SIZE_IN_BYTES;
+        adc_chip->counts(data, counts);
+        montage.apply(counts, counts);
+#pragma GCC unroll 8
+        for (int ch = 0; ch < ADS_MAX_CHANNELS; ch++)
+        {
+            uint8_t *code = data + ADS_SAMPLE_SIZE * ch;
+            code[0] = (uint8_t)(counts[ch] >> 16);
+            code[1] = (uint8_t)(counts[ch] >> 8);
+            code[2] = (uint8_t)counts[ch];
+        }
+    }
+    header->flags |= FRAME_FLAG_DERIVED;
+}
+
+/**
+ * Moves queued events into the spare block behind the samples, up to
+ * FRAME_EVENTS_PER_BLOCK; the rest wait for the next frame.
+ */
+void attachEvents(uint8_t *frame)
+{
+    if (trigger_tail == trigger_head && mark_count == 0)
+        return;
+    FrameHeader *header = (FrameHeader *)frame;
+    FrameEventBlock *block = (FrameEventBlock *)(frame + (1 + header->samples) * BLOCK_SIZE);
+    memset(block, 0, sizeof(*block));
+    while (block->count < FRAME_EVENTS_PER_BLOCK && trigger_tail != trigger_head)
+    {
+        block->events[block->count++] = trigger_events[trigger_tail];
+        trigger_tail = (trigger_tail + 1) % EVENT_QUEUE_SIZE;
+    }
+    int taken = 0;
+    while (block->count < FRAME_EVENTS_PER_BLOCK && taken < mark_count)
+        block->events[block->count++] = mark_events[taken++];
+    mark_count -= taken;
+    memmove(mark_events, mark_events + taken, mark_count * sizeof(FrameEvent));
+    header->flags |= FRAME_FLAG_EVENTS;
+}
+
+/**
+ * Frames the next buffer DRDY_ISR completed: header, events, flash log,
+ * impedance, signal quality and self-test, then runs the pipeline and the
+ * EMG onset detector, derives the montage, packs it into the current
+ * stream level and hands it to networkStep(). The caller holds the lock.
+ */
+bool frameNextBuffer()
+{
+    bool framed = false;
+    if (buffer_completed[buffer_to_frame] && !buffer_framed[buffer_to_frame])
+    {
+        uint8_t *frame = ringFrame(buffer_to_frame);
+        traceEvent(TRACE_FRAME_BEGIN, buffer_to_frame);
+        fillFrameHeader(frame);
+        attachEvents(frame);
+        // Recorded whether or not the client gets it
+        if (flash_log.recording())
+            flash_log.append(frame, frameLength((FrameHeader *)frame));
+        processImpedance(frame);
+        processQuality(frame);
+        processSelfTest(frame);
+        // The log, the meter and the self-test take raw samples, the link whatever it can carry
+        processPipeline(frame);
+        emg_onsets.process(frame);
+        processMontage(frame);
+        streamPack(frame, stream_adapter.level(), montage_mode != MONTAGE_RAW ? montage.outputMask() : active_channel_mask);
+        taskRelease(buffer_framed[buffer_to_frame], true);
+        traceEvent(TRACE_FRAME_END, 0);
+        buffer_to_frame = (buffer_to_frame + 1) % num_buffers;
+        framed = true;
+    }
+    return framed;
+}
+
+// Runs on the core DRDY_ISR is attached to
+bool acquisitionStep()
+{
+    task_layer.lock();
+    serviceScheduledStart();
+    bool framed = frameNextBuffer();
+    task_layer.unlock();
+    return framed;
+}
+
+void sendImpedanceReport()
+{
+    if (!impedance_report)
+        return;
+    JsonDocument doc;
+    task_layer.lock();
+    impedanceToJson(doc);
+    impedance_report = false;
+    task_layer.unlock();
+    send_json_message(doc);
+}
+
+void sendQualityReport()
+{
+    if (!quality_report)
+        return;
+    JsonDocument doc;
+    task_layer.lock();
+    qualityToJson(doc);
+    quality_report = false;
+    task_layer.unlock();
+    send_json_message(doc);
+}
+
+void sendSelfTestReport()
+{
+    if (!self_test_report)
+        return;
+    JsonDocument doc;
+    task_layer.lock();
+    selfTestToJson(doc);
+    self_test_report = false;
+    task_layer.unlock();
+    send_json_message(doc);
+}
+
+/**
+ * Executes the oldest command webSocketEvent() queued, as long as there is
+ * room for its reply. Commands run one per pass, so a burst of them takes
+ * turns with frames instead of holding up the ring. They run without the
+ * lock and take it around the state they share with the other steps, so
+ * one waiting for the chip or the SPI bus holds up nothing else.
+ */
+bool controlStep()
+{
+    serviceSelfTest();
+    serviceBurst();
+    bool executed = false;
+    if (reply_head - __atomic_load_n(&reply_tail, __ATOMIC_ACQUIRE) < REPLY_QUEUE_SIZE && wsCommand.queued())
+    {
+        traceEvent(TRACE_COMMAND_BEGIN, 0);
+        executed = wsCommand.executeQueued();
+        traceEvent(TRACE_COMMAND_END, 0);
+    }
+    return executed;
+}
+
+// send_json_respose() fills a slot before it moves the head past it, this empties it before it moves the tail
+void sendReplies()
+{
+    uint32_t tail = reply_tail;
+    while (tail != __atomic_load_n(&reply_head, __ATOMIC_ACQUIRE))
+    {
+        String reply = reply_queue[tail % REPLY_QUEUE_SIZE];
+        reply_queue[tail % REPLY_QUEUE_SIZE] = "";
+        __atomic_store_n(&reply_tail, ++tail, __ATOMIC_RELEASE);
+        webSocket.sendTXT(0, reply);
+    }
+}
+
+/**
+ * Sends command replies, then the next framed buffer and gives its slot
+ * back to DRDY_ISR, or a resent frame when none is waiting, then handles
+ * WebSocket events, queueing the commands they carry, and updates the
+ * status LED.
+ */
+bool networkStep()
 {
-    if (buffer_completed[buffer_to_send])
+    bool sent = false;
+    task_layer.lock();
+    serviceFlashLog();
+    sendBurstFrame();
+    // Until the slot is given back, lockIdleRing() keeps the ring from being reset under the send
+    uint8_t sending = buffer_to_send;
+    frame_in_flight = taskAcquire(buffer_framed[sending]);
+    task_layer.unlock();
+    sendReplies();
+    if (frame_in_flight)
     {
         // Send the current buffer via WebSocket
-        webSocket.sendBIN(0, (uint8_t *)&data_buffers[buffer_to_send], PACKET_SIZE);
-        
-        vTaskDelay(20 / portTICK_PERIOD_MS);
+        uint8_t *frame = ringFrame(sending);
+        size_t length = frameLength((FrameHeader *)frame);
+        bool delivered = true;
+        bool slow = false;
+        if (impedance_mode != IMPEDANCE_ONLY)
+        {
+            uint32_t send_start = ESP.getCycleCount();
+            uint32_t send_start_us = micros();
+            traceEvent(TRACE_SEND_BEGIN, length > 0xFFFF ? 0xFFFF : length);
+            delivered = sendFrame(frame, length);
+            traceEvent(TRACE_SEND_END, delivered);
+            if (delivered)
+                perfStats.frames_sent++;
+            else
+                perfStats.frames_failed++;
+            perfRecordCycles(perfStats.send_duration, ESP.getCycleCount() - send_start);
+            // Longer than the frame took to fill means the link is falling behind
+            slow = (uint64_t)(micros() - send_start_us) * sample_rate > 1000000ULL * samples_per_buffer;
+        }
+        task_layer.lock();
+        retainFrame(frame);
+        task_layer.unlock();
+
+        vTaskDelay(SEND_DELAY_MS / portTICK_PERIOD_MS);
         // Move to the next buffer in sequence
-        buffer_completed[buffer_to_send] = false;
-        buffer_to_send = (buffer_to_send + 1) % NUM_BUFFERS;
+        task_layer.lock();
+        buffer_framed[sending] = false;
+        taskRelease(buffer_completed[sending], false);
+        buffer_to_send = (sending + 1) % num_buffers;
+        frame_in_flight = false;
+        stream_adapter.update(millis(), completedBuffers(), num_buffers, !delivered, slow);
+        task_layer.unlock();
+        sent = true;
+    }
+    else
+    {
+        task_layer.lock();
+        serviceResend();
+        task_layer.unlock();
     }
+    sendImpedanceReport();
+    sendQualityReport();
+    sendSelfTestReport();
 
     // Regularly handle WebSocket events
     webSocket.loop();
+    status_led.service();
+    return sent;
+}
+
+// setup() runs before anything samples, so it can wait for the pixel
+void showStatus(StatusLedState state)
+{
+    status_led.post(state);
+    status_led.flush();
+}
+
+void loop()
+{
+    task_layer.run();
 }
 
 void webSocketEvent(byte num, WStype_t type, uint8_t *payload, size_t length)
@@ -260,29 +1040,69 @@ void webSocketEvent(byte num, WStype_t type, uint8_t *payload, size_t length)
     {                         // switch on the type of information sent
     case WStype_DISCONNECTED: // if a client is disconnected, then type == WStype_DISCONNECTED
         ESP_LOGD("WEBSOCKET", "Client %d disconnected", num);
-        pixels.setPixelColor(0, pixels.Color(PIXEL_BRIGHTNESS, PIXEL_BRIGHTNESS, 0)); // Yellow
-        pixels.show();
+        status_led.post(STATUS_LED_WAITING);
         break;
     case WStype_CONNECTED: // if a client is connected, then type == WStype_CONNECTED
         ESP_LOGD("WEBSOCKET", "Client %d connected", num);
-        pixels.setPixelColor(0, pixels.Color(0, PIXEL_BRIGHTNESS, PIXEL_BRIGHTNESS)); // cyan
-        pixels.show();
+        status_led.post(STATUS_LED_CONNECTED);
         break;
     case WStype_TEXT: // if a client has sent data, then type == WStype_TEXT
         ESP_LOGD("WEBSOCKET", "Received command from user: %d", num);
-        wsCommand.executeCommand(payload);
+        traceEvent(TRACE_COMMAND_RECEIVED, length);
+        // Executed by controlStep(), stamped now for the sync command
+        if (!wsCommand.queueCommand(payload, length, esp_timer_get_time()))
+            refuseCommand(payload, length);
         break;
     }
 }
 
-void send_json_respose(JsonDocument &doc)
+// Answered at once, without executing: too long for a queue slot, or the queue is full
+void refuseCommand(uint8_t *payload, size_t length)
+{
+    JsonDocument doc;
+    if (length >= WSCOMMAND_MAXPAYLOADLENGTH)
+        doc["response"] = STATUS_TEXT_BAD_REQUEST;
+    else
+    {
+        doc["response"] = STATUS_TEXT_BUSY;
+        perfStats.commands_busy++;
+    }
+    uint32_t id;
+    if (WSCommand::parseRequestId(payload, length, &id))
+        doc["id"] = id;
+    send_json_message(doc);
+}
+
+// Messages of networkStep's own, sent right away
+void send_json_message(JsonDocument &doc)
 {
     String jsonString = "";
     serializeJson(doc, jsonString);
-    ESP_LOGD("JSON", "Sending JSON response");
+    ESP_LOGD("JSON", "Sending JSON message");
     webSocket.sendTXT(0, jsonString);
 }
 
+/**
+ * Reply to the command being executed: tagged with the request ID if it
+ * had one and queued for networkStep(). controlStep() makes room for one
+ * reply per command. The queue needs no lock, so a command replies with
+ * or without holding it.
+ */
+void send_json_respose(JsonDocument &doc)
+{
+    if (wsCommand.hasRequestId())
+        doc["id"] = wsCommand.requestId();
+    uint32_t head = reply_head;
+    if (head - __atomic_load_n(&reply_tail, __ATOMIC_ACQUIRE) >= REPLY_QUEUE_SIZE)
+    {
+        ESP_LOGE("JSON", "Reply queue full, reply dropped");
+        return;
+    }
+    serializeJson(doc, reply_queue[head % REPLY_QUEUE_SIZE]);
+    __atomic_store_n(&reply_head, head + 1, __ATOMIC_RELEASE);
+    perfRecord(perfStats.command_latency, (uint32_t)(esp_timer_get_time() - wsCommand.receivedUs()));
+}
+
 void send_response(const char *payload)
 {
     JsonDocument doc;
@@ -330,64 +1150,1353 @@ void statusCommand(unsigned char unused1, unsigned char unused2)
     send_json_respose(doc);
 }
 
-void nopCommand(unsigned char unused1, unsigned char unused2)
+// Frames filled by the ISR and waiting for loop() to send them
+static inline int IRAM_ATTR completedBuffers()
 {
-    send_response_ok();
+    int pending = (current_buffer_index - buffer_to_send + num_buffers) % num_buffers;
+    if (pending == 0 && buffer_completed[buffer_to_send])
+        pending = num_buffers;
+    return pending;
 }
 
-void microsCommand(unsigned char unused1, unsigned char unused2)
+void statsCommand(unsigned char reset, unsigned char unused1)
 {
-    unsigned long microseconds = micros();
+    TaskLock lock(task_layer);
     JsonDocument doc;
-    doc["response"] = microseconds;
+    perfStatsToJson(doc);
+    doc["queue_depth"] = completedBuffers();
+    doc["ring_size"] = num_buffers;
+    doc["clients"] = webSocket.connectedClients();
+    doc["events_dropped"] = events_dropped;
+    doc["stream_level"] = stream_adapter.level();
     send_json_respose(doc);
+    if (reset == 1)
+        perfStatsReset();
 }
 
-void serialNumberCommand(unsigned char unused1, unsigned char unused2)
+void traceToJson(JsonDocument &doc)
 {
-    send_response(STATUS_TEXT_NOT_IMPLEMENTED);
+    uint32_t recorded = trace_head;
+    doc["enabled"] = (bool)trace_enabled;
+    doc["recorded"] = recorded;
+    doc["oldest"] = recorded > TRACE_SIZE ? recorded - TRACE_SIZE : 0;
+    doc["size"] = TRACE_SIZE;
+    doc["cycles_per_us"] = perfStats.cycles_per_us;
 }
 
-void ledOnCommand(unsigned char unused1, unsigned char unused2)
+/**
+ * [1] clears the trace ring and starts recording, [0] stops so the ring
+ * can be read without the reads showing up in it, [2, first] sends up to
+ * TRACE_PAGE_RECORDS records from first on, or from the oldest one still
+ * there, as hex of their 8 bytes. "first" is where the page starts and
+ * "next" where to ask for the following one; a page stops early at a
+ * record still being written. lib/tracejson turns the pages into a Chrome
+ * trace.
+ */
+void traceCommand(JsonArray parameters)
 {
-    send_response(STATUS_TEXT_NOT_IMPLEMENTED);
+    JsonDocument doc;
+    int mode = !parameters.isNull() && parameters.size() > 0 ? parameters[0].as<int>() : -1;
+    if (mode == 0)
+        trace_enabled = false;
+    else if (mode == 1)
+        traceClear();
+    else if (mode != -1 && mode != 2)
+    {
+        send_response(STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    doc["response"] = STATUS_TEXT_OK;
+    traceToJson(doc);
+    if (mode == 2)
+    {
+        uint32_t first = parameters.size() > 1 ? parameters[1].as<uint32_t>() : 0;
+        uint32_t oldest = doc["oldest"].as<uint32_t>();
+        if (first < oldest)
+            first = oldest;
+        static const char digits[] = "0123456789abcdef";
+        static char hex[TRACE_PAGE_RECORDS * TRACE_RECORD_SIZE * 2 + 1]; // off the control stack
+        uint32_t index = first;
+        TraceRecord record;
+        for (int i = 0; i < TRACE_PAGE_RECORDS && traceRead(index, record); i++, index++)
+        {
+            // Little endian, as the record sits in memory
+            uint8_t bytes[TRACE_RECORD_SIZE];
+            memcpy(bytes, &record.cycles, 4);
+            memcpy(bytes + 4, &record.word, 4);
+            for (int b = 0; b < TRACE_RECORD_SIZE; b++)
+            {
+                hex[(i * TRACE_RECORD_SIZE + b) * 2] = digits[bytes[b] >> 4];
+                hex[(i * TRACE_RECORD_SIZE + b) * 2 + 1] = digits[bytes[b] & 0x0F];
+            }
+        }
+        hex[(index - first) * TRACE_RECORD_SIZE * 2] = 0;
+        doc["first"] = first;
+        doc["next"] = index;
+        doc["records"] = hex;
+    }
+    send_json_respose(doc);
 }
 
-void ledOffCommand(unsigned char unused1, unsigned char unused2)
+// Headroom, header, samples and the event block
+static inline size_t slotSize(long samples)
 {
-    send_response(STATUS_TEXT_NOT_IMPLEMENTED);
+    return SLOT_HEADROOM + (size_t)BLOCK_SIZE * (samples + 2);
 }
 
-void boardLedOnCommand(unsigned char unused1, unsigned char unused2)
+// The rate streaming runs at, or the one rdatac would set up: CONFIG1 may have been written directly with wreg
+uint32_t streamRate()
 {
-    int state = adcRreg(ADS129x::GPIO);
-    state = state & 0xF7;
-    state = state | 0x80;
-    adcWreg(ADS129x::GPIO, state);
-    send_response_ok();
+    using namespace ADS129x;
+    return is_rdatac ? sample_rate : adcConfig1ToRate(adc_family, adcRreg(CONFIG1));
 }
 
-void boardLedOffCommand(unsigned char unused1, unsigned char unused2)
+/**
+ * Derives frame size and ring depth for a sample rate: a frame holds
+ * TARGET_FRAME_MS worth of samples and the ring TARGET_BUFFER_MS, as far as
+ * SAMPLE_POOL_SIZE allows. An unknown rate keeps the legacy 250 sample
+ * frames, as many as fit.
+ */
+StreamGeometry streamGeometry(uint32_t rate)
 {
-    int state = adcRreg(ADS129x::GPIO);
-    state = state & 0x77;
-    adcWreg(ADS129x::GPIO, state);
-    send_response_ok();
+    StreamGeometry geometry;
+    geometry.sample_rate = rate;
+    if (rate == 0)
+    {
+        geometry.samples_per_buffer = 250;
+        geometry.num_buffers = SAMPLE_POOL_SIZE / slotSize(250);
+        geometry.isr_load = 0;
+        geometry.link_kbps = 0;
+        return geometry;
+    }
+
+    int max_samples = (SAMPLE_POOL_SIZE / 2 - SLOT_HEADROOM) / BLOCK_SIZE - 2; // at least two frames
+    long samples = (long)rate * TARGET_FRAME_MS / 1000;
+    if (samples < 1)
+        samples = 1;
+    if (samples > max_samples)
+        samples = max_samples;
+    geometry.samples_per_buffer = samples;
+
+    long frames = ((long)TARGET_BUFFER_MS * rate + 1000L * samples - 1) / (1000L * samples);
+    long max_frames = SAMPLE_POOL_SIZE / slotSize(samples);
+    if (max_frames > MAX_BUFFERS)
+        max_frames = MAX_BUFFERS;
+    if (frames > max_frames)
+        frames = max_frames;
+    if (frames < 2)
+        frames = 2;
+    geometry.num_buffers = frames;
+
+    size_t read_size = adc_chip ? adc_chip->read_size : ADS_STATUS_SIZE + ADS_MAX_DATA_SIZE;
+    float sample_us = ISR_OVERHEAD_US + read_size * 8 * 1e6f / SPI_CLK;
+    float frames_per_second = (float)rate / samples;
+    geometry.isr_load = rate * sample_us / 1e6f;
+    geometry.link_kbps = (rate * BLOCK_SIZE + frames_per_second * (BLOCK_SIZE + FRAME_OVERHEAD_BYTES)) * 8 / 1000;
+    return geometry;
 }
 
-void helpCommand(unsigned char unused1, unsigned char unused2)
+bool streamSustainable(const StreamGeometry &geometry)
 {
-    ESP_LOGD("HELP", "Available commands:");
-    wsCommand.printCommands();
+    float frame_ms = 1000.0f * geometry.samples_per_buffer / geometry.sample_rate;
+    return geometry.isr_load <= MAX_ISR_LOAD && geometry.link_kbps <= LINK_BUDGET_KBPS && frame_ms > SEND_DELAY_MS;
 }
 
-void readRegisterCommand(unsigned char register_number, unsigned char unused1)
+/**
+ * Takes the layer lock once networkStep() has no frame from the ring in
+ * flight, so the ring can be emptied or resized under it. The caller
+ * unlocks.
+ */
+void lockIdleRing()
 {
-    using namespace ADS129x;
-    if (register_number >= 0 and register_number <= 255)
+    task_layer.lock();
+    while (frame_in_flight)
     {
-        unsigned char result = adcRreg(register_number);
-        JsonDocument doc;
+        task_layer.unlock();
+        vTaskDelay(1);
+        task_layer.lock();
+    }
+}
+
+// Only while the ISR is not writing into the ring, and under lockIdleRing()
+void applyStreamGeometry(const StreamGeometry &geometry)
+{
+    if (geometry.samples_per_buffer != samples_per_buffer || geometry.num_buffers != num_buffers)
+    {
+        // Retained frames no longer fit the slots
+        retained_count = 0;
+        resending = false;
+    }
+    samples_per_buffer = geometry.samples_per_buffer;
+    num_buffers = geometry.num_buffers;
+    packet_size = slotSize(samples_per_buffer);
+    retained_slots = SAMPLE_POOL_SIZE / packet_size - num_buffers;
+    current_buffer_index = 0;
+    current_sample_index = 0;
+    memset((void *)buffer_completed, 0, sizeof(buffer_completed));
+    memset((void *)buffer_framed, 0, sizeof(buffer_framed));
+    buffer_to_frame = 0;
+    buffer_to_send = 0;
+}
+
+void streamGeometryToJson(JsonDocument &doc, const StreamGeometry &geometry)
+{
+    doc["sample_rate"] = geometry.sample_rate;
+    doc["samples_per_frame"] = geometry.samples_per_buffer;
+    doc["frames"] = geometry.num_buffers;
+    if (geometry.sample_rate)
+    {
+        doc["frame_ms"] = 1000.0f * geometry.samples_per_buffer / geometry.sample_rate;
+        doc["buffer_ms"] = 1000.0f * geometry.samples_per_buffer * geometry.num_buffers / geometry.sample_rate;
+    }
+    doc["isr_load"] = geometry.isr_load;
+    doc["link_kbps"] = geometry.link_kbps;
+}
+
+void sampleRateCommand(JsonArray parameters)
+{
+    using namespace ADS129x;
+    JsonDocument doc;
+    if (parameters.isNull() || parameters.size() == 0)
+    {
+        // Report what is streaming, or what rdatac would set up
+        StreamGeometry geometry = streamGeometry(streamRate());
+        if (is_rdatac)
+        {
+            geometry.samples_per_buffer = samples_per_buffer;
+            geometry.num_buffers = num_buffers;
+        }
+        doc["response"] = STATUS_TEXT_OK;
+        streamGeometryToJson(doc, geometry);
+        send_json_respose(doc);
+        return;
+    }
+    if (is_rdatac)
+    {
+        send_response(STATUS_TEXT_STREAMING);
+        return;
+    }
+
+    uint32_t rate = parameters[0].as<uint32_t>();
+    uint8_t config1 = 0;
+    if (!adcRateToConfig1(adc_family, rate, adcRreg(CONFIG1), &config1))
+    {
+        send_response(STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    StreamGeometry geometry = streamGeometry(rate);
+    if (!streamSustainable(geometry))
+    {
+        doc["response"] = STATUS_TEXT_BANDWIDTH_EXCEEDED;
+        streamGeometryToJson(doc, geometry);
+        send_json_respose(doc);
+        return;
+    }
+    adcWreg(CONFIG1, config1);
+    lockIdleRing();
+    sample_rate = rate;
+    applyStreamGeometry(geometry);
+    task_layer.unlock();
+    doc["response"] = STATUS_TEXT_OK;
+    streamGeometryToJson(doc, geometry);
+    send_json_respose(doc);
+}
+
+void syncCommand(JsonArray parameters)
+{
+    TaskLock lock(task_layer);
+    int64_t t2 = wsCommand.receivedUs();
+    if (parameters.isNull() || parameters.size() == 0)
+    {
+        send_response(STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    int64_t t1 = parameters[0].as<int64_t>();
+    if (parameters.size() >= 3)
+    {
+        // The host reports when our previous reply arrived
+        if (have_last_sync && parameters[1].as<int64_t>() == last_sync_t1)
+            clock_sync.addExchange(last_sync_t1, last_sync_t2, last_sync_t3, parameters[2].as<int64_t>());
+    }
+    else
+    {
+        clock_sync.reset();
+    }
+
+    JsonDocument doc;
+    doc["response"] = STATUS_TEXT_OK;
+    doc["t1"] = t1;
+    doc["t2"] = t2;
+    doc["synced"] = clock_sync.synced();
+    doc["offset_us"] = clock_sync.offsetUs();
+    doc["drift_ppb"] = clock_sync.driftPpb();
+    doc["rtt_us"] = clock_sync.rttUs();
+    int64_t t3 = esp_timer_get_time();
+    doc["t3"] = t3;
+    last_sync_t1 = t1;
+    last_sync_t2 = t2;
+    last_sync_t3 = t3;
+    have_last_sync = true;
+    send_json_respose(doc);
+}
+
+void startAtCommand(JsonArray parameters)
+{
+    using namespace ADS129x;
+    int64_t host_us = !parameters.isNull() && parameters.size() > 0 ? parameters[0].as<int64_t>() : 0;
+    task_layer.lock();
+    bool synced = clock_sync.synced();
+    int64_t local = clock_sync.toLocal(host_us);
+    task_layer.unlock();
+    if (!synced)
+    {
+        send_response(STATUS_TEXT_NOT_SYNCED);
+        return;
+    }
+    if (parameters.isNull() || parameters.size() == 0)
+    {
+        send_response(STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    int64_t lead = local - esp_timer_get_time();
+    if (lead < START_MIN_LEAD_US || lead > START_MAX_LEAD_US)
+    {
+        send_response(STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    adcSendCommand(STOP);
+    task_layer.lock();
+    start_at_local_us = local;
+    start_pending = true;
+    task_layer.unlock();
+
+    JsonDocument doc;
+    doc["response"] = STATUS_TEXT_OK;
+    doc["local_us"] = local;
+    send_json_respose(doc);
+}
+
+void flashLogToJson(JsonDocument &doc)
+{
+    uint32_t sample = 0;
+    doc["recording"] = flash_log.recording();
+    doc["capacity"] = flash_log.capacity();
+    doc["used"] = flash_log.usedBytes();
+    doc["erased_ahead"] = flash_log.erasedAhead();
+    if (flash_log.oldestSample(sample))
+        doc["first_sample"] = sample;
+    if (flash_log.newestSample(sample))
+        doc["last_sample"] = sample;
+    doc["frames_written"] = flash_log.frames_written;
+    doc["frames_rejected"] = flash_log.frames_rejected;
+    doc["bytes_written"] = flash_log.bytes_written;
+    doc["write_us"] = (uint32_t)(flash_log.write_cycles / ESP.getCpuFreqMHz());
+}
+
+void recordCommand(JsonArray parameters)
+{
+    using namespace ADS129x;
+    if (!flash_log.available())
+    {
+        send_response(STATUS_TEXT_NO_LOG);
+        return;
+    }
+    bool start = !parameters.isNull() && parameters.size() > 0 && parameters[0].as<int>() != 0;
+    if (start && streamRate() > RECORD_MAX_RATE)
+    {
+        send_response(STATUS_TEXT_BANDWIDTH_EXCEEDED);
+        return;
+    }
+    TaskLock lock(task_layer);
+    if (start)
+        flash_log.start();
+    else if (!parameters.isNull() && parameters.size() > 0)
+        flash_log.stop();
+    JsonDocument doc;
+    doc["response"] = STATUS_TEXT_OK;
+    flashLogToJson(doc);
+    send_json_respose(doc);
+}
+
+void downloadCommand(JsonArray parameters)
+{
+    TaskLock lock(task_layer);
+    if (!flash_log.available())
+    {
+        send_response(STATUS_TEXT_NO_LOG);
+        return;
+    }
+    if (is_rdatac)
+    {
+        send_response(STATUS_TEXT_STREAMING);
+        return;
+    }
+    // Both read out through the ring
+    if (burst_state != BURST_OFF)
+    {
+        send_response(STATUS_TEXT_BUSY);
+        return;
+    }
+    uint32_t from = 0;
+    uint32_t to = UINT32_MAX;
+    if (!parameters.isNull() && parameters.size() > 0)
+        from = parameters[0].as<uint32_t>();
+    if (!parameters.isNull() && parameters.size() > 1)
+        to = parameters[1].as<uint32_t>();
+    if (from > to)
+    {
+        send_response(STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    flash_log.beginRead(from, to);
+    downloading = true;
+    download_frames = 0;
+    download_bytes = 0;
+
+    JsonDocument doc;
+    doc["response"] = STATUS_TEXT_OK;
+    flashLogToJson(doc);
+    send_json_respose(doc);
+}
+
+/**
+ * Turns on AC lead-off excitation for the active channels and sizes the
+ * Goertzel window for the current data rate. Not while streaming, the
+ * registers cannot be accessed in RDATAC mode.
+ */
+bool impedanceBegin()
+{
+    using namespace ADS129x;
+    uint8_t loff = 0;
+    if (!adcAcLeadOffConfig(adc_family, &loff))
+        return false;
+    detectActiveChannels();
+    float volts_per_count[IMPEDANCE_MAX_CHANNELS] = {0};
+    uint8_t config3 = adcRreg(CONFIG3);
+    uint8_t sensp = 0;
+    for (int i = 1; i <= max_channels && i <= IMPEDANCE_MAX_CHANNELS; i++)
+    {
+        if (!active_channels[i])
+            continue;
+        volts_per_count[i - 1] = adcVoltsPerCount(adc_family, adcRreg(adc_chip->ch1set + i - 1), config3);
+        sensp |= 1 << (i - 1);
+    }
+    adcWreg(LOFF, loff);
+    adcWreg(LOFF_SENSP, sensp);
+    adcWreg(LOFF_SENSN, 0);
+    adcWreg(LOFF_FLIP, 0);
+    uint32_t rate = adcConfig1ToRate(adc_family, adcRreg(CONFIG1));
+    TaskLock lock(task_layer);
+    impedance_meter.begin(rate, max_channels, volts_per_count, ADC_LEAD_OFF_CURRENT_A);
+    return true;
+}
+
+void impedanceEnd()
+{
+    using namespace ADS129x;
+    task_layer.lock();
+    impedance_meter.end();
+    task_layer.unlock();
+    if (adc_family == ADC_FAMILY_ADS129X || adc_family == ADC_FAMILY_ADS1299)
+    {
+        adcWreg(LOFF_SENSP, 0);
+        adcWreg(LOFF, LOFF_const);
+    }
+}
+
+void impedanceCommand(JsonArray parameters)
+{
+    JsonDocument doc;
+    if (!parameters.isNull() && parameters.size() > 0)
+    {
+        uint8_t mode = parameters[0].as<uint8_t>();
+        if (mode > IMPEDANCE_WITH_FRAMES)
+        {
+            send_response(STATUS_TEXT_BAD_REQUEST);
+            return;
+        }
+        if (is_rdatac)
+        {
+            send_response(STATUS_TEXT_STREAMING);
+            return;
+        }
+        if (mode == IMPEDANCE_OFF)
+            impedanceEnd();
+        else if (!impedanceBegin())
+        {
+            send_response(STATUS_TEXT_NOT_IMPLEMENTED);
+            return;
+        }
+    }
+    TaskLock lock(task_layer);
+    if (!parameters.isNull() && parameters.size() > 0)
+        impedance_mode = parameters[0].as<uint8_t>();
+    doc["response"] = STATUS_TEXT_OK;
+    doc["mode"] = impedance_mode;
+    if (impedance_meter.windows() > 0)
+        impedanceToJson(doc);
+    send_json_respose(doc);
+}
+
+/**
+ * Starts the statistics over the active channels at the current data rate
+ * and gains. Not while streaming, the registers cannot be read in RDATAC
+ * mode.
+ */
+void qualityBegin()
+{
+    using namespace ADS129x;
+    detectActiveChannels();
+    uint8_t config3 = adcRreg(CONFIG3);
+    float uv_per_count[QUALITY_MAX_CHANNELS] = {0};
+    for (int i = 1; i <= max_channels && i <= QUALITY_MAX_CHANNELS; i++)
+        if (active_channels[i])
+            uv_per_count[i - 1] = adcVoltsPerCount(adc_family, adcRreg(adc_chip->ch1set + i - 1), config3) * 1e6f;
+    uint32_t rate = adcConfig1ToRate(adc_family, adcRreg(CONFIG1));
+    TaskLock lock(task_layer);
+    memcpy(quality_uv_per_count, uv_per_count, sizeof(quality_uv_per_count));
+    quality_meter.begin(rate, max_channels, quality_line_hz);
+    quality_report = false;
+}
+
+/**
+ * [1] keeps running statistics of every active channel over one second
+ * windows: mean, RMS about it, extremes, codes at the rails and the RMS at
+ * the mains frequency, all in microvolts at the channel's gain. [2] also
+ * sends them after every window, [mode, 60] measures 60 Hz mains, and [0]
+ * stops. Without parameters reports the last window.
+ */
+void qualityCommand(JsonArray parameters)
+{
+    JsonDocument doc;
+    if (!parameters.isNull() && parameters.size() > 0)
+    {
+        uint8_t mode = parameters[0].as<uint8_t>();
+        uint16_t line_hz = parameters.size() > 1 ? parameters[1].as<uint16_t>() : 50;
+        if (mode > QUALITY_WITH_SUMMARY || (line_hz != 50 && line_hz != 60))
+        {
+            send_response(STATUS_TEXT_BAD_REQUEST);
+            return;
+        }
+        if (is_rdatac)
+        {
+            send_response(STATUS_TEXT_STREAMING);
+            return;
+        }
+        quality_line_hz = line_hz;
+        if (mode != QUALITY_OFF)
+            qualityBegin();
+    }
+    TaskLock lock(task_layer);
+    if (!parameters.isNull() && parameters.size() > 0)
+    {
+        quality_mode = parameters[0].as<uint8_t>();
+        if (quality_mode == QUALITY_OFF)
+            quality_meter.end();
+    }
+    doc["response"] = STATUS_TEXT_OK;
+    doc["mode"] = quality_mode;
+    if (quality_meter.windows() > 0)
+        qualityToJson(doc);
+    send_json_respose(doc);
+}
+
+/**
+ * [1] lets frames degrade to cheaper formats while the link backs up, down
+ * to max_level when given and never better than min_level; [0] keeps them
+ * raw, [0, level] keeps them at one level, say 2 for block floating point
+ * throughout. Reports the level now and what each level costs in bytes per
+ * sample with the active channels.
+ */
+void adaptiveCommand(JsonArray parameters)
+{
+    TaskLock lock(task_layer);
+    JsonDocument doc;
+    if (!parameters.isNull() && parameters.size() > 0)
+    {
+        uint8_t enable = parameters[0].as<uint8_t>();
+        uint8_t max_level = parameters.size() > 1 ? parameters[1].as<uint8_t>() : enable ? STREAM_LEVELS - 1 : 0;
+        uint8_t min_level = parameters.size() > 2 ? parameters[2].as<uint8_t>() : enable ? 0 : max_level;
+        if (enable > 1 || max_level >= STREAM_LEVELS || min_level > max_level || (!enable && parameters.size() > 2))
+        {
+            send_response(STATUS_TEXT_BAD_REQUEST);
+            return;
+        }
+        stream_adapter.begin(enable == 1, max_level, min_level);
+    }
+    doc["response"] = STATUS_TEXT_OK;
+    doc["enabled"] = stream_adapter.enabled();
+    doc["level"] = stream_adapter.level();
+    doc["min_level"] = stream_adapter.minLevel();
+    doc["max_level"] = stream_adapter.maxLevel();
+    doc["switches"] = stream_adapter.switches();
+    JsonArray bytes = doc["bytes_per_sample"].to<JsonArray>();
+    for (uint8_t level = 0; level < STREAM_LEVELS; level++)
+        bytes.add(streamBytesPerSample(level, num_active_channels));
+    send_json_respose(doc);
+}
+
+void montageToJson(JsonDocument &doc)
+{
+    doc["mode"] = montage_mode;
+    doc["output_mask"] = montage_mode != MONTAGE_RAW ? montage.outputMask() : active_channel_mask;
+    if (montage_mode == MONTAGE_RAW)
+        return;
+    // One row per output: its slot, a weight per channel, then the divisor
+    JsonArray rows = doc["rows"].to<JsonArray>();
+    for (int output = 0; output < MONTAGE_MAX_CHANNELS; output++)
+    {
+        if (!(montage.outputMask() & (1 << output)))
+            continue;
+        JsonArray row = rows.add<JsonArray>();
+        row.add(output);
+        for (int input = 0; input < max_channels; input++)
+            row.add(montage.weight(output, input));
+        row.add(montage.divisor(output));
+    }
+}
+
+/**
+ * Derives the streamed channels from the referential ones: [1] common
+ * average of the active channels, [2] bipolar chain over them, [3, mask]
+ * the active channels outside mask against the mean of those in it, and
+ * [4, output, weights..., divisor] sets one row of a custom montage, one
+ * weight per channel. [0] streams the raw channels again. Takes effect
+ * with the next frame, also while streaming.
+ */
+void montageCommand(JsonArray parameters)
+{
+    JsonDocument doc;
+    bool configure = !parameters.isNull() && parameters.size() > 0;
+    // The active channels are only read outside RDATAC, a stream keeps the last ones
+    if (configure && active_channel_mask == 0)
+        detectActiveChannels();
+    TaskLock lock(task_layer);
+    if (configure)
+    {
+        uint8_t mode = parameters[0].as<uint8_t>();
+        bool ok;
+        switch (mode)
+        {
+        case MONTAGE_RAW:
+            ok = true;
+            break;
+        case MONTAGE_COMMON_AVERAGE:
+            ok = montage.commonAverage(active_channel_mask);
+            break;
+        case MONTAGE_BIPOLAR:
+            ok = montage.bipolar(active_channel_mask);
+            break;
+        case MONTAGE_REFERENCE:
+            ok = parameters.size() == 2 && montage.reference(active_channel_mask, parameters[1].as<uint8_t>());
+            break;
+        case MONTAGE_CUSTOM:
+        {
+            int output = parameters.size() > 1 ? parameters[1].as<int>() : -1;
+            ok = (int)parameters.size() == 3 + max_channels;
+            int8_t weights[MONTAGE_MAX_CHANNELS] = {0};
+            for (int input = 0; ok && input < max_channels; input++)
+            {
+                int weight = parameters[2 + input].as<int>();
+                ok = weight >= -MONTAGE_MAX_WEIGHT && weight <= MONTAGE_MAX_WEIGHT;
+                weights[input] = weight;
+            }
+            int divisor = ok ? parameters[2 + max_channels].as<int>() : 0;
+            ok = ok && divisor >= 1 && divisor <= MONTAGE_MAX_DIVISOR;
+            // Rows add up while the montage stays custom
+            if (ok && montage_mode != MONTAGE_CUSTOM)
+                montage.clear();
+            ok = ok && montage.setRow(output, weights, divisor) && montage.compile();
+            break;
+        }
+        default:
+            ok = false;
+            break;
+        }
+        if (!ok)
+        {
+            send_response(STATUS_TEXT_BAD_REQUEST);
+            return;
+        }
+        montage_mode = mode;
+    }
+    doc["response"] = STATUS_TEXT_OK;
+    montageToJson(doc);
+    send_json_respose(doc);
+}
+
+uint32_t cycleCount()
+{
+    return ESP.getCycleCount();
+}
+
+// rate from streamRate(), read before taking the lock
+void pipelineToJson(JsonDocument &doc, uint32_t rate)
+{
+    doc["input_rate"] = rate;
+    doc["output_rate"] = pipeline.outputRate(rate);
+    // rdatac refuses a chain with a stage that does not suit the rate, e.g. after samplerate
+    doc["unfit_stage"] = pipeline.unfitStage(rate) + 1;
+    JsonArray stages = doc["stages"].to<JsonArray>();
+    for (int i = 0; i < pipeline.stages(); i++)
+    {
+        JsonArray stage = stages.add<JsonArray>();
+        stage.add(pipeline.kind(i));
+        stage.add(pipeline.value(i));
+    }
+    // Per input sample: convert, each stage, encode; against the cycles one sample period has
+    JsonArray cycles = doc["cycles_per_sample"].to<JsonArray>();
+    uint64_t samples = pipeline.samplesIn();
+    for (int slot = 0; pipeline.stages() > 0 && slot < pipeline.stages() + 2; slot++)
+        cycles.add(samples ? (float)pipeline.cycles(slot) / samples : 0.0f);
+    doc["cycles_per_period"] = rate ? ESP.getCpuFreqMHz() * 1000000UL / rate : 0;
+}
+
+/**
+ * Appends [kind, value] to the stages run over every frame before it is
+ * packed: 1 high pass and 2 low pass at value Hz, 3 a notch at value Hz, 4
+ * averages value samples into one, 5 applies the montage at that point
+ * instead of after the stages and 6 low passes the rectified signal at value
+ * Hz. Corners are checked against the rate streaming runs at or will run
+ * at. [0] removes them all. Takes effect with the next frame, also while
+ * streaming, with the filters starting from the steady state of their
+ * first sample.
+ */
+void pipelineCommand(JsonArray parameters)
+{
+    JsonDocument doc;
+    uint32_t rate = streamRate();
+    TaskLock lock(task_layer);
+    if (!parameters.isNull() && parameters.size() > 0)
+    {
+        uint8_t kind = parameters[0].as<uint8_t>();
+        if (kind == 0 && parameters.size() == 1)
+        {
+            // The envelopes the detector watched go with them
+            pipeline.clear();
+            emg_onsets.end();
+        }
+        else if (parameters.size() > 2 || !pipeline.append(kind, parameters[1].as<float>(), rate))
+        {
+            send_response(STATUS_TEXT_BAD_REQUEST);
+            return;
+        }
+    }
+    doc["response"] = STATUS_TEXT_OK;
+    pipelineToJson(doc, rate);
+    send_json_respose(doc);
+}
+
+void emgToJson(JsonDocument &doc, uint32_t rate)
+{
+    doc["emg"] = emg_onsets.enabled() ? 1 : 0;
+    if (!emg_onsets.enabled())
+        return;
+    doc["output_rate"] = pipeline.outputRate(rate);
+    doc["k_on"] = emg_onsets.kOn();
+    doc["k_off"] = emg_onsets.kOff();
+    doc["hold_ms"] = emg_onsets.holdMs();
+    doc["learning"] = emg_onsets.learning();
+    doc["dropped"] = emg_onsets.dropped(); // events that found the queue full
+    JsonArray channels = doc["channels"].to<JsonArray>();
+    for (int ch = 0; ch < ONSET_CHANNELS; ch++)
+    {
+        if (!(emg_onsets.channelMask() & (1 << ch)))
+            continue;
+        JsonObject channel = channels.add<JsonObject>();
+        channel["channel"] = ch + 1;
+        channel["active"] = emg_onsets.active(ch);
+        channel["baseline"] = roundf(emg_onsets.baseline(ch) * 10) / 10;
+        channel["deviation"] = roundf(emg_onsets.deviation(ch) * 10) / 10;
+        channel["onsets"] = emg_onsets.onsets(ch);
+    }
+}
+
+/**
+ * [1] replaces the pipeline with a high pass, a rectifier with a low pass
+ * at EMG_ENVELOPE_HZ and decimation to about EMG_OUTPUT_RATE, and starts
+ * the onset detector on the active channels; [1, k on, k off, hold ms]
+ * sets its thresholds in baseline deviations. [0] clears the pipeline and
+ * stops the detector. Uses the rate the stream runs at or, when idle, the
+ * one CONFIG1 sets, and is refused while that is unknown.
+ */
+void emgCommand(JsonArray parameters)
+{
+    JsonDocument doc;
+    uint32_t rate = streamRate();
+    bool configure = !parameters.isNull() && parameters.size() > 0;
+    if (configure && active_channel_mask == 0)
+        detectActiveChannels();
+    TaskLock lock(task_layer);
+    if (configure)
+    {
+        uint8_t mode = parameters[0].as<uint8_t>();
+        if (mode == 0 && parameters.size() == 1)
+        {
+            pipeline.clear();
+            emg_onsets.end();
+        }
+        else if (mode != 1 || (parameters.size() != 1 && parameters.size() != 4))
+        {
+            send_response(STATUS_TEXT_BAD_REQUEST);
+            return;
+        }
+        else
+        {
+            float k_on = parameters.size() == 4 ? parameters[1].as<float>() : ONSET_DEFAULT_K_ON;
+            float k_off = parameters.size() == 4 ? parameters[2].as<float>() : ONSET_DEFAULT_K_OFF;
+            uint32_t hold_ms = parameters.size() == 4 ? parameters[3].as<uint32_t>() : ONSET_DEFAULT_HOLD_MS;
+            // Two decimate stages reach rates a single one cannot
+            uint32_t total = rate / EMG_OUTPUT_RATE;
+            uint32_t first = 1, second = 1;
+            for (uint32_t a = 1; a <= PIPELINE_MAX_DECIMATION; a++)
+                for (uint32_t b = 1; b <= a; b++)
+                    if (a * b <= total && a * b > first * second)
+                    {
+                        first = a;
+                        second = b;
+                    }
+            pipeline.clear();
+            bool ok = rate > 0 && pipeline.append(PIPELINE_HIGHPASS, EMG_HIGHPASS_HZ, rate) &&
+                      pipeline.append(PIPELINE_ENVELOPE, EMG_ENVELOPE_HZ, rate) &&
+                      (first < 2 || pipeline.append(PIPELINE_DECIMATE, first, rate)) &&
+                      (second < 2 || pipeline.append(PIPELINE_DECIMATE, second, rate)) &&
+                      emg_onsets.begin(active_channel_mask, k_on, k_off, hold_ms);
+            if (!ok)
+            {
+                pipeline.clear();
+                emg_onsets.end();
+                send_response(STATUS_TEXT_BAD_REQUEST);
+                return;
+            }
+        }
+    }
+    doc["response"] = STATUS_TEXT_OK;
+    emgToJson(doc, rate);
+    send_json_respose(doc);
+}
+
+void selfTestToJson(JsonDocument &doc)
+{
+    if (self_testing)
+    {
+        doc["selftest"] = "running";
+        return;
+    }
+    if (self_test.channels() == 0)
+    {
+        doc["selftest"] = "none";
+        return;
+    }
+    doc["selftest"] = self_test_aborted ? "aborted" : self_test.passed(self_test_read_errors) ? "passed" : "failed";
+    doc["samples"] = self_test.samples();
+    doc["missed"] = self_test.missed();
+    doc["late"] = self_test.late();
+    doc["dropped"] = self_test_dropped; // by DRDY_ISR with the ring full, seen above as missed or late
+    doc["read_errors"] = self_test_read_errors;
+    doc["drdy_period_us"] = roundf(self_test.meanPeriodUs() * 100) / 100;
+    doc["drdy_nominal_us"] = roundf(self_test.nominalPeriodUs() * 100) / 100;
+    doc["drdy_max_deviation_us"] = self_test.maxPeriodDeviationUs();
+    doc["half_period_samples"] = self_test.expectedHalfPeriod();
+    JsonArray amplitude = doc["amplitude_ratio"].to<JsonArray>();
+    JsonArray offset = doc["offset_counts"].to<JsonArray>();
+    JsonArray edges = doc["edges"].to<JsonArray>();
+    JsonArray edge_error = doc["edge_error_samples"].to<JsonArray>();
+    JsonArray glitches = doc["glitches"].to<JsonArray>();
+    for (int ch = 0; ch < self_test.channels(); ch++)
+    {
+        amplitude.add(roundf(self_test.amplitude(ch) / self_test.expected(ch) * 1000) / 1000);
+        offset.add(lroundf(self_test.offset(ch)));
+        edges.add(self_test.edges(ch));
+        edge_error.add(self_test.edgeError(ch));
+        glitches.add(self_test.glitches(ch));
+    }
+}
+
+/**
+ * Routes every channel to the internal test signal at its current gain,
+ * streams it for the given seconds and checks each sample against the
+ * square wave it must be; serviceSelfTest() ends it. The frames go to the
+ * client as usual, so it can time the edges on its side of the link.
+ */
+void selfTestCommand(JsonArray parameters)
+{
+    using namespace ADS129x;
+    JsonDocument doc;
+    if (parameters.isNull() || parameters.size() == 0)
+    {
+        TaskLock lock(task_layer);
+        doc["response"] = STATUS_TEXT_OK;
+        selfTestToJson(doc);
+        send_json_respose(doc);
+        return;
+    }
+    uint32_t seconds = parameters[0].as<uint32_t>();
+    if (seconds == 0 || seconds > SELFTEST_MAX_SECONDS)
+    {
+        send_response(STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    if (is_rdatac || self_testing)
+    {
+        send_response(STATUS_TEXT_STREAMING);
+        return;
+    }
+    // Lead-off excitation would ride on the test signal, and a recording would keep it
+    if (impedance_mode != IMPEDANCE_OFF || flash_log.recording() || burst_state != BURST_OFF)
+    {
+        send_response(STATUS_TEXT_BUSY);
+        return;
+    }
+    uint8_t config2 = adcRreg(CONFIG2);
+    uint8_t config3 = adcRreg(CONFIG3);
+    uint8_t test_config2;
+    float amplitude_v;
+    float period_s;
+    if (!adc_chip || !adcTestSignalConfig(adc_family, config2, config3, &test_config2, &amplitude_v, &period_s))
+    {
+        send_response(STATUS_TEXT_NOT_IMPLEMENTED);
+        return;
+    }
+    adcSendCommand(STOP);
+    task_layer.lock();
+    start_pending = false;
+    task_layer.unlock();
+    self_test_config2 = config2;
+    float expected[SELFTEST_MAX_CHANNELS] = {0};
+    for (int ch = 0; ch < max_channels && ch < SELFTEST_MAX_CHANNELS; ch++)
+    {
+        uint8_t chset = adcRreg(adc_chip->ch1set + ch);
+        self_test_chset[ch] = chset;
+        // Powered up, and SRB2 open on the ADS1299; the ADS1292 MUX field is four bits
+        uint8_t test_chset = (chset & ~(PDn | 0x0F)) | TEST_SIGNAL;
+        adcWreg(adc_chip->ch1set + ch, test_chset);
+        float volts_per_count = adcVoltsPerCount(adc_family, test_chset, config3);
+        expected[ch] = volts_per_count > 0 ? amplitude_v / volts_per_count : 0;
+    }
+    adcWreg(CONFIG2, test_config2);
+    detectActiveChannels();
+    sample_rate = adcConfig1ToRate(adc_family, adcRreg(CONFIG1));
+    prepareStreaming();
+    task_layer.lock();
+    self_test.begin(sample_rate, max_channels, expected, period_s, seconds * sample_rate);
+    self_test_read_errors = perfStats.read_errors;
+    self_test_dropped = perfStats.samples_dropped;
+    self_test_deadline_ms = millis() + seconds * 1000 + SELFTEST_GRACE_MS;
+    self_test_aborted = false;
+    self_test_report = false;
+    self_testing = true;
+    task_layer.unlock();
+    sample_number_union.sample_number = 0;
+    is_rdatac = true;
+    adcSendCommand(RDATAC);
+    adcSendCommand(START);
+
+    doc["response"] = STATUS_TEXT_OK;
+    doc["selftest"] = "running";
+    doc["seconds"] = seconds;
+    doc["samples"] = seconds * sample_rate;
+    doc["test_amplitude_uV"] = roundf(amplitude_v * 1e7f) / 10;
+    doc["test_period_ms"] = roundf(period_s * 1e4f) / 10;
+    send_json_respose(doc);
+}
+
+/**
+ * Ends the self-test once its samples are in, the client stopped the stream
+ * or the deadline passed with samples still due, which fails it, and puts
+ * the channels back the way they were.
+ */
+void serviceSelfTest()
+{
+    using namespace ADS129x;
+    if (!self_testing)
+        return;
+    task_layer.lock();
+    bool finished = !self_test.active();
+    task_layer.unlock();
+    if (!finished && is_rdatac && (int32_t)(millis() - self_test_deadline_ms) < 0)
+        return;
+    adcSendCommand(STOP);
+    bool aborted = !finished && !is_rdatac;
+    if (is_rdatac)
+        endStreaming();
+    for (int ch = 0; ch < max_channels && ch < SELFTEST_MAX_CHANNELS; ch++)
+        adcWreg(adc_chip->ch1set + ch, self_test_chset[ch]);
+    adcWreg(CONFIG2, self_test_config2);
+    detectActiveChannels();
+    TaskLock lock(task_layer);
+    self_test.end();
+    self_test_aborted = aborted;
+    // From the counts when it started to those during it
+    self_test_read_errors = perfStats.read_errors - self_test_read_errors;
+    self_test_dropped = perfStats.samples_dropped - self_test_dropped;
+    self_testing = false;
+    self_test_report = true;
+}
+
+void burstToJson(JsonDocument &doc)
+{
+    static const char *states[] = {"off", "capturing", "draining"};
+    doc["state"] = states[burst_state];
+    if (burst_state == BURST_OFF)
+    {
+        // What [1] with no window would get
+        uint32_t read_size = adc_chip ? adc_chip->read_size : 0;
+        size_t largest = heap_caps_get_largest_free_block(BURST_HEAP_CAPS);
+        doc["rate"] = adcMaxRate(adc_family);
+        doc["capacity"] = read_size && largest > BURST_HEAP_RESERVE ? (largest - BURST_HEAP_RESERVE) / read_size : 0;
+        return;
+    }
+    doc["rate"] = burst.rate();
+    doc["capacity"] = burst.capacity();
+    doc["pre"] = burst.pre();
+    doc["post"] = burst.post();
+    doc["triggered"] = burst.triggered();
+    doc["written"] = burst.written();
+    doc["gaps"] = burst.gaps();
+}
+
+/**
+ * [1, pre, post] samples at the chip's top rate into a buffer taken from
+ * the heap, keeping the last pre conversions until a trigger edge or [2]
+ * and then post more, so the window holds the trigger sample and what led
+ * up to it. [1] alone splits the largest buffer the heap allows in halves.
+ * [0] aborts. controlStep() stops the conversions once the window is in and
+ * networkStep() sends it at link speed, followed by a burst done message.
+ */
+void burstCommand(JsonArray parameters)
+{
+    using namespace ADS129x;
+    JsonDocument doc;
+    uint8_t action = !parameters.isNull() && parameters.size() > 0 ? parameters[0].as<uint8_t>() : UINT8_MAX;
+    if (action == 0)
+    {
+        // serviceBurst() sees RDATAC end and reports the capture aborted
+        if (burst_state == BURST_CAPTURING)
+            endStreaming();
+        TaskLock lock(task_layer);
+        if (burst_state == BURST_DRAINING)
+            burst_cursor = burst.last();
+        burst_aborted = burst_state != BURST_OFF;
+    }
+    else if (action == 2)
+    {
+        if (burst_state != BURST_CAPTURING)
+        {
+            send_response(STATUS_TEXT_BAD_REQUEST);
+            return;
+        }
+        burst.trigger(micros());
+    }
+    else if (action == 1)
+    {
+        if (is_rdatac || self_testing)
+        {
+            send_response(STATUS_TEXT_STREAMING);
+            return;
+        }
+        if (burst_state != BURST_OFF || impedance_mode != IMPEDANCE_OFF || flash_log.recording() || downloading)
+        {
+            send_response(STATUS_TEXT_BUSY);
+            return;
+        }
+        uint32_t rate = adcMaxRate(adc_family);
+        uint8_t config1 = adcRreg(CONFIG1);
+        uint8_t burst_config1_value;
+        if (!adc_chip || !adcRateToConfig1(adc_family, rate, config1, &burst_config1_value))
+        {
+            send_response(STATUS_TEXT_NOT_IMPLEMENTED);
+            return;
+        }
+        detectActiveChannels();
+        if (num_active_channels == 0)
+        {
+            send_response(STATUS_TEXT_NO_ACTIVE_CHANNELS);
+            return;
+        }
+        size_t largest = heap_caps_get_largest_free_block(BURST_HEAP_CAPS);
+        uint32_t capacity = largest > BURST_HEAP_RESERVE ? (largest - BURST_HEAP_RESERVE) / adc_chip->read_size : 0;
+        uint32_t pre = parameters.size() > 1 ? parameters[1].as<uint32_t>() : capacity / 2;
+        uint32_t post = parameters.size() > 2 ? parameters[2].as<uint32_t>() : capacity - pre;
+        if (post == 0 || (uint64_t)pre + post > capacity)
+        {
+            doc["response"] = STATUS_TEXT_BAD_REQUEST;
+            doc["capacity"] = capacity;
+            send_json_respose(doc);
+            return;
+        }
+        burst_buffer = (uint8_t *)heap_caps_malloc((size_t)(pre + post) * adc_chip->read_size, BURST_HEAP_CAPS);
+        if (!burst_buffer)
+        {
+            send_response(STATUS_TEXT_ERROR);
+            return;
+        }
+        adcWreg(CONFIG1, burst_config1_value);
+        task_layer.lock();
+        burst.begin(burst_buffer, pre + post, adc_chip->read_size, pre, post, rate);
+        burst_config1 = config1;
+        sample_rate = rate;
+        burst_aborted = false;
+        burst_frames = 0;
+        burst_state = BURST_CAPTURING;
+        task_layer.unlock();
+        is_rdatac = true;
+        adcSendCommand(RDATAC);
+        // Record n is conversion n since here
+        adcSendCommand(START);
+        status_led.post(STATUS_LED_STREAMING);
+    }
+    TaskLock lock(task_layer);
+    doc["response"] = STATUS_TEXT_OK;
+    burstToJson(doc);
+    send_json_respose(doc);
+}
+
+/**
+ * Leaves RDATAC once the window is in, or once the client stopped it
+ * before, which aborts the capture, and puts the rate back. The frames are
+ * sent from the buffer after that, so none of it can be overwritten.
+ */
+void serviceBurst()
+{
+    using namespace ADS129x;
+    if (burst_state != BURST_CAPTURING)
+        return;
+    bool frozen = burst.frozen();
+    if (!frozen && is_rdatac)
+        return;
+    if (is_rdatac)
+        endStreaming();
+    adcWreg(CONFIG1, burst_config1);
+    TaskLock lock(task_layer);
+    burst_aborted = !frozen;
+    sample_rate = adcConfig1ToRate(adc_family, burst_config1);
+    burst_cursor = frozen ? burst.first() : burst.last();
+    burst_state = BURST_DRAINING;
+}
+
+/**
+ * Sends the next BURST_FRAME_SAMPLES records of a frozen window as a frame
+ * per call, with the trigger event in the frame that holds the trigger
+ * sample, then reports the capture done and gives the buffer back.
+ */
+void sendBurstFrame()
+{
+    if (burst_state != BURST_DRAINING)
+        return;
+    if (burst_cursor < burst.last())
+    {
+        // The ring is idle while not streaming
+        uint8_t *frame = ringFrame(0);
+        uint32_t samples = burst.last() - burst_cursor;
+        if (samples > BURST_FRAME_SAMPLES)
+            samples = BURST_FRAME_SAMPLES;
+        size_t data_size = adc_chip->read_size - ADS_STATUS_SIZE;
+        for (uint32_t i = 0; i < samples; i++)
+        {
+            uint32_t index = burst_cursor + i;
+            uint32_t timestamp = burst.timestamp(index);
+            uint8_t *block = frame + (i + 1) * BLOCK_SIZE;
+            memcpy(block, &timestamp, TIMESTAMP_SIZE_IN_BYTES);
+            memcpy(block + TIMESTAMP_SIZE_IN_BYTES, &index, SAMPLE_NUMBER_SIZE_IN_BYTES);
+            uint8_t *data = block + TIMESTAMP_SIZE_IN_BYTES + SAMPLE_NUMBER_SIZE_IN_BYTES;
+            memcpy(data, burst.record(index) + ADS_STATUS_SIZE, data_size);
+            memset(data + data_size, 0, ADS_MAX_DATA_SIZE - data_size);
+        }
+        fillFrameHeader(frame);
+        FrameHeader *header = (FrameHeader *)frame;
+        header->samples = samples;
+        header->sample_rate = burst.rate();
+        header->flags |= FRAME_FLAG_BURST;
+        uint32_t trigger = burst.triggerIndex();
+        if (trigger >= burst_cursor && trigger < burst_cursor + samples)
+        {
+            FrameEventBlock *events = (FrameEventBlock *)(frame + (samples + 1) * BLOCK_SIZE);
+            memset(events, 0, sizeof(*events));
+            events->count = 1;
+            events->events[0].sample_number = trigger;
+            events->events[0].source = FRAME_EVENT_TRIGGER;
+            events->events[0].offset_us = burst.triggerOffsetUs();
+            header->flags |= FRAME_FLAG_EVENTS;
+        }
+        if (sendFrame(frame, frameLength(header)))
+            burst_frames++;
+        burst_cursor += samples;
+        return;
+    }
+    JsonDocument doc;
+    doc["response"] = STATUS_TEXT_OK;
+    doc["burst"] = burst_aborted ? "aborted" : "done";
+    doc["rate"] = burst.rate();
+    doc["first"] = burst_aborted ? 0 : burst.first();
+    doc["trigger"] = burst.triggerIndex();
+    doc["samples"] = burst_aborted ? 0 : burst.last() - burst.first();
+    doc["frames"] = burst_frames;
+    doc["gaps"] = burst.gaps();
+    doc["read_errors"] = burst.readErrors();
+    burst.end();
+    heap_caps_free(burst_buffer);
+    burst_buffer = NULL;
+    burst_state = BURST_OFF;
+    send_json_message(doc);
+}
+
+/**
+ * Queues a marker event. With a host time (clock sync needed) the event is
+ * placed at that instant, otherwise at the moment the command runs, and
+ * stamped with the first sample taken at or after it.
+ */
+void markCommand(JsonArray parameters)
+{
+    TaskLock lock(task_layer);
+    if (!is_rdatac || burst_state != BURST_OFF)
+    {
+        send_response(STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    // The last sample taken and its timestamp, from one DRDY_ISR pass
+    uint32_t next_sample, last_timestamp, generation;
+    do
+    {
+        generation = __atomic_load_n(&sample_generation, __ATOMIC_ACQUIRE);
+        next_sample = sample_number_union.sample_number;
+        last_timestamp = timestamp_union.timestamp;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((generation & 1) || generation != sample_generation);
+
+    FrameEvent event;
+    event.source = FRAME_EVENT_MARK;
+    event.code = 0;
+    if (!parameters.isNull() && parameters.size() > 0)
+        event.code = parameters[0].as<uint8_t>();
+    int64_t elapsed_us = (int32_t)((uint32_t)micros() - last_timestamp);
+    if (!parameters.isNull() && parameters.size() > 1)
+    {
+        if (!clock_sync.synced())
+        {
+            send_response(STATUS_TEXT_NOT_SYNCED);
+            return;
+        }
+        int64_t local = clock_sync.toLocal(parameters[1].as<int64_t>());
+        elapsed_us = local - (esp_timer_get_time() - elapsed_us);
+    }
+    if (elapsed_us < -(int64_t)START_MAX_LEAD_US || elapsed_us > START_MAX_LEAD_US || sample_rate == 0)
+    {
+        send_response(STATUS_TEXT_BAD_REQUEST);
+        return;
+    }
+    if (mark_count >= EVENT_QUEUE_SIZE)
+    {
+        // Frames take three events each, so the queue drains and the client can retry
+        events_dropped++;
+        send_response(STATUS_TEXT_BUSY);
+        return;
+    }
+    // Whole sample periods between the last sample and the event, rounded down
+    int64_t scaled = elapsed_us * sample_rate;
+    int64_t periods = scaled >= 0 ? scaled / 1000000 : -((-scaled + 999999) / 1000000);
+    int64_t offset = elapsed_us - periods * 1000000 / sample_rate;
+    event.sample_number = next_sample + periods;
+    event.offset_us = offset > UINT16_MAX ? UINT16_MAX : offset;
+    mark_events[mark_count++] = event;
+
+    JsonDocument doc;
+    doc["response"] = STATUS_TEXT_OK;
+    doc["sample"] = event.sample_number;
+    send_json_respose(doc);
+}
+
+void resendCommand(JsonArray parameters)
+{
+    TaskLock lock(task_layer);
+    JsonDocument doc;
+    if (!parameters.isNull() && parameters.size() > 0)
+    {
+        uint32_t from = parameters[0].as<uint32_t>();
+        uint32_t to = parameters.size() > 1 ? parameters[1].as<uint32_t>() : UINT32_MAX;
+        if (from > to)
+        {
+            send_response(STATUS_TEXT_BAD_REQUEST);
+            return;
+        }
+        resend_from = from;
+        resend_to = to;
+        resend_cursor = retained_total - retained_count;
+        resend_frames = 0;
+        resending = true;
+    }
+    doc["response"] = STATUS_TEXT_OK;
+    doc["frames"] = retained_count;
+    if (retained_count > 0)
+    {
+        const FrameHeader *oldest = (const FrameHeader *)retainedFrame(retained_total - retained_count);
+        const FrameHeader *newest = (const FrameHeader *)retainedFrame(retained_total - 1);
+        doc["first_sample"] = oldest->first_sample;
+        doc["last_sample"] = frameLastSample(newest);
+    }
+    if (sample_rate)
+        doc["window_ms"] = 1000.0f * retained_slots * samples_per_buffer / sample_rate;
+    send_json_respose(doc);
+}
+
+void nopCommand(unsigned char unused1, unsigned char unused2)
+{
+    send_response_ok();
+}
+
+void microsCommand(unsigned char unused1, unsigned char unused2)
+{
+    unsigned long microseconds = micros();
+    JsonDocument doc;
+    doc["response"] = microseconds;
+    send_json_respose(doc);
+}
+
+void serialNumberCommand(unsigned char unused1, unsigned char unused2)
+{
+    send_response(STATUS_TEXT_NOT_IMPLEMENTED);
+}
+
+void ledOnCommand(unsigned char unused1, unsigned char unused2)
+{
+    send_response(STATUS_TEXT_NOT_IMPLEMENTED);
+}
+
+void ledOffCommand(unsigned char unused1, unsigned char unused2)
+{
+    send_response(STATUS_TEXT_NOT_IMPLEMENTED);
+}
+
+void boardLedOnCommand(unsigned char unused1, unsigned char unused2)
+{
+    int state = adcRreg(ADS129x::GPIO);
+    state = state & 0xF7;
+    state = state | 0x80;
+    adcWreg(ADS129x::GPIO, state);
+    send_response_ok();
+}
+
+void boardLedOffCommand(unsigned char unused1, unsigned char unused2)
+{
+    int state = adcRreg(ADS129x::GPIO);
+    state = state & 0x77;
+    adcWreg(ADS129x::GPIO, state);
+    send_response_ok();
+}
+
+void helpCommand(unsigned char unused1, unsigned char unused2)
+{
+    ESP_LOGD("HELP", "Available commands:");
+    wsCommand.printCommands();
+}
+
+void readRegisterCommand(unsigned char register_number, unsigned char unused1)
+{
+    using namespace ADS129x;
+    if (register_number >= 0 and register_number <= 255)
+    {
+        unsigned char result = adcRreg(register_number);
+        JsonDocument doc;
 
         doc["response"] = result;
         send_json_respose(doc);
@@ -425,9 +2534,15 @@ void standbyCommand(unsigned char unused1, unsigned char unused2)
     send_response_ok();
 }
 
+// adsSetup() leaves RDATAC, which would have DRDY_ISR read a chip that no longer streams
 void resetCommand(unsigned char unused1, unsigned char unused2)
 {
     using namespace ADS129x;
+    if (is_rdatac)
+    {
+        send_response(STATUS_TEXT_STREAMING);
+        return;
+    }
     adcSendCommand(RESET);
     adsSetup();
     send_response_ok();
@@ -445,17 +2560,61 @@ void stopCommand(unsigned char unused1, unsigned char unused2)
 {
     using namespace ADS129x;
     adcSendCommand(STOP);
+    task_layer.lock();
+    start_pending = false;
+    task_layer.unlock();
     send_response_ok();
 }
 
+// Sizes the ring for sample_rate and resets what follows the stream, before RDATAC
+void prepareStreaming()
+{
+    // Follow channel and rate changes made since impedance was turned on
+    if (impedance_mode != IMPEDANCE_OFF)
+        impedanceBegin();
+    if (quality_mode != QUALITY_OFF)
+        qualityBegin();
+    lockIdleRing();
+    // The download reads through the ring
+    downloading = false;
+    applyStreamGeometry(streamGeometry(sample_rate));
+    stream_adapter.begin(stream_adapter.enabled(), stream_adapter.maxLevel(), stream_adapter.minLevel());
+    pipeline.reset();
+    emg_onsets.reset();
+    task_layer.unlock();
+}
+
 void rdatacCommand(unsigned char unused1, unsigned char unused2)
 {
     using namespace ADS129x;
+    if (burst_state != BURST_OFF)
+    {
+        send_response(STATUS_TEXT_BUSY);
+        return;
+    }
     detectActiveChannels();
     if (num_active_channels > 0)
     {
+        if (!is_rdatac)
+        {
+            // CONFIG1 may have been written directly with wreg
+            sample_rate = adcConfig1ToRate(adc_family, adcRreg(CONFIG1));
+            if (flash_log.recording() && sample_rate > RECORD_MAX_RATE)
+            {
+                send_response(STATUS_TEXT_BANDWIDTH_EXCEEDED);
+                return;
+            }
+            // Rather than stream a stage that would pass samples through unfiltered
+            if (pipeline.unfitStage(sample_rate) >= 0)
+            {
+                send_response(STATUS_TEXT_PIPELINE_RATE);
+                return;
+            }
+            prepareStreaming();
+        }
         is_rdatac = true;
         adcSendCommand(RDATAC);
+        status_led.post(STATUS_LED_STREAMING);
         send_response_ok();
     }
     else
@@ -464,16 +2623,32 @@ void rdatacCommand(unsigned char unused1, unsigned char unused2)
     }
 }
 
-void sdatacCommand(unsigned char unused1, unsigned char unused2)
+// Leaves RDATAC and empties the ring
+void endStreaming()
 {
     using namespace ADS129x;
     is_rdatac = false;
+    adcSendCommand(SDATAC);
+    lockIdleRing();
+    // A command can run between DRDY_ISR completing a buffer and its
+    // framing; frame what is complete so the log keeps every sample
+    for (int i = 0; i < num_buffers && frameNextBuffer(); i++)
+        ;
     current_buffer_index = 0;
     current_sample_index = 0;
     memset((void*)buffer_completed, 0, sizeof(buffer_completed));
+    memset((void *)buffer_framed, 0, sizeof(buffer_framed));
+    buffer_to_frame = 0;
     buffer_to_send = 0;
-    adcSendCommand(SDATAC);
-    using namespace ADS129x;
+    // Idle erasing would recycle what was just recorded
+    flash_log.stop();
+    task_layer.unlock();
+    status_led.post(STATUS_LED_CONNECTED);
+}
+
+void sdatacCommand(unsigned char unused1, unsigned char unused2)
+{
+    endStreaming();
     send_response_ok();
 }
 
@@ -489,125 +2664,181 @@ void detectActiveChannels()
         return; // we can not read registers when in RDATAC mode
     // Serial.println("Detect active channels: ");
     using namespace ADS129x;
-    num_active_channels = 0;
+    uint8_t mask = 0;
     for (int i = 1; i <= max_channels; i++)
     {
         delayMicroseconds(1);
-        int chSet = adcRreg(CHnSET + i);
-        active_channels[i] = ((chSet & 7) != SHORTED);
+        int chSet = adcRreg(adc_chip->ch1set + i - 1);
         if ((chSet & 7) != SHORTED)
-            num_active_channels++;
+            mask |= 1 << (i - 1);
+    }
+    // Read by the frame and report steps
+    TaskLock lock(task_layer);
+    num_active_channels = 0;
+    active_channel_mask = mask;
+    for (int i = 1; i <= max_channels; i++)
+    {
+        active_channels[i] = (mask >> (i - 1)) & 1;
+        num_active_channels += active_channels[i];
     }
 }
 
-uint8_t readData(uint8_t *data)
-{
-    uint8_t status[ADS_STATUS_SIZE];
-    memset(status, 0, ADS_STATUS_SIZE);
-    memset(data, 0, ADS_DATA_SIZE);
-    digitalWrite(PIN_CS, LOW);
-    spiRec(status, ADS_STATUS_SIZE);
-    spiRec(data, ADS_DATA_SIZE);
-    digitalWrite(PIN_CS, HIGH);
-    return 0;
-}
-
+// One copy per chip, attached by adsSetup()
+template <class Chip>
 void IRAM_ATTR DRDY_ISR(void)
 {
+    uint32_t entry_cycles = ESP.getCycleCount();
     // Confirm if device is in RDATAC mode
     if (!is_rdatac)
         return;
+    perfDrdyEntry(entry_cycles);
+    traceEvent(TRACE_DRDY, sample_number_union.sample_number);
+    if (burst_state == BURST_CAPTURING)
+    {
+        // Raw records straight into the burst buffer; once it froze the rest are left unread.
+        // One a command transaction holds the bus for is missing, the burst sees the gap
+        uint8_t *record = burst.next();
+        if (record && adcBusClaim())
+        {
+            uint32_t now = micros();
+            traceEvent(TRACE_READ_BEGIN, 0);
+            bool aligned = AdsReadout<Chip>::readRecord(record, now);
+            traceEvent(TRACE_READ_END, aligned);
+            if (!aligned)
+                perfStats.read_errors++;
+            burst.commit(now, aligned);
+        }
+        perfRecordCycles(perfStats.isr_duration, ESP.getCycleCount() - entry_cycles);
+        return;
+    }
     // Check if the next buffer is available (not yet sent over WebSocket)
-    if (buffer_completed[current_buffer_index])
+    // A command transaction waits for the read before it claims the bus, so
+    // finding it claimed is rare; the sample is lost like one with the ring full
+    if (buffer_completed[current_buffer_index] || !adcBusClaim())
     {
         // The current buffer is still full and not sent yet, we skip  this write to avoid overflow
-        ESP_LOGD("ERROR", "Buffer Overflow detected at buffer %d", current_buffer_index);
+        perfStats.samples_dropped++;
+        // The number is spent, so the client sees the loss as a gap; marks count from its time
+        sampleGenerationBump();
+        timestamp_union.timestamp = micros();
+        sample_number_union.sample_number++;
+        sampleGenerationBump();
         return;
     }
     // Get a pointer to the current position in the buffer
-    uint8_t *buffer_ptr = &data_buffers[current_buffer_index][current_sample_index * BLOCK_SIZE];
+    uint8_t *buffer_ptr = &sample_pool[current_buffer_index * packet_size + SLOT_HEADROOM + (current_sample_index + 1) * BLOCK_SIZE];
+    sampleGenerationBump();
     timestamp_union.timestamp = micros();
     // Add timestamp Bytes to data
     buffer_ptr[0] = timestamp_union.timestamp_bytes[0];
     buffer_ptr[1] = timestamp_union.timestamp_bytes[1];
     buffer_ptr[2] = timestamp_union.timestamp_bytes[2];
     buffer_ptr[3] = timestamp_union.timestamp_bytes[3];
+
+    // The status word lands on the sample number, which is written after it has been checked
+    traceEvent(TRACE_READ_BEGIN, 0);
+    bool aligned = AdsReadout<Chip>::read(buffer_ptr + TIMESTAMP_SIZE_IN_BYTES + SAMPLE_NUMBER_SIZE_IN_BYTES, timestamp_union.timestamp);
+    traceEvent(TRACE_READ_END, aligned);
+    if (!aligned)
+        perfStats.read_errors++;
     // Add counter Bytes to data
     buffer_ptr[4] = sample_number_union.sample_number_bytes[0];
     buffer_ptr[5] = sample_number_union.sample_number_bytes[1];
     buffer_ptr[6] = sample_number_union.sample_number_bytes[2];
     buffer_ptr[7] = sample_number_union.sample_number_bytes[3];
-
-    readData(buffer_ptr + TIMESTAMP_SIZE_IN_BYTES + SAMPLE_NUMBER_SIZE_IN_BYTES);
     sample_number_union.sample_number++;
+    sampleGenerationBump();
 
     // Update sample index and buffer management
     current_sample_index++;
 
-    if (current_sample_index >= SAMPLES_PER_BUFFER)
+    if (current_sample_index >= samples_per_buffer)
     {
         // Mark the current buffer as completed
         buffer_completed[current_buffer_index] = true;
+        traceEvent(TRACE_FRAME_COMPLETE, current_buffer_index);
 
         // Move to the next buffer in a circular manner
-        current_buffer_index = (current_buffer_index + 1) % NUM_BUFFERS;
+        current_buffer_index = (current_buffer_index + 1) % num_buffers;
         current_sample_index = 0; // Reset the sample index for the new buffer
+        perfRingOccupancy(completedBuffers());
+    }
+    perfRecordCycles(perfStats.isr_duration, ESP.getCycleCount() - entry_cycles);
+}
+
+/**
+ * Falling edge on the trigger input: stamped with the sample DRDY_ISR takes
+ * next, and the time since the last one.
+ */
+void IRAM_ATTR TRIGGER_ISR(void)
+{
+    uint32_t now = micros();
+    if (!is_rdatac || now - trigger_last_us < TRIGGER_HOLDOFF_US)
+        return;
+    trigger_last_us = now;
+    if (burst_state == BURST_CAPTURING)
+    {
+        burst.trigger(now);
+        return;
+    }
+    uint8_t head = trigger_head;
+    uint8_t next = (head + 1) % EVENT_QUEUE_SIZE;
+    if (next == trigger_tail)
+    {
+        events_dropped++;
+        return;
     }
+    FrameEvent &event = trigger_events[head];
+    event.sample_number = sample_number_union.sample_number;
+    event.source = FRAME_EVENT_TRIGGER;
+    event.code = 0;
+    uint32_t offset = now - timestamp_union.timestamp;
+    event.offset_us = offset > UINT16_MAX ? UINT16_MAX : offset;
+    trigger_head = next;
 }
 
+// Takes the DRDY_ISR and register layout built for the detected chip
+struct ChipSetup
+{
+    const AdcChip *chip;
+
+    template <class Chip>
+    void use()
+    {
+        chip = adcChip<Chip>();
+        attachInterrupt(PIN_DRDY, DRDY_ISR<Chip>, FALLING);
+        adcPowerUp<Chip>();
+    }
+};
+
+// Waits for the chip without the layer lock, which it takes only to publish what it found
 void adsSetup()
-{ // default settings for ADS1298 and compatible chips
+{
     using namespace ADS129x;
     // Send SDATAC Command (Stop Read Data Continuously mode)
-    attachInterrupt(PIN_DRDY, DRDY_ISR, FALLING);
     adcSendCommand(SDATAC);
     delay(100);
     int val = adcRreg(ID);
-    // For ADS21292R
-    if(val == B01110011){
-        hardware_type = "ADS1292R";
-        ESP_LOGD("ADC", "ADS1292R detected");
-        max_channels = 2;
-    }
-    switch (val & B00011111)
-    {
-    case B10000:
-        hardware_type = "ADS1294";
-        ESP_LOGD("ADC", "ADS1294 detected");
-        max_channels = 4;
-        break;
-    case B10001:
-        hardware_type = "ADS1296";
-        ESP_LOGD("ADC", "ADS1296 detected");
-        max_channels = 6;
-        break;
-    case B10010:
-        hardware_type = "ADS1298";
-        ESP_LOGD("ADC", "ADS1298 detected");
-        max_channels = 8;
-        break;
-    case B11110:
-        hardware_type = "ADS1299";
-        ESP_LOGD("ADC", "ADS1299 detected");
-        max_channels = 8;
-        break;
-    case B11100:
-        hardware_type = "ADS1299-4";
-        ESP_LOGD("ADC", "ADS1299-4 detected");
-        max_channels = 4;
-        break;
-    case B11101:
-        hardware_type = "ADS1299-6";
-        ESP_LOGD("ADC", "ADS1299-6 detected");
-        max_channels = 6;
-        break;
-    default:
+    ChipSetup setup = {NULL};
+    bool known = adcDispatch(val, setup);
+    task_layer.lock();
+    adc_chip = setup.chip;
+    if (known)
+    {
+        hardware_type = adc_chip->name;
+        max_channels = adc_chip->channels;
+        adc_family = adc_chip->family;
+    }
+    else
+    {
         max_channels = 0;
+        adc_family = ADC_FAMILY_UNKNOWN;
     }
-
-    // All GPIO set to output 0x0000: (floating CMOS inputs can flicker on and off, creating noise)
-    adcWreg(ADS129x::GPIO, 0);
-    adcWreg(CONFIG3, PD_REFBUF | CONFIG3_const);
+    task_layer.unlock();
+    if (known)
+        ESP_LOGD("ADC", "%s detected", adc_chip->name);
+    else
+        ESP_LOGE("ADC", "Unknown chip, ID 0x%02X", val);
     adcSendCommand(ADS129x::START);
 }
 
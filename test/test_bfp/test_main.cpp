@@ -0,0 +1,222 @@
+/*
+ * Block floating point packing bounds and pinned-level streams
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Packs synthetic frames at the block floating point levels for signals
+ * from a few codes to the rails, decodes them with streamDecode() and
+ * checks every record against the mean it stands for: within half a step
+ * of its channel's shift, and the shift the smallest that fits. The error
+ * of the fixed upper 16 bits is printed alongside. Then streams from the
+ * simulated firmware with the level pinned to 24 bit codes and to block
+ * floating point, and prints how the bytes on the link compare.
+ */
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+#include "streamformat.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const int FRAMES = 4096;
+static const double STREAM_SECONDS = 2;
+static uint64_t link_bytes[2];
+
+// The records streamPack averages, straight from the raw blocks
+static void means(const std::vector<uint8_t> &frame, uint32_t decimation, std::vector<int32_t> &out)
+{
+    const int CONVERSIONS = bfpbench::CONVERSIONS;
+    uint32_t records = (CONVERSIONS + decimation - 1) / decimation;
+    out.assign(records * 8, 0);
+    for (uint32_t r = 0; r < records; r++)
+        for (int ch = 0; ch < 8; ch++)
+        {
+            int64_t sum = 0;
+            uint32_t count = std::min<uint32_t>(decimation, CONVERSIONS - r * decimation);
+            for (uint32_t i = r * decimation; i < r * decimation + count; i++)
+            {
+                const uint8_t *code = &frame[FRAME_BLOCK_SIZE * (1 + i) + FRAME_SAMPLE_DATA_OFFSET + 3 * ch];
+                sum += (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+            }
+            out[r * 8 + ch] = (int32_t)(sum / (int64_t)count);
+        }
+}
+
+static void checkLevel(uint8_t level)
+{
+    const int32_t amplitudes[] = {100, 30000, 1 << 20, 8388607};
+    const uint32_t decimation = stream_levels[level].decimation;
+    uint32_t prng = 0x9E3779B9 ^ level;
+    for (size_t a = 0; a < sizeof(amplitudes) / sizeof(amplitudes[0]); a++)
+    {
+        uint64_t records = 0, out_of_bound = 0, not_minimal = 0;
+        int64_t worst_error = 0, worst_int16_error = 0;
+        int max_shift = 0;
+        std::vector<int32_t> exact, decoded(bfpbench::CONVERSIONS * 8);
+        std::vector<uint8_t> frame;
+        for (int f = 0; f < FRAMES; f++)
+        {
+            bfpbench::rawFrame(frame, amplitudes[a], f * bfpbench::CONVERSIONS, prng);
+            means(frame, decimation, exact);
+            streamPack(frame.data(), level, 0xFF);
+            uint32_t n = streamDecode(frame.data(), decoded.data(), bfpbench::CONVERSIONS);
+            FrameFormatBlock format;
+            memcpy(&format, &frame[FRAME_BLOCK_SIZE], sizeof(format));
+            if (n * 8 != exact.size() || format.encoding != FRAME_ENCODING_BFP16)
+            {
+                out_of_bound++;
+                continue;
+            }
+            for (int ch = 0; ch < 8; ch++)
+            {
+                int shift = frameChannelShift(&format, ch);
+                max_shift = std::max(max_shift, shift);
+                int64_t low = 0, high = 0;
+                for (uint32_t r = 0; r < n; r++)
+                {
+                    int64_t value = exact[r * 8 + ch];
+                    int64_t error = std::abs(decoded[r * 8 + ch] - value);
+                    if (error > ((1 << shift) >> 1))
+                        out_of_bound++;
+                    worst_error = std::max(worst_error, error);
+                    worst_int16_error = std::max<int64_t>(worst_int16_error, value - (value >> 8 << 8));
+                    low = std::min(low, value);
+                    high = std::max(high, value);
+                }
+                // One less would have to overflow 16 bits somewhere
+                if (shift > 0)
+                {
+                    int s = shift - 1;
+                    int64_t half = (1 << s) >> 1;
+                    if ((high + half) >> s <= INT16_MAX && (low + half) >> s >= INT16_MIN)
+                        not_minimal++;
+                }
+            }
+            records += n;
+        }
+        printf("{\"test\":\"bfp\",\"level\":%u,\"decimation\":%u,\"amplitude\":%d,\"records\":%llu,"
+               "\"max_shift\":%d,\"worst_error\":%lld,\"worst_int16_error\":%lld,\"out_of_bound\":%llu,"
+               "\"not_minimal\":%llu}\n",
+               level, decimation, amplitudes[a], (unsigned long long)records, max_shift, (long long)worst_error,
+               (long long)worst_int16_error, (unsigned long long)out_of_bound, (unsigned long long)not_minimal);
+        fflush(stdout);
+        TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, records, "no records decoded");
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, out_of_bound, "records off their mean by more than half a step");
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, not_minimal, "shifts larger than needed");
+    }
+}
+
+void test_bfp_levels(void)
+{
+    for (uint8_t level = 2; level < STREAM_LEVELS; level++)
+        checkLevel(level);
+}
+
+// Streams with the adaptive level pinned: 1 for 24 bit codes, 2 for block floating point
+static void checkStream(int pinned)
+{
+    using namespace ADS129x;
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    char json[96];
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(500000000ULL);
+    ads().setChip(ADSSIM_ADS1299);
+    bench.command("{\"command\":\"reset\"}");
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.command("{\"command\":\"samplerate\",\"parameters\":[1000]}");
+    for (int ch = 0; ch < ads().channels(); ch++)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+        bench.command(json);
+    }
+    snprintf(json, sizeof(json), "{\"command\":\"adaptive\",\"parameters\":[0,%d]}", pinned);
+    bench.command(json);
+    std::string enabled = bench.reply;
+    uint64_t bytes = 0, undecoded = 0;
+    std::vector<int32_t> decoded(FRAME_BLOCK_SIZE * 8 * 8);
+    bench.clear();
+    bench.on_frame = [&](const Message &message) {
+        bytes += message.data.size();
+        if (message.data.size() < 2 * FRAME_BLOCK_SIZE || readLE32(&message.data[0]) != FRAME_MAGIC ||
+            streamDecode(message.data.data(), decoded.data(), FRAME_BLOCK_SIZE * 8) == 0)
+            undecoded++;
+    };
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.start_us = nowNs() / 1000;
+    bench.runFor((uint64_t)(STREAM_SECONDS * 1e9));
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.on_frame = nullptr;
+    bench.command("{\"command\":\"adaptive\",\"parameters\":[0]}");
+    link_bytes[pinned - 1] = bytes;
+
+    double per_sample = bench.samples ? (double)bytes / bench.samples : 0;
+    printf("{\"test\":\"bfp\",\"firmware\":\"%s\",\"pinned_level\":%d,\"setup\":%s,\"frames\":%llu,"
+           "\"samples\":%llu,\"sample_gaps\":%llu,\"undecoded\":%llu,\"link_bytes\":%llu,\"bytes_per_sample\":%.2f}\n",
+           firmware.c_str(), pinned, enabled.c_str(), (unsigned long long)bench.frames,
+           (unsigned long long)bench.samples, (unsigned long long)bench.sample_gaps,
+           (unsigned long long)undecoded, (unsigned long long)bytes, per_sample);
+    if (link_bytes[0] && link_bytes[1])
+        printf("{\"test\":\"bfp\",\"bfp16_over_int24_bytes\":%.3f}\n", (double)link_bytes[1] / link_bytes[0]);
+    fflush(stdout);
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, bench.samples, "no samples");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, bench.sample_gaps, "sample gaps");
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32_MESSAGE(1, undecoded, "frames streamDecode() rejects");
+    TEST_ASSERT_TRUE_MESSAGE(bench.level_frames[pinned] + 1 >= bench.frames, "frames off the pinned level");
+}
+
+void test_bfp_stream_int24(void)
+{
+    checkStream(1);
+}
+
+void test_bfp_stream_bfp16(void)
+{
+    checkStream(2);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_bfp_levels);
+    RUN_TEST(test_bfp_stream_int24);
+    RUN_TEST(test_bfp_stream_bfp16);
+    return UNITY_END();
+}
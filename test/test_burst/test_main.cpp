@@ -0,0 +1,250 @@
+/*
+ * Pre-triggered burst capture by command and by trigger pin
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Arms the burst command per chip, lets the pre-trigger buffer wrap, then
+ * triggers once from the command and once from an edge on the trigger
+ * input. The drained window must hold pre + post consecutive samples at
+ * the chip's top rate, its trigger event must be the first conversion
+ * read after the edge or the command, and every derived timestamp must
+ * lie within one period after the simulated conversion. No conversion may
+ * go unread up to the trigger nor the ISR see a gap after it, and the
+ * heap and CONFIG1 must be back as they were.
+ */
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "adscommand.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "esp_heap_caps.h"
+#include "frameformat.h"
+#include "hostsim.h"
+#include "osemboard.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const double WRAP_SECONDS = 0.5;
+
+static void checkBurst(ADSSimChip chip, bool pin)
+{
+    using namespace ADS129x;
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    char json[128];
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(100000000ULL);
+    ads().setChip(chip);
+    bench.command("{\"command\":\"reset\"}");
+    bench.command("{\"command\":\"sdatac\"}");
+    for (int ch = 0; ch < ads().channels(); ch++)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+        bench.command(json);
+    }
+    uint8_t config1 = ads().reg(CONFIG1);
+    size_t heap = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    bench.command("{\"command\":\"burst\"}");
+    uint32_t capacity = (uint32_t)replyNumber(bench.reply, "capacity");
+    uint32_t pre = capacity * 2 / 3;
+    uint32_t post = capacity - pre;
+
+    struct Sample
+    {
+        uint32_t number;
+        uint32_t timestamp;
+    };
+    std::vector<Sample> samples;
+    std::vector<uint32_t> triggers;
+    uint32_t frame_rate = 0;
+    uint64_t burst_frames = 0;
+    std::string done;
+    uint64_t done_ns = 0;
+    bench.on_frame = [&](const Message &message) {
+        FrameHeader header;
+        if (message.data.size() < sizeof(header))
+            return;
+        memcpy(&header, message.data.data(), sizeof(header));
+        if (header.magic != FRAME_MAGIC || !(header.flags & FRAME_FLAG_BURST))
+            return;
+        burst_frames++;
+        frame_rate = header.sample_rate;
+        for (uint32_t i = 0; i < header.samples; i++)
+        {
+            const uint8_t *block = &message.data[FRAME_BLOCK_SIZE * (1 + i)];
+            samples.push_back({readLE32(block + 4), readLE32(block)});
+        }
+        if (!(header.flags & FRAME_FLAG_EVENTS))
+            return;
+        FrameEventBlock block;
+        memcpy(&block, &message.data[FRAME_BLOCK_SIZE * (1 + (size_t)header.samples)], sizeof(block));
+        for (int i = 0; i < block.count && i < FRAME_EVENTS_PER_BLOCK; i++)
+            if (block.events[i].source == FRAME_EVENT_TRIGGER)
+                triggers.push_back(block.events[i].sample_number);
+    };
+    bench.on_text = [&](const Message &message) {
+        std::string text(message.data.begin(), message.data.end());
+        if (text.find("\"burst\":") != std::string::npos)
+        {
+            done = text;
+            done_ns = message.delivered_ns;
+        }
+    };
+
+    snprintf(json, sizeof(json), "{\"command\":\"burst\",\"parameters\":[1,%u,%u]}", pre, post);
+    bench.command(json);
+    uint32_t rate = (uint32_t)replyNumber(bench.reply, "rate");
+    uint64_t isr_lost = stats().isr_lost;
+    uint64_t missed = ads().conversionsMissed();
+    // Long enough for the buffer to wrap
+    bench.runFor((uint64_t)(WRAP_SECONDS * 1e9) + (uint64_t)pre * 1000000000ULL / (rate ? rate : 1));
+
+    // The first conversion read after the trigger, counted from START
+    uint64_t trigger_ns = nowNs() + 1000000ULL + 12345;
+    if (pin)
+    {
+        schedulePinLevel(TRIGGER_PIN, trigger_ns, LOW);
+        schedulePinLevel(TRIGGER_PIN, trigger_ns + 1000000ULL, HIGH);
+        bench.runFor(trigger_ns - nowNs());
+    }
+    else
+    {
+        bench.runFor(trigger_ns - nowNs());
+        bench.command("{\"command\":\"burst\",\"parameters\":[2]}");
+    }
+    uint64_t armed_ns = nowNs();
+    // Conversion times since START, before putting CONFIG1 back restarts them; a
+    // command runs somewhere between being sent and its reply
+    uint64_t latest_ns = pin ? trigger_ns : bench.reply_ns;
+    uint32_t expected_trigger = 0;
+    while (ads().conversionTimeNs(expected_trigger) < trigger_ns)
+        expected_trigger++;
+    uint32_t expected_latest = expected_trigger;
+    while (ads().conversionTimeNs(expected_latest) < latest_ns)
+        expected_latest++;
+    std::vector<uint64_t> conversion_ns;
+    for (uint32_t n = 0; n <= expected_latest + post; n++)
+        conversion_ns.push_back(ads().conversionTimeNs(n));
+    // Anything unread up to here lies before the trigger sample, which gaps would show after it
+    uint64_t not_read = ads().conversionsMissed() - missed;
+    while (done.empty() && nowNs() - armed_ns < 10000000000ULL)
+        bench.step();
+    bench.on_frame = nullptr;
+    bench.on_text = nullptr;
+
+    uint64_t period_ns = 1000000000ULL / (rate ? rate : 1);
+    uint32_t trigger = triggers.empty() ? UINT32_MAX : triggers[0];
+    uint64_t contiguous = samples.empty() ? 0 : 1;
+    int64_t worst_lag_ns = 0, least_lag_ns = INT64_MAX;
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        if (i > 0 && samples[i].number == samples[i - 1].number + 1)
+            contiguous++;
+        if (samples[i].number >= conversion_ns.size())
+            continue;
+        int64_t lag = (int64_t)samples[i].timestamp * 1000 - (int64_t)conversion_ns[samples[i].number];
+        worst_lag_ns = std::max(worst_lag_ns, lag);
+        least_lag_ns = std::min(least_lag_ns, lag);
+    }
+    if (samples.empty())
+        least_lag_ns = 0;
+    uint32_t first = samples.empty() ? 0 : samples[0].number;
+    bench.command("{\"command\":\"burst\"}");
+    std::string state = bench.reply;
+    size_t heap_after = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    double drain_ms = done_ns > armed_ns ? (done_ns - armed_ns) / 1e6 : 0;
+    uint64_t isr_lost_after = stats().isr_lost - isr_lost;
+
+    printf("{\"test\":\"burst\",\"firmware\":\"%s\",\"chip\":\"%s\",\"trigger\":\"%s\",\"rate\":%u,"
+           "\"capacity\":%u,\"pre\":%u,\"post\":%u,\"samples\":%zu,\"contiguous\":%llu,\"frames\":%llu,"
+           "\"trigger_sample\":%u,\"expected\":[%u,%u],\"not_read\":%llu,\"isr_lost\":%llu,\"gaps\":%lld,"
+           "\"lag_us\":[%.1f,%.1f],\"drain_ms\":%.1f,\"heap_restored\":%s}\n",
+           firmware.c_str(), ads().chipName(), pin ? "pin" : "command", rate, capacity, pre, post,
+           samples.size(), (unsigned long long)contiguous, (unsigned long long)burst_frames,
+           trigger, expected_trigger, expected_latest, (unsigned long long)not_read,
+           (unsigned long long)isr_lost_after, (long long)replyNumber(done, "gaps"),
+           least_lag_ns / 1000.0, worst_lag_ns / 1000.0, drain_ms, heap_after == heap ? "true" : "false");
+    fflush(stdout);
+
+    TEST_ASSERT_TRUE_MESSAGE(done.find("\"done\"") != std::string::npos, "burst not done");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(adcMaxRate(adcFamily(ads().reg(ID))), rate, "burst rate");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(rate, frame_rate, "rate in the frame header");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(pre + post, samples.size(), "samples drained");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(samples.size(), contiguous, "consecutive sample numbers");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, triggers.size(), "trigger events");
+    TEST_ASSERT_TRUE_MESSAGE(trigger >= expected_trigger && trigger <= expected_latest,
+                             "trigger not on the first conversion read after it");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(trigger, first + pre, "pre-trigger samples");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, replyNumber(done, "gaps"), "gaps after the trigger");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, replyNumber(done, "read_errors"), "read errors");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, not_read, "conversions unread before the trigger");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, isr_lost_after, "DRDY lost");
+    TEST_ASSERT_TRUE_MESSAGE(least_lag_ns >= 0, "timestamp before its conversion");
+    TEST_ASSERT_TRUE_MESSAGE(worst_lag_ns < (int64_t)period_ns, "timestamp a period or more after its conversion");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(heap, heap_after, "largest free block after the burst");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(config1, ads().reg(CONFIG1), "CONFIG1 after the burst");
+    TEST_ASSERT_TRUE_MESSAGE(state.find("\"off\"") != std::string::npos, "burst not off after draining");
+}
+
+void test_burst_ads1299_command(void)
+{
+    checkBurst(ADSSIM_ADS1299, false);
+}
+
+void test_burst_ads1299_pin(void)
+{
+    checkBurst(ADSSIM_ADS1299, true);
+}
+
+void test_burst_ads1298_command(void)
+{
+    checkBurst(ADSSIM_ADS1298, false);
+}
+
+void test_burst_ads1298_pin(void)
+{
+    checkBurst(ADSSIM_ADS1298, true);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_burst_ads1299_command);
+    RUN_TEST(test_burst_ads1299_pin);
+    RUN_TEST(test_burst_ads1298_command);
+    RUN_TEST(test_burst_ads1298_pin);
+    return UNITY_END();
+}
@@ -0,0 +1,241 @@
+/*
+ * EMG onset and offset events and the bandwidth they save
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Streams each rate raw, then in EMG mode through a rest long enough to
+ * learn the baseline and two rounds of simulated muscle bursts on
+ * channels 1 and 3. Every burst must give one onset and one offset event
+ * on each of those channels, the onset from one output period before the
+ * burst began to ONSET_MS after, the offset likewise within OFFSET_MS of
+ * its end; no other channel may see an event. The link bytes per second
+ * in EMG mode must be at least REDUCTION times below the raw stream.
+ */
+
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const double PHASE_SECONDS = 1;
+static const double REST_SECONDS = 3;
+static const int32_t ONSET_MS = 100;
+static const int32_t OFFSET_MS = 300;
+static const double REDUCTION = 10;
+static const float BURST_UV = 100.0f;
+static const uint8_t MASK = 0x05;
+static ADSSimSignal saved;
+
+static void checkEmg(uint32_t rate)
+{
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    char json[128];
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(100000000ULL);
+    ads().signal().emg_uV = BURST_UV;
+    ads().signal().emg_mask = 0;
+    for (int ch = 0; ch < ads().channels(); ch++)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", ADS129x::CH1SET + ch, 0x60);
+        bench.command(json);
+    }
+    snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+    bench.command(json);
+    bench.command("{\"command\":\"emg\",\"parameters\":[0]}");
+
+    // Raw first, for the bandwidth it takes
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.runFor(200000000ULL);
+    uint64_t raw_bytes = stats().ws_bytes_sent;
+    bench.runFor((uint64_t)(PHASE_SECONDS * 1e9));
+    raw_bytes = stats().ws_bytes_sent - raw_bytes;
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(100000000ULL);
+
+    bench.command("{\"command\":\"emg\",\"parameters\":[1]}");
+    std::string enabled = bench.reply;
+    uint32_t output_rate = (uint32_t)replyNumber(enabled, "output_rate");
+
+    struct Event
+    {
+        uint32_t number;
+        uint8_t source;
+        uint8_t channel;
+    };
+    std::vector<Event> events;
+    std::map<uint32_t, uint32_t> timestamps; // output sample number to its timestamp
+    uint64_t unfiltered = 0;
+    bench.on_frame = [&](const Message &message) {
+        FrameHeader header;
+        if (message.data.size() < sizeof(header) || readLE32(&message.data[0]) != FRAME_MAGIC)
+            return;
+        memcpy(&header, &message.data[0], sizeof(header));
+        if (!(header.flags & FRAME_FLAG_FILTERED) || (header.flags & FRAME_FLAG_PACKED))
+        {
+            unfiltered++;
+            return;
+        }
+        for (uint32_t i = 0; i < header.samples && (2 + i) * FRAME_BLOCK_SIZE <= message.data.size(); i++)
+        {
+            const uint8_t *block = &message.data[(1 + i) * FRAME_BLOCK_SIZE];
+            timestamps[readLE32(block + 4)] = readLE32(block);
+        }
+        size_t at = (1 + header.samples) * FRAME_BLOCK_SIZE;
+        if (!(header.flags & FRAME_FLAG_EVENTS) || at + sizeof(FrameEventBlock) > message.data.size())
+            return;
+        FrameEventBlock block;
+        memcpy(&block, &message.data[at], sizeof(block));
+        for (int i = 0; i < block.count && i < FRAME_EVENTS_PER_BLOCK; i++)
+            if (block.events[i].source == FRAME_EVENT_ONSET || block.events[i].source == FRAME_EVENT_OFFSET)
+                events.push_back({block.events[i].sample_number, block.events[i].source, block.events[i].code});
+    };
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.runFor((uint64_t)(REST_SECONDS * 1e9));
+
+    // Bursts, the times they began and ended in micros()
+    std::vector<std::pair<uint32_t, uint32_t>> bursts;
+    uint64_t emg_bytes = stats().ws_bytes_sent;
+    uint64_t emg_ns = nowNs();
+    for (int round = 0; round < 2; round++)
+    {
+        uint32_t begin_us = (uint32_t)(nowNs() / 1000);
+        ads().signal().emg_mask = MASK;
+        bench.runFor((uint64_t)(PHASE_SECONDS * 1e9));
+        uint32_t end_us = (uint32_t)(nowNs() / 1000);
+        ads().signal().emg_mask = 0;
+        bench.runFor((uint64_t)(PHASE_SECONDS * 1e9));
+        bursts.push_back(std::make_pair(begin_us, end_us));
+    }
+    emg_bytes = stats().ws_bytes_sent - emg_bytes;
+    emg_ns = nowNs() - emg_ns;
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.on_frame = nullptr;
+    bench.command("{\"command\":\"emg\"}");
+    std::string report = bench.reply;
+    bench.command("{\"command\":\"emg\",\"parameters\":[0]}");
+
+    // Each burst claims the first event of each kind on each channel in its window
+    const int32_t period_us = output_rate ? 1000000 / output_rate : 0;
+    uint64_t matched = 0, unknown = 0, stray = 0;
+    int32_t worst_onset_us = INT32_MIN, worst_offset_us = INT32_MIN;
+    std::vector<bool> used(events.size(), false);
+    for (size_t b = 0; b < bursts.size(); b++)
+    {
+        for (int ch = 0; ch < 8; ch++)
+        {
+            if (!(MASK & (1 << ch)))
+                continue;
+            for (int kind = 0; kind < 2; kind++)
+            {
+                uint8_t source = kind ? FRAME_EVENT_OFFSET : FRAME_EVENT_ONSET;
+                uint32_t edge_us = kind ? bursts[b].second : bursts[b].first;
+                int32_t limit_us = (kind ? OFFSET_MS : ONSET_MS) * 1000;
+                for (size_t e = 0; e < events.size(); e++)
+                {
+                    if (used[e] || events[e].channel != ch || events[e].source != source)
+                        continue;
+                    std::map<uint32_t, uint32_t>::iterator t = timestamps.find(events[e].number);
+                    if (t == timestamps.end())
+                        continue;
+                    int32_t lag_us = (int32_t)(t->second - edge_us);
+                    if (lag_us < -period_us || lag_us > limit_us)
+                        continue;
+                    used[e] = true;
+                    matched++;
+                    int32_t &worst = kind ? worst_offset_us : worst_onset_us;
+                    worst = std::max(worst, lag_us);
+                    break;
+                }
+            }
+        }
+    }
+    for (size_t e = 0; e < events.size(); e++)
+    {
+        if (used[e])
+            continue;
+        if (timestamps.find(events[e].number) == timestamps.end())
+            unknown++;
+        else
+            stray++;
+    }
+    uint64_t expected = bursts.size() * 2 * __builtin_popcount(MASK);
+    double raw_rate = raw_bytes / PHASE_SECONDS;
+    double emg_rate = emg_ns ? emg_bytes * 1e9 / emg_ns : 0;
+    double reduction = emg_rate > 0 ? raw_rate / emg_rate : 0;
+    printf("{\"test\":\"emg\",\"firmware\":\"%s\",\"rate\":%u,\"output_rate\":%u,\"events\":%zu,\"expected\":%llu,"
+           "\"matched\":%llu,\"stray\":%llu,\"unknown\":%llu,\"worst_onset_ms\":%.1f,\"worst_offset_ms\":%.1f,"
+           "\"unfiltered\":%llu,\"raw_bytes_per_s\":%.0f,\"emg_bytes_per_s\":%.0f,\"reduction\":%.1f,\"report\":%s}\n",
+           firmware.c_str(), rate, output_rate, events.size(), (unsigned long long)expected, (unsigned long long)matched,
+           (unsigned long long)stray, (unsigned long long)unknown, worst_onset_us / 1000.0, worst_offset_us / 1000.0,
+           (unsigned long long)unfiltered, raw_rate, emg_rate, reduction, report.c_str());
+    fflush(stdout);
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected, matched, "onsets and offsets within their windows");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected, events.size(), "events");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, unfiltered, "frames not filtered in EMG mode");
+    TEST_ASSERT_TRUE_MESSAGE(reduction >= REDUCTION, "EMG mode not enough below the raw stream");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, replyNumber(report, "dropped"), "dropped");
+}
+
+void test_emg_1000(void)
+{
+    checkEmg(1000);
+}
+
+void test_emg_2000(void)
+{
+    checkEmg(2000);
+}
+
+void test_emg_4000(void)
+{
+    checkEmg(4000);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+    ads().signal() = saved;
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    saved = ads().signal();
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_emg_1000);
+    RUN_TEST(test_emg_2000);
+    RUN_TEST(test_emg_4000);
+    return UNITY_END();
+}
@@ -0,0 +1,139 @@
+/*
+ * Impedance mode against the simulated electrode impedances
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Turns on impedance mode with known electrode impedances in the
+ * simulator and compares the reported values with them, for each chip
+ * family and rate. Also prints how many bytes per second reach the link,
+ * which is only the impedance messages in this mode.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "hostsim.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const double MEASURE_SECONDS = 3;
+static const double MAX_ERROR = 0.05;
+
+static void checkImpedance(ADSSimChip chip)
+{
+    using namespace ADS129x;
+    const uint32_t rates[] = {250, 500, 1000, 2000};
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    char json[96];
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+    {
+        uint32_t rate = rates[r];
+        bench.command("{\"command\":\"sdatac\"}");
+        bench.runFor(500000000ULL);
+        ads().setChip(chip);
+        bench.command("{\"command\":\"reset\"}");
+        bench.command("{\"command\":\"sdatac\"}");
+        snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+        bench.command(json);
+        for (int ch = 0; ch < ads().channels(); ch++)
+        {
+            snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+            bench.command(json);
+        }
+        bench.command("{\"command\":\"impedance\",\"parameters\":[1]}");
+        std::string mode_reply = replyField(bench.reply);
+
+        bench.clear();
+        uint64_t bytes_start = stats().ws_bytes_sent;
+        bench.command("{\"command\":\"rdatac\"}");
+        uint64_t start_ns = nowNs();
+        uint64_t end_ns = start_ns + (uint64_t)(MEASURE_SECONDS * 1e9);
+        int reports = 0;
+        std::string last;
+        while (nowNs() < end_ns)
+        {
+            bench.have_reply = false;
+            bench.step();
+            if (bench.have_reply && bench.reply.find("\"impedance_kohm\"") != std::string::npos)
+            {
+                reports++;
+                last = bench.reply;
+            }
+        }
+        double elapsed = (nowNs() - start_ns) / 1e9;
+        uint64_t link_bytes = stats().ws_bytes_sent - bytes_start;
+        bench.command("{\"command\":\"sdatac\"}");
+        bench.command("{\"command\":\"impedance\",\"parameters\":[0]}");
+
+        double worst = 0;
+        printf("{\"test\":\"impedance\",\"firmware\":\"%s\",\"chip\":\"%s\",\"rate\":%u,\"impedance\":\"%s\","
+               "\"reports_per_s\":%.2f,\"link_bytes_per_s\":%.0f,\"raw_frames\":%llu,\"kohm\":[",
+               firmware.c_str(), ads().chipName(), rate, mode_reply.c_str(), reports / elapsed,
+               link_bytes / elapsed, (unsigned long long)bench.frames);
+        const char *p = last.empty() ? NULL : strchr(last.c_str() + last.find("\"impedance_kohm\""), '[');
+        for (int ch = 0; ch < ads().channels(); ch++)
+        {
+            double truth = ads().signal().electrode_kohm[ch];
+            double measured = p ? strtod(p + 1, (char **)&p) : 0;
+            worst = std::max(worst, fabs(measured - truth) / truth);
+            printf("%s[%.1f,%.1f]", ch ? "," : "", truth, measured);
+        }
+        printf("],\"max_error\":%.4f}\n", worst);
+        fflush(stdout);
+        TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, reports, "no impedance reports");
+        TEST_ASSERT_TRUE_MESSAGE(worst <= MAX_ERROR, "impedance off the simulated electrode");
+    }
+}
+
+void test_impedance_ads1299(void)
+{
+    checkImpedance(ADSSIM_ADS1299);
+}
+
+void test_impedance_ads1298(void)
+{
+    checkImpedance(ADSSIM_ADS1298);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_impedance_ads1299);
+    RUN_TEST(test_impedance_ads1298);
+    return UNITY_END();
+}
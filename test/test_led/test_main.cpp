@@ -0,0 +1,175 @@
+/*
+ * Status LED updates while a client reconnects, against the DRDY delay bound
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A client drops and reconnects every 10 to 40 ms while the firmware
+ * streams, so webSocketEvent() posts a status LED state each time. The
+ * worst delay from a DRDY edge to DRDY_ISR has to stay within
+ * ISR_DELAY_BOUND_NS and no conversion may go unread. The same churn is
+ * then repeated with the interrupts masked for a bit-banged show after
+ * every event, as Adafruit_NeoPixel did, to check that the bound catches
+ * that. The pixel has to show the state last posted at each step.
+ */
+
+#include <stdio.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "hostsim.h"
+#include "osemboard.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const double CHURN_SECONDS = 2;
+static const uint64_t ISR_DELAY_BOUND_NS = 10000;
+
+static void checkLed(uint32_t rate)
+{
+    using namespace ADS129x;
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    // GRB at the board brightness
+    const uint32_t GREEN = (uint32_t)PIXEL_BRIGHTNESS << 16;
+    const uint32_t CYAN = GREEN | PIXEL_BRIGHTNESS;
+
+    char json[128];
+    uint32_t prng = 0x9E3779B9 ^ rate;
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(500000000ULL);
+    ads().setChip(ADSSIM_ADS1299);
+    bench.command("{\"command\":\"reset\"}");
+    bench.command("{\"command\":\"sdatac\"}");
+    snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+    bench.command(json);
+    for (int ch = 0; ch < ads().channels(); ch++)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+        bench.command(json);
+    }
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.command("{\"command\":\"start\"}");
+    bench.runFor(300000000ULL);
+    uint32_t streaming_color = ledColor();
+
+    struct Phase
+    {
+        uint64_t events, delay_max_ns, not_read, isr_lost, rmt_writes;
+        uint32_t color;
+    } phases[2];
+    for (int bitbang = 0; bitbang < 2; bitbang++)
+    {
+        Phase &phase = phases[bitbang];
+        uint64_t missed_start = ads().conversionsMissed();
+        uint64_t lost_start = stats().isr_lost;
+        uint64_t writes_start = stats().rmt_writes;
+        stats().isr_delay_max_ns = 0;
+        phase.events = 0;
+        uint64_t end_ns = nowNs() + (uint64_t)(CHURN_SECONDS * 1e9);
+        while (nowNs() < end_ns)
+        {
+            if (client().connected())
+                client().disconnect();
+            else
+                client().connect();
+            phase.events++;
+            // Wait for the firmware to see it, then show the pixel the old way
+            bool connected = client().connected();
+            uint64_t wait_end = nowNs() + 100000000ULL;
+            while (client().connected() == connected && nowNs() < wait_end)
+                bench.step();
+            if (bitbang)
+                criticalSection(config().neopixel_show_ns);
+            prng = prng * 1664525 + 1013904223;
+            bench.runFor(10000000ULL + (prng >> 2) % 30000000ULL);
+        }
+        if (!client().connected())
+        {
+            client().connect();
+            while (!client().connected())
+                bench.step();
+            if (bitbang)
+                criticalSection(config().neopixel_show_ns);
+        }
+        // Queued states go out one hold time apart
+        bench.runFor(500000000ULL);
+        phase.color = ledColor();
+        phase.delay_max_ns = stats().isr_delay_max_ns;
+        phase.not_read = ads().conversionsMissed() - missed_start;
+        phase.isr_lost = stats().isr_lost - lost_start;
+        phase.rmt_writes = stats().rmt_writes - writes_start;
+    }
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(300000000ULL);
+    uint32_t stopped_color = ledColor();
+
+    printf("{\"test\":\"led\",\"firmware\":\"%s\",\"rate\":%u,\"seconds\":%.3f,\"bound_us\":%.1f",
+           firmware.c_str(), rate, CHURN_SECONDS, ISR_DELAY_BOUND_NS / 1e3);
+    const char *names[2] = {"rmt", "bitbang"};
+    for (int i = 0; i < 2; i++)
+        printf(",\"%s\":{\"events\":%llu,\"isr_delay_max_us\":%.1f,\"not_read\":%llu,\"isr_lost\":%llu,\"rmt_writes\":%llu}",
+               names[i], (unsigned long long)phases[i].events, phases[i].delay_max_ns / 1e3,
+               (unsigned long long)phases[i].not_read, (unsigned long long)phases[i].isr_lost,
+               (unsigned long long)phases[i].rmt_writes);
+    printf("}\n");
+    fflush(stdout);
+
+    const Phase &rmt = phases[0], &shown = phases[1];
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(GREEN, streaming_color, "pixel while streaming");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(CYAN, rmt.color, "pixel after the churn");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(CYAN, shown.color, "pixel after the bit-banged churn");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(CYAN, stopped_color, "pixel after sdatac");
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32_MESSAGE(ISR_DELAY_BOUND_NS, rmt.delay_max_ns, "DRDY to DRDY_ISR with the RMT driver");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, rmt.not_read, "conversions unread with the RMT driver");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, rmt.isr_lost, "DRDY lost with the RMT driver");
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, rmt.rmt_writes, "no RMT writes");
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(ISR_DELAY_BOUND_NS, shown.delay_max_ns, "the bound misses a bit-banged show");
+}
+
+void test_led_1000(void)
+{
+    checkLed(1000);
+}
+
+void test_led_16000(void)
+{
+    checkLed(16000);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_led_1000);
+    RUN_TEST(test_led_16000);
+    return UNITY_END();
+}
@@ -0,0 +1,205 @@
+/*
+ * Trigger input and mark events against the simulated conversions
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Pulses the trigger input at irregular instants and places marks at
+ * host times in the past, then checks the sample number of every event
+ * in the stream against the simulator: a trigger belongs to the first
+ * conversion at or after its edge, a mark to the first conversion at or
+ * after its host time. Sample numbers restart with START, so sample n is
+ * conversion n of the simulated chip.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+#include "osemboard.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const double EVENT_SECONDS = 5;
+static const uint64_t PULSE_NS = 1000000ULL;
+
+// First conversion at or after t_ns
+static uint32_t sampleAt(uint64_t t_ns)
+{
+    uint64_t period_ns = 1000000000ULL / ads().sampleRate();
+    uint64_t n = t_ns > ads().conversionTimeNs(0) ? (t_ns - ads().conversionTimeNs(0)) / period_ns : 0;
+    while (ads().conversionTimeNs(n) < t_ns)
+        n++;
+    while (n > 0 && ads().conversionTimeNs(n - 1) >= t_ns)
+        n--;
+    return (uint32_t)n;
+}
+
+static void checkMarkers(uint32_t rate)
+{
+    using namespace ADS129x;
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    char json[128];
+    uint32_t prng = 0x9E3779B9 ^ rate;
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(500000000ULL);
+    ads().setChip(ADSSIM_ADS1299);
+    bench.command("{\"command\":\"reset\"}");
+    bench.command("{\"command\":\"sdatac\"}");
+    snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+    bench.command(json);
+    for (int ch = 0; ch < ads().channels(); ch++)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+        bench.command(json);
+    }
+    syncClock(bench, 8, 100000000ULL);
+
+    std::vector<uint32_t> trigger_samples, mark_samples(256, UINT32_MAX);
+    uint64_t event_frames = 0;
+    bench.on_frame = [&](const Message &message) {
+        FrameHeader header;
+        if (message.data.size() < sizeof(header))
+            return;
+        memcpy(&header, message.data.data(), sizeof(header));
+        if (header.magic != FRAME_MAGIC || !(header.flags & FRAME_FLAG_EVENTS))
+            return;
+        size_t at = FRAME_BLOCK_SIZE * (1 + (size_t)header.samples);
+        if (at + sizeof(FrameEventBlock) > message.data.size())
+            return;
+        FrameEventBlock block;
+        memcpy(&block, &message.data[at], sizeof(block));
+        event_frames++;
+        for (int i = 0; i < block.count && i < FRAME_EVENTS_PER_BLOCK; i++)
+        {
+            if (block.events[i].source == FRAME_EVENT_TRIGGER)
+                trigger_samples.push_back(block.events[i].sample_number);
+            else if (block.events[i].source == FRAME_EVENT_MARK)
+                mark_samples[block.events[i].code] = block.events[i].sample_number;
+        }
+    };
+
+    bench.clear();
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.command("{\"command\":\"start\"}");
+    bench.runFor(200000000ULL);
+
+    // Trigger pulses spread over the run, 20 to 60 ms apart
+    std::vector<uint32_t> trigger_expected;
+    uint64_t end_ns = nowNs() + (uint64_t)(EVENT_SECONDS * 1e9);
+    for (uint64_t t = nowNs() + 10000000ULL; t + PULSE_NS < end_ns;)
+    {
+        schedulePinLevel(TRIGGER_PIN, t, LOW);
+        schedulePinLevel(TRIGGER_PIN, t + PULSE_NS, HIGH);
+        trigger_expected.push_back(sampleAt(t));
+        prng = prng * 1664525 + 1013904223;
+        t += 20000000ULL + (prng >> 2) % 40000000ULL;
+    }
+
+    // Marks between the pulses, each half a period before a conversion 5 to 50 ms
+    // back, so that clock sync errors below half a period do not move them
+    std::vector<uint32_t> mark_expected, mark_replied;
+    while (nowNs() + 100000000ULL < end_ns && mark_expected.size() < 255)
+    {
+        bench.runFor(50000000ULL + (prng >> 2) % 50000000ULL);
+        prng = prng * 1664525 + 1013904223;
+        uint32_t sample = sampleAt(nowNs() - 5000000ULL - (prng >> 2) % 45000000ULL);
+        uint64_t host_ns = ads().conversionTimeNs(sample) - 500000000ULL / rate;
+        int code = (int)mark_expected.size() + 1;
+        snprintf(json, sizeof(json), "{\"command\":\"mark\",\"parameters\":[%d,%llu]}",
+                 code, (unsigned long long)(host_ns / 1000));
+        bench.command(json);
+        mark_expected.push_back(sample);
+        mark_replied.push_back((uint32_t)replyNumber(bench.reply, "sample"));
+    }
+    if (nowNs() < end_ns)
+        bench.runFor(end_ns - nowNs());
+    bench.runFor(200000000ULL);
+    bench.on_frame = nullptr;
+    bench.command("{\"command\":\"stats\"}");
+    int64_t dropped = replyNumber(bench.reply, "events_dropped");
+    bench.command("{\"command\":\"sdatac\"}");
+
+    size_t trigger_exact = 0, mark_exact = 0;
+    int64_t worst = 0;
+    for (size_t i = 0; i < trigger_expected.size(); i++)
+    {
+        int64_t error = i < trigger_samples.size() ? (int64_t)trigger_samples[i] - trigger_expected[i] : INT32_MAX;
+        trigger_exact += error == 0;
+        worst = std::max(worst, error < 0 ? -error : error);
+    }
+    for (size_t i = 0; i < mark_expected.size(); i++)
+    {
+        uint32_t got = mark_samples[i + 1];
+        int64_t error = got == UINT32_MAX || got != mark_replied[i] ? INT32_MAX : (int64_t)got - mark_expected[i];
+        mark_exact += error == 0;
+        worst = std::max(worst, error < 0 ? -error : error);
+    }
+    printf("{\"test\":\"marker\",\"firmware\":\"%s\",\"rate\":%u,\"seconds\":%.1f,\"triggers\":%zu,"
+           "\"triggers_received\":%zu,\"triggers_exact\":%zu,\"marks\":%zu,\"marks_exact\":%zu,"
+           "\"event_frames\":%llu,\"events_dropped\":%lld,\"max_error_samples\":%lld}\n",
+           firmware.c_str(), rate, EVENT_SECONDS, trigger_expected.size(), trigger_samples.size(), trigger_exact,
+           mark_expected.size(), mark_exact, (unsigned long long)event_frames, (long long)dropped, (long long)worst);
+    fflush(stdout);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(trigger_expected.size(), trigger_samples.size(), "trigger events received");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(trigger_expected.size(), trigger_exact, "triggers on the first conversion after the edge");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(mark_expected.size(), mark_exact, "marks on the first conversion after their host time");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, dropped, "events dropped");
+}
+
+void test_marker_250(void)
+{
+    checkMarkers(250);
+}
+
+void test_marker_1000(void)
+{
+    checkMarkers(1000);
+}
+
+void test_marker_4000(void)
+{
+    checkMarkers(4000);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_marker_250);
+    RUN_TEST(test_marker_1000);
+    RUN_TEST(test_marker_4000);
+    return UNITY_END();
+}
@@ -0,0 +1,181 @@
+/*
+ * Montage arithmetic against its definition and montages streamed
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks Montage::apply against the definition on random 24 bit codes,
+ * full scale and near it, for each kind of montage. Then streams common
+ * average and bipolar montages from the simulated firmware: the common
+ * average outputs of a sample have to sum to zero within their rounding,
+ * and slots outside the montage have to be zero.
+ */
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+#include "montage.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const int SAMPLES = 1 << 20;
+static const double STREAM_SECONDS = 2;
+
+// Straight from the definition: 64 bit sums and a real division
+static void reference(const Montage &montage, const int32_t *in, int32_t *out)
+{
+    for (int output = 0; output < MONTAGE_MAX_CHANNELS; output++)
+    {
+        int64_t d = montage.divisor(output);
+        if (!d)
+        {
+            out[output] = 0;
+            continue;
+        }
+        int64_t sum = 0;
+        for (int input = 0; input < MONTAGE_MAX_CHANNELS; input++)
+            sum += (int64_t)montage.weight(output, input) * in[input];
+        int64_t q = ((sum < 0 ? -sum : sum) + d / 2) / d;
+        q = sum < 0 ? -q : q;
+        out[output] = (int32_t)std::max<int64_t>(MONTAGE_CODE_MIN, std::min<int64_t>(MONTAGE_CODE_MAX, q));
+    }
+}
+
+void test_montage_exact(void)
+{
+    std::vector<montagebench::Case> cases = montagebench::cases();
+    std::vector<int32_t> codes = montagebench::codes(SAMPLES);
+    for (size_t c = 0; c < cases.size(); c++)
+    {
+        const Montage &montage = cases[c].montage;
+        uint64_t mismatches = 0;
+        for (int i = 0; i < SAMPLES; i++)
+        {
+            int32_t fast[MONTAGE_MAX_CHANNELS], exact[MONTAGE_MAX_CHANNELS];
+            montage.apply(&codes[(size_t)i * MONTAGE_MAX_CHANNELS], fast);
+            reference(montage, &codes[(size_t)i * MONTAGE_MAX_CHANNELS], exact);
+            if (memcmp(fast, exact, sizeof(fast)) != 0)
+                mismatches++;
+        }
+        printf("{\"test\":\"montage\",\"montage\":\"%s\",\"outputs\":%d,\"terms\":%d,\"samples\":%d,\"mismatches\":%llu}\n",
+               cases[c].name, __builtin_popcount(montage.outputMask()), montage.terms(), SAMPLES,
+               (unsigned long long)mismatches);
+        fflush(stdout);
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mismatches, cases[c].name);
+    }
+}
+
+// Streams one montage mode from the firmware: 1 common average, 2 bipolar
+static void checkStream(int mode)
+{
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    char json[64];
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(500000000ULL);
+    ads().setChip(ADSSIM_ADS1299);
+    bench.command("{\"command\":\"reset\"}");
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.command("{\"command\":\"samplerate\",\"parameters\":[1000]}");
+    for (int ch = 0; ch < ads().channels(); ch++)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", ADS129x::CH1SET + ch, 0x60);
+        bench.command(json);
+    }
+    snprintf(json, sizeof(json), "{\"command\":\"montage\",\"parameters\":[%d]}", mode);
+    bench.command(json);
+    std::string enabled = bench.reply;
+    uint64_t derived_frames = 0, samples = 0, worst_sum = 0, stray = 0;
+    bench.clear();
+    bench.on_frame = [&](const Message &message) {
+        if (message.data.size() < FRAME_BLOCK_SIZE || readLE32(&message.data[0]) != FRAME_MAGIC ||
+            !(message.data[5] & FRAME_FLAG_DERIVED) || (message.data[5] & FRAME_FLAG_PACKED))
+            return;
+        derived_frames++;
+        size_t end = std::min<size_t>(message.data.size(), FRAME_BLOCK_SIZE * (1 + (message.data[6] | (message.data[7] << 8))));
+        for (size_t offset = FRAME_BLOCK_SIZE; offset + FRAME_BLOCK_SIZE <= end; offset += FRAME_BLOCK_SIZE)
+        {
+            int64_t sum = 0;
+            for (int ch = 0; ch < MONTAGE_MAX_CHANNELS; ch++)
+            {
+                const uint8_t *code = &message.data[offset + FRAME_SAMPLE_DATA_OFFSET + 3 * ch];
+                int32_t value = (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+                sum += value;
+                if (mode == 2 && ch == 7 && value != 0)
+                    stray++;
+            }
+            if (mode == 1)
+                worst_sum = std::max<uint64_t>(worst_sum, (uint64_t)(sum < 0 ? -sum : sum));
+            samples++;
+        }
+    };
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.command("{\"command\":\"start\"}");
+    bench.runFor((uint64_t)(STREAM_SECONDS * 1e9));
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.on_frame = nullptr;
+    bench.command("{\"command\":\"montage\",\"parameters\":[0]}");
+
+    printf("{\"test\":\"montage\",\"firmware\":\"%s\",\"stream\":\"%s\",\"setup\":%s,\"derived_frames\":%llu,"
+           "\"samples\":%llu,\"worst_car_sum\":%llu,\"stray_outputs\":%llu}\n",
+           firmware.c_str(), mode == 1 ? "car" : "bipolar", enabled.c_str(), (unsigned long long)derived_frames,
+           (unsigned long long)samples, (unsigned long long)worst_sum, (unsigned long long)stray);
+    fflush(stdout);
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, derived_frames, "no derived frames");
+    // Eight outputs, each rounded by at most half a code
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32_MESSAGE(4, worst_sum, "common average outputs off zero");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, stray, "outputs outside the montage");
+}
+
+void test_montage_stream_car(void)
+{
+    checkStream(1);
+}
+
+void test_montage_stream_bipolar(void)
+{
+    checkStream(2);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_montage_exact);
+    RUN_TEST(test_montage_stream_car);
+    RUN_TEST(test_montage_stream_bipolar);
+    return UNITY_END();
+}
@@ -0,0 +1,360 @@
+/*
+ * Filter chains against a double precision reference and a filtered stream
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Captures raw frames from the simulated firmware at each rate, with a
+ * 20 mV electrode offset for the high pass stages to take out, and runs
+ * each chain over them offline: every output against a double precision
+ * reference of the same chain, within a code per stage. Then streams with
+ * a notch and decimation by four through the firmware and checks the
+ * frames carry the output rate and consecutive sample numbers.
+ */
+
+#include <array>
+#include <map>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+#include "montage.h"
+#include "pipeline.h"
+
+void setup();
+
+using namespace hostsim;
+using pipelinebench::Step;
+
+static const double CAPTURE_SECONDS = 2;
+static const char *const CHAINS[] = {"hp:0.5", "notch:50", "lp:100", "dec:4", "hp:0.5+notch:50+lp:40",
+                                     "hp:0.5+notch:50+lp:100+dec:4", "montage+hp:0.5+dec:2+lp:100+dec:2", "hp:20+env:6+dec:10"};
+static ADSSimSignal saved;
+
+// The chain in double precision with unquantised RBJ coefficients, one sample at a time
+class Reference
+{
+public:
+    Reference(const std::vector<Step> &steps, uint32_t rate, const Montage &montage) : montage_(montage)
+    {
+        for (size_t i = 0; i < steps.size(); i++)
+        {
+            State state;
+            memset(&state, 0, sizeof(state));
+            state.step = steps[i];
+            if (steps[i].kind == PIPELINE_HIGHPASS || steps[i].kind == PIPELINE_LOWPASS || steps[i].kind == PIPELINE_NOTCH ||
+                steps[i].kind == PIPELINE_ENVELOPE)
+            {
+                double w0 = 2 * M_PI * steps[i].value / rate;
+                double cosw = cos(w0);
+                double q = steps[i].kind == PIPELINE_NOTCH ? PIPELINE_NOTCH_Q : M_SQRT1_2;
+                double alpha = sin(w0) / (2 * q);
+                double a0 = 1 + alpha;
+                if (steps[i].kind == PIPELINE_HIGHPASS)
+                    state.b[0] = state.b[2] = (1 + cosw) / 2, state.b[1] = -(1 + cosw);
+                else if (steps[i].kind == PIPELINE_LOWPASS || steps[i].kind == PIPELINE_ENVELOPE)
+                    state.b[0] = state.b[2] = (1 - cosw) / 2, state.b[1] = 1 - cosw;
+                else
+                    state.b[0] = state.b[2] = 1, state.b[1] = -2 * cosw;
+                for (int k = 0; k < 3; k++)
+                    state.b[k] /= a0;
+                state.a[0] = -2 * cosw / a0;
+                state.a[1] = (1 - alpha) / a0;
+            }
+            if (steps[i].kind == PIPELINE_DECIMATE)
+                rate /= (uint32_t)steps[i].value;
+            states_.push_back(state);
+        }
+    }
+
+    // Feeds one input sample; outputs land in out by their sample number
+    void add(uint32_t number, const double *sample, std::map<uint32_t, std::array<double, 8>> &out)
+    {
+        std::array<double, 8> value;
+        memcpy(value.data(), sample, sizeof(double) * 8);
+        run(0, number, value, out);
+    }
+
+private:
+    struct State
+    {
+        Step step;
+        double b[3], a[2];
+        double x1[8], x2[8], y1[8], y2[8];
+        bool primed;
+        bool pending;
+        uint32_t group;
+        int summed;
+        double sum[8];
+    };
+
+    void run(size_t s, uint32_t number, std::array<double, 8> value, std::map<uint32_t, std::array<double, 8>> &out)
+    {
+        for (; s < states_.size(); s++)
+        {
+            State &state = states_[s];
+            if (state.step.kind == PIPELINE_DECIMATE)
+            {
+                uint32_t group = number / (uint32_t)state.step.value;
+                if (state.pending && group != state.group)
+                {
+                    std::array<double, 8> mean;
+                    for (int ch = 0; ch < 8; ch++)
+                        mean[ch] = state.sum[ch] / state.summed;
+                    state.pending = false;
+                    run(s + 1, state.group, mean, out);
+                }
+                if (!state.pending)
+                {
+                    state.pending = true;
+                    state.group = group;
+                    state.summed = 0;
+                    memset(state.sum, 0, sizeof(state.sum));
+                }
+                for (int ch = 0; ch < 8; ch++)
+                    state.sum[ch] += value[ch];
+                state.summed++;
+                // Complete groups leave at once, the pipeline lets them go by the end of the frame
+                if (number % (uint32_t)state.step.value != (uint32_t)state.step.value - 1)
+                    return;
+                for (int ch = 0; ch < 8; ch++)
+                    value[ch] = state.sum[ch] / state.summed;
+                state.pending = false;
+                number = group;
+                continue;
+            }
+            if (state.step.kind == PIPELINE_MONTAGE)
+            {
+                std::array<double, 8> derived;
+                for (int output = 0; output < 8; output++)
+                {
+                    double sum = 0;
+                    for (int input = 0; input < 8; input++)
+                        sum += montage_.weight(output, input) * value[input];
+                    derived[output] = montage_.divisor(output) ? sum / montage_.divisor(output) : 0;
+                }
+                value = derived;
+                continue;
+            }
+            if (state.step.kind == PIPELINE_ENVELOPE)
+                for (int ch = 0; ch < 8; ch++)
+                    value[ch] = fabs(value[ch]);
+            if (!state.primed)
+            {
+                for (int ch = 0; ch < 8; ch++)
+                {
+                    state.x1[ch] = state.x2[ch] = value[ch];
+                    state.y1[ch] = state.y2[ch] = state.step.kind == PIPELINE_HIGHPASS ? 0 : value[ch];
+                }
+                state.primed = true;
+            }
+            for (int ch = 0; ch < 8; ch++)
+            {
+                double y = state.b[0] * value[ch] + state.b[1] * state.x1[ch] + state.b[2] * state.x2[ch] -
+                           state.a[0] * state.y1[ch] - state.a[1] * state.y2[ch];
+                state.x2[ch] = state.x1[ch];
+                state.x1[ch] = value[ch];
+                state.y2[ch] = state.y1[ch];
+                state.y1[ch] = y;
+                value[ch] = y;
+            }
+        }
+        out[number] = value;
+    }
+
+    std::vector<State> states_;
+    const Montage &montage_;
+};
+
+static void checkChains(uint32_t rate)
+{
+    BenchClient bench;
+    connectBench(bench);
+    ads().signal().offset_mV = 20;
+    std::vector<std::vector<uint8_t>> frames;
+    pipelinebench::capture(bench, rate, CAPTURE_SECONDS, frames);
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, frames.size(), "no raw frames captured");
+    Montage montage;
+    montage.commonAverage(0xFF);
+
+    for (size_t c = 0; c < sizeof(CHAINS) / sizeof(CHAINS[0]); c++)
+    {
+        std::vector<Step> steps;
+        TEST_ASSERT_TRUE_MESSAGE(pipelinebench::parseChain(CHAINS[c], steps), CHAINS[c]);
+        Pipeline pipeline;
+        bool appended = true;
+        for (size_t i = 0; i < steps.size(); i++)
+            appended = appended && pipeline.append(steps[i].kind, steps[i].value, rate);
+        TEST_ASSERT_TRUE_MESSAGE(appended, CHAINS[c]);
+
+        // Against the reference, skipping the first second while both settle alike
+        Reference reference(steps, rate, montage);
+        std::map<uint32_t, std::array<double, 8>> expected;
+        std::map<uint32_t, std::array<int32_t, 8>> outputs;
+        std::vector<uint8_t> frame;
+        uint64_t unflagged = 0;
+        for (size_t f = 0; f < frames.size(); f++)
+        {
+            frame = frames[f];
+            frame.resize(frame.size() + FRAME_BLOCK_SIZE);
+            uint32_t samples = frame[6] | (frame[7] << 8);
+            for (uint32_t i = 0; i < samples; i++)
+            {
+                const uint8_t *block = &frame[FRAME_BLOCK_SIZE * (1 + i)];
+                double sample[8];
+                for (int ch = 0; ch < 8; ch++)
+                {
+                    const uint8_t *code = block + FRAME_SAMPLE_DATA_OFFSET + 3 * ch;
+                    sample[ch] = (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+                }
+                reference.add(readLE32(block + 4), sample, expected);
+            }
+            pipeline.process(frame.data(), &montage);
+            FrameHeader header;
+            memcpy(&header, frame.data(), sizeof(header));
+            if (!(header.flags & FRAME_FLAG_FILTERED) || header.sample_rate != pipeline.outputRate(rate))
+                unflagged++;
+            for (uint32_t i = 0; i < header.samples; i++)
+            {
+                const uint8_t *block = &frame[FRAME_BLOCK_SIZE * (1 + i)];
+                std::array<int32_t, 8> values;
+                for (int ch = 0; ch < 8; ch++)
+                {
+                    const uint8_t *code = block + FRAME_SAMPLE_DATA_OFFSET + 3 * ch;
+                    values[ch] = (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+                }
+                outputs[readLE32(block + 4)] = values;
+            }
+        }
+        uint32_t output_rate = pipeline.outputRate(rate);
+        uint32_t first = outputs.empty() ? 0 : outputs.begin()->first;
+        uint64_t compared = 0, missing = 0, gaps = 0;
+        double worst = 0;
+        uint32_t previous = first;
+        for (std::map<uint32_t, std::array<int32_t, 8>>::iterator it = outputs.begin(); it != outputs.end(); ++it)
+        {
+            if (it->first != first && it->first != previous + 1)
+                gaps++;
+            previous = it->first;
+            if (it->first < first + output_rate)
+                continue;
+            std::map<uint32_t, std::array<double, 8>>::iterator e = expected.find(it->first);
+            if (e == expected.end())
+            {
+                missing++;
+                continue;
+            }
+            for (int ch = 0; ch < 8; ch++)
+                worst = std::max(worst, fabs(it->second[ch] - e->second[ch]));
+            compared++;
+        }
+        printf("{\"test\":\"pipeline\",\"chain\":\"%s\",\"rate\":%u,\"output_rate\":%u,\"frames\":%zu,\"samples_out\":%zu,"
+               "\"compared\":%llu,\"missing\":%llu,\"gaps\":%llu,\"unflagged\":%llu,\"worst_error\":%.2f}\n",
+               CHAINS[c], rate, output_rate, frames.size(), outputs.size(), (unsigned long long)compared,
+               (unsigned long long)missing, (unsigned long long)gaps, (unsigned long long)unflagged, worst);
+        fflush(stdout);
+        TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, compared, CHAINS[c]);
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, missing, CHAINS[c]);
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, gaps, CHAINS[c]);
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, unflagged, CHAINS[c]);
+        // Within a code per stage
+        TEST_ASSERT_TRUE_MESSAGE(worst <= steps.size(), CHAINS[c]);
+    }
+}
+
+void test_pipeline_1000(void)
+{
+    checkChains(1000);
+}
+
+void test_pipeline_4000(void)
+{
+    checkChains(4000);
+}
+
+void test_pipeline_stream(void)
+{
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(500000000ULL);
+    bench.command("{\"command\":\"samplerate\",\"parameters\":[1000]}");
+    bench.command("{\"command\":\"pipeline\",\"parameters\":[0]}");
+    bench.command("{\"command\":\"pipeline\",\"parameters\":[3,50]}");
+    bench.command("{\"command\":\"pipeline\",\"parameters\":[4,4]}");
+    std::string enabled = bench.reply;
+    uint64_t filtered = 0, other = 0, wrong_rate = 0;
+    bench.clear();
+    bench.on_frame = [&](const Message &message) {
+        if (message.data.size() < FRAME_BLOCK_SIZE || readLE32(&message.data[0]) != FRAME_MAGIC)
+            return;
+        if (!(message.data[5] & FRAME_FLAG_FILTERED))
+            other++;
+        else
+            filtered++;
+        if (readLE32(&message.data[12]) != 250)
+            wrong_rate++;
+    };
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.runFor((uint64_t)(CAPTURE_SECONDS * 1e9));
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.on_frame = nullptr;
+    bench.command("{\"command\":\"pipeline\"}");
+    std::string report = bench.reply;
+    bench.command("{\"command\":\"pipeline\",\"parameters\":[0]}");
+
+    double expected_samples = CAPTURE_SECONDS * 250;
+    printf("{\"test\":\"pipeline\",\"firmware\":\"%s\",\"setup\":%s,\"frames\":%llu,\"unfiltered\":%llu,\"wrong_rate\":%llu,"
+           "\"samples\":%llu,\"expected_samples\":%.0f,\"sample_gaps\":%llu,\"report\":%s}\n",
+           firmware.c_str(), enabled.c_str(), (unsigned long long)filtered, (unsigned long long)other,
+           (unsigned long long)wrong_rate, (unsigned long long)bench.samples, expected_samples,
+           (unsigned long long)bench.sample_gaps, report.c_str());
+    fflush(stdout);
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, filtered, "no filtered frames");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, other, "unfiltered frames");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, wrong_rate, "frames not at the output rate");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, bench.sample_gaps, "sample gaps");
+    TEST_ASSERT_TRUE_MESSAGE(fabs(bench.samples - expected_samples) <= 0.1 * expected_samples, "samples off the output rate");
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+    ads().signal() = saved;
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    saved = ads().signal();
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_pipeline_1000);
+    RUN_TEST(test_pipeline_4000);
+    RUN_TEST(test_pipeline_stream);
+    return UNITY_END();
+}
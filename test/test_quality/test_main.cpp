@@ -0,0 +1,302 @@
+/*
+ * Signal quality statistics against a reference, offline and streamed
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Feeds QualityMeter synthetic channels, from quiet to clipped, with a
+ * sine at the line frequency, and checks every statistic of a window
+ * against a double precision reference. Then streams from the simulated
+ * firmware with the summary on, at 50 Hz and at 60 Hz mains and with an
+ * electrode offset past full scale, and checks each summary against the
+ * same reference over the raw samples it covers, and the line RMS against
+ * the mains amplitude the simulator injects.
+ */
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "adscommand.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+#include "quality.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const double STREAM_SECONDS = 5;
+static ADSSimSignal saved;
+
+// The numbers of a flat JSON array under key, NAN for null
+static std::vector<double> replyArray(const std::string &reply, const char *key)
+{
+    std::vector<double> values;
+    std::string pattern = std::string("\"") + key + "\":[";
+    size_t at = reply.find(pattern);
+    if (at == std::string::npos)
+        return values;
+    const char *p = reply.c_str() + at + pattern.size();
+    while (*p && *p != ']')
+    {
+        char *end;
+        if (strncmp(p, "null", 4) == 0)
+        {
+            values.push_back(NAN);
+            end = (char *)p + 4;
+        }
+        else
+            values.push_back(strtod(p, &end));
+        p = *end == ',' ? end + 1 : end;
+        if (end == p && *p != ']')
+            break;
+    }
+    return values;
+}
+
+// Straight from the definitions, in double precision
+struct Reference
+{
+    double mean = 0, rms = 0, line_rms = 0;
+    int32_t minimum = 0, maximum = 0;
+    uint32_t clipped = 0;
+};
+
+static Reference reference(const std::vector<int32_t> &codes, double line_hz, double rate)
+{
+    Reference r;
+    double sum = 0, re = 0, im = 0;
+    r.minimum = r.maximum = codes[0];
+    for (size_t i = 0; i < codes.size(); i++)
+    {
+        sum += codes[i];
+        r.minimum = std::min(r.minimum, codes[i]);
+        r.maximum = std::max(r.maximum, codes[i]);
+        r.clipped += codes[i] >= QUALITY_CODE_MAX || codes[i] <= QUALITY_CODE_MIN;
+        re += codes[i] * cos(2 * M_PI * line_hz * i / rate);
+        im -= codes[i] * sin(2 * M_PI * line_hz * i / rate);
+    }
+    r.mean = sum / codes.size();
+    double m2 = 0;
+    for (size_t i = 0; i < codes.size(); i++)
+        m2 += (codes[i] - r.mean) * (codes[i] - r.mean);
+    r.rms = sqrt(m2 / codes.size());
+    r.line_rms = sqrt(2.0) * sqrt(re * re + im * im) / codes.size();
+    return r;
+}
+
+static bool close(double value, double expected, double relative, double absolute)
+{
+    return fabs(value - expected) <= relative * fabs(expected) + absolute;
+}
+
+void test_quality_meter(void)
+{
+    const uint32_t rates[] = {250, 1000, 16000};
+    const float lines[] = {50, 60};
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+        for (size_t l = 0; l < 2; l++)
+        {
+            uint32_t rate = rates[r];
+            std::vector<std::vector<int32_t>> codes;
+            qualitybench::window(rate, lines[l], codes);
+            uint32_t window = (uint32_t)codes[0].size();
+            QualityMeter meter;
+            meter.begin(rate, 8, lines[l]);
+            for (uint32_t i = 0; i < window; i++)
+            {
+                int32_t sample[8];
+                for (int ch = 0; ch < 8; ch++)
+                    sample[ch] = codes[ch][i];
+                meter.addSample(i, sample);
+            }
+            bool polled = meter.poll();
+            printf("{\"test\":\"quality\",\"rate\":%u,\"line_hz\":%.0f,\"window\":%u,\"samples\":%u,\"clipped_ch8\":%u}\n",
+                   rate, lines[l], window, meter.samples(), meter.clipped(7));
+            fflush(stdout);
+            TEST_ASSERT_TRUE_MESSAGE(polled, "no window after a full window of samples");
+            TEST_ASSERT_EQUAL_UINT32_MESSAGE(window, meter.samples(), "samples in the window");
+            for (int ch = 0; ch < 8; ch++)
+            {
+                Reference ref = reference(codes[ch], lines[l], rate);
+                TEST_ASSERT_TRUE_MESSAGE(close(meter.mean(ch), ref.mean, 1e-6, 1), "mean");
+                TEST_ASSERT_TRUE_MESSAGE(close(meter.rms(ch), ref.rms, 1e-3, 0.5), "rms");
+                TEST_ASSERT_TRUE_MESSAGE(close(meter.lineRms(ch), ref.line_rms, 1e-3, 2), "line rms");
+                TEST_ASSERT_EQUAL_INT_MESSAGE(ref.minimum, meter.minimum(ch), "minimum");
+                TEST_ASSERT_EQUAL_INT_MESSAGE(ref.maximum, meter.maximum(ch), "maximum");
+                TEST_ASSERT_EQUAL_UINT32_MESSAGE(ref.clipped, meter.clipped(ch), "clipped");
+            }
+        }
+}
+
+struct Scenario
+{
+    const char *name;
+    float line_hz;
+    float line_uV;
+    float offset_mV;
+};
+
+static void checkStream(const Scenario &scenario)
+{
+    using namespace ADS129x;
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    char json[96];
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(500000000ULL);
+    ads().setChip(ADSSIM_ADS1299);
+    ads().signal().line_hz = scenario.line_hz;
+    ads().signal().line_uV = scenario.line_uV;
+    ads().signal().offset_mV = scenario.offset_mV;
+    bench.command("{\"command\":\"reset\"}");
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.command("{\"command\":\"samplerate\",\"parameters\":[1000]}");
+    for (int ch = 0; ch < ads().channels(); ch++)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+        bench.command(json);
+    }
+    snprintf(json, sizeof(json), "{\"command\":\"quality\",\"parameters\":[2,%.0f]}", scenario.line_hz);
+    bench.command(json);
+    const double uv_per_count = adcVoltsPerCount(ADC_FAMILY_ADS1299, 0x60, ads().reg(CONFIG3)) * 1e6;
+
+    std::map<uint32_t, std::array<int32_t, 8>> samples;
+    std::vector<std::string> summaries;
+    bench.clear();
+    bench.on_frame = [&](const Message &message) {
+        if (message.data.size() < FRAME_BLOCK_SIZE || readLE32(&message.data[0]) != FRAME_MAGIC ||
+            (message.data[5] & FRAME_FLAG_PACKED))
+            return;
+        size_t end = std::min<size_t>(message.data.size(), FRAME_BLOCK_SIZE * (1 + (message.data[6] | (message.data[7] << 8))));
+        for (size_t offset = FRAME_BLOCK_SIZE; offset + FRAME_BLOCK_SIZE <= end; offset += FRAME_BLOCK_SIZE)
+        {
+            std::array<int32_t, 8> codes;
+            for (int ch = 0; ch < 8; ch++)
+            {
+                const uint8_t *code = &message.data[offset + FRAME_SAMPLE_DATA_OFFSET + 3 * ch];
+                codes[ch] = (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+            }
+            samples[readLE32(&message.data[offset + 4])] = codes;
+        }
+    };
+    bench.on_text = [&](const Message &message) {
+        std::string text(message.data.begin(), message.data.end());
+        if (text.compare(0, 11, "{\"quality\":") == 0)
+            summaries.push_back(text);
+    };
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.runFor((uint64_t)(STREAM_SECONDS * 1e9));
+    bench.command("{\"command\":\"quality\"}");
+    std::string last = bench.reply;
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.on_frame = nullptr;
+    bench.on_text = nullptr;
+    bench.command("{\"command\":\"quality\",\"parameters\":[0]}");
+
+    uint64_t checked = 0, mismatches = 0;
+    double worst_line_vs_injected = 0;
+    for (const std::string &summary : summaries)
+    {
+        uint32_t last_sample = (uint32_t)replyNumber(summary, "last_sample");
+        uint32_t count = (uint32_t)replyNumber(summary, "samples");
+        std::vector<double> dc = replyArray(summary, "dc_uv");
+        std::vector<double> rms = replyArray(summary, "rms_uv");
+        std::vector<double> min = replyArray(summary, "min_uv");
+        std::vector<double> max = replyArray(summary, "max_uv");
+        std::vector<double> line = replyArray(summary, "line_uv");
+        std::vector<double> clipped = replyArray(summary, "clipped");
+        if (count == 0 || !samples.count(last_sample - count + 1) || !samples.count(last_sample) || dc.size() != 8)
+            continue;
+        checked++;
+        for (int ch = 0; ch < ads().channels(); ch++)
+        {
+            std::vector<int32_t> codes;
+            for (uint32_t n = last_sample - count + 1; n != last_sample + 1; n++)
+                if (samples.count(n))
+                    codes.push_back(samples[n][ch]);
+            Reference ref = reference(codes, scenario.line_hz, 1000);
+            bool ok = codes.size() == count && close(dc[ch], ref.mean * uv_per_count, 1e-5, 0.1) &&
+                      close(rms[ch], ref.rms * uv_per_count, 2e-3, 0.02) &&
+                      close(min[ch], ref.minimum * uv_per_count, 1e-5, 0.1) &&
+                      close(max[ch], ref.maximum * uv_per_count, 1e-5, 0.1) &&
+                      close(line[ch], ref.line_rms * uv_per_count, 2e-3, 0.02) && clipped[ch] == ref.clipped;
+            if (scenario.offset_mV < 100)
+                worst_line_vs_injected = std::max(worst_line_vs_injected, fabs(line[ch] / (scenario.line_uV / sqrt(2.0)) - 1));
+            else
+                ok = ok && clipped[ch] == count;
+            if (!ok)
+                mismatches++;
+        }
+    }
+    printf("{\"test\":\"quality\",\"firmware\":\"%s\",\"scenario\":\"%s\",\"summaries\":%zu,\"checked\":%llu,"
+           "\"mismatches\":%llu,\"worst_line_vs_injected\":%.4f,\"last\":%s}\n",
+           firmware.c_str(), scenario.name, summaries.size(), (unsigned long long)checked,
+           (unsigned long long)mismatches, worst_line_vs_injected, summaries.empty() ? "null" : summaries.back().c_str());
+    fflush(stdout);
+    TEST_ASSERT_TRUE_MESSAGE(checked + 1 >= (uint64_t)STREAM_SECONDS, "too few summaries checked");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, mismatches, "channel summaries off the reference");
+    TEST_ASSERT_TRUE_MESSAGE(worst_line_vs_injected < 0.05, "line RMS off the injected mains");
+    TEST_ASSERT_TRUE_MESSAGE(last.find("\"quality\"") != std::string::npos, "no summary in the quality reply");
+}
+
+void test_quality_mains50(void)
+{
+    checkStream({"mains50", 50, 30, 0});
+}
+
+void test_quality_mains60(void)
+{
+    checkStream({"mains60", 60, 100, 20});
+}
+
+void test_quality_clipped(void)
+{
+    checkStream({"clipped", 50, 10, 400});
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+    ads().signal() = saved;
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    saved = ads().signal();
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_quality_meter);
+    RUN_TEST(test_quality_mains50);
+    RUN_TEST(test_quality_mains60);
+    RUN_TEST(test_quality_clipped);
+    return UNITY_END();
+}
@@ -0,0 +1,195 @@
+/*
+ * Flash recording through a WiFi outage, then download
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Records to the flash log through a WiFi outage and downloads the
+ * recording afterwards. The log is prepared with record [1] while idle,
+ * then the client disconnects for OUTAGE_SECONDS and reconnects before
+ * sdatac. Every sample converted while streaming should come back from
+ * the download, and the acquisition path should lose nothing to the page
+ * programs that run between frame sends.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const double OUTAGE_SECONDS = 10;
+static const uint64_t CONNECTED_NS = 1000000000ULL; // before and after the outage
+
+static void checkRecord(uint32_t rate)
+{
+    using namespace ADS129x;
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    char json[96];
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(500000000ULL);
+    ads().setChip(ADSSIM_ADS1299);
+    bench.command("{\"command\":\"reset\"}");
+    bench.command("{\"command\":\"sdatac\"}");
+    snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+    bench.command(json);
+    for (int ch = 0; ch < ads().channels(); ch++)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+        bench.command(json);
+    }
+
+    // Arm and wait for the erase ahead to settle
+    uint64_t prepare_start = nowNs();
+    bench.command("{\"command\":\"record\",\"parameters\":[1]}");
+    std::string record_reply = replyField(bench.reply);
+    int64_t erased = -1;
+    while (replyNumber(bench.reply, "erased_ahead") != erased)
+    {
+        erased = replyNumber(bench.reply, "erased_ahead");
+        bench.runFor(1000000000ULL);
+        bench.command("{\"command\":\"record\"}");
+    }
+    double prepare_s = (nowNs() - prepare_start) / 1e9;
+
+    bool have_first = false;
+    uint32_t first_sample = 0;
+    bench.on_frame = [&](const Message &message) {
+        if (!have_first && message.data.size() >= sizeof(FrameHeader) && readLE32(&message.data[0]) == FRAME_MAGIC)
+        {
+            first_sample = readLE32(&message.data[8]);
+            have_first = true;
+        }
+    };
+    Stats before = stats();
+    uint64_t conversions_start = ads().conversions();
+    uint64_t start_ns = nowNs();
+    bench.clear();
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.runFor(CONNECTED_NS);
+    client().disconnect();
+    bench.runFor((uint64_t)(OUTAGE_SECONDS * 1e9));
+    client().connect();
+    while (!client().connected())
+        bench.step();
+    bench.runFor(CONNECTED_NS);
+    bench.on_frame = nullptr;
+    uint64_t live_samples = bench.samples;
+    // Conversions after the chip left RDATAC are not streamed; the
+    // reply to sdatac comes a queue and a link later
+    bench.have_reply = false;
+    uint64_t sdatac_ns = nowNs();
+    client().sendText("{\"command\":\"sdatac\"}");
+    while (ads().isRdatac() && nowNs() - sdatac_ns < 2000000000ULL)
+        bench.step();
+    uint64_t generated = ads().conversions() - conversions_start;
+    while (!bench.have_reply && nowNs() - sdatac_ns < 2000000000ULL)
+        bench.step();
+    double elapsed = (nowNs() - start_ns) / 1e9;
+    Stats after = stats();
+    bench.command("{\"command\":\"record\"}");
+    std::string log_reply = bench.reply;
+
+    bench.clear();
+    uint64_t recorded = 0;
+    uint64_t download_bytes = 0;
+    uint32_t frame_samples = 0;
+    bench.on_frame = [&](const Message &message) {
+        FrameHeader header;
+        if (message.data.size() < sizeof(header))
+            return;
+        memcpy(&header, message.data.data(), sizeof(header));
+        if (header.magic == FRAME_MAGIC && (header.flags & FRAME_FLAG_RECORDED))
+        {
+            recorded += header.samples;
+            frame_samples = header.samples;
+            download_bytes += message.data.size();
+        }
+    };
+    uint64_t download_start = nowNs();
+    snprintf(json, sizeof(json), "{\"command\":\"download\",\"parameters\":[%u]}", first_sample);
+    bench.command(json);
+    uint64_t download_end = nowNs() + 60000000000ULL;
+    while (bench.reply.find("\"done\"") == std::string::npos && nowNs() < download_end)
+        bench.step();
+    double download_s = (bench.reply_ns - download_start) / 1e9;
+    bench.on_frame = nullptr;
+
+    printf("{\"test\":\"record\",\"firmware\":\"%s\",\"rate\":%u,\"outage_s\":%.1f,\"seconds\":%.3f,\"record\":\"%s\","
+           "\"prepare_s\":%.1f,\"generated\":%llu,\"live\":%llu,\"recorded\":%llu,\"sample_gaps\":%llu,"
+           "\"isr_latched\":%llu,\"isr_lost\":%llu,\"flash_kBps\":%.1f,\"flash_busy\":%.4f,"
+           "\"download_s\":%.3f,\"download_kBps\":%.1f,\"frames_rejected\":%lld}\n",
+           firmware.c_str(), rate, OUTAGE_SECONDS, elapsed, record_reply.c_str(), prepare_s,
+           (unsigned long long)generated, (unsigned long long)live_samples, (unsigned long long)recorded,
+           (unsigned long long)bench.sample_gaps,
+           (unsigned long long)(after.isr_latched - before.isr_latched),
+           (unsigned long long)(after.isr_lost - before.isr_lost),
+           (after.flash_bytes_written - before.flash_bytes_written) / elapsed / 1000,
+           (after.flash_busy_ns - before.flash_busy_ns) / (elapsed * 1e9),
+           download_s, download_s > 0 ? download_bytes / download_s / 1000 : 0,
+           (long long)replyNumber(log_reply, "frames_rejected"));
+    fflush(stdout);
+    TEST_ASSERT_TRUE_MESSAGE(have_first, "no live frame before the outage");
+    // The frame still open at sdatac is never completed
+    TEST_ASSERT_TRUE_MESSAGE(recorded + frame_samples > generated, "download is missing converted samples");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, bench.sample_gaps, "gaps in the download");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, after.isr_lost - before.isr_lost, "DRDY lost to flash writes");
+}
+
+void test_record_250(void)
+{
+    checkRecord(250);
+}
+
+void test_record_500(void)
+{
+    checkRecord(500);
+}
+
+void test_record_1000(void)
+{
+    checkRecord(1000);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_record_250);
+    RUN_TEST(test_record_500);
+    RUN_TEST(test_record_1000);
+    return UNITY_END();
+}
@@ -0,0 +1,176 @@
+/*
+ * Gap recovery through the resend command after a disconnect
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Streams, drops the client for about half the resend window and, once
+ * live frames arrive again, asks for the samples in between. Live and
+ * resent frames are merged by sample number, and the test passes when the
+ * merged recording has no gap. Live latency while the resend runs is
+ * printed next to the latency outside it.
+ */
+
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const double STREAM_SECONDS = 2; // before and after the outage
+
+static void checkResend(uint32_t rate)
+{
+    using namespace ADS129x;
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    char json[96];
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(500000000ULL);
+    ads().setChip(ADSSIM_ADS1299);
+    bench.command("{\"command\":\"reset\"}");
+    bench.command("{\"command\":\"sdatac\"}");
+    snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+    bench.command(json);
+    for (int ch = 0; ch < ads().channels(); ch++)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+        bench.command(json);
+    }
+
+    std::set<uint32_t> received;
+    uint32_t last_live = 0;
+    bool have_live = false;
+    bool resend_running = false;
+    std::vector<uint32_t> latency_live, latency_resend;
+    uint64_t resent_frames = 0;
+    bench.on_frame = [&](const Message &message) {
+        FrameHeader header;
+        if (message.data.size() < sizeof(header))
+            return;
+        memcpy(&header, message.data.data(), sizeof(header));
+        if (header.magic != FRAME_MAGIC)
+            return;
+        bool resent = header.flags & FRAME_FLAG_RESENT;
+        if (resent)
+            resent_frames++;
+        for (size_t offset = sizeof(header); offset < FRAME_BLOCK_SIZE * (1 + (size_t)header.samples) && offset < message.data.size(); offset += FRAME_BLOCK_SIZE)
+        {
+            received.insert(readLE32(&message.data[offset + 4]));
+            if (resent)
+                continue;
+            uint32_t latency = (uint32_t)(message.delivered_ns / 1000) - readLE32(&message.data[offset]);
+            (resend_running ? latency_resend : latency_live).push_back(latency);
+        }
+        if (!resent)
+        {
+            last_live = header.first_sample + header.samples - 1;
+            have_live = true;
+        }
+    };
+
+    bench.clear();
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.runFor((uint64_t)(STREAM_SECONDS * 1e9));
+    bench.command("{\"command\":\"resend\"}");
+    double window_ms = atof(bench.reply.c_str() + bench.reply.find("\"window_ms\":") + 12);
+    uint64_t outage_ns = (uint64_t)(window_ms * 1e6 / 2);
+
+    uint32_t before_outage = last_live;
+    client().disconnect();
+    bench.runFor(outage_ns);
+    client().connect();
+    have_live = false;
+    while (!have_live)
+        bench.step();
+    uint32_t after_outage = last_live;
+
+    // Everything between the last frame before and the first after
+    snprintf(json, sizeof(json), "{\"command\":\"resend\",\"parameters\":[%u,%u]}", before_outage + 1, after_outage);
+    uint64_t resend_start = nowNs();
+    resend_running = true;
+    bench.command(json);
+    uint64_t resend_end = nowNs() + 30000000000ULL;
+    while (bench.reply.find("\"done\"") == std::string::npos && nowNs() < resend_end)
+        bench.step();
+    double resend_s = (bench.reply_ns - resend_start) / 1e9;
+    resend_running = false;
+    bench.runFor((uint64_t)(STREAM_SECONDS * 1e9));
+    bench.on_frame = nullptr;
+    bench.command("{\"command\":\"sdatac\"}");
+
+    uint64_t missing = 0;
+    if (!received.empty())
+        missing = (uint64_t)(*received.rbegin() - *received.begin() + 1) - received.size();
+    printf("{\"test\":\"resend\",\"firmware\":\"%s\",\"rate\":%u,\"window_ms\":%.0f,\"outage_ms\":%.0f,"
+           "\"gap_samples\":%u,\"resent_frames\":%llu,\"resend_s\":%.3f,\"received\":%zu,\"missing\":%llu,",
+           firmware.c_str(), rate, window_ms, outage_ns / 1e6, after_outage - before_outage,
+           (unsigned long long)resent_frames, resend_s, received.size(), (unsigned long long)missing);
+    printPercentiles("latency_us", latency_live);
+    printf(",");
+    printPercentiles("latency_resend_us", latency_resend);
+    printf("}\n");
+    fflush(stdout);
+    TEST_ASSERT_FALSE_MESSAGE(received.empty(), "no frames");
+    TEST_ASSERT_TRUE_MESSAGE(resent_frames > 0, "nothing was resent");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, missing, "samples missing from live and resent frames");
+}
+
+void test_resend_250(void)
+{
+    checkResend(250);
+}
+
+void test_resend_1000(void)
+{
+    checkResend(1000);
+}
+
+void test_resend_4000(void)
+{
+    checkResend(4000);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_resend_250);
+    RUN_TEST(test_resend_1000);
+    RUN_TEST(test_resend_4000);
+    return UNITY_END();
+}
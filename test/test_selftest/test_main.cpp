@@ -0,0 +1,176 @@
+/*
+ * Test signal self-test per chip and rate, and on a throttled link
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Runs the selftest command per chip and rate and times, on the client
+ * side, every edge of the test signal from the DRDY of its conversion to
+ * the arrival of the frame that carries it. A last run throttles the link
+ * to a third of the raw stream, so the firmware drops samples and the
+ * self-test has to catch them as missed or, stuck in the ring when time
+ * is up, late. The device verdict has to be passed on every clean run
+ * and failed on the throttled one.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const uint32_t TEST_SECONDS = 2;
+static const uint32_t RATES[] = {250, 1000, 4000};
+static uint32_t full_kbps;
+
+// Runs the self-test once: the result the device reported, "none" without a verdict
+static std::string runSelfTest(ADSSimChip chip, uint32_t rate, bool throttled, std::string &verdict)
+{
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    // Edges of channel 1 as the frames arrive, raw frames only
+    std::vector<uint32_t> edge_latency_us;
+    int level = 0;
+    bench.on_frame = [&](const Message &message) {
+        if (message.data.size() < FRAME_BLOCK_SIZE || readLE32(&message.data[0]) != FRAME_MAGIC ||
+            (message.data[5] & FRAME_FLAG_PACKED))
+            return;
+        size_t end = std::min<size_t>(message.data.size(), FRAME_BLOCK_SIZE * (1 + (message.data[6] | (message.data[7] << 8))));
+        for (size_t offset = FRAME_BLOCK_SIZE; offset + FRAME_BLOCK_SIZE <= end; offset += FRAME_BLOCK_SIZE)
+        {
+            const uint8_t *code = &message.data[offset + FRAME_SAMPLE_DATA_OFFSET];
+            int32_t value = (int32_t)(((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) | ((uint32_t)code[2] << 8)) >> 8;
+            int now = value > 0 ? 1 : -1;
+            if (level != 0 && now != level)
+            {
+                uint64_t drdy_ns = ads().conversionTimeNs(readLE32(&message.data[offset + 4]));
+                edge_latency_us.push_back((uint32_t)((message.delivered_ns - drdy_ns) / 1000));
+            }
+            level = now;
+        }
+    };
+
+    char json[96];
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(500000000ULL);
+    ads().setChip(chip);
+    bench.command("{\"command\":\"reset\"}");
+    bench.command("{\"command\":\"sdatac\"}");
+    snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+    bench.command(json);
+
+    bench.clear();
+    if (throttled)
+        config().link_kbps = rate * 32 * 8 / 1000 / 3;
+    verdict.clear();
+    bench.on_text = [&](const Message &message) {
+        std::string text(message.data.begin(), message.data.end());
+        if (text.find("\"selftest\"") != std::string::npos && text.find("\"running\"") == std::string::npos)
+            verdict = text;
+    };
+    snprintf(json, sizeof(json), "{\"command\":\"selftest\",\"parameters\":[%u]}", TEST_SECONDS);
+    bench.command(json);
+    std::string started = bench.reply;
+    uint64_t deadline = nowNs() + (uint64_t)(TEST_SECONDS + 3) * 1000000000ULL;
+    while (verdict.empty() && nowNs() < deadline)
+        bench.step();
+    bench.on_text = nullptr;
+    bench.on_frame = nullptr;
+    config().link_kbps = full_kbps;
+
+    std::string result = verdict.empty() ? "none" : replyField(verdict.substr(verdict.find("\"selftest\"")));
+    result = result.substr(0, result.find(','));
+    printf("{\"test\":\"selftest\",\"firmware\":\"%s\",\"chip\":\"%s\",\"rate\":%u,\"throttled\":%s,"
+           "\"seconds\":%u,\"result\":\"%s\",\"missed\":%lld,\"late\":%lld,\"read_errors\":%lld,\"frames\":%llu,",
+           firmware.c_str(), ads().chipName(), rate, throttled ? "true" : "false", TEST_SECONDS,
+           result.c_str(), (long long)replyNumber(verdict, "missed"), (long long)replyNumber(verdict, "late"),
+           (long long)replyNumber(verdict, "read_errors"), (unsigned long long)bench.frames);
+    printPercentiles("edge_latency_us", edge_latency_us);
+    printf(",\"device\":%s}\n", verdict.empty() ? (started.empty() ? "null" : started.c_str()) : verdict.c_str());
+    fflush(stdout);
+    return result;
+}
+
+static void checkPasses(ADSSimChip chip)
+{
+    int runs = 0;
+    for (size_t r = 0; r < sizeof(RATES) / sizeof(RATES[0]); r++)
+    {
+        uint8_t config1;
+        if (!config1ForRate(chip, RATES[r], config1))
+            continue;
+        std::string verdict;
+        std::string result = runSelfTest(chip, RATES[r], false, verdict);
+        TEST_ASSERT_EQUAL_STRING_MESSAGE("passed", result.c_str(), "self-test on a clean link");
+        runs++;
+    }
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, runs, "no rate the chip supports");
+}
+
+void test_selftest_ads1299(void)
+{
+    checkPasses(ADSSIM_ADS1299);
+}
+
+void test_selftest_ads1298(void)
+{
+    checkPasses(ADSSIM_ADS1298);
+}
+
+void test_selftest_ads1292r(void)
+{
+    checkPasses(ADSSIM_ADS1292R);
+}
+
+void test_selftest_fails_on_throttled_link(void)
+{
+    std::string verdict;
+    std::string result = runSelfTest(ADSSIM_ADS1299, RATES[sizeof(RATES) / sizeof(RATES[0]) - 1], true, verdict);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("failed", result.c_str(), "self-test with samples dropped");
+    TEST_ASSERT_TRUE_MESSAGE(replyNumber(verdict, "missed") + replyNumber(verdict, "late") > 0,
+                             "dropped samples not reported as missed or late");
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+    config().link_kbps = full_kbps;
+}
+
+int main(int argc, char **argv)
+{
+    full_kbps = config().link_kbps;
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_selftest_ads1299);
+    RUN_TEST(test_selftest_ads1298);
+    RUN_TEST(test_selftest_ads1292r);
+    RUN_TEST(test_selftest_fails_on_throttled_link);
+    return UNITY_END();
+}
@@ -0,0 +1,180 @@
+/*
+ * Clock sync and scheduled start across simulated devices
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Brings up one simulated device per clock configuration, estimates its
+ * clock with SYNC_SECONDS of sync exchanges over a jittery link,
+ * schedules a START at a host time and streams for STREAM_SECONDS while
+ * the exchanges go on. The drift estimate must be within
+ * DRIFT_TOLERANCE_PPB of the crystal error both before the START and at
+ * the end, and the samples must land on the host timeline: the START
+ * error against the requested instant and, per sample, the header mapped
+ * timestamp against the true DRDY time. The devices run one after the
+ * other on the same host timeline, so their START errors compare
+ * directly.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "frameformat.h"
+#include "hostsim.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const double SYNC_SECONDS = 120;
+static const double STREAM_SECONDS = 30;
+static const uint64_t EXCHANGE_INTERVAL_NS = 200000000ULL;
+static const uint64_t START_LEAD_US = 300000;
+static const int64_t DRIFT_TOLERANCE_PPB = 3000;
+static const int64_t ALIGN_TOLERANCE_US = 1000;
+
+void test_sync_devices_share_the_host_timeline(void)
+{
+    using namespace ADS129x;
+    static const struct
+    {
+        int32_t ppm;
+        int64_t offset_us;
+    } DEVICES[] = {{-40, 5000000}, {0, 123456}, {25, 9000000000LL}, {60, 77777}};
+
+    BenchClient bench;
+    connectBench(bench);
+
+    char json[160];
+    int64_t start_min = INT64_MAX, start_max = INT64_MIN;
+    uint32_t worst_map = 0;
+    for (size_t d = 0; d < sizeof(DEVICES) / sizeof(DEVICES[0]); d++)
+    {
+        bench.command("{\"command\":\"sdatac\"}");
+        bench.runFor(500000000ULL);
+        config().clock_ppm = DEVICES[d].ppm;
+        config().clock_offset_us = DEVICES[d].offset_us - (int64_t)(nowNs() / 1000);
+        ads().setChip(ADSSIM_ADS1299);
+        bench.command("{\"command\":\"reset\"}");
+        bench.command("{\"command\":\"sdatac\"}");
+        bench.command("{\"command\":\"samplerate\",\"parameters\":[1000]}");
+        for (int ch = 0; ch < ads().channels(); ch++)
+        {
+            snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+            bench.command(json);
+        }
+
+        SyncClient sync;
+        int exchanges = 0;
+        std::string sync_reply;
+        for (; exchanges < SYNC_SECONDS * 1e9 / EXCHANGE_INTERVAL_NS; exchanges++)
+        {
+            sync_reply = sync.exchange(bench);
+            bench.runFor(EXCHANGE_INTERVAL_NS);
+        }
+
+        bench.clear();
+        bench.command("{\"command\":\"rdatac\"}");
+        int64_t start_host_us = nowNs() / 1000 + START_LEAD_US;
+        snprintf(json, sizeof(json), "{\"command\":\"startat\",\"parameters\":[%lld]}", (long long)start_host_us);
+        bench.command(json);
+        std::string startat_reply = replyField(bench.reply);
+
+        std::vector<uint32_t> map_error;
+        bench.on_frame = [&](const Message &message) {
+            if (message.data.size() < sizeof(FrameHeader) || readLE32(&message.data[0]) != FRAME_MAGIC)
+                return;
+            FrameHeader header;
+            memcpy(&header, message.data.data(), sizeof(header));
+            if (!(header.flags & FRAME_FLAG_CLOCK_SYNCED))
+                return;
+            for (size_t offset = sizeof(header); offset < FRAME_BLOCK_SIZE * (1 + (size_t)header.samples) && offset < message.data.size(); offset += FRAME_BLOCK_SIZE)
+            {
+                int64_t elapsed = (int32_t)(readLE32(&message.data[offset]) - header.ref_local_us);
+                int64_t host_us = header.ref_host_us + elapsed + elapsed * header.drift_ppb / 1000000000LL;
+                // Samples from before the scheduled START are numbered differently
+                if (host_us < start_host_us)
+                    continue;
+                uint32_t sample_number = readLE32(&message.data[offset + 4]);
+                int64_t true_us = ads().conversionTimeNs(sample_number) / 1000;
+                int64_t error = host_us - true_us;
+                map_error.push_back((uint32_t)(error < 0 ? -error : error));
+            }
+        };
+        // A host keeps the clock tracked while it records
+        uint64_t stream_end = nowNs() + (uint64_t)((START_LEAD_US / 1e6 + STREAM_SECONDS) * 1e9);
+        std::string final_reply;
+        while (nowNs() < stream_end)
+        {
+            bench.runFor(EXCHANGE_INTERVAL_NS);
+            final_reply = sync.exchange(bench);
+            exchanges++;
+        }
+        bench.on_frame = nullptr;
+        bench.command("{\"command\":\"sdatac\"}");
+
+        int64_t start_error = (int64_t)(ads().startedNs() / 1000) - start_host_us;
+        start_min = std::min(start_min, start_error);
+        start_max = std::max(start_max, start_error);
+        std::vector<uint32_t> sorted = map_error;
+        Percentiles p = percentiles(sorted);
+        worst_map = std::max(worst_map, (uint32_t)p.max);
+        // The device runs fast by clock_ppm, so host time gains that much less
+        int64_t true_drift = -(int64_t)DEVICES[d].ppm * 1000;
+        int64_t start_drift = replyNumber(sync_reply, "drift_ppb");
+        int64_t final_drift = replyNumber(final_reply, "drift_ppb");
+        printf("{\"test\":\"sync\",\"device\":%zu,\"clock_ppm\":%d,\"link_jitter_us\":%u,\"exchanges\":%d,"
+               "\"drift_ppb\":[%lld,%lld],\"true_drift_ppb\":%lld,\"rtt_us\":%lld,\"startat\":\"%s\",\"start_error_us\":%lld,",
+               d, DEVICES[d].ppm, config().link_jitter_us, exchanges, (long long)start_drift, (long long)final_drift,
+               (long long)true_drift, (long long)replyNumber(final_reply, "rtt_us"), startat_reply.c_str(),
+               (long long)start_error);
+        printPercentiles("map_error_us", map_error);
+        printf("}\n");
+        fflush(stdout);
+        TEST_ASSERT_FALSE_MESSAGE(map_error.empty(), "no clock synced frames");
+        TEST_ASSERT_LESS_OR_EQUAL_INT_MESSAGE(DRIFT_TOLERANCE_PPB, llabs(start_drift - true_drift), "drift estimate before the START");
+        TEST_ASSERT_LESS_OR_EQUAL_INT_MESSAGE(DRIFT_TOLERANCE_PPB, llabs(final_drift - true_drift), "drift estimate at the end");
+    }
+
+    printf("{\"test\":\"sync_summary\",\"start_spread_us\":%lld,\"max_map_error_us\":%u}\n",
+           (long long)(start_max - start_min), worst_map);
+    TEST_ASSERT_TRUE_MESSAGE(start_max - start_min < ALIGN_TOLERANCE_US, "START spread across devices");
+    TEST_ASSERT_TRUE_MESSAGE(worst_map < ALIGN_TOLERANCE_US, "mapped timestamp against the true DRDY time");
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+int main(int argc, char **argv)
+{
+    // Sync has to hold up on a jittery link
+    config().link_jitter_us = 2000;
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_sync_devices_share_the_host_timeline);
+    return UNITY_END();
+}
@@ -0,0 +1,194 @@
+/*
+ * Trace ring read back through the trace command and decoded
+ *
+ * Copyright (c) 2024 OriginInterconnect PVT. LTD.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Streams at each rate with register reads in between, stops the trace
+ * ring and reads it back page by page through the trace command, then
+ * decodes it with lib/tracejson. Every DRDY in the window has to be
+ * followed by its readout before the next one, with consecutive sample
+ * numbers, and frames, sends, commands and bus transactions have to
+ * show up as spans.
+ */
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+#include "Arduino.h"
+#include "ads129x.h"
+#include "benchclient.h"
+#include "hostsim.h"
+#include "trace.h"
+#include "tracejson.h"
+
+void setup();
+
+using namespace hostsim;
+
+static const double TRACE_SECONDS = 0.5;
+
+static void checkTrace(uint32_t rate)
+{
+    using namespace ADS129x;
+    BenchClient bench;
+    std::string firmware = connectBench(bench);
+
+    char json[128];
+    bench.command("{\"command\":\"sdatac\"}");
+    bench.runFor(500000000ULL);
+    ads().setChip(ADSSIM_ADS1299);
+    bench.command("{\"command\":\"reset\"}");
+    bench.command("{\"command\":\"sdatac\"}");
+    snprintf(json, sizeof(json), "{\"command\":\"samplerate\",\"parameters\":[%u]}", rate);
+    bench.command(json);
+    for (int ch = 0; ch < ads().channels(); ch++)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"wreg\",\"parameters\":[%d,%d]}", CH1SET + ch, 0x60);
+        bench.command(json);
+    }
+    bench.command("{\"command\":\"rdatac\"}");
+    bench.command("{\"command\":\"start\"}");
+    bench.runFor(100000000ULL);
+    bench.command("{\"command\":\"trace\",\"parameters\":[1]}");
+    uint64_t end_ns = nowNs() + (uint64_t)(TRACE_SECONDS * 1e9);
+    while (nowNs() < end_ns)
+    {
+        bench.command("{\"command\":\"rreg\",\"parameters\":[0]}");
+        bench.runFor(2000000ULL);
+    }
+    bench.command("{\"command\":\"trace\",\"parameters\":[0]}");
+    int64_t recorded = replyNumber(bench.reply, "recorded");
+
+    // Page through the ring while streaming goes on untraced
+    TraceDecoder decoder;
+    uint32_t next = 0;
+    int pages = 0;
+    uint64_t dump_start_ns = nowNs();
+    for (;;)
+    {
+        snprintf(json, sizeof(json), "{\"command\":\"trace\",\"parameters\":[2,%u]}", next);
+        if (!bench.command(json) || !decoder.addReply(bench.reply))
+            break;
+        pages++;
+        int64_t page_next = replyNumber(bench.reply, "next");
+        if (page_next <= (int64_t)next && pages > 1)
+            break;
+        next = (uint32_t)page_next;
+        if ((int64_t)next >= recorded)
+            break;
+    }
+    double dump_ms = (nowNs() - dump_start_ns) / 1e6;
+    bench.command("{\"command\":\"sdatac\"}");
+
+    std::vector<TraceSpan> spans = decoder.spans();
+    uint64_t counts[TRACE_IDS] = {0};
+    std::vector<uint32_t> durations_ns[TRACE_IDS];
+    uint64_t drdy = 0, unread = 0, sample_gaps = 0, negative = 0;
+    bool have_drdy = false, read_seen = true;
+    uint16_t last_sample = 0;
+    double first_us = 0, last_us = 0;
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        const TraceSpan &span = spans[i];
+        counts[span.id]++;
+        if (span.duration_us < 0)
+            negative++;
+        if (span.duration_us >= 0)
+            durations_ns[span.id].push_back((uint32_t)(span.duration_us * 1000 + 0.5));
+        if (span.id == TRACE_READ_BEGIN)
+            read_seen = true;
+        if (span.id != TRACE_DRDY)
+            continue;
+        if (!have_drdy)
+            first_us = span.start_us;
+        else
+        {
+            if (!read_seen)
+                unread++;
+            if ((uint16_t)(span.arg - last_sample) != 1)
+                sample_gaps++;
+        }
+        last_us = span.start_us;
+        have_drdy = true;
+        read_seen = false;
+        last_sample = span.arg;
+        drdy++;
+    }
+    double drdy_period_us = drdy > 1 ? (last_us - first_us) / (drdy - 1) : 0;
+    size_t expected = (size_t)std::min<int64_t>(recorded, TRACE_SIZE);
+
+    printf("{\"test\":\"trace\",\"firmware\":\"%s\",\"rate\":%u,\"recorded\":%lld,\"records\":%zu,\"lost\":%llu,"
+           "\"pages\":%d,\"dump_ms\":%.1f,\"window_ms\":%.2f,\"drdy\":%llu,\"drdy_period_us\":%.2f,\"unread\":%llu,"
+           "\"sample_gaps\":%llu,\"negative\":%llu,\"spans\":{",
+           firmware.c_str(), rate, (long long)recorded, decoder.records(), (unsigned long long)decoder.lost(),
+           pages, dump_ms, (last_us - first_us) / 1e3, (unsigned long long)drdy, drdy_period_us,
+           (unsigned long long)unread, (unsigned long long)sample_gaps, (unsigned long long)negative);
+    const TraceId timed[] = {TRACE_READ_BEGIN, TRACE_FRAME_BEGIN, TRACE_SEND_BEGIN, TRACE_COMMAND_BEGIN,
+                             TRACE_BUS_WAIT_BEGIN, TRACE_BUS_BEGIN};
+    for (size_t t = 0; t < sizeof(timed) / sizeof(timed[0]); t++)
+    {
+        std::string name = TraceDecoder::name(timed[t]);
+        std::replace(name.begin(), name.end(), ' ', '_');
+        printf("%s", t ? "," : "");
+        printPercentiles((name + "_ns").c_str(), durations_ns[timed[t]]);
+    }
+    printf("}}\n");
+    fflush(stdout);
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected, decoder.records(), "records read back");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, decoder.lost(), "records lost");
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(1, drdy, "DRDY spans");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, unread, "DRDY without a readout before the next");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, sample_gaps, "DRDY sample numbers not consecutive");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, negative, "spans ending before they begin");
+    TEST_ASSERT_TRUE_MESSAGE(counts[TRACE_READ_BEGIN] + 1 >= drdy, "readouts missing");
+    TEST_ASSERT_TRUE_MESSAGE(fabs(drdy_period_us * rate / 1e6 - 1) < 0.01, "DRDY period off the sample rate");
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, counts[TRACE_SEND_BEGIN], "no send spans");
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, counts[TRACE_COMMAND_BEGIN], "no command spans");
+    TEST_ASSERT_GREATER_THAN_UINT32_MESSAGE(0, counts[TRACE_BUS_BEGIN], "no bus spans");
+}
+
+void test_trace_1000(void)
+{
+    checkTrace(1000);
+}
+
+void test_trace_16000(void)
+{
+    checkTrace(16000);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+int main(int argc, char **argv)
+{
+    ads().setChip(ADSSIM_ADS1299);
+    setup();
+    UNITY_BEGIN();
+    RUN_TEST(test_trace_1000);
+    RUN_TEST(test_trace_16000);
+    return UNITY_END();
+}